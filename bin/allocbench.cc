@@ -1,60 +1,55 @@
-#if defined(XV6_USER)
-#include "pthread.h"
-#else
-#include <pthread.h>
-#endif
-#include "xsys.h"
-#include <inttypes.h>
+// Benchmark concurrent anonymous mmap and munmap of 256KB regions.
+
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <unistd.h>
-#include <sys/wait.h>
-
-static pthread_barrier_t bar;
-static int niter;
-
-void*
-thr(void *arg)
-{
-  int tid = (uintptr_t)arg;
 
-  if (setaffinity(tid) < 0)
-    die("setaffinity err");
+#include "libutil.h"
+#include "benchlib.hh"
 
-  pthread_barrier_wait(&bar);
+enum { mapsize = 256 * 1024 };
 
-  for (int i = 0; i < niter; i++) {
-    if ((i % 100) == 0)
-      printf("%d: %d ops\n", tid, i);
-
-    char *p = (char*) mmap(0, 256 * 1024, PROT_READ|PROT_WRITE,
+static void
+do_bench(bench_thread *t)
+{
+  while (t->running()) {
+    uint64_t start = t->op_begin();
+    char *p = (char*) mmap(0, mapsize, PROT_READ|PROT_WRITE,
                            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
     if (p == MAP_FAILED)
-      die("%d: map failed", tid);
+      die("%d: map failed", t->id());
+    if (munmap(p, mapsize) < 0)
+      die("%d: unmap failed", t->id());
+    t->op_end(start);
   }
-  return 0;
 }
 
-int
-main(int ac, char **av)
+static void
+usage(const char *argv0)
 {
-  if (ac < 2)
-    die("usage: %s nthreads [nloop]", av[0]);
-
-  int nthread = atoi(av[1]);
-  niter = 100;
-  if (ac > 2)
-    niter = atoi(av[2]);
+  fprintf(stderr, "Usage: %s [options] [nthreads]\n", argv0);
+  bench_usage_common();
+  exit(2);
+}
 
-  pthread_t* tid = (pthread_t*) malloc(sizeof(*tid)*nthread);
+int
+main(int argc, char **argv)
+{
+  bench_config conf("allocbench");
 
-  pthread_barrier_init(&bar, 0, nthread);
+  if (bench_getopt(&conf, argc, argv, "") != -1)
+    usage(argv[0]);
 
-  for(uint64_t i = 0; i < nthread; i++)
-    xthread_create(&tid[i], 0, thr, (void*) i);
+  // For compatibility, accept a single core count as an argument
+  if (argc - optind == 1) {
+    if (!bench_parse_cores(argv[optind], &conf.cores))
+      usage(argv[0]);
+  } else if (argc - optind != 0) {
+    usage(argv[0]);
+  }
 
-  for(int i = 0; i < nthread; i++)
-    xpthread_join(tid[i]);
+  bench_run(conf, bench_ops{nullptr, do_bench, nullptr, nullptr});
   return 0;
 }
@@ -1,10 +1,11 @@
 // Print a benchmark run header, echoing anything on the command line,
 // followed by basic kernel information, followed by kconfig settings.
 
+#include "benchlib.hh"
+
 #include <algorithm>
 
 #include <ctype.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -64,32 +65,10 @@ print_iso8601(void)
 }
 
 void
-print_kconfig(void)
+print_kconfig_line(const char *line, void *)
 {
-  char buf[512];
-  int pos = 0;
-  int fd = open("/dev/kconfig", O_RDONLY);
-  if (fd < 0)
-    return;
-  while (pos < sizeof buf) {
-    int n = read(fd, buf + pos, sizeof buf - pos);
-    if (n < 0)
-      break;
-    pos += n;
-    while (true) {
-      char *nl = std::find(buf, buf + pos, '\n');
-      if (nl == buf + pos)
-        break;
-      *nl = '\0';
-      printf(" ");
-      print_escaped(buf);
-      pos -= (nl - buf) + 1;
-      memmove(buf, nl + 1, pos);
-    }
-    if (n == 0)
-      break;
-  }
-  close(fd);
+  printf(" ");
+  print_escaped(line);
 }
 
 int main(int argc, char **argv)
@@ -116,7 +95,7 @@ int main(int argc, char **argv)
   printf(" kver=");
   print_escaped(uts.version);
 
-  print_kconfig();
+  bench_kconfig(print_kconfig_line, nullptr);
 
   printf(" ==\n");
   return 0;
@@ -1,8 +1,6 @@
 #include "types.h"
 #include "user.h"
-#include "amd64.h"
 #include "lib.h"
-#include <xv6/perf.h>
 
 #include <fcntl.h>
 #include <uk/gcstat.h>
@@ -12,45 +10,18 @@
 #include <string.h>
 #include <unistd.h>
 
-static int cpu = 0;
-static int sec = 2;
-static int fd_ctrl;
-
-#ifdef PROFILE
-static u64 selector = 
-  0UL << 32 |
-  1 << 24 | 
-  1 << 22 | 
-  1 << 20 |
-  1 << 17 | 
-  1 << 16 | 
-  0x00 << 8 | 
-  0x76;
-static u64 period = 100000;
-#else
-static u64 selector = 0;
-static u64 period = 0;
-#endif
+#include "benchlib.hh"
 
-static void
-ctrl_init(void)
-{
-  fd_ctrl = open("/dev/gc", O_WRONLY);
-  if (fd_ctrl < 0)
-    die("gc: open failed");
-}
-
-static void
-ctrl_done(void)
-{
-  close(fd_ctrl);
-}
+static int batchsize;
 
 static void
 ctrl(int ncore, int size, int op)
 {
   int r;
   char buf[sizeof(int) * 3];
+  int fd_ctrl = open("/dev/gc", O_WRONLY);
+  if (fd_ctrl < 0)
+    die("gc: open failed");
   
   memcpy(buf, &ncore, sizeof(int));
   memcpy(buf + sizeof(int), &size, sizeof(int));
@@ -58,6 +29,7 @@ ctrl(int ncore, int size, int op)
   r = write(fd_ctrl, buf, 3* sizeof(int));
   if (r < 0)
     die("gc: write failed");
+  close(fd_ctrl);
 }
 
 static void
@@ -83,7 +55,7 @@ stats(int print)
       die("gct: unexpected read");
 
     if (print)
-      printf("%d: ndelay %" PRId64 " nfree %" PRId64 " nrun %" PRId64 " ncycles %lu nop %lu cycles/op %lu\n",
+      printf("# %d: ndelay %" PRId64 " nfree %" PRId64 " nrun %" PRId64 " ncycles %lu nop %lu cycles/op %lu\n",
             c++, gs.ndelay, gs.nfree, gs.nrun, gs.ncycles, gs.nop, 
               (gs.nop > 0) ? gs.ncycles/gs.nop : 0);
   }
@@ -91,93 +63,87 @@ stats(int print)
   close(fd);
 }
 
-//
-// Each core open and closes a file, delay freeing the file structure.
-//
-
-void gctest(char *fn)
+static void
+setup(unsigned ncores, void *)
 {
-  int fd;
-  if((fd = open(fn, O_RDONLY)) < 0){
-    die("cat: cannot open %s", "cat");
+  ctrl(ncores, batchsize, 0);
+
+  for (unsigned i = 0; i < ncores; i++) {
+    char filename[32];
+    snprintf(filename, sizeof(filename), "f%d", i);
+    int fd = open(filename, O_CREAT|O_RDWR, 0666);
+    if (fd < 0)
+      die("gc: open failed");
+    close(fd);
   }
-  close(fd);
 
+  stats(0);
 }
 
-void
-child()
+static void
+teardown(unsigned ncores, void *)
 {
-  u64 s = 5; // use integer instead of float (e.g., 2.5)!
-  u64 nsec = sec*s*1000*1000*1000L; 
-  int n = 0;
-  char filename[32];
-  int fd;
+  stats(1);
 
-  if (setaffinity(cpu) < 0) {
-    die("sys_setaffinity(%d) failed", 0);
+  for (unsigned i = 0; i < ncores; i++) {
+    char filename[32];
+    snprintf(filename, sizeof(filename), "f%d", i);
+    if (unlink(filename) < 0)
+      die("unlink failed\n");
   }
-  snprintf(filename, sizeof(filename), "f%d", cpu);
-  fd = open(filename, O_CREAT|O_RDWR, 0666);
-  if (fd < 0)
-    die("gc: open failed");
-  close(fd);
+}
 
-  if (cpu == 0) { 
-    stats(0);
-  }
-  if (cpu == 0) perf_start(selector, period);
-  u64 t0 = rdtsc();
-  u64 t1;
-  do {
-    for(int i = 0; i < 10; i++) {
-      gctest(filename);
-      n++;
-    }
-    t1 = rdtsc();
-  } while((t1 - t0) < nsec);
+//
+// Each core open and closes a file, delay freeing the file structure.
+//
 
-  // printf("%d: %d ops in %d sec\n", cpu, n, s);
+static void
+do_bench(bench_thread *t)
+{
+  char filename[32];
+  snprintf(filename, sizeof(filename), "f%d", t->id());
 
-  if (cpu == 0) { 
-    printf("stats for %" PRId64 " sec\n", s);
-    stats(1);
+  while (t->running()) {
+    uint64_t start = t->op_begin();
+    int fd;
+    if((fd = open(filename, O_RDONLY)) < 0){
+      die("gc: cannot open %s", filename);
+    }
+    close(fd);
+    t->op_end(start);
   }
-  if (cpu == 0) perf_stop();
-  if (unlink(filename) < 0)
-    die("unlink failed\n");
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [options] batchsize\n", argv0);
+  fprintf(stderr, "       %s nproc batchsize [nsec]\n", argv0);
+  bench_usage_common();
+  exit(2);
 }
 
 int
 main(int argc, char *argv[])
 {
-  if (argc < 3)
-    die("usage: %s nproc batchsize [nsec]", argv[0]);
-
-  int nproc = atoi(argv[1]);
-  int batchsize = atoi(argv[2]);
-  if (argc > 3)
-    sec = atoi(argv[3]);
-
-  printf("%s: %d %d\n", argv[0], nproc, batchsize);
-
-  ctrl_init();
-  ctrl(nproc, batchsize, 0);
-  ctrl_done();
-
-  for (int i = 0; i < nproc; i++) {
-    int pid = fork();
-    if (pid < 0)
-      die("time_this: fork failed %s", argv[0]);
-    if (pid == 0) {
-      child();
-      exit(0);
-    } else {
-      cpu++;
-    }
+  bench_config conf("gcbench");
+
+  if (bench_getopt(&conf, argc, argv, "") != -1)
+    usage(argv[0]);
+
+  // For compatibility, accept the old positional arguments
+  if (argc - optind == 2 || argc - optind == 3) {
+    if (!bench_parse_cores(argv[optind], &conf.cores))
+      usage(argv[0]);
+    if (argc - optind == 3 && (conf.duration_secs = atoi(argv[optind+2])) == 0)
+      usage(argv[0]);
+  } else if (argc - optind != 1) {
+    usage(argv[0]);
   }
-  for (int i = 0; i < nproc; i++)
-    wait(NULL);
-  printf("done %d %s\n", getpid(), argv[0]);
+
+  batchsize = atoi(argv[argc - optind == 1 ? optind : optind + 1]);
+  conf.param("batchsize", (long long)batchsize);
+
+  bench_run(conf, bench_ops{setup, do_bench, teardown, nullptr});
   return 0;
 }
@@ -44,6 +44,9 @@ static struct {
   { "/dev/kmemstats",    MAJ_KMEMSTATS},
   { "/dev/mfsstats",    MAJ_MFSSTATS},
   { "/dev/qstats", MAJ_QSTATS},
+  { "/dev/syscallstat", MAJ_SYSCALLSTAT},
+  { "/dev/procmem", MAJ_PROCMEM},
+  { "/dev/procacct", MAJ_PROCACCT},
 };
 #endif
 
@@ -15,6 +15,51 @@ xwrite(int fd, char c)
     die("lockstat: write failed");
 }
 
+static const char *
+kind_name(u32 kind)
+{
+  switch (kind) {
+  case LOCKSTAT_KIND_SPIN:
+    return "spin";
+  case LOCKSTAT_KIND_SLEEPLOCK:
+    return "sleeplock";
+  case LOCKSTAT_KIND_CONDVAR:
+    return "condvar";
+  case LOCKSTAT_KIND_SEMAPHORE:
+    return "semaphore";
+  }
+  return "unknown";
+}
+
+// Print the waiter histogram and blocking callers of a blocking
+// primitive.
+static void
+blocking_stats(int fd, const struct lockstat *ls)
+{
+  dprintf(fd, "#   waiters");
+  for (int i = 0; i < LOCKSTAT_WAITER_BUCKETS; i++) {
+    if (!ls->waiters[i])
+      continue;
+    if (i == 0)
+      dprintf(fd, " 0:%lu", ls->waiters[i]);
+    else if (i == LOCKSTAT_WAITER_BUCKETS - 1)
+      dprintf(fd, " %d+:%lu", 1 << (i - 1), ls->waiters[i]);
+    else
+      dprintf(fd, " %d-%d:%lu", 1 << (i - 1), (1 << i) - 1, ls->waiters[i]);
+  }
+  dprintf(fd, "\n");
+
+  for (int i = 0; i < LOCKSTAT_NCALLERS; i++) {
+    const struct lockstat_caller *c = &ls->callers[i];
+    if (!c->contends)
+      continue;
+    if (c->pc)
+      dprintf(fd, "#   caller %#lx %lu %lu\n", c->pc, c->contends, c->waiting);
+    else
+      dprintf(fd, "#   caller other %lu %lu\n", c->contends, c->waiting);
+  }
+}
+
 static void
 stats(void)
 {
@@ -32,8 +77,11 @@ stats(void)
   if (sfd < 0)
     die("lockstat: open failed");
 
-  printf("## name acquires contends locking locked\n");
-  dprintf(sfd, "## name acquires contends locking locked\n");
+  // For blocking primitives, locking is cycles spent blocked and each
+  // lock is followed by its waiter histogram and the callers that
+  // blocked (pc contends waiting).
+  printf("## name acquires contends locking locked kind\n");
+  dprintf(sfd, "## name acquires contends locking locked kind\n");
   
   while (1) {
     r = read(fd, &ls, sz);
@@ -54,10 +102,16 @@ stats(void)
       locked += ls.cpu[i].locked;
     }
     if (contends > 0) {
-      printf("%s %lu %lu %lu %lu\n", 
-             ls.name, acquires, contends, locking, locked);
-      dprintf(sfd, "%s %lu %lu %lu %lu\n",
-             ls.name, acquires, contends, locking, locked);
+      printf("%s %lu %lu %lu %lu %s\n",
+             ls.name, acquires, contends, locking, locked,
+             kind_name(ls.kind));
+      dprintf(sfd, "%s %lu %lu %lu %lu %s\n",
+             ls.name, acquires, contends, locking, locked,
+             kind_name(ls.kind));
+      if (ls.kind != LOCKSTAT_KIND_SPIN) {
+        blocking_stats(1, &ls);
+        blocking_stats(sfd, &ls);
+      }
     }
   }
 
@@ -55,10 +55,20 @@ struct backcmd {
 };
 
 int fork1(void);  // Fork but panics on failure.
-void panic(const char*);
+int forkcheck(int);  // Panics if a fork failed.
+int execonly(struct cmd*);
+
+// Fork a child that will run cmd.  If cmd goes straight to exec, the
+// child only needs our address space until then, so it borrows it
+// with vfork instead of copying it.  This has to be a macro because a
+// vfork child can't return from the function that called vfork.
+#define forkcmd(cmd) forkcheck(execonly(cmd) ? vfork() : fork())
+void panic(const char*) __attribute__((noreturn));
 struct cmd *parsecmd(char*);
 
 // Execute cmd.  Never returns.
+void runcmd(struct cmd*) __attribute__((noreturn));
+
 void
 runcmd(struct cmd *cmd)
 {
@@ -96,7 +106,7 @@ runcmd(struct cmd *cmd)
 
   case LIST:
     lcmd = (struct listcmd*)cmd;
-    if(fork1() == 0)
+    if(forkcmd(lcmd->left) == 0)
       runcmd(lcmd->left);
     wait(NULL);
     runcmd(lcmd->right);
@@ -106,14 +116,14 @@ runcmd(struct cmd *cmd)
     pcmd = (struct pipecmd*)cmd;
     if(pipe(p) < 0)
       panic("pipe");
-    if(fork1() == 0){
+    if(forkcmd(pcmd->left) == 0){
       close(1);
       dup(p[1]);
       close(p[0]);
       close(p[1]);
       runcmd(pcmd->left);
     }
-    if(fork1() == 0){
+    if(forkcmd(pcmd->right) == 0){
       close(0);
       dup(p[0]);
       close(p[0]);
@@ -128,7 +138,7 @@ runcmd(struct cmd *cmd)
     
   case BACK:
     bcmd = (struct backcmd*)cmd;
-    if(fork1() == 0)
+    if(forkcmd(bcmd->cmd) == 0)
       runcmd(bcmd->cmd);
     break;
   }
@@ -170,8 +180,15 @@ main(void)
         fprintf(stderr, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
+    // Run each command line as a job in its own process group, so
+    // kill(0, ...) from it doesn't reach the shell.  Both sides set the
+    // group so it's in place before either relies on it.
+    int pid = fork1();
+    if(pid == 0){
+      setpgid(0, 0);
       runcmd(parsecmd(buf));
+    }
+    setpgid(pid, pid);
     wait(NULL);
   }
   return 0;
@@ -187,14 +204,26 @@ panic(const char *s)
 int
 fork1(void)
 {
-  int pid;
-  
-  pid = fork();
+  return forkcheck(fork());
+}
+
+int
+forkcheck(int pid)
+{
   if(pid == -1)
     panic("fork");
   return pid;
 }
 
+// Does running cmd go straight to exec?
+int
+execonly(struct cmd *cmd)
+{
+  while(cmd && cmd->type == REDIR)
+    cmd = ((struct redircmd*)cmd)->cmd;
+  return cmd && cmd->type == EXEC;
+}
+
 //PAGEBREAK!
 // Constructors
 
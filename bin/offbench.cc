@@ -0,0 +1,140 @@
+// Benchmark read, write, and O_APPEND write through a single file
+// descriptor shared by all threads.  These all update the same file
+// offset, so they scale only if the kernel can advance the offset
+// without serializing whole operations.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libutil.h"
+#include "benchlib.hh"
+
+enum bench_mode { MODE_READ, MODE_WRITE, MODE_APPEND };
+
+static const char *fname = "offbench-f";
+static bench_mode mode = MODE_READ;
+static size_t opsize = 64;
+static size_t filesize = 4 << 20;
+static int fd;
+
+static void
+setup(unsigned ncores, void *)
+{
+  int flags = O_RDWR|O_CREAT|O_TRUNC;
+  if (mode == MODE_APPEND)
+    flags |= O_APPEND;
+  fd = open(fname, flags, 0666);
+  if (fd < 0)
+    die("offbench: open %s failed", fname);
+
+  if (mode == MODE_READ) {
+    char buf[4096];
+    memset(buf, 'x', sizeof buf);
+    for (size_t pos = 0; pos < filesize; pos += sizeof buf)
+      xwrite(fd, buf, sizeof buf);
+    if (lseek(fd, 0, SEEK_SET) != 0)
+      die("offbench: lseek failed");
+  }
+}
+
+static void
+teardown(unsigned ncores, void *)
+{
+  close(fd);
+  unlink(fname);
+}
+
+static void
+do_bench(bench_thread *t)
+{
+  char buf[4096];
+  memset(buf, 'a' + t->id() % 26, sizeof buf);
+
+  for (uint64_t n = 0; t->running(); ++n) {
+    uint64_t start = t->op_begin();
+    switch (mode) {
+    case MODE_READ:
+      if (read(fd, buf, opsize) == 0) {
+        // Start over.  Other threads may do the same.
+        lseek(fd, 0, SEEK_SET);
+        continue;
+      }
+      break;
+    case MODE_WRITE:
+      if (write(fd, buf, opsize) != opsize)
+        die("offbench: write failed");
+      // Keep the file size bounded
+      if (n % 256 == 0 && lseek(fd, 0, SEEK_CUR) >= (off_t)filesize)
+        lseek(fd, 0, SEEK_SET);
+      break;
+    case MODE_APPEND:
+      if (write(fd, buf, opsize) != opsize)
+        die("offbench: write failed");
+      break;
+    }
+    t->op_end(start);
+  }
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [options]\n", argv0);
+  bench_usage_common();
+  fprintf(stderr, "  -m mode       read, write, or append (default: read)\n");
+  fprintf(stderr, "  -s bytes      Bytes per operation (default: 64)\n");
+  fprintf(stderr, "  -f bytes      File size for read and write (default: 4194304)\n");
+  fprintf(stderr, "Append mode grows the file for the whole trial.\n");
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  bench_config conf("offbench");
+  const char *mode_name = "read";
+
+  int opt;
+  while ((opt = bench_getopt(&conf, argc, argv, "m:s:f:")) != -1) {
+    switch (opt) {
+    case 'm':
+      mode_name = optarg;
+      if (strcmp(optarg, "read") == 0)
+        mode = MODE_READ;
+      else if (strcmp(optarg, "write") == 0)
+        mode = MODE_WRITE;
+      else if (strcmp(optarg, "append") == 0)
+        mode = MODE_APPEND;
+      else
+        usage(argv[0]);
+      break;
+    case 's':
+      opsize = atoi(optarg);
+      if (opsize == 0 || opsize > 4096)
+        usage(argv[0]);
+      break;
+    case 'f':
+      filesize = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc)
+    usage(argv[0]);
+  if (filesize < opsize)
+    die("offbench: file size must be at least one operation");
+
+  conf.param("mode", mode_name);
+  conf.param("opsize", (long long)opsize);
+  if (mode != MODE_APPEND)
+    conf.param("filesize", (long long)filesize);
+
+  bench_run(conf, bench_ops{setup, do_bench, teardown, nullptr});
+  return 0;
+}
@@ -0,0 +1,172 @@
+// Report how much memory each address space uses, from /dev/procmem.
+//
+// Address spaces are listed by the process that created them, largest
+// resident set first.  Threads share their process's address space,
+// so they aren't listed separately.  With -c, instead report how much
+// CPU time each thread has used and how long it has waited for a CPU,
+// from /dev/procacct, busiest first.  With -d, redisplay every
+// interval seconds, like top.
+
+#include "types.h"
+#include "user.h"
+#include "kstats.hh"
+#include "libutil.h"
+#include "mmu.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+static std::vector<procmem_rec>
+read_procmem(void)
+{
+  std::vector<procmem_rec> res;
+  int fd = open("/dev/procmem", O_RDONLY);
+  if (fd < 0)
+    die("Couldn't open /dev/procmem");
+  procmem_rec rec;
+  int r;
+  while ((r = xread(fd, &rec, sizeof rec)) == sizeof rec)
+    res.push_back(rec);
+  if (r != 0)
+    die("Short read from /dev/procmem");
+  close(fd);
+  return res;
+}
+
+static std::vector<procacct_rec>
+read_procacct(void)
+{
+  std::vector<procacct_rec> res;
+  int fd = open("/dev/procacct", O_RDONLY);
+  if (fd < 0)
+    die("Couldn't open /dev/procacct");
+  procacct_rec rec;
+  int r;
+  while ((r = xread(fd, &rec, sizeof rec)) == sizeof rec)
+    res.push_back(rec);
+  if (r != 0)
+    die("Short read from /dev/procacct");
+  close(fd);
+  return res;
+}
+
+static uint64_t
+kb(uint64_t pages)
+{
+  return pages * PGSIZE / 1024;
+}
+
+static void
+show(size_t limit)
+{
+  std::vector<procmem_rec> recs = read_procmem();
+  std::sort(recs.begin(), recs.end(),
+            [](const procmem_rec &a, const procmem_rec &b) {
+              return a.anon_pages + a.file_pages > b.anon_pages + b.file_pages;
+            });
+
+  procmem_rec total{};
+  for (auto &rec : recs) {
+    total.anon_pages += rec.anon_pages;
+    total.file_pages += rec.file_pages;
+    total.pt_pages += rec.pt_pages;
+  }
+
+  printf("%6s %-16s %10s %10s %10s %8s\n",
+         "pid", "name", "rss(KB)", "anon(KB)", "file(KB)", "pt(KB)");
+  for (size_t i = 0; i < recs.size() && (!limit || i < limit); ++i) {
+    procmem_rec &rec = recs[i];
+    printf("%6d %-16s %10lu %10lu %10lu %8lu\n",
+           rec.pid, rec.name[0] ? rec.name : "-",
+           kb(rec.anon_pages + rec.file_pages), kb(rec.anon_pages),
+           kb(rec.file_pages), kb(rec.pt_pages));
+  }
+  // Shared pages count once for each address space that maps them,
+  // so the total may exceed physical memory.
+  printf("%6s %-16s %10lu %10lu %10lu %8lu\n", "", "total",
+         kb(total.anon_pages + total.file_pages), kb(total.anon_pages),
+         kb(total.file_pages), kb(total.pt_pages));
+}
+
+static uint64_t
+ms(uint64_t ns)
+{
+  return ns / 1000000;
+}
+
+static void
+show_cpu(size_t limit)
+{
+  std::vector<procacct_rec> recs = read_procacct();
+  std::sort(recs.begin(), recs.end(),
+            [](const procacct_rec &a, const procacct_rec &b) {
+              return a.utime + a.stime > b.utime + b.stime;
+            });
+
+  printf("%6s %-16s %3s %10s %10s %10s %8s %8s %6s\n",
+         "pid", "name", "cpu", "user(ms)", "sys(ms)", "wait(ms)",
+         "vcsw", "ivcsw", "migr");
+  for (size_t i = 0; i < recs.size() && (!limit || i < limit); ++i) {
+    procacct_rec &rec = recs[i];
+    printf("%6d %-16s %3d %10lu %10lu %10lu %8lu %8lu %6lu\n",
+           rec.pid, rec.name[0] ? rec.name : "-", rec.cpu,
+           ms(rec.utime), ms(rec.stime), ms(rec.wtime),
+           rec.nvcsw, rec.nivcsw, rec.nmigrate);
+  }
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-c] [-d interval] [-n count]\n", argv0);
+  fprintf(stderr, "  -c           Show CPU usage by thread\n");
+  fprintf(stderr, "  -d interval  Redisplay every interval seconds\n");
+  fprintf(stderr, "  -n count     Show only the count largest entries\n");
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  int interval = 0;
+  size_t limit = 0;
+  bool cpu = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "cd:n:")) != -1) {
+    switch (opt) {
+    case 'c':
+      cpu = true;
+      break;
+    case 'd':
+      interval = atoi(optarg);
+      if (interval <= 0)
+        usage(argv[0]);
+      break;
+    case 'n':
+      limit = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc)
+    usage(argv[0]);
+
+  for (;;) {
+    if (cpu)
+      show_cpu(limit);
+    else
+      show(limit);
+    if (!interval)
+      break;
+    nsleep(interval * 1000000000ull);
+    printf("\n");
+  }
+  return 0;
+}
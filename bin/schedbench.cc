@@ -9,6 +9,11 @@
 #include <atomic>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/wait.h>
 
 static volatile std::atomic<u64> waiting;
 static volatile std::atomic<u64> waking __attribute__((unused));
@@ -65,13 +70,145 @@ void master0(void)
     wait(NULL);
 }
 
+// Fork a storm of CPU-bound children and report which CPU each one
+// started on, to check how well placement spreads new processes.
+static
+void spawn0(int nchildren, u64 spin_ms)
+{
+  int hist[NCPU] = {};
+  u64 spin = spin_ms * cpuhz() / 1000;
+
+  u64 t0 = rdtsc();
+  for (int i = 0; i < nchildren; i++) {
+    int pid = fork();
+    if (pid < 0)
+      die("fork");
+    if (pid == 0) {
+      int cpu = getcpu();
+      u64 s = rdtsc();
+      while (rdtsc() - s < spin)
+        ;
+      exit(cpu);
+    }
+  }
+  for (int i = 0; i < nchildren; i++) {
+    int status;
+    if (wait(&status) < 0)
+      die("wait");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) >= NCPU)
+      die("bad child status %d", status);
+    hist[WEXITSTATUS(status)]++;
+  }
+  u64 t1 = rdtsc();
+
+  int ncpus = 0, max = 0;
+  for (int cpu = 0; cpu < NCPU; cpu++) {
+    if (!hist[cpu])
+      continue;
+    printf("cpu %d: %d\n", cpu, hist[cpu]);
+    ncpus++;
+    if (hist[cpu] > max)
+      max = hist[cpu];
+  }
+  printf("%d children on %d cpus, max/mean %lu.%02lu, %lu ms\n",
+         nchildren, ncpus,
+         (u64)max * ncpus / nchildren, (u64)max * ncpus * 100 / nchildren % 100,
+         (t1 - t0) * 1000 / cpuhz());
+}
+
+// Measure wakeup-to-run latency under load.  A thread on CPU 0 with
+// real-time priority prio (or SCHED_OTHER if prio is 0) blocks on a
+// pipe while nspin CPU-bound processes also run on CPU 0.  CPU 1
+// wakes it every millisecond by writing the TSC to the pipe.
+static
+void latency0(int iters, int nspin, int prio)
+{
+  enum { MAX_SPIN = 64 };
+  int spinners[MAX_SPIN];
+  int fds[2];
+
+  if (nspin > MAX_SPIN)
+    die("at most %d spinners", MAX_SPIN);
+  if (pipe(fds) < 0)
+    die("pipe");
+
+  for (int i = 0; i < nspin; i++) {
+    if ((spinners[i] = fork()) < 0)
+      die("fork");
+    if (spinners[i] == 0) {
+      setaffinity(0);
+      for (;;)
+        ;
+    }
+  }
+
+  int pid = fork();
+  if (pid < 0)
+    die("fork");
+  if (pid == 0) {
+    close(fds[1]);
+    setaffinity(0);
+    struct sched_param sp;
+    sp.sched_priority = prio;
+    if (sched_setscheduler(0, prio ? SCHED_FIFO : SCHED_OTHER, &sp) < 0)
+      die("sched_setscheduler");
+    u64 min = ~0ull, max = 0, sum = 0;
+    for (int i = 0; i < iters; i++) {
+      u64 sent;
+      if (read(fds[0], &sent, sizeof(sent)) != sizeof(sent))
+        die("read");
+      u64 lat = rdtsc() - sent;
+      if (lat < min)
+        min = lat;
+      if (lat > max)
+        max = lat;
+      sum += lat;
+    }
+    u64 mhz = cpuhz() / 1000000;
+    printf("%s latency with %d spinners: min %lu ns mean %lu ns max %lu ns\n",
+           prio ? "SCHED_FIFO" : "SCHED_OTHER", nspin,
+           min * 1000 / mhz, sum / iters * 1000 / mhz, max * 1000 / mhz);
+    exit(0);
+  }
+
+  close(fds[0]);
+  setaffinity(1);
+  // Let the spinners get going
+  nsleep(100*1000*1000);
+  for (int i = 0; i < iters; i++) {
+    nsleep(1000*1000);
+    u64 now = rdtsc();
+    if (write(fds[1], &now, sizeof(now)) != sizeof(now))
+      die("write");
+  }
+  if (wait(NULL) != pid)
+    die("wait");
+  for (int i = 0; i < nspin; i++) {
+    kill(spinners[i], SIGKILL);
+    wait(NULL);
+  }
+}
+
 int
 main(int ac, char** av)
 {
   long r;
 
+  if (ac >= 3 && strcmp(av[1], "spawn") == 0) {
+    spawn0(atoi(av[2]), ac >= 4 ? atoi(av[3]) : 100);
+    return 0;
+  }
+
+  if (ac >= 3 && strcmp(av[1], "latency") == 0) {
+    latency0(atoi(av[2]), ac >= 4 ? atoi(av[3]) : 4,
+             ac >= 5 ? atoi(av[4]) : 50);
+    return 0;
+  }
+
   if (ac < 3)
-    die("usage: %s iters nworkers", av[0]);
+    die("usage: %s iters nworkers\n"
+        "       %s spawn nchildren [spin_ms]\n"
+        "       %s latency iters [nspin [rt_prio]]", av[0], av[0], av[0]);
 
   iters = atoi(av[1]);
   nworkers = atoi(av[2]);
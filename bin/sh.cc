@@ -27,6 +27,30 @@ bool interactive = true;
 
 int fork1(void);  // Fork but panics on failure.
 
+// Process group of the job being run, or 0 if it has no processes
+// yet.  Each top-level command line is a job, and so is each
+// background command, so kill(0, ...) from a job only reaches that
+// job.
+int job_pgid;
+
+// Put a child we just forked in the current job's process group.
+// Both the parent and the child call this, so the group is set before
+// either relies on it.  In a vfork child, this sets job_pgid for the
+// parent, too, which is what the parent would set it to.
+void
+join_job(int pid)
+{
+  if (pid == 0) {
+    if (!job_pgid)
+      job_pgid = getpid();
+    setpgid(0, job_pgid);
+  } else {
+    if (!job_pgid)
+      job_pgid = pid;
+    setpgid(pid, job_pgid);
+  }
+}
+
 //////////////////////////////////////////////////////////////////
 // Environment
 //
@@ -159,13 +183,18 @@ public:
       argstrs.push_back(arg.c_str());
     argstrs.push_back(nullptr);
 
-    // XXX posix_spawn
+    // The child only runs until exec, so it can borrow our address
+    // space instead of copying it.
     int child;
-    if ((child = fork1()) == 0) {
+    if ((child = vfork()) == 0) {
+      join_job(0);
       savefd::preexec();
       execv(argstrs[0], const_cast<char * const *>(argstrs.data()));
       edie("exec %s failed", argstrs[0]);
     }
+    if (child < 0)
+      die("vfork");
+    join_job(child);
     int status;
     if (waitpid(child, &status, 0) < 0)
       edie("wait failed");
@@ -218,12 +247,14 @@ public:
 
     int child;
     if ((child = fork1()) == 0) {
+      join_job(0);
       close(1);
       dup(p[1]);
       close(p[0]);
       close(p[1]);
       exit(left_->run());
     }
+    join_job(child);
 
     savefd saved(0);
     close(0);
@@ -247,8 +278,14 @@ public:
 
   int run() override
   {
-    if (fork1() == 0)
+    // A background command is a job of its own
+    int child = fork1();
+    if (child == 0) {
+      job_pgid = 0;
+      join_job(0);
       exit(cmd_->run());
+    }
+    setpgid(child, child);
     return 0;
   }
 };
@@ -881,6 +918,7 @@ main(int argc, char** argv)
     if (p.incomplete)
       continue;
     buf.clear();
+    job_pgid = 0;
     last = p.res->run();
   }
   return last;
@@ -0,0 +1,121 @@
+// Report per-system call counts and latencies from /dev/syscallstat.
+//
+// With no arguments, print totals since boot.  Otherwise, run the
+// given command and print only the system calls made while it ran
+// (by all processes, not just the command).
+
+#include "types.h"
+#include "user.h"
+#include "kstats.hh"
+#include "libutil.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+static std::vector<syscall_kstats_rec>
+read_syscallstat(void)
+{
+  std::vector<syscall_kstats_rec> res;
+  int fd = open("/dev/syscallstat", O_RDONLY);
+  if (fd < 0)
+    die("Couldn't open /dev/syscallstat");
+  syscall_kstats_rec rec;
+  int r;
+  while ((r = xread(fd, &rec, sizeof rec)) == sizeof rec)
+    res.push_back(rec);
+  if (r != 0)
+    die("Short read from /dev/syscallstat");
+  close(fd);
+  return res;
+}
+
+// Return an upper bound on the p'th quantile of s's latency.
+static uint64_t
+quantile(const syscall_kstats &s, double p)
+{
+  uint64_t rank = p * s.count, seen = 0;
+  if (rank >= s.count)
+    rank = s.count - 1;
+  for (int i = 0; i < syscall_kstats::NBUCKETS; ++i) {
+    seen += s.hist[i];
+    if (rank < seen)
+      return std::min<uint64_t>(s.max_cycles, (2ull << i) - 1);
+  }
+  return s.max_cycles;
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-a] [command...]\n", argv0);
+  fprintf(stderr, "  -a  Include system calls that were never made\n");
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  bool all = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a")) != -1) {
+    switch (opt) {
+    case 'a':
+      all = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  std::vector<syscall_kstats_rec> before, after = read_syscallstat();
+
+  if (optind < argc) {
+    before = after;
+
+    int pid = fork();
+    if (pid < 0)
+      die("syscallstat: fork failed");
+
+    if (pid == 0) {
+      std::vector<const char *> args(argv + optind, argv + argc);
+      args.push_back(nullptr);
+      execv(args[0], const_cast<char * const *>(args.data()));
+      die("syscallstat: exec failed");
+    }
+
+    wait(NULL);
+    after = read_syscallstat();
+    if (before.size() != after.size())
+      die("syscallstat: system call table changed");
+    for (size_t i = 0; i < after.size(); ++i)
+      after[i].stats = after[i].stats - before[i].stats;
+  }
+
+  // Most expensive first
+  std::sort(after.begin(), after.end(),
+            [](const syscall_kstats_rec &a, const syscall_kstats_rec &b) {
+              return a.stats.cycles > b.stats.cycles;
+            });
+
+  printf("%-20s %10s %8s %10s %10s %10s %12s\n",
+         "syscall", "count", "errors", "mean", "p50", "p99", "max");
+  for (auto &rec : after) {
+    const syscall_kstats &s = rec.stats;
+    if (s.count == 0) {
+      if (all)
+        printf("%-20s %10d\n", rec.name, 0);
+      continue;
+    }
+    // Note that max is since boot even when running a command.
+    printf("%-20s %10lu %8lu %10lu %10lu %10lu %12lu\n",
+           rec.name, s.count, s.errors, s.cycles / s.count,
+           quantile(s, 0.5), quantile(s, 0.99), s.max_cycles);
+  }
+  return 0;
+}
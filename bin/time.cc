@@ -3,6 +3,8 @@
 #include "amd64.h"
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include <vector>
 
@@ -26,8 +28,16 @@ main(int ac, char * const av[])
     die("time: exec failed");
   }
 
-  wait(NULL);
+  struct rusage ru;
+  if (wait4(pid, NULL, 0, &ru) < 0)
+    die("time: wait failed");
   u64 t1 = rdtsc();
   printf("%lu cycles\n", t1-t0);
+  printf("%lu.%06lu user %lu.%06lu sys %lu.%06lu wait (ms)\n",
+         ru.ru_utime / 1000000, ru.ru_utime % 1000000,
+         ru.ru_stime / 1000000, ru.ru_stime % 1000000,
+         ru.ru_wtime / 1000000, ru.ru_wtime % 1000000);
+  printf("%lu voluntary %lu involuntary switches %lu migrations\n",
+         ru.ru_nvcsw, ru.ru_nivcsw, ru.ru_nmigrate);
   return 0;
 }
@@ -3,10 +3,14 @@
 #include "fs.h"
 #include "traps.h"
 #include "pthread.h"
+#include "futex.h"
 #include "rnd.hh"
+#include "amd64.h"
+#include "kstats.hh"
 
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +18,8 @@
 #include <setjmp.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sched.h>
 
 #include <utility>
 
@@ -265,9 +271,9 @@ preempt(void)
   }
   close(pfds[0]);
   printf("kill... ");
-  kill(pid1);
-  kill(pid2);
-  kill(pid3);
+  kill(pid1, SIGKILL);
+  kill(pid2, SIGKILL);
+  kill(pid3, SIGKILL);
   printf("wait... ");
   wait(NULL);
   wait(NULL);
@@ -299,6 +305,49 @@ exitwait(void)
   printf("exitwait ok\n");
 }
 
+// waitpid(WNOHANG) and exit notification fds
+void
+exitfdtest(void)
+{
+  int fd[2], pid, r;
+  char c = 'x';
+
+  printf("exitfdtest\n");
+  int efd = exitfd(0);
+  int nbfd = exitfd(O_NONBLOCK);
+  if (efd < 0 || nbfd < 0)
+    die("exitfd failed");
+  if (pipe(fd) < 0)
+    die("pipe failed");
+
+  pid = fork();
+  if (pid < 0)
+    die("fork failed");
+  if (pid == 0) {
+    read(fd[0], &c, 1);
+    exit(0);
+  }
+
+  if (waitpid(pid, NULL, WNOHANG) != 0)
+    die("waitpid WNOHANG returned before exit");
+  if (read(nbfd, &r, sizeof r) != -1)
+    die("non-blocking exitfd read returned before exit");
+
+  write(fd[1], &c, 1);
+  if (read(efd, &r, sizeof r) != sizeof r || r != pid)
+    die("exitfd read returned wrong pid");
+  if (waitpid(pid, NULL, 0) != pid)
+    die("waitpid wrong pid");
+  if (read(efd, &r, sizeof r) != 0)
+    die("exitfd read with no children should return 0");
+
+  close(fd[0]);
+  close(fd[1]);
+  close(efd);
+  close(nbfd);
+  printf("exitfdtest ok\n");
+}
+
 void
 killtest(void)
 {
@@ -326,7 +375,7 @@ killtest(void)
     return;
   }
   sleep(1);
-  kill(pid);
+  kill(pid, SIGKILL);
   sleep(1);
   if(wait(NULL) < 0)
     die("wait should have return the killed child");
@@ -381,7 +430,7 @@ mem(void)
     m1 = malloc(1024*20);
     if(m1 == 0){
       printf("couldn't allocate mem?!!\n");
-      kill(ppid);
+      kill(ppid, SIGKILL);
       exit(0);
     }
     free(m1);
@@ -1210,6 +1259,220 @@ forktest(void)
   printf("fork test OK\n");
 }
 
+void
+vforktest(void)
+{
+  static volatile int shared;
+  const char *args[] = { "echo", "vfork", "exec", "OK", 0 };
+  int pid, status;
+
+  printf("vfork test\n");
+
+  // The child runs in our address space and we don't run again until
+  // it exits.
+  shared = 0;
+  pid = vfork();
+  if(pid < 0)
+    die("vfork failed");
+  if(pid == 0){
+    shared = 1;
+    exit(7);
+  }
+  if(shared != 1)
+    die("vfork child didn't share memory");
+  if(waitpid(pid, &status, 0) < 0)
+    die("vfork wait failed");
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 7)
+    die("vfork wrong status");
+
+  // Or until it calls exec, which reuses our stack
+  pid = vfork();
+  if(pid < 0)
+    die("vfork failed");
+  if(pid == 0){
+    execv(args[0], const_cast<char * const *>(args));
+    die("vfork exec failed");
+  }
+  if(waitpid(pid, &status, 0) < 0)
+    die("vfork wait failed");
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    die("vfork exec wrong status");
+
+  printf("vfork test OK\n");
+}
+
+void
+rusagetest(void)
+{
+  struct rusage self, child, children;
+  int pid;
+
+  printf("rusage test\n");
+
+  if(getrusage(RUSAGE_SELF, &self) < 0)
+    die("getrusage failed");
+  if(getrusage(7, &self) != -1)
+    die("getrusage accepted a bad who");
+
+  pid = fork();
+  if(pid < 0)
+    die("fork failed");
+  if(pid == 0){
+    // Spin in user space for a while
+    for(volatile int i = 0; i < 10000000; i++)
+      ;
+    exit(0);
+  }
+  if(wait4(pid, NULL, 0, &child) != pid)
+    die("wait4 failed");
+  if(child.ru_utime == 0)
+    die("child has no user time");
+  if(getrusage(RUSAGE_CHILDREN, &children) < 0)
+    die("getrusage children failed");
+  if(children.ru_utime < child.ru_utime)
+    die("children's usage doesn't include child");
+
+  printf("rusage test OK\n");
+}
+
+void
+schedtest(void)
+{
+  struct sched_param sp;
+  int pid;
+
+  printf("sched test\n");
+
+  if(sched_getscheduler(0) != SCHED_OTHER)
+    die("not SCHED_OTHER to start");
+  sp.sched_priority = 0;
+  if(sched_setscheduler(0, SCHED_FIFO, &sp) != -1)
+    die("SCHED_FIFO accepted priority 0");
+  sp.sched_priority = SCHED_NICE_MAX + 1;
+  if(sched_setscheduler(0, SCHED_OTHER, &sp) != -1)
+    die("SCHED_OTHER accepted a bad nice value");
+  if(sched_setscheduler(0, 7, &sp) != -1)
+    die("sched_setscheduler accepted a bad policy");
+
+  sp.sched_priority = 10;
+  if(sched_setscheduler(0, SCHED_FIFO, &sp) < 0)
+    die("sched_setscheduler SCHED_FIFO failed");
+  sp.sched_priority = 0;
+  if(sched_getscheduler(0) != SCHED_FIFO ||
+     sched_getparam(0, &sp) < 0 || sp.sched_priority != 10)
+    die("SCHED_FIFO didn't stick");
+
+  // Children inherit their parent's policy
+  pid = fork();
+  if(pid < 0)
+    die("fork failed");
+  if(pid == 0){
+    if(sched_getscheduler(0) != SCHED_FIFO ||
+       sched_getparam(0, &sp) < 0 || sp.sched_priority != 10)
+      die("child didn't inherit SCHED_FIFO");
+    exit(0);
+  }
+  if(wait(NULL) != pid)
+    die("wait failed");
+
+  sp.sched_priority = 5;
+  if(sched_setscheduler(0, SCHED_OTHER, &sp) < 0)
+    die("sched_setscheduler SCHED_OTHER failed");
+  sp.sched_priority = 0;
+  if(sched_getscheduler(0) != SCHED_OTHER ||
+     sched_getparam(0, &sp) < 0 || sp.sched_priority != 5)
+    die("nice value didn't stick");
+  sp.sched_priority = 0;
+  if(sched_setscheduler(0, SCHED_OTHER, &sp) < 0)
+    die("sched_setscheduler nice 0 failed");
+
+  printf("sched test OK\n");
+}
+
+// A SCHED_FIFO thread woken from another CPU should preempt a spinner
+// on its own CPU right away, not at the next tick.
+void
+schedpreempttest(void)
+{
+  enum { ITERS = 10 };
+  int spinner, rt, fds[2], res[2];
+
+  printf("sched preempt test\n");
+
+  if(setaffinity(1) < 0){
+    printf("sched preempt test needs two CPUs, skipping\n");
+    return;
+  }
+  if(pipe(fds) < 0 || pipe(res) < 0)
+    die("pipe failed");
+
+  spinner = fork();
+  if(spinner < 0)
+    die("fork failed");
+  if(spinner == 0){
+    setaffinity(0);
+    for(;;)
+      ;
+  }
+
+  rt = fork();
+  if(rt < 0)
+    die("fork failed");
+  if(rt == 0){
+    struct sched_param sp;
+    u64 max = 0;
+    setaffinity(0);
+    sp.sched_priority = 10;
+    if(sched_setscheduler(0, SCHED_FIFO, &sp) < 0)
+      die("sched_setscheduler failed");
+    for(int i = 0; i < ITERS; i++){
+      u64 sent;
+      if(read(fds[0], &sent, sizeof(sent)) != sizeof(sent))
+        die("read failed");
+      u64 lat = rdtsc() - sent;
+      if(lat > max)
+        max = lat;
+    }
+    if(write(res[1], &max, sizeof(max)) != sizeof(max))
+      die("write failed");
+    exit(0);
+  }
+
+  // Without wakeup preemption, the wakeup latency is spread over a
+  // whole tick, so at least one of these would likely take more than
+  // half.
+  for(int i = 0; i < ITERS; i++){
+    nsleep(2*1000*1000);
+    u64 now = rdtsc();
+    if(write(fds[1], &now, sizeof(now)) != sizeof(now))
+      die("write failed");
+  }
+  u64 max;
+  if(read(res[0], &max, sizeof(max)) != sizeof(max))
+    die("read failed");
+  if(wait(NULL) != rt)
+    die("wait failed");
+  kill(spinner, SIGKILL);
+  if(wait(NULL) != spinner)
+    die("wait failed");
+  close(fds[0]);
+  close(fds[1]);
+  close(res[0]);
+  close(res[1]);
+  setaffinity(-1);
+
+  // This depends on wall-clock timing, which an emulator or a busy
+  // host can stretch arbitrarily, so report the latency rather than
+  // failing on it.
+  printf("sched preempt test: max wakeup latency %lu us\n",
+         max * 1000000 / cpuhz());
+  if(max > (u64)cpuhz() / 1000 * QUANTUM / 2)
+    printf("sched preempt test: warning: longer than half a %d ms tick\n",
+           QUANTUM);
+
+  printf("sched preempt test OK\n");
+}
+
 void
 memtest(void)
 {
@@ -1323,7 +1586,7 @@ sbrktest(void)
     if(pid < 0)
       die("fork failed");
     if(pid == 0)
-      kill(ppid);
+      kill(ppid, SIGKILL);
       die("oops could read %x = %x", a, *a);
     }
   wait(NULL);
@@ -1352,7 +1615,7 @@ sbrktest(void)
   for(i = 0; i < sizeof(pids)/sizeof(pids[0]); i++){
     if(pids[i] == -1)
       continue;
-    kill(pids[i]);
+    kill(pids[i], SIGKILL);
     wait(NULL);
   }
   if(c == (char*)0xffffffff)
@@ -1385,7 +1648,7 @@ validatetest(void)
     }
     nsleep(0);
     nsleep(0);
-    kill(pid);
+    kill(pid, SIGKILL);
     wait(NULL);
 
     // try to crash the kernel by passing in a bad string pointer
@@ -1443,6 +1706,77 @@ sigtest(void)
   fprintf(stderr, "sigtest ok\n");
 }
 
+static volatile int sigusr_count;
+
+static void
+sigusrhand(int signo)
+{
+  if (signo != SIGUSR1)
+    die("sigusrhand: wrong signal %d", signo);
+  sigusr_count++;
+}
+
+// kill with handlers, blocked signals, signalfd and process groups
+void
+sigkilltest(void)
+{
+  printf("sigkilltest\n");
+
+  // The handler runs on the way out of kill, and kill still returns
+  // its own result.
+  if (signal(SIGUSR1, sigusrhand) == SIG_ERR)
+    die("failed to set SIGUSR1 handler");
+  if (kill(getpid(), SIGUSR1) != 0 || sigusr_count != 1)
+    die("SIGUSR1 not delivered");
+
+  // Blocked signals stay pending for signalfd
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  if (sigprocmask(SIG_BLOCK, &set, &old) < 0)
+    die("sigprocmask failed");
+  int sfd = signalfd(set, O_NONBLOCK);
+  if (sfd < 0)
+    die("signalfd failed");
+  kill(getpid(), SIGUSR1);
+  kill(getpid(), SIGUSR2);
+  if (sigusr_count != 1)
+    die("blocked SIGUSR1 delivered");
+  int sigs[4];
+  if (read(sfd, sigs, sizeof sigs) != 2 * sizeof(int) ||
+      sigs[0] != SIGUSR1 || sigs[1] != SIGUSR2)
+    die("signalfd read wrong signals");
+  if (read(sfd, sigs, sizeof sigs) != -1)
+    die("non-blocking signalfd read with nothing pending");
+  close(sfd);
+  sigprocmask(SIG_SETMASK, &old, nullptr);
+  signal(SIGUSR1, SIG_DFL);
+
+  // SIGTERM's default action kills every process in the group
+  int pids[2];
+  for (int i = 0; i < 2; i++) {
+    pids[i] = fork();
+    if (pids[i] < 0)
+      die("fork failed");
+    if (pids[i] == 0) {
+      for (;;)
+        yield();
+    }
+    if (setpgid(pids[i], pids[0]) < 0)
+      die("setpgid failed");
+  }
+  if (getpgid(pids[1]) != pids[0])
+    die("getpgid wrong group");
+  if (kill(-pids[0], SIGTERM) < 0)
+    die("kill process group failed");
+  for (int i = 0; i < 2; i++)
+    if (waitpid(pids[i], NULL, 0) != pids[i])
+      die("waitpid wrong pid");
+
+  printf("sigkilltest ok\n");
+}
+
 // does unintialized data start out zero?
 char uninit[10000];
 void
@@ -1543,7 +1877,7 @@ unopentest(void)
       unlink(name);
     }
   }
-  kill(pid);
+  kill(pid, SIGKILL);
   wait(NULL);
 
   fprintf(stdout, "concurrent unlink/open ok\n");
@@ -1596,6 +1930,114 @@ preads(void)
   printf("concurrent preads OK\n");
 }
 
+void
+iovtest(void)
+{
+  static char a[5000], b[3], c[100];
+  struct iovec iov[3] = {{a, sizeof a}, {b, sizeof b}, {c, sizeof c}};
+  const int total = sizeof a + sizeof b + sizeof c;
+  int fd;
+
+  printf("readv/writev test\n");
+
+  fd = open("iov.x", O_CREAT|O_RDWR|O_TRUNC, 0666);
+  if (fd < 0)
+    die("iovtest: open failed");
+
+  memset(a, 'a', sizeof a);
+  memset(b, 'b', sizeof b);
+  memset(c, 'c', sizeof c);
+  if (writev(fd, iov, 3) != total)
+    die("iovtest: writev failed");
+  if (pwritev(fd, iov + 1, 1, 1) != sizeof b)
+    die("iovtest: pwritev failed");
+  if (lseek(fd, 0, SEEK_CUR) != total)
+    die("iovtest: wrong offset after writev");
+
+  memset(a, 0, sizeof a);
+  memset(b, 0, sizeof b);
+  memset(c, 0, sizeof c);
+  if (lseek(fd, 0, SEEK_SET) != 0)
+    die("iovtest: lseek failed");
+  if (readv(fd, iov, 3) != total)
+    die("iovtest: readv failed");
+  if (a[0] != 'a' || a[1] != 'b' || a[3] != 'b' || a[4] != 'a' ||
+      a[sizeof a - 1] != 'a' || b[0] != 'b' || b[2] != 'b' ||
+      c[0] != 'c' || c[sizeof c - 1] != 'c')
+    die("iovtest: readv read wrong data");
+  if (readv(fd, iov, 3) != 0)
+    die("iovtest: readv past EOF failed");
+
+  memset(c, 0, sizeof c);
+  if (preadv(fd, iov + 2, 1, total - 10) != 10 || c[9] != 'c' || c[10])
+    die("iovtest: preadv failed");
+
+  // A writev bigger than the kernel gathers at once, and one with a
+  // bad buffer after a good one, which writes what comes before it.
+  const int bigsz = 200 * 1024;
+  char *big = (char*)malloc(bigsz);
+  if (!big)
+    die("iovtest: malloc failed");
+  memset(big, 'x', bigsz);
+  struct iovec biov[2] = {{big, (size_t)bigsz}, {(void*)1, 10}};
+  if (lseek(fd, 0, SEEK_SET) != 0)
+    die("iovtest: lseek failed");
+  if (writev(fd, biov, 1) != bigsz)
+    die("iovtest: large writev failed");
+  if (writev(fd, biov, 2) != bigsz)
+    die("iovtest: writev with a bad buffer didn't write the good one");
+  if (lseek(fd, 0, SEEK_CUR) != 2 * bigsz)
+    die("iovtest: wrong offset after partial writev");
+  close(fd);
+
+  // Appends, including one bigger than the kernel gathers at once.
+  fd = open("iov.x", O_WRONLY|O_APPEND);
+  if (fd < 0)
+    die("iovtest: open O_APPEND failed");
+  memset(big, 'y', bigsz);
+  if (writev(fd, iov + 1, 2) != sizeof b + sizeof c)
+    die("iovtest: append writev failed");
+  if (writev(fd, biov, 1) != bigsz)
+    die("iovtest: large append writev failed");
+  if (lseek(fd, 0, SEEK_CUR) != 3 * bigsz + sizeof b + sizeof c)
+    die("iovtest: wrong offset after append writev");
+  close(fd);
+  fd = open("iov.x", O_RDONLY);
+  if (fd < 0)
+    die("iovtest: reopen failed");
+  memset(b, 0, sizeof b);
+  memset(c, 0, sizeof c);
+  if (pread(fd, b, sizeof b, 2 * bigsz) != sizeof b ||
+      pread(fd, c, 1, 2 * bigsz + sizeof b + sizeof c - 1) != 1 ||
+      pread(fd, a, 1, 3 * bigsz + sizeof b + sizeof c - 1) != 1 ||
+      b[0] != 'b' || c[0] != 'c' || a[0] != 'y')
+    die("iovtest: append writev wrote wrong data");
+  close(fd);
+  if (unlink("iov.x") < 0)
+    die("iovtest: unlink failed");
+
+  // Pipes take the generic path, which moves a page at a time but
+  // should still transfer the whole vector.
+  int pfds[2];
+  if (pipe(pfds) < 0)
+    die("iovtest: pipe failed");
+  struct iovec piov[2] = {{big, 3 * 4096}, {c, sizeof c}};
+  memset(c, 'c', sizeof c);
+  if (writev(pfds[1], piov, 2) != 3 * 4096 + sizeof c)
+    die("iovtest: pipe writev failed");
+  memset(big, 0, bigsz);
+  memset(c, 0, sizeof c);
+  if (readv(pfds[0], piov, 2) != 3 * 4096 + sizeof c)
+    die("iovtest: pipe readv failed");
+  if (big[0] != 'y' || big[3 * 4096 - 1] != 'y' ||
+      c[0] != 'c' || c[sizeof c - 1] != 'c')
+    die("iovtest: pipe readv read wrong data");
+  close(pfds[0]);
+  close(pfds[1]);
+  free(big);
+  printf("readv/writev test OK\n");
+}
+
 void
 tls_test(void)
 {
@@ -1661,6 +2103,86 @@ ftabletest(void)
   printf("ftabletest ok\n");
 }
 
+// Run by fdtabletest through exec: the FDs in argv[0] and argv[1]
+// were O_CLOEXEC and the one in argv[2] wasn't.
+static void
+fdcheck(char **argv)
+{
+  struct stat st;
+  for (int i = 0; i < 2; i++)
+    if (fstat(atoi(argv[i]), &st) == 0)
+      die("fdcheck: O_CLOEXEC fd %s survived exec", argv[i]);
+  if (fstat(atoi(argv[2]), &st) < 0)
+    die("fdcheck: fd %s didn't survive exec", argv[2]);
+  exit(0);
+}
+
+static void
+fdtabletest(void)
+{
+  // Enough FDs to fill several 64-FD chunks
+  enum { NFDS = 300 };
+  static int fds[NFDS];
+  struct stat st;
+  int status;
+
+  printf("fdtabletest...\n");
+
+  fds[0] = open("README", O_RDONLY);
+  if (fds[0] < 0)
+    die("fdtabletest: open");
+  for (int i = 1; i < NFDS; i++) {
+    fds[i] = dup(fds[0]);
+    if (fds[i] <= fds[i - 1])
+      die("fdtabletest: dup %d returned %d after %d", i, fds[i], fds[i - 1]);
+  }
+
+  // Every FD below the last one is now in use, so a hole in an early
+  // chunk is the lowest free FD.
+  close(fds[1]);
+  if (dup(fds[0]) != fds[1])
+    die("fdtabletest: didn't reuse fd %d", fds[1]);
+
+  // A child gets a copy of every chunk
+  if (fork() == 0) {
+    for (int i = 0; i < NFDS; i++)
+      if (fstat(fds[i], &st) < 0)
+        die("fdtabletest: fd %d not inherited", fds[i]);
+    close(fds[NFDS - 50]);
+    if (dup(fds[0]) != fds[NFDS - 50])
+      die("fdtabletest: child didn't reuse fd %d", fds[NFDS - 50]);
+    exit(0);
+  }
+  wait(&status);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    die("fdtabletest: fork child failed");
+  if (fstat(fds[NFDS - 50], &st) < 0)
+    die("fdtabletest: child's close reached parent");
+
+  // exec drops O_CLOEXEC FDs from the first chunk and a later one
+  if (fork() == 0) {
+    close(fds[2]);
+    close(fds[NFDS - 50]);
+    if (open("README", O_RDONLY|O_CLOEXEC) != fds[2] ||
+        open("README", O_RDONLY|O_CLOEXEC) != fds[NFDS - 50])
+      die("fdtabletest: O_CLOEXEC open didn't reuse fds");
+    char a[3][16];
+    snprintf(a[0], sizeof a[0], "%d", fds[2]);
+    snprintf(a[1], sizeof a[1], "%d", fds[NFDS - 50]);
+    snprintf(a[2], sizeof a[2], "%d", fds[NFDS - 20]);
+    const char *argv[] = {"usertests", "-fdcheck", a[0], a[1], a[2], nullptr};
+    execv(argv[0], const_cast<char * const *>(argv));
+    die("fdtabletest: exec usertests failed");
+  }
+  wait(&status);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    die("fdtabletest: exec child failed");
+
+  for (int i = 0; i < NFDS; i++)
+    close(fds[i]);
+  printf("fdtabletest ok\n");
+}
+
 static pthread_key_t tkey;
 static pthread_barrier_t bar0, bar1;
 enum { nthread = 8 };
@@ -1703,6 +2225,49 @@ thrtest(void)
   printf("thrtest ok\n");
 }
 
+// Detached clone_thread threads joined through their tid words
+static u64 clone_tids[nthread];
+static u64 clone_tls[nthread][2];
+static char clone_stacks[nthread][4096] __attribute__((aligned(16)));
+static std::atomic<int> clone_ok;
+
+static void
+clonethr(u64 i)
+{
+  u64 v;
+  __asm volatile("movq %%fs:0, %0" : "=r" (v));
+  if (v == clone_tls[i][0])
+    clone_ok++;
+  exit(0);
+}
+
+void
+clonethreadtest(void)
+{
+  printf("clonethreadtest\n");
+
+  for (int i = 0; i < nthread; i++) {
+    clone_tls[i][0] = 0xc0ffee00ULL | i;
+    int tid = clone_thread((u64)(clone_stacks[i] + sizeof clone_stacks[i]),
+                           (u64)clonethr, i, (u64)clone_tls[i],
+                           &clone_tids[i], FORK_SHARE_FD | FORK_DETACHED);
+    if (tid <= 0)
+      die("clone_thread failed");
+  }
+
+  for (int i = 0; i < nthread; i++) {
+    u64 v;
+    while ((v = clone_tids[i]) != 0)
+      futex(&clone_tids[i], FUTEX_WAIT, v, 0);
+  }
+  if (clone_ok != nthread)
+    die("clone_thread: wrong TLS in %d threads", nthread - clone_ok);
+  if (wait(NULL) != -1)
+    die("clone_thread: detached thread was a child");
+
+  printf("clonethreadtest ok\n");
+}
+
 void
 unmappedtest(void)
 {
@@ -1938,6 +2503,99 @@ floattest(void)
   printf("floattest ok\n");
 }
 
+static u64
+ksm_merged(void)
+{
+  struct kstats ks;
+  int fd = open("/dev/kstats", O_RDONLY);
+  if(fd < 0)
+    die("ksmtest: cannot open /dev/kstats");
+  if(read(fd, &ks, sizeof(ks)) != sizeof(ks))
+    die("ksmtest: short read from /dev/kstats");
+  close(fd);
+  return ks.ksm_merged;
+}
+
+// Fill the pages identically in every process, but unlike anything
+// else that might be mergeable.
+static void
+ksm_fill(char *p, int npages)
+{
+  for(int i = 0; i < npages; i++)
+    for(int j = 0; j < 4096; j++)
+      p[i*4096 + j] = "ksmtest"[j % 7] + i;
+}
+
+void
+ksmtest(void)
+{
+  enum { NPAGES = 4 };
+  int ready[2], go[2];
+  char c;
+
+  printf("ksm test\n");
+  if(KSM_CPU_PERCENT == 0){
+    printf("ksm test: merging disabled, skipping\n");
+    return;
+  }
+
+  if(pipe(ready) < 0 || pipe(go) < 0)
+    die("ksmtest: pipe failed");
+  u64 before = ksm_merged();
+
+  // Each process maps its own pages after the fork, so the only way
+  // for them to end up shared is by merging.
+  int pid = fork();
+  if(pid < 0)
+    die("ksmtest: fork failed");
+  char *p = (char*)mmap(0, NPAGES*4096, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED)
+    die("ksmtest: mmap failed");
+  ksm_fill(p, NPAGES);
+  if(madvise(p, NPAGES*4096, MADV_MERGEABLE) < 0)
+    die("ksmtest: madvise failed");
+
+  if(pid == 0){
+    if(write(ready[1], "r", 1) != 1)
+      die("ksmtest: write failed");
+    // Wait until the parent has written its copy
+    if(read(go[0], &c, 1) != 1)
+      die("ksmtest: read failed");
+    for(int i = 0; i < NPAGES*4096; i++)
+      if(p[i] != "ksmtest"[(i % 4096) % 7] + i / 4096)
+        die("ksmtest: write to a merged page showed up in another process");
+    exit(0);
+  }
+
+  if(read(ready[0], &c, 1) != 1)
+    die("ksmtest: read failed");
+  // The scanner makes a pass every second
+  for(int i = 0; ksm_merged() == before; i++){
+    if(i == 100)
+      die("ksmtest: identical pages were never merged");
+    nsleep(100*1000*1000);
+  }
+
+  for(int i = 0; i < NPAGES; i++)
+    p[i*4096] = 0;
+  if(write(go[1], "g", 1) != 1)
+    die("ksmtest: write failed");
+  int status;
+  if(wait(&status) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    die("ksmtest: child failed");
+  for(int i = 0; i < NPAGES; i++)
+    if(p[i*4096] != 0 || p[i*4096 + 1] != 's' + i)
+      die("ksmtest: lost a write to a merged page");
+
+  munmap(p, NPAGES*4096);
+  close(ready[0]);
+  close(ready[1]);
+  close(go[0]);
+  close(go[1]);
+  printf("ksm test ok\n");
+}
+
 void
 writeprotecttest(void)
 {
@@ -1992,6 +2650,94 @@ writeprotecttest(void)
   munmap(buffer, 4 * 4096);
 }
 
+// Check that every page of buf holds the byte that mark says it
+// should.
+static void
+cowcheck(const char *who, char *buf, int npages, char (*mark)(int))
+{
+  for (int i = 0; i < npages; i++)
+    for (int j = 0; j < 4096; j += 512)
+      if (buf[i*4096 + j] != mark(i))
+        die("forkcowtest: %s page %d is %d, want %d",
+            who, i, buf[i*4096 + j], mark(i));
+}
+
+// After fork, parent and child must each see only their own writes,
+// including writes the kernel makes on their behalf, through a
+// grandchild, and across pages that were never written before fork.
+void
+forkcowtest(void)
+{
+  enum { NPAGES = 80 };
+  char *buf;
+  int fds[2], status;
+
+  printf("forkcowtest\n");
+  buf = (char*)mmap(0, NPAGES*4096, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    die("forkcowtest: mmap failed");
+  // Leave the last few pages untouched
+  for (int i = 0; i < NPAGES - 4; i++)
+    memset(buf + i*4096, 'a', 4096);
+  if (pipe(fds) < 0)
+    die("forkcowtest: pipe failed");
+
+  int pid = fork();
+  if (pid < 0)
+    die("forkcowtest: fork failed");
+  if (pid == 0) {
+    // Let the parent write first
+    char c;
+    if (read(fds[0], &c, 1) != 1)
+      die("forkcowtest: read failed");
+    for (int i = 0; i < NPAGES; i += 2)
+      memset(buf + i*4096, 'c', 4096);
+    cowcheck("child", buf, NPAGES, [](int i) {
+        return i % 2 == 0 ? 'c' : i < NPAGES - 4 ? 'a' : '\0';
+      });
+
+    // The kernel's writes to a copy-on-write page must copy it, too
+    for (int n = 0, r; n < 512; n += r)
+      if ((r = read(fds[0], buf + 3*4096 + n, 512 - n)) <= 0)
+        die("forkcowtest: read failed");
+    if (buf[3*4096] != 'k' || buf[3*4096 + 511] != 'k')
+      die("forkcowtest: child missed the kernel's write");
+
+    int pid2 = fork();
+    if (pid2 < 0)
+      die("forkcowtest: fork failed");
+    if (pid2 == 0) {
+      for (int i = 0; i < NPAGES; i++)
+        buf[i*4096] = 'g';
+      exit(0);
+    }
+    if (waitpid(pid2, &status, 0) < 0 || status != 0)
+      die("forkcowtest: grandchild failed");
+    if (buf[0] != 'c' || buf[4096] != 'a' || buf[3*4096] != 'k' ||
+        buf[(NPAGES-1)*4096] != '\0')
+      die("forkcowtest: child sees its child's writes");
+    exit(0);
+  }
+
+  for (int i = 1; i < NPAGES; i += 2)
+    memset(buf + i*4096, 'p', 4096);
+  char data[512];
+  memset(data, 'k', sizeof data);
+  if (write(fds[1], data, 1) != 1 ||
+      write(fds[1], data, sizeof data) != sizeof data)
+    die("forkcowtest: write failed");
+  if (waitpid(pid, &status, 0) < 0 || status != 0)
+    die("forkcowtest: child failed");
+  cowcheck("parent", buf, NPAGES, [](int i) {
+      return i % 2 == 1 ? 'p' : i < NPAGES - 4 ? 'a' : '\0';
+    });
+  close(fds[0]);
+  close(fds[1]);
+  munmap(buf, NPAGES*4096);
+  printf("forkcowtest ok\n");
+}
+
 void
 cloexec(void)
 {
@@ -2059,6 +2805,9 @@ run_test(const char *name, void (*test)())
 int
 main(int argc, char *argv[])
 {
+  if (argc == 5 && strcmp(argv[1], "-fdcheck") == 0)
+    fdcheck(argv + 2);
+
   printf("usertests starting\n");
 
   if(open("usertests.ran", 0) >= 0)
@@ -2086,16 +2835,19 @@ main(int argc, char *argv[])
 
   TEST(validatetest);
   TEST(sigtest);
+  TEST(sigkilltest);
 
   TEST(opentest);
   TEST(writetest);
 //  TEST(writetest1);   // Currently broken
   TEST(createtest);
   TEST(preads);
+  TEST(iovtest);
 
   TEST(pipe1);
   TEST(preempt);
   TEST(exitwait);
+  TEST(exitfdtest);
   TEST(zombietest);
   TEST(killtest); 
 
@@ -2113,14 +2865,22 @@ main(int argc, char *argv[])
   TEST(dirfile);
   TEST(iref);
   TEST(forktest);
+  TEST(vforktest);
+  TEST(rusagetest);
+  TEST(schedtest);
+  TEST(schedpreempttest);
   TEST(bigdir); // slow
   TEST(tls_test);
   TEST(thrtest);
+  TEST(clonethreadtest);
   TEST(ftabletest);
+  TEST(fdtabletest);
   TEST(renametest);
 
   TEST(floattest);
   TEST(writeprotecttest);
+  TEST(forkcowtest);
+  TEST(ksmtest);
 
   TEST(cloexec);
 
@@ -34,6 +34,12 @@ public:
     send_ipi(c, T_SAMPCONF);
   }
 
+  // Send a T_RESCHED IPI to a remote CPU
+  void send_resched(struct cpu *c)
+  {
+    send_ipi(c, T_RESCHED);
+  }
+
   // Mask or unmask PC
   virtual void mask_pc(bool mask) = 0;
 
@@ -11,6 +11,15 @@
 #endif
 
 // Binary buddy allocator.
+//
+// To limit fragmentation, memory is divided into pageblocks and each
+// pageblock has a migratetype.  Free blocks smaller than a pageblock
+// are kept on a separate free list for each type, so allocations of
+// different types come from different pageblocks.  An allocation only
+// falls back to another type's pageblocks if there are no free
+// pageblocks left, and takes over the whole pageblock if most of it
+// is free.  This keeps unmovable kernel allocations from being
+// scattered through memory that compaction could otherwise empty.
 class buddy_allocator
 {
 public:
@@ -23,6 +32,26 @@ public:
     MAX_ORDER = 12,
     // The maximum size this allocator can allocate.
     MAX_SIZE = MIN_SIZE << MAX_ORDER,
+    // The order of a pageblock.  Free blocks of this order and above
+    // don't have a migratetype.
+    PAGEBLOCK_ORDER = 9,
+    PAGEBLOCK_SIZE = MIN_SIZE << PAGEBLOCK_ORDER,
+  };
+
+  enum migratetype {
+    // Kernel memory that can't be moved
+    MIGRATE_UNMOVABLE,
+    // Page table pages.  These can't be moved either, but they're
+    // freed in bulk when an address space goes away.
+    MIGRATE_PGTABLE,
+    // Memory that compaction can migrate
+    MIGRATE_MOVABLE,
+    // Pageblocks being compacted.  Nothing is allocated from these,
+    // so they can coalesce as their pages are freed.
+    MIGRATE_ISOLATE,
+    MIGRATE_TYPES,
+    // The types that can be allocated
+    MIGRATE_ALLOC_TYPES = MIGRATE_ISOLATE,
   };
 
   struct stats
@@ -35,6 +64,12 @@ public:
     std::size_t free;
     // The number of free blocks at each order.
     std::size_t nfree[MAX_ORDER + 1];
+    // The number of free blocks at each order below PAGEBLOCK_ORDER
+    // on each migratetype's free lists.
+    std::size_t nfree_type[MIGRATE_TYPES][PAGEBLOCK_ORDER];
+    // Allocations that had to take memory from another migratetype's
+    // pageblock, and how many of those took over the pageblock.
+    std::size_t fallbacks, conversions;
   };
 
 private:
@@ -53,8 +88,41 @@ private:
     return log2 - __builtin_ctz(MIN_SIZE);
   }
 
-  void *alloc_order(std::size_t order);
+  // Convert a size that's a multiple of MIN_SIZE into the order of
+  // the smallest block that holds it.
+  static std::size_t size_to_block_order(std::size_t size)
+  {
+    if (size < MIN_SIZE)
+      throw std::domain_error("buddy allocator: size < MIN_SIZE");
+    if (size % MIN_SIZE)
+      throw std::domain_error("buddy allocator: size is not a multiple of MIN_SIZE");
+    std::size_t order = 0;
+    while ((MIN_SIZE << order) < size && order <= MAX_ORDER)
+      ++order;
+    return size_to_order(MIN_SIZE << order);
+  }
+
+  void *alloc_order(std::size_t order, migratetype type);
+  void *alloc_fallback(std::size_t order, migratetype type);
+  void *take_block(std::size_t order, migratetype type);
   void free_order(void *ptr, std::size_t order);
+  void trim_order(void *ptr, std::size_t order, std::size_t keep);
+
+  struct pageblock
+  {
+    unsigned char type;
+    // Scratch space for compaction_candidates
+    unsigned short nfree;
+  };
+
+  pageblock *pageblock_of(const void *ptr) const
+  {
+    return &pageblocks[((uintptr_t)ptr - base) / PAGEBLOCK_SIZE];
+  }
+
+  // Set the migratetype of the pageblocks covering [ptr,
+  // ptr+(MIN_SIZE << order)).
+  void set_type(void *ptr, std::size_t order, migratetype type);
 
   // Flip the bitmap bit for the buddy pair containing ptr and return
   // its new value.
@@ -66,7 +134,7 @@ private:
 public:
   // Construct a buddy allocator with no memory.  Useful in
   // conjunction with move assignment.
-  buddy_allocator() : base(0), limit(0) { }
+  buddy_allocator() : base(0), limit(0), pageblocks(nullptr) { }
 
   // Construct a buddy allocator containing the memory from [base,
   // base+len).  If track_len is not 0, then the buddy allocator will
@@ -85,27 +153,37 @@ public:
   bool empty() const
   {
     for (auto &order : orders)
-      if (!order.blocks.empty())
-        return false;
+      for (auto &list : order.blocks)
+        if (!list.empty())
+          return false;
     return true;
   }
 
   // Allocate a region of the given size, which must be between
-  // MIN_SIZE and MAX_SIZE and must be a power of two.  Returns
-  // nullptr if out of memory.  Throws std::domain_error if size does
-  // not satisfy the requirements.
-  void *alloc_nothrow(std::size_t size)
+  // MIN_SIZE and MAX_SIZE and must be a multiple of MIN_SIZE,
+  // preferably from pageblocks of migratetype type.  Returns nullptr
+  // if out of memory.  Throws std::domain_error if size does not
+  // satisfy the requirements.
+  //
+  // If size isn't a power of two, this takes a block of the next
+  // power of two and immediately frees what's left over after size.
+  void *alloc_nothrow(std::size_t size,
+                      migratetype type = MIGRATE_UNMOVABLE)
   {
-    void *ptr = alloc_order(size_to_order(size));
-    if (ptr)
+    std::size_t order = size_to_block_order(size);
+    void *ptr = alloc_order(order, type);
+    if (ptr) {
       free_bytes -= size;
+      if (size != MIN_SIZE << order)
+        trim_order(ptr, order, size);
+    }
     return ptr;
   }
 
   // Like alloc_nothrow(), but throws std::bad_alloc if out of memory.
-  void *alloc(std::size_t size)
+  void *alloc(std::size_t size, migratetype type = MIGRATE_UNMOVABLE)
   {
-    void *ptr = alloc_nothrow(size);
+    void *ptr = alloc_nothrow(size, type);
     if (!ptr)
       throw std::bad_alloc();
     return ptr;
@@ -115,7 +193,18 @@ public:
   void free(void *ptr, std::size_t size)
   {
     free_bytes += size;
-    free_order(ptr, size_to_order(size));
+    if ((size & (size - 1)) == 0) {
+      free_order(ptr, size_to_order(size));
+      return;
+    }
+    // alloc trimmed this region into blocks of decreasing order, one
+    // for each bit of size.
+    for (std::size_t order = MAX_ORDER + 1; order-- > 0; ) {
+      if (size & (MIN_SIZE << order)) {
+        free_order(ptr, order);
+        ptr = (char*)ptr + (MIN_SIZE << order);
+      }
+    }
   }
 
   // Return the lowest address the allocator can return.
@@ -144,6 +233,27 @@ public:
     return free_bytes;
   }
 
+  // Return the migratetype of the pageblock containing ptr, which
+  // must be tracked by this allocator.
+  migratetype get_type(const void *ptr) const
+  {
+    return (migratetype)pageblock_of(ptr)->type;
+  }
+
+  // Find up to max MIGRATE_MOVABLE pageblocks that have at least
+  // min_free bytes free in this allocator, but aren't entirely free,
+  // and store their addresses in out, most free first.  Returns the
+  // number found.  This scans the free lists, so it's slow.
+  std::size_t compaction_candidates(uintptr_t *out, std::size_t max,
+                                    std::size_t min_free);
+
+  // Change the migratetype of n pageblocks, moving their free blocks
+  // to the new type's free lists.  This is used to isolate pageblocks
+  // for compaction and to release them afterwards.  This scans the
+  // free lists, so it's slow.
+  void move_pageblocks(const uintptr_t *pbs, std::size_t n,
+                       migratetype type);
+
   // Return statistics for this allocator.  This may be expensive.
   stats get_stats() const;
 
@@ -162,14 +272,27 @@ private:
   // blocks.
   std::size_t waste_bytes;
 
+  // Migratetype of each pageblock in [base, limit).  Allocated with
+  // the tracking bitmaps.
+  pageblock *pageblocks;
+
+  std::size_t fallbacks, conversions;
+
   struct block
   {
     ilink<block> link;
   };
 
+  typedef ilist<block, &block::link> block_list;
+
   struct order_head
   {
-    ilist<block, &block::link> blocks;
+    // Free blocks of this order.  Below PAGEBLOCK_ORDER, there is a
+    // list for each migratetype, and a block is usually on the list
+    // of its pageblock's type.  When a pageblock changes type during
+    // an allocation fallback, its free blocks stay where they are.
+    // Above PAGEBLOCK_ORDER, only blocks[0] is used.
+    block_list blocks[MIGRATE_TYPES];
 
     // Bitmap indicating the status of each pair of buddies in this
     // order.  Set to 1 if one of the buddies in the pair is free, or
@@ -187,4 +310,9 @@ private:
     unsigned char *debug;
 #endif
   } orders[MAX_ORDER + 1];
+
+  block_list &free_list(std::size_t order, migratetype type)
+  {
+    return orders[order].blocks[order >= PAGEBLOCK_ORDER ? 0 : type];
+  }
 };
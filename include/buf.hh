@@ -64,10 +64,29 @@ private:
   bufdata data_;
 
   buf(u32 dev, u64 block)
-    : dev_(dev), block_(block), dirty_(false) {}
+    : dev_(dev), block_(block), dirty_(false), cached_(false) {}
   void onzero() override;
   NEW_DELETE_OPS(buf);
 
+  // The cache holds a reference to a buf, so it stays around after
+  // its last user is done with it, until memory gets low.
+  std::atomic<bool> cached_;
+  friend class bufcache_shrinker;
+
+  bool pin() {
+    if (!cmpxch(&cached_, false, true))
+      return false;
+    inc();
+    return true;
+  }
+
+  bool unpin() {
+    if (!cmpxch(&cached_, true, false))
+      return false;
+    dec();
+    return true;
+  }
+
   void mark_dirty() {
     if (cmpxch(&dirty_, false, true))
       inc();
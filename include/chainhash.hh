@@ -9,6 +9,7 @@
 #include "lockwrap.hh"
 #include "hash.hh"
 #include "ilist.hh"
+#include "kmemcache.hh"
 
 template<class K, class V>
 class chainhash {
@@ -18,7 +19,7 @@ private:
       : rcu_freed("chainhash::item", this, sizeof(*this)),
         key(k), val(v) {}
     void do_gc() override { delete this; }
-    NEW_DELETE_OPS(item);
+    NEW_DELETE_OPS_CACHE(item, "chainhash::item");
 
     islink<item> link;
     seqcount<u32> seq;
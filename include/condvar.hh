@@ -7,6 +7,7 @@
 struct condvar {
   struct spinlock lock;
   ilist<proc,&proc::cv_waiters> waiters;
+  blockstat stat;
 
   // Construct an uninitialized condvar.  This should be move-assigned
   // from an initialized condvar before being used.  This is
@@ -15,8 +16,11 @@ struct condvar {
   condvar()
     : lock() { }
 
-  condvar(const char *name)
-    : lock(name, LOCKSTAT_CONDVAR) { }
+  // Construct a condvar.  If lockstat is true, sleeps are reported
+  // to lockstat under name.
+  condvar(const char *name, bool lockstat = LOCKSTAT_CONDVAR)
+    : lock(name, LOCKSTAT_CONDVAR),
+      stat(name, LOCKSTAT_KIND_CONDVAR, lockstat) { }
 
   // Condvars cannot be copied.
   condvar(const condvar &o) = delete;
@@ -28,7 +32,12 @@ struct condvar {
 
   NEW_DELETE_OPS(condvar);
 
-  void sleep(struct spinlock *, struct spinlock * = nullptr);
+  // This is inline so sleep_to's return address identifies the
+  // caller for lockstat.
+  void sleep(struct spinlock *lk, struct spinlock *lk2 = nullptr)
+  {
+    sleep_to(lk, 0, lk2);
+  }
   void sleep_to(struct spinlock*, u64, struct spinlock * = nullptr);
   void wake_all(int yield=false, proc *callerproc=nullptr);
   void wake_one(proc *p);
@@ -12,6 +12,7 @@
 #include "mfs.hh"
 #include "sleeplock.hh"
 #include <uk/unistd.h>
+#include <uk/uio.h>
 
 class dirns;
 
@@ -32,6 +33,15 @@ struct file {
   virtual ssize_t pread(char *addr, size_t n, off_t offset) { return -1; }
   virtual ssize_t pwrite(const char *addr, size_t n, off_t offset) { return -1; }
 
+  // Vectored I/O.  iov is a kernel copy of the caller's iovec array,
+  // but the buffers it describes are in user space.  The defaults
+  // transfer at most one page with a single read, write, pread, or
+  // pwrite, so they keep the atomicity of those operations.
+  virtual ssize_t readv(const struct iovec *iov, int iovcnt);
+  virtual ssize_t writev(const struct iovec *iov, int iovcnt);
+  virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset);
+  virtual ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset);
+
   // Socket operations
   virtual int bind(const struct sockaddr *addr, size_t addrlen) { return -1; }
   virtual int listen(int backlog) { return -1; }
@@ -66,7 +76,8 @@ protected:
 struct file_inode : public refcache::referenced, public file {
 public:
   file_inode(sref<mnode> i, bool r, bool w, bool a)
-    : ip(i), readable(r), writable(w), append(a), off(0) {}
+    : ip(i), readable(r), writable(w), append(a), off(0),
+      off_lock("file_inode::off_lock") {}
   NEW_DELETE_OPS(file_inode);
 
   void inc() override { refcache::referenced::inc(); }
@@ -76,7 +87,10 @@ public:
   const bool readable;
   const bool writable;
   const bool append;
-  u32 off;
+  // The file offset.  For regular files, this is updated atomically
+  // without off_lock (see file_inode::read).
+  std::atomic<u64> off;
+  // Serializes offset updates for devices.
   sleeplock off_lock;
 
   int stat(struct stat*, enum stat_flags) override;
@@ -84,6 +98,10 @@ public:
   ssize_t write(const char *addr, size_t n) override;
   ssize_t pread(char* addr, size_t n, off_t off) override;
   ssize_t pwrite(const char *addr, size_t n, off_t offset) override;
+  ssize_t readv(const struct iovec *iov, int iovcnt) override;
+  ssize_t writev(const struct iovec *iov, int iovcnt) override;
+  ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+  ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override;
   void onzero() override
   {
     delete this;
@@ -208,6 +226,45 @@ private:
   struct pipe* const pipe;
 };
 
+// Exit notifications for the reading process's children.  Each read
+// returns the pid of a child that has exited, as an int, without
+// reaping it, so an event loop can call waitpid knowing it won't
+// block.  A read returns 0 if the process has no children, and
+// blocks until one exits unless the file is non-blocking.
+struct file_exitfd : public referenced, public file {
+public:
+  file_exitfd(bool nonblock) : nonblock(nonblock) {}
+  NEW_DELETE_OPS(file_exitfd);
+
+  void inc() override { referenced::inc(); }
+  void dec() override { referenced::dec(); }
+
+  ssize_t read(char *addr, size_t n) override;
+
+private:
+  const bool nonblock;
+};
+
+// A file that reads signals sent to the reading thread.  The thread
+// should block the signals in mask so they stay pending rather than
+// running handlers.  A read takes pending signals in mask and returns
+// their numbers as ints.  It blocks until one is pending unless the
+// file is non-blocking.
+struct file_signalfd : public referenced, public file {
+public:
+  file_signalfd(u64 mask, bool nonblock) : mask(mask), nonblock(nonblock) {}
+  NEW_DELETE_OPS(file_signalfd);
+
+  void inc() override { referenced::inc(); }
+  void dec() override { referenced::dec(); }
+
+  ssize_t read(char *addr, size_t n) override;
+
+private:
+  const u64 mask;
+  const bool nonblock;
+};
+
 // in-core file system types
 struct inode : public referenced, public rcu_freed
 {
@@ -45,6 +45,11 @@ class scoped_gc_epoch {
 
  public:
   scoped_gc_epoch() { valid = true; gc_begin_epoch(); }
+  // Begin an epoch only if begin is true.
+  explicit scoped_gc_epoch(bool begin) : valid(begin) {
+    if (valid)
+      gc_begin_epoch();
+  }
   ~scoped_gc_epoch() { if (valid) gc_end_epoch(); }
 
   scoped_gc_epoch(const scoped_gc_epoch&) = delete;
@@ -57,3 +62,30 @@ class scoped_gc_epoch {
 void            initgc(void);
 void            gc_delayed(rcu_freed *);
 void            gc_wakeup(void);
+
+// Holds an object that doesn't have an rcu_freed of its own until
+// it can be deleted.  See gc_delayed_delete.
+template<class T>
+class gc_deleter : public rcu_freed
+{
+  T *p_;
+
+public:
+  gc_deleter(T *p) : rcu_freed("gc_deleter", this, sizeof(*this)), p_(p) { }
+
+  void do_gc() override
+  {
+    delete p_;
+    delete this;
+  }
+
+  NEW_DELETE_OPS(gc_deleter);
+};
+
+// Delete p once every epoch that might still see it has ended.
+template<class T>
+void
+gc_delayed_delete(T *p)
+{
+  gc_delayed(new gc_deleter<T>(p));
+}
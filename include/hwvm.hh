@@ -38,6 +38,14 @@ public:
 
   void set_cache_tracker(cache_tracker* t) {}
 
+  bool empty() const { return !need_shootdown; }
+
+  // Add the shootdowns gathered by o to this shootdown.
+  void merge(const batched_shootdown &o)
+  {
+    need_shootdown |= o.need_shootdown;
+  }
+
   // Fully flush all cores' TLBs.
   void perform() const;
 
@@ -76,6 +84,15 @@ public:
       end_ = end;
   }
 
+  bool empty() const { return !t_ || start_ >= end_; }
+
+  void merge(const core_tracking_shootdown &o) {
+    if (o.t_) {
+      set_cache_tracker(o.t_);
+      add_range(o.start_, o.end_);
+    }
+  }
+
   void perform() const;
 
   static void on_ipi() { panic("core_tracking_shootdown::on_ipi\n"); }
@@ -147,6 +164,12 @@ namespace mmu_shared_page_table {
       __invalidate(start, len, sd);
     }
 
+    // Unmap all of user space at the top level of the page table,
+    // keeping the lower levels so each page can fault back in
+    // cheaply.  Fork uses this so the pages it shares become
+    // copy-on-write without touching their PTEs.
+    void hide_user();
+
     // Switch to this page_map_cache on this CPU.
     void switch_to() const;
 
@@ -166,6 +189,11 @@ namespace mmu_shared_page_table {
 // by the invalidating core.  Another consequence of this is that we
 // can always use targeted invlpg operations rather than full TLB
 // flushes.
+//
+// A core only needs an IPI if it is currently running the
+// page_map_cache.  Cores that merely have stale entries in their page
+// table record the invalidated range instead and clear it, along with
+// their TLB, the next time they switch to the page_map_cache.
 namespace mmu_per_core_page_table {
   // XXX(Austin) This could get really big for large core counts.  We
   // could assume that a machine that large has enough memory to deal
@@ -194,6 +222,23 @@ namespace mmu_per_core_page_table {
 
     void perform() const;
 
+    bool empty() const { return targets.none(); }
+
+    // Add the shootdowns gathered by o, which must be for the same
+    // page_map_cache, to this shootdown.
+    void merge(const shootdown &o)
+    {
+      if (o.targets.none())
+        return;
+      assert(!cache || cache == o.cache);
+      cache = o.cache;
+      targets |= o.targets;
+      if (o.start < start)
+        start = o.start;
+      if (end < o.end)
+        end = o.end;
+    }
+
     static void on_ipi()
     {
       // XXX(Austin) This shootdown uses IPI calls instead of
@@ -205,18 +250,52 @@ namespace mmu_per_core_page_table {
 
   class page_map_cache
   {
-    percpu<pgmap_pair> pml4s;
+    struct core_state
+    {
+      pgmap_pair pml4s;
+      // Region of this core's page table that must be cleared before
+      // the core next switches to this page_map_cache.  Remote cores
+      // extend the region and then set lazy_pending.
+      std::atomic<uintptr_t> lazy_start, lazy_end;
+      std::atomic<bool> lazy_pending;
+      // Set by hide_user for this core to apply to its tables.
+      std::atomic<bool> hide_pending;
+    };
+
+    percpu<core_state> cores;
+    // Cores currently running this page_map_cache.
+    mutable bitset<NCPU> active_cores;
     friend class shootdown;
 
     // Clear and TLB flush a region of this core's page table.
-    void clear(uintptr_t start, uintptr_t end);
+    void clear(uintptr_t start, uintptr_t end) const;
+
+    // Record that core must clear [start, end) before using this
+    // page_map_cache again.
+    void clear_lazy(cpuid_t core, uintptr_t start, uintptr_t end);
+
+    // Perform any clear recorded by clear_lazy and any pending
+    // hide_user for this core.  Returns true if this core's TLB must
+    // be flushed.
+    bool finish_lazy() const;
+
+    // Hide user space in this core's tables.
+    void hide_local() const;
+
+    // Perform a pending hide_user for this core if it is running this
+    // page_map_cache, and flush its TLB.
+    void finish_hide() const;
 
   public:
     page_map_cache()
     {
       for (size_t i = 0; i < NCPU; ++i) {
-        pml4s[i].user = nullptr;
-        pml4s[i].kernel = nullptr;
+        cores[i].pml4s.user = nullptr;
+        cores[i].pml4s.kernel = nullptr;
+        cores[i].lazy_start.store(~(uintptr_t)0, std::memory_order_relaxed);
+        cores[i].lazy_end.store(0, std::memory_order_relaxed);
+        cores[i].lazy_pending.store(false, std::memory_order_relaxed);
+        cores[i].hide_pending.store(false, std::memory_order_relaxed);
       }
     }
     page_map_cache(const page_map_cache&) = delete;
@@ -227,6 +306,10 @@ namespace mmu_per_core_page_table {
 
     void insert(uintptr_t va, page_tracker *t, pme_t pte);
 
+    // Unmap all of user space at the top level of the page table.
+    // See mmu_shared_page_table.
+    void hide_user();
+
     template<class ForwardIterator>
     void invalidate(uintptr_t start, uintptr_t len,
                     ForwardIterator tracker_it, shootdown *sd)
@@ -266,7 +349,7 @@ namespace mmu_per_core_page_table {
     }
 
     void switch_to(bool kernel, proc* p) const;
-    void switch_from() const {}
+    void switch_from() const;
 
     u64 internal_pages() const;
   };
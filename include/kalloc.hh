@@ -101,6 +101,14 @@ public:
   T*
   allocate(std::size_t n, const void *hint = 0)
   {
+    // Objects smaller than a page (such as a radix_array's sharing
+    // records) come from kmalloc.
+    if (n * sizeof(T) < PGSIZE) {
+      T *p = (T*)kmalloc(n * sizeof(T), typeid(T).name());
+      if (!p)
+        throw_bad_alloc();
+      return p;
+    }
     if (n * sizeof(T) != PGSIZE)
       panic("%s cannot allocate %zu bytes", __PRETTY_FUNCTION__, n * sizeof(T));
     return (T*)kalloc(typeid(T).name());
@@ -109,6 +117,10 @@ public:
   void
   deallocate(T* p, std::size_t n)
   {
+    if (n * sizeof(T) < PGSIZE) {
+      kmfree(p, n * sizeof(T));
+      return;
+    }
     if (n * sizeof(T) != PGSIZE)
       panic("%s cannot deallocate %zu bytes", __PRETTY_FUNCTION__,
             n * sizeof(T));
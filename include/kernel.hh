@@ -137,8 +137,27 @@ struct proc *   idleproc(void);
 void            idlezombie(struct proc*);
 
 // kalloc.c
-char*           kalloc(const char *name, size_t size = PGSIZE);
+// What a page allocation is for.  kalloc keeps each type in separate
+// pageblocks so that unmovable memory doesn't fragment the memory
+// compaction can move.
+enum kalloc_type
+{
+  // Kernel memory
+  KALLOC_KERNEL,
+  // Page table pages
+  KALLOC_PGTABLE,
+  // Private anonymous user pages, which compaction can migrate
+  KALLOC_MOVABLE,
+  KALLOC_NTYPES,
+};
+
+char*           kalloc(const char *name, size_t size = PGSIZE,
+                       kalloc_type type = KALLOC_KERNEL);
 void            kfree(void*, size_t size = PGSIZE);
+size_t          kalloc_batch(const char *name, kalloc_type type, void **pages,
+                             size_t n);
+void            kfree_batch(void **pages, size_t n);
+kalloc_type     kalloc_type_of(void *p);
 void*           ksalloc(int slabtype);
 void            ksfree(int slabtype, void*);
 void*           early_kalloc(size_t size, size_t align);
@@ -149,6 +168,9 @@ void            kmalignfree(void *, int align, u64 size);
 void            verifyfree(char *ptr, u64 nbytes);
 void            kminit(void);
 void            kmemprint(print_stream *s);
+size_t          kalloc_node_free(int node);
+size_t          kalloc_node_total(int node);
+size_t          kalloc_compact(void);
 
 // kbd.c
 void            kbdintr(void);
@@ -179,6 +201,10 @@ int             pipewrite(struct pipe*, const char*, int);
 struct pipe*    pipesockalloc();
 void            pipesockclose(struct pipe *);
 
+// proccache.cc
+void            proccache_get(struct proc*);
+void            proccache_put(struct proc*);
+
 // proc.c
 enum clone_flags
 {
@@ -188,6 +214,12 @@ enum clone_flags
   CLONE_NO_VMAP = 1<<2,
   CLONE_NO_FTABLE = 1<<3,
   CLONE_NO_RUN = 1<<4,
+  // The new process is not a child of the caller: nobody waits for
+  // it and it is reaped as soon as it exits.
+  CLONE_NO_PARENT = 1<<5,
+  // Lend the new process our address space and suspend the caller
+  // until the new process calls exec or exits.
+  CLONE_VFORK = 1<<6,
 };
 ENUM_BITSET_OPS(clone_flags);
 void            finishproc(struct proc*, bool removepid = true);
@@ -199,6 +231,7 @@ void            procdumpall(void);
 void            scheduler(void) __noret__;
 void            userinit(void);
 void            yield(void);
+void            preempt(void);
 struct proc*    threadalloc(void (*fn)(void*), void *arg);
 struct proc*    threadpin(void (*fn)(void*), void *arg, const char *name, int cpu);
 
@@ -215,6 +248,8 @@ void            sched(void);
 void            post_swtch(void);
 void            scheddump(void);
 int             steal(void);
+int             pickcpu(bool self);
+void            sched_resched_ipi(void);
 void            addrun(struct proc*);
 int             dwork_push(struct dwork*, int);
 
@@ -228,7 +263,11 @@ u64             syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
 // sysfile.cc
 #include "userptr.hh"
 #include "ref.hh"
-int             wait(int, userptr<int>);
+int             wait(int, userptr<int>, int options = 0,
+                     struct rusage *ru = nullptr);
+int             getrusage(int who, struct rusage *ru);
+int             wait_ready(bool nonblock);
+u64             signal_wait(u64 mask, bool nonblock);
 int             doexec(userptr_str upath,
                        userptr<userptr_str> uargv);
 int             fdalloc(sref<file>&& f, int omode);
@@ -263,7 +302,7 @@ size_t          safe_read_hw(void *dst, uintptr_t src, size_t n);
 size_t          safe_read_vm(void *dst, uintptr_t src, size_t n);
 
 // zalloc.cc
-char*           zalloc(const char* name);
+char*           zalloc(const char* name, kalloc_type type = KALLOC_KERNEL);
 void            zfree(void* p);
 
 // other exported/imported functions
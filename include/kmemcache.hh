@@ -0,0 +1,173 @@
+#pragma once
+
+// Typed object caches.
+//
+// A kmem_cache allocates objects of one exact size.  Each CPU keeps a
+// magazine of free objects, so most allocations and frees touch only
+// CPU-local state.  Small objects are carved out of single-page slabs
+// that belong to the CPU that allocated the slab.  When a magazine
+// overflows, objects from other CPUs' slabs are returned to their
+// owners in batches through a per-CPU remote-free queue, and slabs
+// that become completely free go back to the page allocator.
+//
+// Objects too large to fit several to a page are allocated with
+// kmalloc and only cached in the magazines.
+//
+// Under memory pressure, a shrinker empties the magazines and
+// releases the empty slabs CPUs keep around.
+
+#include "cpputil.hh"
+#include "percpu.hh"
+#include "ilist.hh"
+
+#include <atomic>
+
+class print_stream;
+
+class kmem_cache
+{
+public:
+  enum {
+    // Objects per per-CPU magazine
+    MAG_SIZE = 32,
+    // Completely free slabs each CPU keeps before releasing them
+    KEEP_EMPTY = 1,
+  };
+
+  struct stats
+  {
+    u64 allocs, frees;
+    // Objects returned to another CPU's slab through its remote-free
+    // queue
+    u64 remote_frees;
+    // Magazine refills and flushes
+    u64 refills, flushes;
+    // Slab pages (or large objects) allocated from and released to
+    // kalloc
+    u64 slab_allocs, slab_frees;
+
+    stats &operator+=(const stats &o);
+  };
+
+  // Return the cache for objects of the given name, size and
+  // alignment, creating it if necessary.  Caches with the same name
+  // and size are shared, so different instantiations of a template
+  // with same-sized objects use one cache.
+  static kmem_cache *get(const char *name, size_t size, size_t align);
+
+  // Allocate an object, or return nullptr if out of memory.
+  void *alloc();
+  void free(void *p);
+
+  const char *name() const { return name_; }
+  size_t size() const { return size_; }
+  stats get_stats() const;
+
+  // Print statistics for all caches.
+  static void print_all(print_stream *s);
+
+  // Return roughly how many pages CPU cpu holds in free objects and
+  // empty slabs across all caches.
+  static size_t reclaimable(int cpu);
+
+  // Release everything this CPU holds in free objects and empty slabs
+  // across all caches.  Interrupts must be disabled.  Returns the
+  // number of pages released.
+  static size_t shrink_local();
+
+  NEW_DELETE_OPS(kmem_cache);
+
+private:
+  struct free_obj { free_obj *next; };
+
+  // Header at the beginning of each slab page
+  struct slab
+  {
+    int cpu;                    // Owning CPU
+    u32 inuse;                  // Allocated objects, including in magazines
+    free_obj *free;
+    ilink<slab> link;           // On the owner's partial list
+    bool listed;
+  };
+
+  struct cpu_state
+  {
+    // Free objects ready to allocate
+    void *mag[MAG_SIZE];
+    int nmag;
+    // Objects freed by other CPUs to slabs owned by this CPU
+    std::atomic<free_obj*> remote;
+    // Slabs owned by this CPU that have free objects
+    ilist<slab, &slab::link> partial;
+    int nempty;
+    stats st;
+  };
+
+  kmem_cache(const char *name, size_t size, size_t align);
+
+  bool large() const { return per_slab_ == 0; }
+  slab *slab_of(void *p) const;
+  slab *new_slab(cpu_state *c, int cpu);
+  void put_local(cpu_state *c, slab *s, free_obj *o);
+  void drain_remote(cpu_state *c);
+  bool refill(cpu_state *c, int cpu);
+  void flush(cpu_state *c, int cpu, int n);
+  size_t shrink(cpu_state *c, int cpu);
+
+  char name_[32];
+  size_t size_;
+  size_t offset_;               // Offset of the first object in a slab
+  size_t per_slab_;             // Objects per slab, or 0 for large objects
+  kmem_cache *next_;            // All caches
+  percpu<cpu_state, NO_INT> cpu_;
+};
+
+// Like NEW_DELETE_OPS, but allocate objects from a kmem_cache named
+// cachename.
+#define NEW_DELETE_OPS_CACHE(classname, cachename)                  \
+  static kmem_cache* kmem_cache_of() {                              \
+    static kmem_cache *cache =                                      \
+      kmem_cache::get(cachename, sizeof(classname),                 \
+                      alignof(classname));                          \
+    return cache;                                                   \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes,                   \
+                            const std::nothrow_t&) noexcept {       \
+    assert(nbytes == sizeof(classname));                            \
+    return kmem_cache_of()->alloc();                                \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes,                   \
+                            std::align_val_t al,                    \
+                            const std::nothrow_t&) noexcept {       \
+    assert(nbytes == sizeof(classname));                            \
+    return classname::operator new(nbytes, std::nothrow);           \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes) {                 \
+    void *p = classname::operator new(nbytes, std::nothrow);        \
+    if (p == nullptr)                                               \
+      throw_bad_alloc();                                            \
+    return p;                                                       \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes,                   \
+                            std::align_val_t al) noexcept {         \
+    assert((size_t)al == alignof(classname));                       \
+    return classname::operator new(nbytes);                         \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes, classname *buf) { \
+    assert(nbytes == sizeof(classname));                            \
+    return buf;                                                     \
+  }                                                                 \
+                                                                    \
+  static void operator delete(void *p,                              \
+                              const std::nothrow_t&) noexcept {     \
+    kmem_cache_of()->free(p);                                       \
+  }                                                                 \
+                                                                    \
+  static void operator delete(void *p) {                            \
+    classname::operator delete(p, std::nothrow);                    \
+  }
@@ -24,6 +24,14 @@
   X(uint64_t, tlb_shootdown_targets)                                   \
   /* Total number of cycles spent in TLB shootdown operations. */      \
   X(uint64_t, tlb_shootdown_cycles)                                    \
+  /* Shootdown targets that weren't running the address space and     \
+   * were left to clear their TLB lazily on their next switch to it.   \
+   * Each of these is an IPI saved. */                                 \
+  X(uint64_t, tlb_shootdown_lazy)                                      \
+  /* # of unmaps whose shootdown was deferred and batched, and # of    \
+   * batches.  The difference is the number of IPI rounds saved. */    \
+  X(uint64_t, tlb_shootdown_deferred)                                  \
+  X(uint64_t, tlb_shootdown_batches)                                   \
 
 #define KSTATS_VM(X)                            \
   X(uint64_t, page_fault_count)                 \
@@ -38,6 +46,20 @@
                                                 \
   X(uint64_t, munmap_count)                     \
   X(uint64_t, munmap_cycles)                    \
+                                                \
+  /* Pages the same-page merging scanner hashed, and the cycles it \
+   * spent doing so */                          \
+  X(uint64_t, ksm_scanned)                      \
+  X(uint64_t, ksm_cycles)                       \
+  /* Pages it made into shared copy-on-write copies, and mappings  \
+   * it pointed at those instead of their own page.  The latter is \
+   * the number of pages saved, less any later COW breaks. */     \
+  X(uint64_t, ksm_shared)                       \
+  X(uint64_t, ksm_merged)                       \
+                                                \
+  /* Pages allocated ahead of faults by MADV_WILLNEED and         \
+   * MAP_POPULATE */                            \
+  X(uint64_t, prefault_pages)                   \
 
 #define KSTATS_KALLOC(X)                        \
   X(uint64_t, kalloc_page_alloc_count)          \
@@ -46,6 +68,18 @@
   X(uint64_t, kalloc_hot_list_flush_count)      \
   X(uint64_t, kalloc_hot_list_steal_count)      \
   X(uint64_t, kalloc_hot_list_remote_free_count)        \
+  /* Background reclaim runs and the pages they released */    \
+  X(uint64_t, reclaim_wakeup_count)             \
+  X(uint64_t, reclaim_pages)                    \
+  /* Direct reclaims from failed allocations and the pages they \
+   * released */                                \
+  X(uint64_t, reclaim_direct_count)             \
+  X(uint64_t, reclaim_direct_pages)             \
+  /* Compaction passes, the pageblocks they isolated, and the     \
+   * pages they migrated */                     \
+  X(uint64_t, compact_count)                    \
+  X(uint64_t, compact_pageblocks)               \
+  X(uint64_t, compact_migrated)                 \
 
 #define KSTATS_REFCACHE(X)                      \
   X(uint64_t, refcache_review_count)            \
@@ -156,6 +190,112 @@ struct kstats
   }
 };
 
+// Per-system call statistics.  The kernel keeps one of these per CPU
+// for each system call number (the table is generated by
+// tools/syscalls.py) and records every call in the dispatch path.
+// /dev/syscallstat returns a syscall_kstats_rec for each system call,
+// summed over all CPUs.
+struct syscall_kstats
+{
+  // Bucket i counts calls that took [2^i, 2^(i+1)) cycles.  The last
+  // bucket also counts anything longer.
+  enum { NBUCKETS = 36 };
+
+  uint64_t count;
+  // Number of calls that returned a negative value.
+  uint64_t errors;
+  uint64_t cycles;
+  uint64_t max_cycles;
+  uint64_t hist[NBUCKETS];
+
+#ifdef XV6_KERNEL
+  void record(uint64_t delta, bool error)
+  {
+    ++count;
+    errors += error;
+    cycles += delta;
+    if (delta > max_cycles)
+      max_cycles = delta;
+    unsigned b = delta ? 63 - __builtin_clzll(delta) : 0;
+    if (b >= NBUCKETS)
+      b = NBUCKETS - 1;
+    ++hist[b];
+  }
+#endif
+
+  syscall_kstats &operator+=(const syscall_kstats &o)
+  {
+    count += o.count;
+    errors += o.errors;
+    cycles += o.cycles;
+    if (o.max_cycles > max_cycles)
+      max_cycles = o.max_cycles;
+    for (int i = 0; i < NBUCKETS; ++i)
+      hist[i] += o.hist[i];
+    return *this;
+  }
+
+  // max_cycles is not a counter, so the difference keeps this
+  // object's maximum.
+  syscall_kstats operator-(const syscall_kstats &b) const
+  {
+    syscall_kstats res(*this);
+    res.count -= b.count;
+    res.errors -= b.errors;
+    res.cycles -= b.cycles;
+    for (int i = 0; i < NBUCKETS; ++i)
+      res.hist[i] -= b.hist[i];
+    return res;
+  }
+};
+
+struct syscall_kstats_rec
+{
+  uint32_t num;
+  char name[28];
+  struct syscall_kstats stats;
+};
+
+// /dev/procmem returns one of these for each address space.
+struct procmem_rec
+{
+  // The process that created the address space
+  int32_t pid;
+  char name[16];
+  // Resident pages.  Pages shared with other address spaces count in
+  // each of them.
+  uint64_t anon_pages;
+  uint64_t file_pages;
+  // Page table pages
+  uint64_t pt_pages;
+};
+
+// /dev/procacct returns one of these for each thread.
+struct procacct_rec
+{
+  int32_t pid;
+  char name[16];
+  // The CPU it last ran on, or -1
+  int32_t cpu;
+  // Nanoseconds running in user space, running in the kernel, and
+  // runnable but waiting for a CPU
+  uint64_t utime;
+  uint64_t stime;
+  uint64_t wtime;
+  // Context switches because it blocked, and while still runnable
+  uint64_t nvcsw;
+  uint64_t nivcsw;
+  // Times it ran on a different CPU than the last time
+  uint64_t nmigrate;
+};
+
+#ifdef XV6_KERNEL
+// Return this CPU's or CPU cpu's syscall_kstats table, indexed by
+// system call number.  Defined in the generated sysvectors.cc.
+struct syscall_kstats *mysyscall_kstats(void);
+struct syscall_kstats *syscall_kstats_on(int cpu);
+#endif
+
 __attribute__((unused))
 static void
 to_stream(print_stream *s, const kstats &o)
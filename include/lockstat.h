@@ -1,3 +1,5 @@
+#pragma once
+
 #include "ilist.hh"
 
 #define LOCKSTAT_MAGIC 0xb4cd79c1b2e46f40ull
@@ -7,19 +9,130 @@
 #include "gc.hh"
 #include "uk/lockstat.h"
 
+#include <atomic>
+
 struct klockstat : public rcu_freed {
   u64 magic;
   
   // LIST_ENTRY(klockstat) link;
   ilink<klockstat> link;
   struct lockstat s;
+  // For blocking primitives, the full name shared by every instance
+  // that uses this klockstat.
+  const char *key;
 
-  klockstat(const char *name);
+  klockstat(const char *name, u32 kind = LOCKSTAT_KIND_SPIN);
   void do_gc() override { delete this; }
 
   static void* operator new(unsigned long nbytes);
   static void operator delete(void *p);
 };
+
+#if LOCKSTAT
+extern int lockstat_enable;
+extern struct klockstat klockstat_lazy;
+#endif
+
+// Lock statistics for a blocking primitive (sleeplock, condvar, or
+// semaphore).  Unlike spinlocks, all blocking primitives with the
+// same name and kind share statistics, since they are usually
+// embedded in per-object structures (e.g., file_inode::off_lock).
+// Unless noted, the owner calls these methods with its internal
+// spinlock held.
+class blockstat
+{
+#if LOCKSTAT
+  struct klockstat *stat_;
+  const char *name_;
+  u32 kind_;
+  std::atomic<u32> nwaiters_;
+  u64 locked_ts_;
+
+  u64 block_slow(void *pc, int *caller);
+  void unblock_slow(u64 ts, int caller);
+  void acquired_slow();
+  void releasing_slow();
+#endif
+
+public:
+  constexpr blockstat()
+#if LOCKSTAT
+    : stat_(nullptr), name_(nullptr), kind_(0), nwaiters_(0), locked_ts_(0)
+#endif
+  { }
+
+  constexpr blockstat(const char *name, u32 kind, bool lockstat)
+#if LOCKSTAT
+    : stat_(lockstat ? &klockstat_lazy : nullptr), name_(name), kind_(kind),
+      nwaiters_(0), locked_ts_(0)
+#endif
+  { }
+
+  blockstat(const blockstat &o) = delete;
+  blockstat &operator=(const blockstat &o) = delete;
+
+  // Moving transfers the statistics.  The owner must not be in use.
+  blockstat(blockstat &&o)
+#if LOCKSTAT
+    : stat_(o.stat_), name_(o.name_), kind_(o.kind_), nwaiters_(0),
+      locked_ts_(0)
+#endif
+  {
+#if LOCKSTAT
+    o.stat_ = nullptr;
+#endif
+  }
+
+  blockstat &operator=(blockstat &&o)
+  {
+#if LOCKSTAT
+    stat_ = o.stat_;
+    name_ = o.name_;
+    kind_ = o.kind_;
+    o.stat_ = nullptr;
+#endif
+    return *this;
+  }
+
+  // The caller at pc is about to block.  Returns a timestamp to pass
+  // to unblock and sets *caller.
+  u64 block(void *pc, int *caller)
+  {
+#if LOCKSTAT
+    if (stat_ && lockstat_enable)
+      return block_slow(pc, caller);
+#endif
+    return 0;
+  }
+
+  // The caller has woken up from a block that returned ts.
+  void unblock(u64 ts, int caller)
+  {
+#if LOCKSTAT
+    if (ts)
+      unblock_slow(ts, caller);
+#endif
+  }
+
+  // The primitive was acquired (with or without blocking).
+  void acquired()
+  {
+#if LOCKSTAT
+    if (stat_ && lockstat_enable)
+      acquired_slow();
+#endif
+  }
+
+  // The primitive is about to be released.  Only for primitives with
+  // an owner.
+  void releasing()
+  {
+#if LOCKSTAT
+    if (locked_ts_)
+      releasing_slow();
+#endif
+  }
+};
 #else
 struct klockstat;
 #endif
@@ -10,3 +10,6 @@
 #define MAJ_KMEMSTATS 10
 #define MAJ_MFSSTATS 11
 #define MAJ_QSTATS 12
+#define MAJ_SYSCALLSTAT 13
+#define MAJ_PROCMEM 14
+#define MAJ_PROCACCT 15
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "mnode.hh"
+#include <uk/uio.h>
 
 extern u64 root_inum;
 extern mfs* root_fs;
@@ -8,6 +9,10 @@ extern mfs* anon_fs;
 sref<mnode> namei(sref<mnode> cwd, const char* path);
 sref<mnode> nameiparent(sref<mnode> cwd, const char* path, strbuf<DIRSIZ>* buf);
 s64 readi(sref<mnode> m, char* buf, u64 start, u64 nbytes);
+// Like readi, but copy to the user buffers in iov.  The total length
+// of iov must be at least nbytes.
+s64 readiv(sref<mnode> m, const struct iovec *iov, int iovcnt,
+           u64 start, u64 nbytes);
 s64 writei(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
            mfile::resizer* resize = nullptr);
 
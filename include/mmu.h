@@ -22,7 +22,7 @@
 #define PTE_G           0x100   // Global
 #define PTE_MBZ		0x180	// Bits must be zero
 #define PTE_LOCK        0x200   // xv6: lock
-#define PTE_UNUSED      0x400   // xv6: unused
+#define PTE_HIDDEN      0x400   // Not present, but table kept (pgmap::hide_user)
 #define PTE_COW         0x800   // xv6: copy-on-write
 #define PTE_NX		0x8000000000000000ull // No-execute enable
 
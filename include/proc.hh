@@ -10,6 +10,8 @@
 #include <stdexcept>
 #include "vmalloc.hh"
 #include "bitset.hh"
+#include "kmemcache.hh"
+#include "gc.hh"
 
 struct pgmap;
 struct gc_handle;
@@ -84,16 +86,27 @@ struct proc {
   char name[16];               // Process name (debugging)
   u64 tsc;
   u64 curcycles;
+  proc_acct acct;              // CPU accounting for this thread
+  proc_acct child_acct;        // Totals for reaped children
   unsigned cpuid;
   void *fpu_state;             // FXSAVE state, lazily allocated
   struct spinlock lock;
   ilink<proc> child_next;
-  ilist<proc,&proc::child_next> childq;
+  ilist<proc,&proc::child_next> childq;   // Running children
+  ilist<proc,&proc::child_next> zombieq;  // Exited children to reap
   ilink<proc> sched_link;
   struct condvar *cv;          // for waiting till children exit
   struct gc_handle *gc;
   char lockname[16];
   int cpu_pin;
+  u8 sched_policy;             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+  s8 sched_prio;               // Real-time priority, or nice value
+  u32 sched_weight;            // CPU share if SCHED_OTHER (nice 0 is 1024)
+  u64 vruntime;                // CPU time scaled by sched_weight
+  int vruntime_cpu;            // Run queue vruntime is relative to, or -1
+  int runq_level;              // Run queue level we're on, or -1
+  bool preempted_;             // Involuntary sched, so keep running if we can
+  bool reapable;               // On parent's zombieq (parent's lock)
 #if MTRACE
   struct mtrace_stacks mtrace_stacks;
 #endif
@@ -104,12 +117,15 @@ struct proc {
   struct spinlock futex_lock;
   u64 unmap_tlbreq_;
   int data_cpuid;              // Where vmap and kstack is likely to be cached
+  int kstack_home;             // proccache that kstack came from
   int run_cpuid_;
   int in_exec_;
   bool yield_;                 // yield cpu up when returning to user space
 
   userptr_str upath;
   userptr<userptr_str> uargv;
+  userptr<u64> tid_word;       // Zeroed and futex-woken on exit
+  proc *vfork_parent;          // Suspended until we exec or exit
 
   u8 __cxa_eh_global[16];
 
@@ -118,14 +134,24 @@ struct proc {
   u64 magic;
   uptr unmapped_hint;
   sigaction sig[NSIG];
+  std::atomic<u64> sig_pending; // Signals sent to this thread
+  u64 sig_blocked;             // Signals this thread has blocked
+  int pgid;                    // Process group
 
   static proc* alloc();
   void         init_vmap();
   void         set_state(procstate_t s);
   procstate_t  get_state(void) const { return state_; }
   int          set_cpu_pin(int cpu);
-  static int   kill(int pid);
+  int          set_sched(int policy, int prio);
+  void         migrate(int cpu);
+  void         vfork_done();
+  static int   kill(int pid, int signo);
   int          kill();
+  int          signal(int signo);
+  int          take_signal();
+  // Read procacct_recs for all threads, for /dev/procacct.
+  static int   acct_read(char *dst, u32 off, u32 n);
   bool         cansteal(bool nonexec) {
     return (get_state() == RUNNABLE && !cpu_pin &&
           (in_exec_ || nonexec) &&
@@ -138,7 +164,16 @@ struct proc {
   bool deliver_signal(int signo);
 
   ~proc(void);
-  NEW_DELETE_OPS(proc);
+  NEW_DELETE_OPS_CACHE(proc, "proc");
+
+  // Frees the proc through gc, since group signals find procs in
+  // xnspid without locking them (see proc::kill).
+  struct freer : public rcu_freed
+  {
+    proc *p;
+    freer(proc *p) : rcu_freed("proc", p, sizeof(*p)), p(p) { }
+    void do_gc() override;
+  } freer_;
 
 private:
   proc(int npid);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cstddef>
@@ -166,6 +167,7 @@ private:
   struct node_ptr;
   struct upper_node;
   struct leaf_node;
+  struct share_rec;
 
   static constexpr std::size_t
   log2_exact(std::size_t x, std::size_t accum = 0)
@@ -247,7 +249,7 @@ public:
   /**
    * Construct an empty radix array in which all values are unset.
    */
-  constexpr radix_array() noexcept : root_(0) { }
+  constexpr radix_array() noexcept : root_(0), ever_shared_(false) { }
 
   /**
    * Destruct all set elements and free backing memory.
@@ -263,7 +265,7 @@ public:
 
   /** Move constructor. */
   radix_array(radix_array &&o) noexcept
-    : root_(o.root_)
+    : root_(o.root_), ever_shared_(o.ever_shared_.load())
   {
     o.root_ = 0;
   }
@@ -273,6 +275,7 @@ public:
   {
     node_ptr(root_).free(this);
     root_ = o.root_;
+    ever_shared_ = o.ever_shared_.load();
     o.root_ = 0;
   }
 
@@ -365,7 +368,7 @@ public:
         node_ptr next(unode->child[subkey(k_, node_level_)]);
         if (next.is_null() || next.is_external() || node_level_ == limit)
           return next;
-        node_ = next;
+        node_ = next.deref();
       }
       return node_ptr();
     }
@@ -427,8 +430,7 @@ public:
 
           // Free the old node if it was an external
           if (orig_child.is_external())
-            // XXX This isn't safe without RCU
-            delete orig_child.as_external();
+            retire_external(orig_child.as_external(), 0);
         } else {
           // CAS failed.  Free new node and try again.
           if (node_level_ > 1) {
@@ -501,12 +503,11 @@ public:
               *ext = *x;
             } else {
               upper->child[i] = node_ptr(nullptr, child.get_lock().is_locked());
-              // XXX This isn't safe without RCU
-              delete ext;
+              retire_external(ext, 0);
             }
           } else {
             // Recurse into the pointed-to node
-            set_recursive(child, level - 1, 0,
+            set_recursive(child.deref(), level - 1, 0,
                           level == 1 ? LEAF_FANOUT : UPPER_FANOUT, x, unset);
           }
         }
@@ -1034,6 +1035,11 @@ public:
    * folded (unlike #fill(), the will not expand compressed regions).
    * Callers should be prepared for this.
    *
+   * Any nodes covering this range that are shared with another array
+   * (see #share()) are first copied, so the locked range can be
+   * modified without affecting other arrays.  This may throw if that
+   * copy fails.
+   *
    * It is up to the caller to disable preemption until the lock is
    * released, if required by the environment.  All bit spinlocks are
    * acquired with cli_caller.
@@ -1045,6 +1051,16 @@ public:
     // former would expand the region to ensure tight locking, while
     // the latter would perform loose locking?
 
+    // Create the lock object first in case we're using a nontrivial
+    // ScopedCritical.  It covers nothing until we fill in its range.
+    lock l(this, low.k_, low.k_);
+
+    // Unsharing may replace nodes the iterators have cached.
+    if (unshare(low.k_, high.k_)) {
+      low.reset_node();
+      high.reset_node();
+    }
+
     // Round low down to key boundary
     key_type low_key = low.base();
     // Round high up to key boundary
@@ -1052,10 +1068,8 @@ public:
     if (high_key != high.index())
       // We have to lock the whole high slot
       high_key += high.base_span();
-
-    // Create the lock object first in case we're using a nontrivial
-    // ScopedCritical.
-    lock l(this, low_key, high_key);
+    l.low_ = low_key;
+    l.high_ = high_key;
 
     // We have to iterate from low_key to high_key, rather than just
     // from low to high, because the shape of the tree might change
@@ -1078,11 +1092,49 @@ public:
   lock
   acquire(const iterator &it)
   {
-    lock l(this, it.base(), it.base() + it.base_span());
+    lock l(this, it.k_, it.k_);
+    if (unshare(it.k_, it.k_ + 1))
+      it.reset_node();
+    l.low_ = it.base();
+    l.high_ = it.base() + it.base_span();
     it.lock();
     return l;
   }
 
+  /**
+   * Share the values in <tt>[low, high)</tt> with @c dst, which must
+   * be unset in this range, without copying them.  Nodes that lie
+   * entirely within the range become shared by both arrays through a
+   * reference-counted record, so this takes time proportional to the
+   * number of such top-most nodes, not to the number of values.  A
+   * shared node is copied lazily, one level at a time, when either
+   * array acquires a range that covers it (see #acquire()).
+   *
+   * Before a value is copied out of a shared node (or out of an
+   * external or a partially covered node, which this copies right
+   * away), its <code>void on_share()</code> method is called if
+   * value_type has one.  This lets values that refer to mutable
+   * state arrange to stop sharing it too, for example by marking it
+   * copy-on-write.
+   *
+   * The caller must ensure that neither array is modified or locked
+   * in this range while this runs.  Lock-free lookups are safe.  The
+   * nodes of this array on the paths to the range (those that cover
+   * it only in part) must not be shared.  Since a shared node is
+   * freed with the last array that refers to it, an array that has
+   * shared must not be destroyed until lock-free lookups in the other
+   * arrays that may have reached its nodes are done.
+   */
+  void
+  share(radix_array *dst, const iterator &low, const iterator &high)
+  {
+    ever_shared_.store(true, std::memory_order_relaxed);
+    dst->ever_shared_.store(true, std::memory_order_relaxed);
+    share_recursive(dst, get_root_ptr().as_upper_node(),
+                    dst->get_root_ptr().as_upper_node(), LEVELS, 0,
+                    low.k_, high.k_);
+  }
+
 private:
   typename ZAllocator::template rebind<upper_node>::other upper_node_alloc_;
   typename ZAllocator::template rebind<leaf_node>::other leaf_node_alloc_;
@@ -1090,7 +1142,9 @@ private:
   /**
    * A discriminated union of a null pointer, an upper node pointer, a
    * leaf node pointer, and an external pointer, plus a lock bit for
-   * all types.
+   * all types.  Upper and leaf node pointers may instead point to a
+   * #share_rec for a node that is shared with other arrays, which is
+   * indicated by the shared bit.
    */
   struct node_ptr
   {
@@ -1102,8 +1156,10 @@ private:
     };
 
     static constexpr int lock_bit = 2;
+    static constexpr int shared_bit = 3;
     static constexpr uintptr_t type_mask = 3 << 0;
     static constexpr uintptr_t lock_mask = 1 << lock_bit;
+    static constexpr uintptr_t shared_mask = 1 << shared_bit;
     static constexpr uintptr_t mask = type_mask | lock_mask;
 
     constexpr node_ptr() : v(0) { }
@@ -1117,7 +1173,7 @@ private:
     {
       if (RADIX_DEBUG) {
         assert(node);
-        assert(((uintptr_t)node & mask) == 0);
+        assert(((uintptr_t)node & (mask | shared_mask)) == 0);
       }
     }
 
@@ -1127,7 +1183,7 @@ private:
     {
       if (RADIX_DEBUG) {
         assert(node);
-        assert(((uintptr_t)node & mask) == 0);
+        assert(((uintptr_t)node & (mask | shared_mask)) == 0);
       }
     }
 
@@ -1141,6 +1197,16 @@ private:
       }
     }
 
+    node_ptr(share_rec *rec, type t)
+      : v(reinterpret_cast<uintptr_t>(rec) | t | shared_mask)
+    {
+      if (RADIX_DEBUG) {
+        assert(rec);
+        assert(t == UPPER || t == LEAF);
+        assert(((uintptr_t)rec & (mask | shared_mask)) == 0);
+      }
+    }
+
     constexpr node_ptr(uintptr_t v) : v(v) { }
 
     operator uintptr_t() const
@@ -1168,17 +1234,45 @@ private:
       return get_type() == NONE;
     }
 
+    /**
+     * Test if this is an upper or leaf node pointer that refers to
+     * the node through a #share_rec.
+     */
+    bool is_shared() const
+    {
+      return (get_type() == UPPER || get_type() == LEAF) &&
+        (v & shared_mask);
+    }
+
+    share_rec *as_share() const
+    {
+      if (RADIX_DEBUG)
+        assert(is_shared());
+      return reinterpret_cast<share_rec*>(v & ~(mask | shared_mask));
+    }
+
+    /**
+     * If this is a shared pointer, return a plain pointer to the
+     * node it shares.  Otherwise, return this pointer.
+     */
+    node_ptr deref() const
+    {
+      if (is_shared())
+        return node_ptr(as_share()->node.load(std::memory_order_relaxed));
+      return *this;
+    }
+
     upper_node *as_upper_node() const
     {
       if (RADIX_DEBUG)
-        assert(get_type() == UPPER);
+        assert(get_type() == UPPER && !is_shared());
       return reinterpret_cast<upper_node*>(v & ~mask);
     }
 
     leaf_node *as_leaf_node() const
     {
       if (RADIX_DEBUG)
-        assert(get_type() == LEAF);
+        assert(get_type() == LEAF && !is_shared());
       return reinterpret_cast<leaf_node*>(v & ~mask);
     }
 
@@ -1193,6 +1287,10 @@ private:
     {
       if (RADIX_DEBUG)
         assert(!get_lock().is_locked());
+      if (is_shared()) {
+        r->release_share(as_share());
+        return;
+      }
       switch (get_type()) {
       case EXTERNAL:
         delete as_external();
@@ -1221,7 +1319,7 @@ private:
    * the external, since having a non-null pointer implies that the
    * value is set.
    */
-  struct upper_node
+  struct alignas(16) upper_node
   {
     // XXX gcc 4.6's atomic template only support integral types.  4.7
     // supports any type.  Replace uintptr_t with node_ptr.
@@ -1387,6 +1485,24 @@ private:
       return node;
     }
 
+    /**
+     * Create a leaf node using r's allocator whose values are copies
+     * of the (unlocked) values in @c src.
+     */
+    static leaf_node *create_copy(radix_array *r, leaf_node *src)
+    {
+      leaf_node *node = r->leaf_node_alloc_.allocate(1);
+      try {
+        for (std::size_t i = 0; i < LEAF_FANOUT; ++i)
+          new (&node->child[i]) value_type(src->child[i]);
+      } catch (...) {
+        // XXX As in create(), some values might be junk
+        node->free(r);
+        throw;
+      }
+      return node;
+    }
+
     /**
      * Free a leaf node allocated with #create().
      */
@@ -1401,7 +1517,8 @@ private:
   };
 
   /**
-   * The root of the radix tree.
+   * The root of the radix tree.  Like all nodes, it is aligned so a
+   * pointer to it has room for the shared bit.
    *
    * We represent the root as a virtual #upper_node at level #LEVELS
    * that has only a single child.  This symmetry simplifies various
@@ -1411,7 +1528,7 @@ private:
    * the tree has only one level), or external (if the tree contains
    * only one item spanning the entire index space).
    */
-  std::atomic<uintptr_t> root_;
+  alignas(16) std::atomic<uintptr_t> root_;
 
   /**
    * Return a pointer to the virtual root node.  The returned node
@@ -1421,4 +1538,283 @@ private:
   {
     return node_ptr(reinterpret_cast<upper_node*>(&root_), false);
   }
+
+  /**
+   * A reference-counted handle on an upper or leaf node that is
+   * shared by several node pointers, usually in different arrays.
+   * The shared node itself is never modified; an array that needs to
+   * modify it copies it first (see #unshare_slot()).  Records and
+   * shared nodes are freed only when the last array that refers to
+   * them is destroyed or moved over, so it's up to the owner of the
+   * arrays to wait out lock-free lookups first (see #share()).
+   */
+  struct alignas(16) share_rec
+  {
+    /** Plain #node_ptr to the shared node. */
+    std::atomic<uintptr_t> node;
+    /** Number of node pointers that refer to this record. */
+    std::atomic<std::size_t> refs;
+    /** Bit 0 serializes copying the node and dropping references. */
+    uintptr_t lock;
+  };
+
+  typename ZAllocator::template rebind<share_rec>::other share_rec_alloc_;
+
+  /**
+   * True if #share() has ever been applied to this array.  Arrays
+   * that never share skip the unsharing walk in #acquire().
+   */
+  std::atomic<bool> ever_shared_;
+
+  /**
+   * Call <tt>x.on_share()</tt> if value_type has such a method.
+   */
+  template<typename U>
+  static auto on_share(U &x, int) -> decltype(x.on_share(), void())
+  {
+    x.on_share();
+  }
+
+  template<typename U>
+  static void on_share(U &x, long) { }
+
+  /**
+   * Free the external @c x, which has been unlinked from the array
+   * but which lock-free lookups may still be reading.  If value_type
+   * has a <tt>static void retire(value_type*)</tt> method, this
+   * calls it, which should free @c x once such lookups are done;
+   * otherwise this deletes @c x right away.
+   */
+  template<typename U>
+  static auto retire_external(U *x, int) -> decltype(U::retire(x), void())
+  {
+    U::retire(x);
+  }
+
+  template<typename U>
+  static void retire_external(U *x, long)
+  {
+    delete x;
+  }
+
+  /**
+   * Return a node pointer to the non-null, non-external node at
+   * @c *slot that can be stored in another slot, converting @c *slot
+   * to a shared pointer if it is not one already.  The caller must
+   * ensure that nothing else modifies @c *slot.
+   */
+  node_ptr share_slot(std::atomic<uintptr_t> *slot)
+  {
+    node_ptr c(*slot);
+    if (c.is_shared()) {
+      c.as_share()->refs.fetch_add(1, std::memory_order_relaxed);
+      return c;
+    }
+    share_rec *rec = share_rec_alloc_.allocate(1);
+    rec->node.store(c.v, std::memory_order_relaxed);
+    rec->refs.store(2, std::memory_order_relaxed);
+    rec->lock = 0;
+    node_ptr s(rec, c.get_type());
+    slot->store(s.v);
+    return s;
+  }
+
+  /**
+   * Drop a reference to @c rec, freeing it and the shared node when
+   * this is the last reference.
+   */
+  void release_share(share_rec *rec)
+  {
+    bit_spinlock l(&rec->lock, 0);
+    l.acquire();
+    std::size_t left = --rec->refs;
+    l.release();
+    if (left)
+      return;
+    node_ptr(rec->node.load(std::memory_order_relaxed)).free(this);
+    share_rec_alloc_.deallocate(rec, 1);
+  }
+
+  /**
+   * Return a private copy of @c orig, an upper or leaf node whose
+   * parent is at @c level.  The copy shares all of @c orig's child
+   * nodes and has its own copies of any values and externals.
+   */
+  node_ptr copy_node(node_ptr orig, unsigned level)
+  {
+    if (level == 1) {
+      leaf_node *src = orig.as_leaf_node();
+      for (auto &c : src->child)
+        on_share(c, 0);
+      return node_ptr(leaf_node::create_copy(this, src), false);
+    }
+
+    upper_node *src = orig.as_upper_node();
+    upper_node *node = upper_node_alloc_.default_allocate();
+    try {
+      for (std::size_t i = 0; i < UPPER_FANOUT; ++i) {
+        node_ptr c(src->child[i]);
+        if (c.is_null())
+          continue;
+        if (c.is_external()) {
+          on_share(*c.as_external(), 0);
+          // XXX Use allocator?
+          node->child[i].store(node_ptr(new value_type(*c.as_external()),
+                                        false),
+                               std::memory_order_relaxed);
+        } else {
+          node->child[i].store(share_slot(&src->child[i]),
+                               std::memory_order_relaxed);
+        }
+      }
+    } catch (...) {
+      node->free(this);
+      throw;
+    }
+    return node_ptr(node, false);
+  }
+
+  /**
+   * Make the node referred to by the shared pointer @c c, stored at
+   * @c *slot in a node at @c level that is private to this array,
+   * private as well.  If @c *slot holds the last reference, this
+   * simply takes the node; otherwise it replaces @c *slot with a
+   * copy.  Returns a plain pointer to the now-private node.
+   */
+  node_ptr unshare_slot(std::atomic<uintptr_t> *slot, node_ptr c,
+                        unsigned level)
+  {
+    share_rec *rec = c.as_share();
+    bit_spinlock l(&rec->lock, 0);
+    l.acquire(bit_spinlock::cli_caller);
+    // Another CPU may have unshared this slot between our load of c
+    // and taking the lock, in which case it's already private.
+    node_ptr cur(slot->load(std::memory_order_relaxed));
+    if (cur.v != c.v) {
+      l.release(bit_spinlock::cli_caller);
+      if (RADIX_DEBUG)
+        assert(!cur.is_shared());
+      return cur;
+    }
+    node_ptr orig(rec->node.load(std::memory_order_relaxed));
+    // Only holders of a reference can add references, and the other
+    // holders can only drop theirs under the lock, so refs == 1
+    // means this slot is the only way to reach the node.  We leave
+    // the record in place since lock-free lookups may be using it.
+    if (rec->refs.load(std::memory_order_relaxed) == 1) {
+      l.release(bit_spinlock::cli_caller);
+      return orig;
+    }
+    node_ptr copy;
+    try {
+      copy = copy_node(orig, level);
+    } catch (...) {
+      l.release(bit_spinlock::cli_caller);
+      throw;
+    }
+    slot->store(copy.v);
+    // The other holders keep the original alive.
+    --rec->refs;
+    l.release(bit_spinlock::cli_caller);
+    return copy;
+  }
+
+  /**
+   * Make every node that covers part of <tt>[low, high)</tt> private
+   * to this array, copying shared nodes from the top down.  Nodes
+   * below and beside the range stay shared.  Returns false if this
+   * array has never shared anything, so no node can have changed.
+   */
+  bool unshare(key_type low, key_type high)
+  {
+    if (!ever_shared_.load(std::memory_order_relaxed))
+      return false;
+    if (low < high)
+      unshare_recursive(get_root_ptr().as_upper_node(), LEVELS, 0, low, high);
+    return true;
+  }
+
+  void unshare_recursive(upper_node *node, unsigned level, key_type base,
+                         key_type low, key_type high)
+  {
+    key_type span = level_span(level);
+    std::size_t i = low > base ? (low - base) / span : 0;
+    for (; i < UPPER_FANOUT && base + i * span < high; ++i) {
+      node_ptr c(node->child[i]);
+      if (c.is_null() || c.is_external())
+        continue;
+      if (c.is_shared())
+        c = unshare_slot(&node->child[i], c, level);
+      if (level > 1)
+        unshare_recursive(c.as_upper_node(), level - 1, base + i * span,
+                          low, high);
+    }
+  }
+
+  /**
+   * Share the slots of @c snode, a node at @c level starting at key
+   * @c base, that intersect <tt>[low, high)</tt> with the matching
+   * slots of @c dnode.  See #share().
+   */
+  void share_recursive(radix_array *dst, upper_node *snode, upper_node *dnode,
+                       unsigned level, key_type base,
+                       key_type low, key_type high)
+  {
+    key_type span = level_span(level);
+    std::size_t i = low > base ? (low - base) / span : 0;
+    for (; i < UPPER_FANOUT && base + i * span < high; ++i) {
+      key_type cbase = base + i * span;
+      node_ptr c(snode->child[i]);
+      if (c.is_null())
+        continue;
+
+      if (low <= cbase && cbase + span <= high) {
+        // The whole slot is in range
+        if (RADIX_DEBUG)
+          assert(node_ptr(dnode->child[i]).is_null());
+        if (c.is_external()) {
+          on_share(*c.as_external(), 0);
+          // XXX Use allocator?
+          dnode->child[i].store(
+            node_ptr(new value_type(*c.as_external()), false));
+        } else {
+          dnode->child[i].store(share_slot(&snode->child[i]));
+        }
+        continue;
+      }
+
+      // The slot is only partly in range
+      key_type klow = std::max(low, cbase);
+      key_type khigh = std::min(high, cbase + span);
+      if (c.is_external()) {
+        on_share(*c.as_external(), 0);
+        value_type x(*c.as_external());
+        dst->fill(dst->find(klow), dst->find(khigh), x);
+        continue;
+      }
+      if (RADIX_DEBUG)
+        assert(!c.is_shared());
+      node_ptr d(dnode->child[i]);
+      if (RADIX_DEBUG)
+        assert(d.is_null() || !(d.is_external() || d.is_shared()));
+      if (level == 1) {
+        if (d.is_null()) {
+          d = node_ptr(leaf_node::create(dst, node_ptr()), false);
+          dnode->child[i].store(d.v);
+        }
+        leaf_node *sleaf = c.as_leaf_node(), *dleaf = d.as_leaf_node();
+        for (key_type k = klow; k < khigh; ++k) {
+          on_share(sleaf->child[k - cbase], 0);
+          dleaf->child[k - cbase] = sleaf->child[k - cbase];
+        }
+      } else {
+        if (d.is_null()) {
+          d = node_ptr(upper_node::create(dst, node_ptr(), level), false);
+          dnode->child[i].store(d.v);
+        }
+        share_recursive(dst, c.as_upper_node(), d.as_upper_node(),
+                        level - 1, cbase, low, high);
+      }
+    }
+  }
 };
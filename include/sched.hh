@@ -1,5 +1,10 @@
 #pragma once
 
+#include <uk/sched.h>
+
+// SCHED_OTHER weight of a nice 0 thread
+enum { SCHED_WEIGHT_NICE_0 = 1024 };
+
 struct sched_stat
 {
   u64 enqs;
@@ -8,5 +13,33 @@ struct sched_stat
   u64 misses;
   u64 idle;
   u64 busy;
+  u64 preempts;                 // Preemptions this CPU requested
   u64 schedstart;
 };
+
+// Per-thread CPU accounting.  Only the CPU running a thread updates
+// its accounting, except for wait_start, which is set by whoever makes
+// the thread runnable.  Times are in TSC cycles.
+struct proc_acct
+{
+  u64 run;                      // Running on a CPU
+  u64 user;                     // Running in user space (part of run)
+  u64 user_start;               // Last return to user space, or 0
+  u64 wait;                     // Runnable, but waiting for a CPU
+  u64 wait_start;               // When we last became runnable
+  u64 nvcsw;                    // Switched out because we blocked
+  u64 nivcsw;                   // Switched out while still runnable
+  u64 nmigrate;                 // Ran on a different CPU than last time
+  int last_cpu;                 // CPU we last ran on, or -1
+
+  // Add o's totals to ours.
+  void add(const proc_acct &o)
+  {
+    run += o.run;
+    user += o.user;
+    wait += o.wait;
+    nvcsw += o.nvcsw;
+    nivcsw += o.nivcsw;
+    nmigrate += o.nmigrate;
+  }
+};
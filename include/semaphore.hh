@@ -9,6 +9,7 @@ private:
   spinlock lock;
   condvar cv;
   uint64_t count;
+  blockstat stat;
 
 public:
   // Construct an uninitialized semaphore.  This should be
@@ -16,11 +17,14 @@ public:
   // This is constexpr, so it can be used for global semaphores
   // without incurring a static constructor.
   semaphore()
-    : lock(), cv(), count() { }
-
-  // Construct a semaphore.
-  semaphore(const char *name, uint64_t permits)
-    : lock(name), cv(name), count(permits) { }
+    : lock(), cv(), count(), stat() { }
+
+  // Construct a semaphore.  If lockstat is true, contention is
+  // reported to lockstat under name.
+  semaphore(const char *name, uint64_t permits,
+            bool lockstat = LOCKSTAT_SEMAPHORE)
+    : lock(name), cv(name, false), count(permits),
+      stat(name, LOCKSTAT_KIND_SEMAPHORE, lockstat) { }
 
   // Semaphores cannot be copied.
   semaphore(const semaphore &o) = delete;
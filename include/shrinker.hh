@@ -0,0 +1,62 @@
+#pragma once
+
+// Memory pressure callbacks for kernel caches.
+//
+// Kernel caches that hold on to memory they could give back implement
+// a shrinker.  Each NUMA node has a reclaim thread that wakes up when
+// the node's free memory drops below its low watermark and calls the
+// shrinkers until free memory is back above the high watermark.
+// kalloc also calls them directly before it fails an allocation.
+//
+// The reclaim threads also run memory compaction when high-order
+// allocations fail.
+
+#include <atomic>
+
+class print_stream;
+
+class shrinker
+{
+public:
+  // Register this shrinker.  Shrinkers are usually static objects and
+  // are never unregistered, so this is safe to call from a global
+  // constructor.
+  shrinker(const char *name);
+
+  // Return roughly how many pages scan could release on NUMA node.
+  virtual size_t count(int node) = 0;
+
+  // Try to release target pages, preferring memory on NUMA node.
+  // direct is true if this is called from an allocation that failed,
+  // in which case the caller may hold spinlocks or have interrupts
+  // disabled.  Return the number of pages released.
+  virtual size_t scan(int node, size_t target, bool direct) = 0;
+
+  const char *name() const { return name_; }
+
+  // Print counts and reclaim statistics for all shrinkers.
+  static void print_all(print_stream *s);
+
+private:
+  const char *name_;
+  shrinker *next_;
+  std::atomic<u64> reclaimed_;
+
+  friend size_t shrink_node(int node, size_t target, bool direct);
+};
+
+// Call shrinkers to release target pages, preferring memory on NUMA
+// node.  Return the number of pages released.
+size_t shrink_node(int node, size_t target, bool direct);
+
+// Wake node's reclaim thread if its free memory is below the low
+// watermark.  This is cheap enough to call from kalloc's slow path.
+void reclaim_check(int node);
+
+// Try to release enough memory for an allocation of size bytes on
+// node that just failed.  Return true if anything was released.
+bool reclaim_direct(int node, size_t size);
+
+// Ask node's reclaim thread to compact memory because a high-order
+// allocation failed.
+void compact_request(int node);
@@ -7,26 +7,23 @@ class sleeplock {
  public:
   sleeplock() : held_(false) {}
 
-  void acquire() {
-    scoped_acquire x(&spinlock_);
-    while (held_)
-      cv_.sleep(&spinlock_);
-    held_ = true;
-  }
+  // Create a sleeplock that reports contention to lockstat under
+  // name.  name must outlive the sleeplock.
+  sleeplock(const char *name, bool lockstat = LOCKSTAT_SLEEPLOCK)
+    : held_(false), stat_(name, LOCKSTAT_KIND_SLEEPLOCK, lockstat) {}
+
+  void acquire();
 
   bool try_acquire() {
     scoped_acquire x(&spinlock_);
     if (held_)
       return false;
     held_ = true;
+    stat_.acquired();
     return true;
   }
 
-  void release() {
-    scoped_acquire x(&spinlock_);
-    held_ = false;
-    cv_.wake_all();
-  }
+  void release();
 
   lock_guard<sleeplock> guard() {
     return lock_guard<sleeplock>(this);
@@ -36,4 +33,5 @@ class sleeplock {
   spinlock spinlock_;
   condvar cv_;
   bool held_;
+  blockstat stat_;
 };
@@ -11,6 +11,9 @@ struct sockaddr;
 // ulib.c
 char* gets(char*, int max);
 
+// umalloc.cc
+void malloc_thread_exit(void);
+
 // uthread.S
 int forkt(void *sp, void *pc, void *arg, int forkflags);
 void forkt_setup(u64 pid);
@@ -9,6 +9,7 @@
 #include "kalloc.hh"
 #include "page_info.hh"
 #include "mfs.hh"
+#include "kmemcache.hh"
 
 struct padded_length;
 
@@ -52,6 +53,15 @@ struct vmdesc : public mmu::page_tracker
     // Set if the page should be quasi user-visible. Requires
     // FLAG_ANON, conflicts with FLAG_COW and FLAG_SHARED.
     FLAG_QVISIBLE = 1<<6,
+
+    // Set if the kernel may use the page's kernel address without
+    // holding this page frame's lock (for example, as a futex key),
+    // so compaction must not move it.
+    FLAG_PINNED = 1<<7,
+
+    // Set if same-page merging may share this page with identical
+    // pages (see MADV_MERGEABLE).  Requires FLAG_ANON.
+    FLAG_MERGEABLE = 1<<8,
   };
 
   // Flags
@@ -116,9 +126,26 @@ struct vmdesc : public mmu::page_tracker
     return vmdesc(flags & ~FLAG_LOCK, page, inode, start);
   }
 
+  // Called by the radix_array before it copies this descriptor out of
+  // a node shared by two vmaps after fork().  A private page is now
+  // mapped by both, so it becomes copy-on-write on both sides.
+  void on_share()
+  {
+    if (page && !(flags & FLAG_SHARED) && !(flags & FLAG_COW))
+      flags |= FLAG_COW;
+  }
+
+  // Called by the radix_array to free an external node it has unset
+  // or replaced.  Lock-free lookups may still be reading it, so it
+  // must outlive their gc epochs.
+  static void retire(vmdesc *x)
+  {
+    gc_delayed_delete(x);
+  }
+
   // We need new/delete so the radix_array can allocate external nodes
   // when performing node compression.
-  NEW_DELETE_OPS(vmdesc)
+  NEW_DELETE_OPS_CACHE(vmdesc, "vmdesc")
 
 private:
   vmdesc(u64 flags)
@@ -132,12 +159,40 @@ private:
 
 void to_stream(class print_stream *s, const vmdesc &vmd);
 
+// Chooses and allocates pages for vmap::migrate_all.
+struct page_migrator
+{
+  // Return true if the page at kernel address va should be moved.
+  virtual bool want(void *va) = 0;
+
+  // Allocate a page to move a page to, or return nullptr to stop.
+  virtual char *alloc() = 0;
+};
+
+// Visits pages for vmap::merge_scan_all.
+struct page_merger
+{
+  // Called for each private anonymous page, which vm maps at va.  No
+  // locks are held, so the mapping may change at any time.
+  virtual void scan(vmap *vm, uptr va, const sref<page_info> &page) = 0;
+};
+
 // An address space. This manages the mapping from virtual addresses
 // to virtual memory descriptors.
-struct vmap : public referenced {
+struct vmap : public referenced, public rcu_freed {
   static sref<vmap> alloc();
 
-  // Copy this vmap's structure and share pages copy-on-write.
+  // Drop the reference vm.  If it was the last one, free the address
+  // space's pages and page tables from cpu's deferred work queue
+  // rather than the caller's context.  No CPU may still be using vm's
+  // page tables.
+  static void release_async(sref<vmap> &&vm, int cpu);
+
+  // Copy this vmap's structure and share pages copy-on-write.  The
+  // two vmaps share the radix nodes that describe user memory, so
+  // this takes time proportional to the number of top-level nodes;
+  // each node and the descriptors in it are copied when one side
+  // first locks a range under it.
   sref<vmap> copy();
 
   // Map desc from virtual addresses start to start+len.  Returns
@@ -147,9 +202,15 @@ struct vmap : public referenced {
   // Unmap from virtual addresses start to start+len.
   int remove(uptr start, uptr len);
 
-  // Populate vmdesc's.
+  // Populate vmdesc's and map them in this CPU's page tables.
+  // Anonymous pages are allocated in batches.
   int willneed(uptr start, uptr len);
 
+  // Discard the pages of private anonymous memory in a range.  They
+  // will be zero-filled on the next access.  Other mappings are left
+  // alone.
+  int dontneed(uptr start, uptr len);
+
   // Invalidate page caches.
   int invalidate_cache(uptr start, uptr len);
 
@@ -183,9 +244,55 @@ struct vmap : public referenced {
   // Report the number of internal pages used by the page map cache.
   u64 internal_pages() const { return cache.internal_pages(); }
 
+  // Resident page counters.  A page shared with other address spaces
+  // counts in each of them.
+  enum rss_type { RSS_ANON, RSS_FILE, RSS_NTYPES };
+
+  // Return the number of pages of the given type mapped in this
+  // address space.  This is only an estimate if the address space is
+  // changing.
+  u64 rss(rss_type type) const;
+
+  // Fold this CPU's cached counter updates into their vmap.  This must
+  // be called, with interrupts disabled, before the vmap this CPU is
+  // running can go away.
+  static void flush_rss();
+
+  // Record the process this address space belongs to, for
+  // /dev/procmem.
+  void set_owner(int pid, const char *name);
+
+  // Read procmem_recs for all address spaces, for /dev/procmem.
+  static int procmem_read(char *dst, u32 off, u32 n);
+
   // Set write permission bit in vmdesc
   int set_write_permission(uptr start, uptr len, bool is_readonly, bool is_cow);
 
+  // Allow or forbid same-page merging of the anonymous pages in
+  // [start, start+len).
+  int set_mergeable(uptr start, uptr len, bool mergeable);
+
+  // Move the private anonymous pages of every address space that m
+  // wants to pages allocated by m.  Returns the number of pages
+  // moved.
+  static size_t migrate_all(page_migrator *m);
+
+  // Pass every mergeable private anonymous page of every address
+  // space to m.
+  static void merge_scan_all(page_merger *m);
+
+  // If va still maps page, replace it with a copy-on-write mapping of
+  // shared, provided the two pages are identical.  Returns true if
+  // the pages were merged.
+  bool merge_page(uptr va, page_info *page, const sref<page_info> &shared);
+
+  // If va still maps page, make it copy-on-write so that page's
+  // contents can't change from under a merge.  Returns true if it did.
+  bool protect_page(uptr va, page_info *page);
+
+  // Return a reference to vm if it's still a live address space.
+  static sref<vmap> lookup(vmap *vm);
+
   uptr brk_;                    // Top of heap
 
 private:
@@ -194,18 +301,150 @@ private:
   vmap& operator=(const vmap&);
   ~vmap();
   NEW_DELETE_OPS(vmap)
+
+  // The last array to refer to a radix node shared by fork frees it,
+  // and lock-free lookups in the other vmaps may still be reading
+  // it, so we free ourselves through gc.
+  void onzero() override { gc_delayed(this); }
+  void do_gc() override { delete this; }
   uptr unmapped_area(size_t n);
+  size_t migrate_pages(page_migrator *m);
+  void merge_scan(page_merger *m);
+  void add_rss(rss_type type, s64 n);
+  struct rss_tally;
+  template<class F> static void for_each(F f);
+
+  // All vmaps, for compaction and same-page merging, which need to
+  // find the mappings of the pages they move.  Each CPU lists the
+  // vmaps created on it, so creating and destroying address spaces
+  // doesn't serialize on one lock.
+  struct all_list;
+  ilink<vmap> all_link_;
+  int all_cpu_;                 // CPU whose list we're on
+  static all_list all_[NCPU];
+
+  // Set once any range of this address space has been made
+  // mergeable, so the merge scanner can skip the rest.
+  std::atomic<bool> any_mergeable_;
+
+  // Resident pages, except for updates CPUs haven't folded in yet
+  std::atomic<s64> rss_[RSS_NTYPES];
+  std::atomic<int> owner_pid_;
+  char owner_name_[16];
 
   mmu::page_map_cache cache;
   friend void switchvm(struct proc *);
 
-  // Virtual page frames
+  // Virtual page frames.  Externals we unset and nodes shared with
+  // other vmaps are freed through gc (see vmdesc::retire and onzero),
+  // so lookups in the user half must run in a gc epoch.
   typedef radix_array<vmdesc, 0x10000000000000, PGSIZE,
                       kalloc_allocator<vmdesc>, scoped_no_sched> vpf_array;
   vpf_array vpfs_;
 
+  // Fork gate.  copy() shares vpfs_'s nodes with the child, which
+  // must not race with anything that has part of vpfs_ locked, so
+  // every range lock on user memory passes through this gate and
+  // copy() closes it.  Ranges above USERTOP are never shared, so
+  // locking them skips the gate; switch_to does so with interrupts
+  // disabled, where it couldn't wait for a fork's IPIs.
+  // A CPU taking a range lock records the vmap in its own slot, so
+  // locking doesn't bounce a shared cache line between CPUs.
+  //
+  // A CPU that already holds a range lock on another vmap must not
+  // wait at this gate, since a fork of the other vmap may be waiting
+  // for it.  So the gate closes in two steps: while it is draining,
+  // such nested range locks still get through and the fork waits for
+  // them to finish; once it is closed, everyone waits, but a fork
+  // holds it closed only while it hides page tables and shares,
+  // which waits only for IPIs.
+  enum { GATE_OPEN, GATE_DRAINING, GATE_CLOSED };
+  std::atomic<int> gate_;
+  // Range locks taken on CPUs whose slot was busy with another vmap
+  std::atomic<int> gate_overflow_;
+  // Pass the gate, waiting for any fork in progress.  The caller must
+  // have disabled preemption, but not interrupts.  Returns whether this used
+  // gate_overflow_, to pass to leave_gate.
+  bool enter_gate();
+  void leave_gate(bool overflow);
+  // Wait for range locks to drain and keep new ones out.
+  void close_gate();
+  void open_gate();
+  // Whether no CPU holds a range lock on this vmap.
+  bool gate_drained() const;
+
+  // Passes vm's gate if user is true, and does nothing otherwise.
+  struct gate_pass
+  {
+    vmap *vm;
+    bool overflow;
+    gate_pass(vmap *vm, bool user)
+      : vm(user ? vm : nullptr), overflow(user && vm->enter_gate()) { }
+    ~gate_pass() { if (vm) vm->leave_gate(overflow); }
+  };
+
+  // A lock on a range of vpfs_ that also holds the fork gate open.
+  class range_lock
+  {
+    scoped_no_sched nosched_;
+    gate_pass pass_;
+    vpf_array::lock lock_;
+
+  public:
+    range_lock(vmap *vm, const vpf_array::iterator &low,
+               const vpf_array::iterator &high)
+      : pass_(vm, low.index() < USERTOP / PGSIZE),
+        lock_(vm->vpfs_.acquire(low, high)) { }
+    range_lock(vmap *vm, const vpf_array::iterator &it)
+      : pass_(vm, it.index() < USERTOP / PGSIZE),
+        lock_(vm->vpfs_.acquire(it)) { }
+    range_lock(const range_lock &) = delete;
+    range_lock &operator=(const range_lock &) = delete;
+  };
+
+  // Use these instead of vpfs_.acquire.
+  range_lock lock_range(const vpf_array::iterator &low,
+                        const vpf_array::iterator &high)
+  {
+    return range_lock(this, low, high);
+  }
+
+  range_lock lock_range(const vpf_array::iterator &it)
+  {
+    return range_lock(this, it);
+  }
+
+  // Whether it holds a page that only this vmdesc can write, which
+  // same-page merging can replace and was asked to.  it must be
+  // locked.
+  static bool mergeable(const vpf_array::iterator &it);
+
   struct spinlock brklock_;
 
+  // munmap shootdowns that have been deferred, and the pages they
+  // unmapped, which can't be freed until the shootdown is performed.
+  // Protected by deferred_lock_.
+  struct spinlock deferred_lock_;
+  mmu::shootdown deferred_sd_;
+  class page_holder *deferred_pages_;
+  size_t deferred_npages_;
+  uptr deferred_start_, deferred_end_;
+  // Batches taken from the above that are still being shot down
+  int deferred_flushing_;
+
+  // Defer sd, which covers [start, end), and hold on to pages until
+  // it is performed.  This may perform the whole batch.
+  void defer_shootdown(const mmu::shootdown &sd, class page_holder *pages,
+                       uptr start, uptr end);
+  // Return true if a deferred shootdown may overlap [start, end).
+  bool deferred_overlaps(uptr start, uptr end);
+  // Perform any deferred shootdowns that overlap [start, end) and
+  // wait for any in progress.  This must not be called with
+  // interrupts disabled.
+  void flush_deferred(uptr start, uptr end);
+  void take_deferred(mmu::shootdown *sd, class page_holder **pages);
+  void finish_deferred(const mmu::shootdown &sd, class page_holder *pages);
+
   enum class access_type
   {
     READ, WRITE
@@ -214,7 +453,9 @@ private:
   // Ensure there is a backing page at @c it.  The caller is
   // responsible for ensuring that there is a mapping at @c it and for
   // locking vpfs_ at @c it.  This throws bad_alloc if a page must be
-  // allocated and cannot be.
+  // allocated and cannot be.  If @c fresh is non-null, it is an
+  // unzeroed page to use if this must allocate an anonymous page; the
+  // caller must only pass one if that is the case.
   page_info *ensure_page(const vpf_array::iterator &it, access_type type,
-                         bool *allocated = nullptr);
+                         bool *allocated = nullptr, char *fresh = nullptr);
 };
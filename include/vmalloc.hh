@@ -9,6 +9,8 @@
 // safety.
 
 void *vmalloc_raw(size_t bytes, size_t guard, const char *name);
+// Like vmalloc_raw, but returns nullptr if out of memory.
+void *vmalloc_raw_nothrow(size_t bytes, size_t guard, const char *name);
 void vmalloc_free(void *ptr);
 
 // Managed single-owner pointer to vmalloc'd memory
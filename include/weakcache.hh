@@ -5,6 +5,7 @@
 #include "refcache.hh"
 #include "hash.hh"
 #include "log2.hh"
+#include "kmemcache.hh"
 
 template<class K, class V>
 class weakcache
@@ -32,7 +33,7 @@ private:
       : rcu_freed("weakcache::item", this, sizeof(*this)),
         key_(k), weakref_(v), parent_(b) {}
     void do_gc() override { delete this; }
-    NEW_DELETE_OPS(item)
+    NEW_DELETE_OPS_CACHE(item, "weakcache::item")
   };
 
   class bucket
@@ -84,6 +85,18 @@ private:
       }
     }
 
+    template<class CB>
+    void
+    for_each(CB &cb) const
+    {
+      scoped_gc_epoch reader;
+      for (auto &i: chain_) {
+        sref<V> v = i.weakref_.get();
+        if (v)
+          cb(v);
+      }
+    }
+
     void
     update_stats(struct stats *stats) const
     {
@@ -144,6 +157,25 @@ public:
     i->parent_->remove(i);
   }
 
+  std::size_t
+  num_buckets() const
+  {
+    return mask_ + 1;
+  }
+
+  // Call cb with a reference to each live value in n buckets,
+  // starting at bucket start and wrapping around.  Returns the bucket
+  // after the last one visited, so the caller can sweep the cache
+  // incrementally.
+  template<class CB>
+  std::size_t
+  scan(std::size_t start, std::size_t n, CB cb) const
+  {
+    for (; n; --n, start = (start + 1) & mask_)
+      buckets_[start & mask_].for_each(cb);
+    return start & mask_;
+  }
+
   struct stats
   get_stats() const
   {
@@ -2,8 +2,11 @@
 #include "kernel.hh"
 #include "buf.hh"
 #include "weakcache.hh"
+#include "shrinker.hh"
 
 static weakcache<buf::key_t, buf> bufcache(512 << 10);
+// Bufs the cache holds a reference to
+static std::atomic<size_t> bufcache_pinned;
 
 sref<buf>
 buf::get(u32 dev, u64 block)
@@ -12,6 +15,9 @@ buf::get(u32 dev, u64 block)
   for (;;) {
     sref<buf> b = bufcache.lookup(k);
     if (b.get() != nullptr) {
+      // The shrinker may have dropped the cache's reference
+      if (!b->cached_.load(std::memory_order_relaxed) && b->pin())
+        bufcache_pinned++;
       // Wait for buffer to load, by getting a read seqlock,
       // which waits for the write seqlock bit to be cleared.
       b->seq_.read_begin();
@@ -21,7 +27,8 @@ buf::get(u32 dev, u64 block)
     sref<buf> nb = sref<buf>::transfer(new buf(dev, block));
     auto locked = nb->write();
     if (bufcache.insert(k, nb.get())) {
-      nb->inc();  // keep it in the cache
+      if (nb->pin())  // keep it in the cache
+        bufcache_pinned++;
       ideread(dev, locked->data, BSIZE, block*BSIZE);
       return nb;
     }
@@ -46,3 +53,48 @@ buf::onzero()
   bufcache.cleanup(weakref_);
   delete this;
 }
+
+// Drop the cache's references to bufs, sweeping through the cache
+// like a clock hand.  A buf is freed once nobody else is using it and
+// it is clean.
+class bufcache_shrinker : public shrinker
+{
+  std::atomic<size_t> hand_;
+
+  static size_t pages(size_t nbufs)
+  {
+    return nbufs * sizeof(buf) / PGSIZE;
+  }
+
+public:
+  bufcache_shrinker() : shrinker("bufcache"), hand_(0) { }
+
+  size_t count(int node) override
+  {
+    // Bufs come from any node
+    return pages(bufcache_pinned);
+  }
+
+  size_t scan(int node, size_t target, bool direct) override
+  {
+    // refcache drops the last reference at its next review, so this
+    // doesn't help an allocation that is failing right now.
+    if (direct)
+      return 0;
+
+    enum { BATCH = 64 };
+    size_t unpinned = 0;
+    for (size_t swept = 0; swept < bufcache.num_buckets() &&
+           pages(unpinned) < target; swept += BATCH) {
+      hand_ = bufcache.scan(hand_, BATCH, [&](const sref<buf> &b) {
+          if (b->unpin()) {
+            bufcache_pinned--;
+            unpinned++;
+          }
+        });
+    }
+    return pages(unpinned);
+  }
+};
+
+static bufcache_shrinker bufcache_shrinker;
@@ -3,6 +3,7 @@
 #include "kstream.hh"
 #endif
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iterator>
@@ -11,6 +12,7 @@ using namespace std;
 
 buddy_allocator::buddy_allocator(void *base, size_t len,
                                  void *track_base, size_t track_len)
+  : pageblocks(nullptr), fallbacks(0), conversions(0)
 {
   if (track_base == nullptr && track_len == 0) {
     track_base = base;
@@ -58,6 +60,19 @@ buddy_allocator::buddy_allocator(void *base, size_t len,
   orders[MAX_ORDER].debug = nullptr;
 #endif
 
+  // Allocate the pageblock array the same way.  Everything starts
+  // out movable, but whole free pageblocks get the type of whatever
+  // is first allocated from them.
+  size_t npageblocks = track_len / PAGEBLOCK_SIZE;
+  base = (void*)(((uintptr_t)base + alignof(pageblock) - 1) &
+                 ~(alignof(pageblock) - 1));
+  if ((uintptr_t)base + npageblocks * sizeof(pageblock) >= free_end)
+    return;
+  pageblocks = (pageblock*)base;
+  for (size_t i = 0; i < npageblocks; ++i)
+    pageblocks[i] = pageblock{MIGRATE_MOVABLE, 0};
+  base = pageblocks + npageblocks;
+
   // Record the region we can track.  These must be multiples of
   // MIN_SIZE, but they will be since we've already rounded to
   // MAX_SIZE above.
@@ -91,38 +106,60 @@ buddy_allocator::buddy_allocator(void *base, size_t len,
 #endif
 }
 
+// Take a block from the free list of the given order and type, or
+// return nullptr if it's empty.
 void*
-buddy_allocator::alloc_order(size_t order)
+buddy_allocator::take_block(size_t order, migratetype type)
 {
-  // Is a block of this order available?
-  if (!orders[order].blocks.empty()) {
-    // Get a block
-    struct block *block = &orders[order].blocks.front();
-    orders[order].blocks.pop_front();
-
-    // Mark it as allocated
-    if (order < MAX_ORDER) {
-      bool state = flip_bit(block, order);
-      // Now both buddies must be allocated (otherwise they would have
-      // been promoted).
-      assert(state == 0);
-      mark_allocated(block, order, true);
-    }
+  auto &list = free_list(order, type);
+  if (list.empty())
+    return nullptr;
+
+  // Get a block
+  struct block *block = &list.front();
+  list.pop_front();
 
-    assert((uintptr_t)block >= base && (uintptr_t)block < limit);
-    return (void*)block;
+  // Mark it as allocated
+  if (order < MAX_ORDER) {
+    bool state = flip_bit(block, order);
+    // Now both buddies must be allocated (otherwise they would have
+    // been promoted).
+    assert(state == 0);
+    mark_allocated(block, order, true);
+  }
+
+  assert((uintptr_t)block >= base && (uintptr_t)block < limit);
+  return (void*)block;
+}
+
+void*
+buddy_allocator::alloc_order(size_t order, migratetype type)
+{
+  // Is a block of this order available?
+  if (void *block = take_block(order, type)) {
+    if (order >= PAGEBLOCK_ORDER)
+      // This was a whole free pageblock (or several).  It now belongs
+      // to this type.
+      set_type(block, order, type);
+    return block;
   } else if (order == MAX_ORDER) {
     return nullptr;
   } else {
     // We need to split a block.  We'll allocate one of order + 1, use
     // the first half of it and add the second half to order's free
     // list.
-    void *parent = alloc_order(order + 1);
-    if (!parent)
+    void *parent = alloc_order(order + 1, type);
+    if (!parent) {
+      // There are no larger blocks of this type and no free
+      // pageblocks.  Since we're unwinding from the largest order
+      // down, this takes the largest block another type can spare.
+      if (order < PAGEBLOCK_ORDER)
+        return alloc_fallback(order, type);
       return nullptr;
+    }
     struct block *second_half =
       (struct block*)((char*)parent + (MIN_SIZE << order));
-    orders[order].blocks.push_front(second_half);
+    free_list(order, get_type(second_half)).push_front(second_half);
 
     // Mark this pair as half-allocated
     bool state = flip_bit(parent, order);
@@ -134,6 +171,68 @@ buddy_allocator::alloc_order(size_t order)
   }
 }
 
+// Split the allocated block of the given order at ptr into allocated
+// blocks covering its first keep bytes, and free the rest.  keep must
+// be a multiple of MIN_SIZE.
+void
+buddy_allocator::trim_order(void *ptr, size_t order, size_t keep)
+{
+  while (keep < (MIN_SIZE << order)) {
+    // Split the block into two allocated halves.  Their bitmap bit is
+    // already 0, since they were both free or both allocated before.
+    --order;
+    mark_allocated(ptr, order, true);
+    void *second_half = (char*)ptr + (MIN_SIZE << order);
+    if (keep <= (MIN_SIZE << order)) {
+      free_order(second_half, order);
+    } else {
+      // Keep all of the first half, and trim the second
+      keep -= MIN_SIZE << order;
+      ptr = second_half;
+    }
+  }
+}
+
+// Allocate a block of the given order from another type's free list.
+void*
+buddy_allocator::alloc_fallback(size_t order, migratetype type)
+{
+  // The order to try other types in, indexed by the requested type
+  static const migratetype fallback_types[MIGRATE_ALLOC_TYPES][2] = {
+    // MIGRATE_UNMOVABLE
+    {MIGRATE_PGTABLE, MIGRATE_MOVABLE},
+    // MIGRATE_PGTABLE
+    {MIGRATE_UNMOVABLE, MIGRATE_MOVABLE},
+    // MIGRATE_MOVABLE
+    {MIGRATE_UNMOVABLE, MIGRATE_PGTABLE},
+  };
+
+  for (migratetype other : fallback_types[type]) {
+    void *block = take_block(order, other);
+    if (!block)
+      continue;
+    ++fallbacks;
+    // If we're taking a big piece of this pageblock, take over the
+    // rest of it, too, so later allocations of this type come from
+    // here instead of stealing from yet another pageblock.
+    if (order >= PAGEBLOCK_ORDER / 2 && get_type(block) == other) {
+      set_type(block, order, type);
+      ++conversions;
+    }
+    return block;
+  }
+  return nullptr;
+}
+
+void
+buddy_allocator::set_type(void *ptr, size_t order, migratetype type)
+{
+  uintptr_t start = (uintptr_t)ptr & ~((uintptr_t)PAGEBLOCK_SIZE - 1);
+  uintptr_t end = (uintptr_t)ptr + ((uintptr_t)MIN_SIZE << order);
+  for (uintptr_t pb = start; pb < end; pb += PAGEBLOCK_SIZE)
+    pageblock_of((void*)pb)->type = type;
+}
+
 void
 buddy_allocator::free_order(void *ptr, size_t order)
 {
@@ -155,16 +254,80 @@ buddy_allocator::free_order(void *ptr, size_t order)
 
   if (order < MAX_ORDER && flip_bit(ptr, order) == 0) {
     // This block's buddy is also free.  Remove the buddy from its
-    // list, combine them, and free to the higher order.
+    // list, combine them, and free to the higher order.  The buddy
+    // may not be on the list of its pageblock's current type, but
+    // unlinking doesn't depend on the list head.
     uintptr_t buddy = (uintptr_t)ptr ^ ((uintptr_t)MIN_SIZE << order);
-    orders[order].blocks.erase(
-      orders[order].blocks.iterator_to((struct block*)buddy));
+    block_list::iterator it = block_list::iterator_to((struct block*)buddy);
+    orders[order].blocks[0].erase(it);
     uintptr_t parent = (uintptr_t)ptr & ~((uintptr_t)MIN_SIZE << order);
     free_order((void*)parent, order + 1);
   } else {
     // This block's buddy is allocated.  Release this block to the
     // current order.
-    orders[order].blocks.push_front((struct block*)ptr);
+    free_list(order, get_type(ptr)).push_front((struct block*)ptr);
+  }
+}
+
+size_t
+buddy_allocator::compaction_candidates(uintptr_t *out, size_t max,
+                                       size_t min_free)
+{
+  if (!pageblocks || max == 0)
+    return 0;
+
+  // Count the free pages in each pageblock.  Whole free pageblocks
+  // have coalesced into higher orders, so they don't count.
+  size_t npageblocks = (limit - base) / PAGEBLOCK_SIZE;
+  for (size_t i = 0; i < npageblocks; ++i)
+    pageblocks[i].nfree = 0;
+  for (size_t order = 0; order < PAGEBLOCK_ORDER; ++order)
+    for (auto &list : orders[order].blocks)
+      for (auto &b : list)
+        pageblock_of(&b)->nfree += 1 << order;
+
+  // Keep the max most free movable pageblocks, in decreasing order
+  size_t n = 0;
+  for (size_t i = 0; i < npageblocks; ++i) {
+    auto &pb = pageblocks[i];
+    if (pb.type != MIGRATE_MOVABLE || pb.nfree == 0 ||
+        pb.nfree * MIN_SIZE < min_free)
+      continue;
+    if (n == max && pageblock_of((void*)out[n - 1])->nfree >= pb.nfree)
+      continue;
+    size_t j = n < max ? n++ : n - 1;
+    for (; j > 0 && pageblock_of((void*)out[j - 1])->nfree < pb.nfree; --j)
+      out[j] = out[j - 1];
+    out[j] = base + i * PAGEBLOCK_SIZE;
+  }
+  return n;
+}
+
+void
+buddy_allocator::move_pageblocks(const uintptr_t *pbs, size_t n,
+                                 migratetype type)
+{
+  for (size_t i = 0; i < n; ++i)
+    pageblock_of((void*)pbs[i])->type = type;
+
+  for (size_t order = 0; order < PAGEBLOCK_ORDER; ++order) {
+    for (size_t t = 0; t < MIGRATE_TYPES; ++t) {
+      if (t == type)
+        continue;
+      auto &list = orders[order].blocks[t];
+      for (auto it = list.begin(); it != list.end(); ) {
+        struct block *b = &*it;
+        uintptr_t pb = (uintptr_t)b & ~((uintptr_t)PAGEBLOCK_SIZE - 1);
+        if (std::find(pbs, pbs + n, pb) != pbs + n) {
+          // Put these at the back, so a pageblock that has just been
+          // compacted has a chance to fill in before it's used.
+          it = list.erase(it);
+          free_list(order, type).push_back(b);
+        } else {
+          ++it;
+        }
+      }
+    }
   }
 }
 
@@ -219,14 +382,20 @@ buddy_allocator::get_stats() const
 {
   stats out{};
   for (size_t order = 0; order <= MAX_ORDER; ++order) {
-    for (auto &b : orders[order].blocks) {
-      (void)b;                  // Hush g++
-      ++out.nfree[order];
+    for (size_t t = 0; t < MIGRATE_TYPES; ++t) {
+      for (auto &b : orders[order].blocks[t]) {
+        (void)b;                // Hush g++
+        ++out.nfree[order];
+        if (order < PAGEBLOCK_ORDER)
+          ++out.nfree_type[t][order];
+      }
     }
     out.free += out.nfree[order] * (MIN_SIZE << order);
   }
   assert(out.free == get_free_bytes());
   out.metadata_bytes = bitmap_bytes;
   out.waste_bytes = waste_bytes;
+  out.fallbacks = fallbacks;
+  out.conversions = conversions;
   return out;
 }
@@ -104,12 +104,17 @@ condvar::sleep_to(struct spinlock *lk, u64 timeout, struct spinlock *lk2)
     sleepers.push_back(myproc());
  }
 
+  int caller = 0;
+  stat.acquired();
+  u64 ts = stat.block(__builtin_return_address(0), &caller);
+
   lock.release();
   sched();
   // Reacquire original lock.
   lk->acquire();
   if (lk2)
     lk2->acquire();
+  stat.unblock(ts, caller);
   if (myproc()->killed) {
     // Callers should use scoped locks to ensure locks are released as the stack
     // is unwinded.  But, callers don't have to check for p->killed to ensure
@@ -118,12 +123,6 @@ condvar::sleep_to(struct spinlock *lk, u64 timeout, struct spinlock *lk2)
   }
 }
 
-void
-condvar::sleep(struct spinlock *lk, struct spinlock *lk2)
-{
-  sleep_to(lk, 0, lk2);
-}
-
 void
 condvar::wake_one(proc *p)
 {
@@ -147,7 +146,9 @@ void
 condvar::wake_all(int yield, proc *callerproc)
 {
   scoped_acquire cv_l(&lock);
-  myproc()->yield_ = yield;
+  // Don't clear a yield somebody else requested
+  if (yield)
+    myproc()->yield_ = true;
 
   for (auto it = this->waiters.begin(); it != this->waiters.end();
        it++) {
@@ -6,6 +6,7 @@
 #include "kstats.hh"
 #include "kstream.hh"
 #include "linearhash.hh"
+#include "vm.hh"
 
 extern const char *kconfig;
 
@@ -37,6 +38,37 @@ kstatsread(mdev*, char *dst, u32 off, u32 n)
   return n;
 }
 
+static int
+syscallstatread(mdev*, char *dst, u32 off, u32 n)
+{
+  extern const char* syscall_names[];
+  extern const int nsyscalls;
+
+  // Return one record for each system call, skipping unused numbers.
+  u32 pos = 0, used = 0;
+  for (int num = 0; num < nsyscalls && used < n; ++num) {
+    if (!syscall_names[num])
+      continue;
+    if (pos + sizeof(syscall_kstats_rec) <= off) {
+      pos += sizeof(syscall_kstats_rec);
+      continue;
+    }
+
+    syscall_kstats_rec rec{};
+    rec.num = num;
+    strncpy(rec.name, syscall_names[num], sizeof rec.name - 1);
+    for (size_t i = 0; i < ncpu; ++i)
+      rec.stats += syscall_kstats_on(i)[num];
+
+    u32 roff = off > pos ? off - pos : 0;
+    u32 len = MIN(sizeof rec - roff, n - used);
+    memmove(dst + used, (char*)&rec + roff, len);
+    used += len;
+    pos += sizeof rec;
+  }
+  return used;
+}
+
 static int
 qstatsread(mdev*, char *dst, u32 off, u32 n)
 {
@@ -54,10 +86,25 @@ qstatsread(mdev*, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
+static int
+procmemread(mdev*, char *dst, u32 off, u32 n)
+{
+  return vmap::procmem_read(dst, off, n);
+}
+
+static int
+procacctread(mdev*, char *dst, u32 off, u32 n)
+{
+  return proc::acct_read(dst, off, n);
+}
+
 void
 initdev(void)
 {
   devsw[MAJ_KCONFIG].pread = kconfigread;
   devsw[MAJ_KSTATS].pread = kstatsread;
+  devsw[MAJ_SYSCALLSTAT].pread = syscallstatread;
   devsw[MAJ_QSTATS].pread = qstatsread;
+  devsw[MAJ_PROCMEM].pread = procmemread;
+  devsw[MAJ_PROCACCT].pread = procacctread;
 }
@@ -13,7 +13,6 @@
 #include "cpu.hh"
 #include "kmtrace.hh"
 #include "mfs.hh"
-#include "work.hh"
 #include "filetable.hh"
 
 #define BRK (USERTOP >> 1)
@@ -151,24 +150,14 @@ doheap(vmap* vmp)
   return 0;
 }
 
-struct cleanup_work : public dwork
-{
-  cleanup_work(sref<vmap>&& oldvmap)
-    : dwork(), oldvmap_(std::move(oldvmap)) {}
-
-  virtual void run() override {
-    // The destructor will decref oldvmap_.
-     delete this;
-  }
-
-  sref<vmap> oldvmap_;
-
-  NEW_DELETE_OPS(cleanup_work)
-};
-
 int
 exec(const char *path, const char * const *argv)
 {
+  // The new image has no cache state to stay near, so this is a good
+  // time to move to a less loaded CPU.  Do it first, so the image's
+  // memory comes from its new CPU.
+  myproc()->migrate(pickcpu(true));
+
   sref<vmap> oldvmap;
   int r = load_image(myproc(), path, argv, &oldvmap);
   if (r < 0) {
@@ -190,9 +179,15 @@ exec(const char *path, const char * const *argv)
   // Switch to the new address space
   switchvm(myproc());
 
-  // Now it's safe to clean up the old address space
-  cleanup_work* w = new cleanup_work(std::move(oldvmap));
-  assert(dwork_push(w, myproc()->data_cpuid) >= 0);
+  // Now it's safe to clean up the old address space.  If we borrowed
+  // it with vfork, it lives on, so take our mappings out of it before
+  // giving it back.
+  if (myproc()->vfork_parent) {
+    oldvmap->remove((uptr)myproc(), PGSIZE);
+    oldvmap->remove((uptr)myproc()->kstack, KSTACKSIZE);
+  }
+  vmap::release_async(std::move(oldvmap), myproc()->data_cpuid);
+  myproc()->vfork_done();
 
   return 0;
 }
@@ -302,6 +297,7 @@ load_image(proc *p, const char *path, const char * const *argv,
     if(*s == '/')
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
+  p->vmap->set_owner(p->pid, p->name);
 
   return 0;
 }
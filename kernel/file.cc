@@ -37,14 +37,20 @@ file_inode::stat(struct stat *st, enum stat_flags flags)
   return 0;
 }
 
+// Regular files don't use off_lock.  Instead, read and write
+// reserve the byte range they will access by atomically advancing
+// off, so concurrent sequential I/O through one file descriptor
+// proceeds in parallel on disjoint ranges.  Appends are serialized by
+// the file's size lock, which writei needs anyway, and publish the
+// new offset while holding it.  Devices may return short or
+// unpredictable counts, so they still serialize on off_lock.
+
 ssize_t
 file_inode::read(char *addr, size_t n)
 {
   if (!readable)
     return -1;
 
-  lock_guard<sleeplock> l;
-  ssize_t r;
   if (ip->type() == mnode::types::dev) {
     u16 major = ip->as_dev()->major();
     if (major >= NDEV)
@@ -52,26 +58,36 @@ file_inode::read(char *addr, size_t n)
     if (devsw[major].read) {
       return devsw[major].read(ip->as_dev(), addr, n);
     } else if (devsw[major].pread) {
-      l = off_lock.guard();
-      r = devsw[major].pread(ip->as_dev(), addr, off, n);
+      auto l = off_lock.guard();
+      u64 cur = off.load(std::memory_order_relaxed);
+      ssize_t r = devsw[major].pread(ip->as_dev(), addr, cur, n);
+      if (r > 0)
+        off.store(cur + r, std::memory_order_relaxed);
+      return r;
     } else {
       return -1;
     }
   } else if (ip->type() != mnode::types::file) {
     return -1;
-  } else {
-    mfile::page_state ps = ip->as_file()->get_page(off / PGSIZE);
-    if (!ps.get_page_info())
-      return 0;
+  }
 
-    if (ps.is_partial_page() && off >= *ip->as_file()->read_size())
+  // Reserve [cur, cur + want), clamped to the end of the file so that
+  // readers at EOF don't push the offset past it.
+  u64 cur = off.load(std::memory_order_relaxed), want;
+  do {
+    u64 size = *ip->as_file()->read_size();
+    if (cur >= size)
       return 0;
+    want = MIN(n, size - cur);
+  } while (!off.compare_exchange_weak(cur, cur + want));
 
-    l = off_lock.guard();
-    r = readi(ip, addr, off, n);
+  ssize_t r = readi(ip, addr, cur, want);
+  if (r != (ssize_t)want) {
+    // Give back the part of the range we didn't read, as write does.
+    // If another reader has already reserved past us, we can't.
+    u64 expected = cur + want;
+    off.compare_exchange_strong(expected, r > 0 ? cur + r : cur);
   }
-  if (r > 0)
-    off += r;
   return r;
 }
 
@@ -81,8 +97,6 @@ file_inode::write(const char *addr, size_t n)
   if (!writable)
     return -1;
 
-  lock_guard<sleeplock> l;
-  ssize_t r;
   if (ip->type() == mnode::types::dev) {
     u16 major = ip->as_dev()->major();
     if (major >= NDEV)
@@ -90,26 +104,36 @@ file_inode::write(const char *addr, size_t n)
     if (devsw[major].write) {
       return devsw[major].write(ip->as_dev(), addr, n);
     } else if (devsw[major].pwrite) {
-      l = off_lock.guard();
-      r = devsw[major].pwrite(ip->as_dev(), addr, off, n);
+      auto l = off_lock.guard();
+      u64 cur = off.load(std::memory_order_relaxed);
+      ssize_t r = devsw[major].pwrite(ip->as_dev(), addr, cur, n);
+      if (r > 0)
+        off.store(cur + r, std::memory_order_relaxed);
+      return r;
     } else {
       return -1;
     }
-  } else if (ip->type() == mnode::types::file) {
-    l = off_lock.guard();
-    mfile::resizer resize;
-    if (append) {
-      resize = ip->as_file()->write_size();
-      off = resize.read_size();
-    }
-
-    r = writei(ip, addr, off, n, append ? &resize : nullptr);
-  } else {
+  } else if (ip->type() != mnode::types::file) {
     return -1;
   }
 
-  if (r > 0)
-    off += r;
+  if (append) {
+    mfile::resizer resize = ip->as_file()->write_size();
+    u64 start = resize.read_size();
+    ssize_t r = writei(ip, addr, start, n, &resize);
+    off.store(r > 0 ? start + r : start, std::memory_order_relaxed);
+    return r;
+  }
+
+  u64 start = off.fetch_add(n);
+  ssize_t r = writei(ip, addr, start, n, nullptr);
+  if ((size_t)r != n) {
+    // Give back the part of the range we didn't write.  If another
+    // writer has already reserved past us, we can't, and the file will
+    // have a hole (which writei fills with zeroes).
+    u64 expected = start + n;
+    off.compare_exchange_strong(expected, r > 0 ? start + r : start);
+  }
   return r;
 }
 
@@ -141,6 +165,340 @@ file_inode::pwrite(const char *addr, size_t n, off_t off)
   return writei(ip, addr, off, n);
 }
 
+// Vectored I/O
+
+namespace {
+  // Data gathered from user buffers into separately allocated pages,
+  // so it can be written while holding locks that don't permit page
+  // faults without needing one large contiguous buffer.  Each gather
+  // replaces the data with the next chunk of the iovec array, reusing
+  // the pages.
+  class iov_pages
+  {
+    enum { MAX_PAGES = 16 };
+    char *pages_[MAX_PAGES];
+    int npages_;                // Pages allocated
+    size_t len_;                // Bytes gathered
+    // Next byte of the iovec array to gather
+    const struct iovec *iov_;
+    int iovcnt_;
+    int seg_;
+    size_t segoff_;
+    bool failed_;
+
+  public:
+    iov_pages(const struct iovec *iov, int iovcnt)
+      : npages_(0), len_(0), iov_(iov), iovcnt_(iovcnt), seg_(0),
+        segoff_(0), failed_(false) { }
+    iov_pages(const iov_pages &) = delete;
+    iov_pages &operator=(const iov_pages &) = delete;
+
+    ~iov_pages()
+    {
+      for (int i = 0; i < npages_; i++)
+        kfree(pages_[i]);
+    }
+
+    // Replace the gathered data with up to max more bytes (at most
+    // MAX_PAGES pages) from the iovec array.  Returns the number of
+    // bytes gathered.  This is short if a user buffer is invalid or
+    // we're out of memory, in which case failed() becomes true, and
+    // -1 if that happened before gathering anything.
+    ssize_t gather(size_t max)
+    {
+      len_ = 0;
+      max = MIN(max, (size_t)MAX_PAGES * PGSIZE);
+      for (; seg_ < iovcnt_ && len_ < max; seg_++, segoff_ = 0) {
+        while (segoff_ < iov_[seg_].iov_len && len_ < max) {
+          size_t pgoff = len_ % PGSIZE;
+          int pg = len_ / PGSIZE;
+          if (pg == npages_) {
+            if (!(pages_[pg] = kalloc("iov_pages"))) {
+              failed_ = true;
+              return len_ ?: -1;
+            }
+            npages_++;
+          }
+          size_t n = MIN(iov_[seg_].iov_len - segoff_,
+                         MIN(PGSIZE - pgoff, max - len_));
+          if (fetchmem(pages_[pg] + pgoff,
+                       (char*)iov_[seg_].iov_base + segoff_, n) < 0) {
+            failed_ = true;
+            return len_ ?: -1;
+          }
+          segoff_ += n;
+          len_ += n;
+        }
+        if (segoff_ < iov_[seg_].iov_len)
+          break;
+      }
+      return len_;
+    }
+
+    bool failed() const
+    {
+      return failed_;
+    }
+
+    // Call fn(buf, len, pos) for each page of the gathered data, where
+    // pos is the offset of buf in the gathered data.  Returns the total
+    // of fn's results, stopping after any short or failed call.
+    template<class Fn>
+    ssize_t for_each(Fn fn) const
+    {
+      ssize_t total = 0;
+      for (int i = 0; i * PGSIZE < len_; i++) {
+        size_t len = MIN(len_ - i * PGSIZE, (size_t)PGSIZE);
+        ssize_t r = fn(pages_[i], len, i * PGSIZE);
+        if (r < 0)
+          return total ?: r;
+        total += r;
+        if ((size_t)r != len)
+          break;
+      }
+      return total;
+    }
+  };
+
+  // Write up to max bytes from iov a chunk of iov_pages at a time by
+  // calling chunk_fn(data, pos) for each chunk, where pos is the
+  // offset of the chunk in the iovec array.  chunk_fn returns the
+  // number of bytes of the chunk it wrote.  Returns the number of
+  // bytes written, stopping at the first short or failed write or bad
+  // user buffer, or -1 if that happened before writing anything.
+  // The chunk is gathered before calling chunk_fn, so chunk_fn may
+  // hold locks that don't permit page faults.
+  template<class Fn>
+  ssize_t
+  iov_write_chunks(const struct iovec *iov, int iovcnt, size_t max,
+                   Fn chunk_fn)
+  {
+    iov_pages data(iov, iovcnt);
+    size_t total = 0;
+    while (total < max) {
+      ssize_t g = data.gather(max - total);
+      if (g <= 0)
+        return total ?: g;
+      ssize_t r = chunk_fn(data, total);
+      if (r < 0)
+        return total ?: r;
+      total += r;
+      if (r != g || data.failed())
+        break;
+    }
+    return total;
+  }
+
+  // Like iov_write_chunks, but call fn(buf, len, pos) for each page,
+  // where pos is the offset of buf in the iovec array.
+  template<class Fn>
+  ssize_t
+  iov_write(const struct iovec *iov, int iovcnt, size_t max, Fn fn)
+  {
+    return iov_write_chunks(
+      iov, iovcnt, max, [&](const iov_pages &data, size_t total) {
+        return data.for_each([&](const char *b, size_t len, size_t pos) {
+            return fn(b, len, total + pos);
+          });
+      });
+  }
+
+  size_t
+  iov_total(const struct iovec *iov, int iovcnt)
+  {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+      total += iov[i].iov_len;
+    return total;
+  }
+
+  // Copy len bytes of buf to the user buffers in iov, starting pos
+  // bytes into the iovec array.
+  bool
+  iov_scatter(const struct iovec *iov, int iovcnt, size_t pos,
+              const char *buf, size_t len)
+  {
+    for (int seg = 0; seg < iovcnt && len; seg++) {
+      if (pos >= iov[seg].iov_len) {
+        pos -= iov[seg].iov_len;
+        continue;
+      }
+      size_t n = MIN(len, iov[seg].iov_len - pos);
+      if (putmem((char*)iov[seg].iov_base + pos, buf, n) < 0)
+        return false;
+      pos = 0;
+      buf += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  // Read into iov a page at a time with read_fn(buf, n, pos), where
+  // pos is the offset of buf in the iovec array, scattering each page
+  // before reading the next.  Stops at the first short or failed read
+  // or bad user buffer.
+  template<class Fn>
+  ssize_t
+  readv_pages(const struct iovec *iov, int iovcnt, Fn read_fn)
+  {
+    char *b = kalloc("readvbuf");
+    if (!b)
+      return -1;
+    auto cleanup = scoped_cleanup([b](){kfree(b);});
+    size_t max = iov_total(iov, iovcnt);
+    size_t total = 0;
+    while (total < max) {
+      size_t n = MIN(max - total, (size_t)PGSIZE);
+      ssize_t r = read_fn(b, n, total);
+      if (r < 0)
+        return total ?: r;
+      if (!iov_scatter(iov, iovcnt, total, b, r))
+        return total ?: -1;
+      total += r;
+      if ((size_t)r != n)
+        break;
+    }
+    return total;
+  }
+}
+
+ssize_t
+file::readv(const struct iovec *iov, int iovcnt)
+{
+  return readv_pages(iov, iovcnt, [this](char *b, size_t n, size_t) {
+      return read(b, n);
+    });
+}
+
+ssize_t
+file::writev(const struct iovec *iov, int iovcnt)
+{
+  return iov_write(iov, iovcnt, iov_total(iov, iovcnt),
+                   [this](const char *b, size_t n, size_t) {
+                     return write(b, n);
+                   });
+}
+
+ssize_t
+file::preadv(const struct iovec *iov, int iovcnt, off_t off)
+{
+  return readv_pages(iov, iovcnt, [this, off](char *b, size_t n, size_t pos) {
+      return pread(b, n, off + pos);
+    });
+}
+
+ssize_t
+file::pwritev(const struct iovec *iov, int iovcnt, off_t off)
+{
+  return iov_write(iov, iovcnt, iov_total(iov, iovcnt),
+                   [this, off](const char *b, size_t n, size_t pos) {
+                     return pwrite(b, n, off + pos);
+                   });
+}
+
+// For regular files, vectored reads copy directly from file pages to
+// the user's buffers and vectored writes gather into a few pages
+// before touching the file.  Like read and write, each call other
+// than an append reserves its whole byte range of the offset at once,
+// so it is atomic with respect to other I/O on the same file
+// descriptor.
+
+ssize_t
+file_inode::readv(const struct iovec *iov, int iovcnt)
+{
+  if (ip->type() != mnode::types::file)
+    return file::readv(iov, iovcnt);
+  if (!readable)
+    return -1;
+
+  size_t n = iov_total(iov, iovcnt);
+  u64 cur = off.load(std::memory_order_relaxed), want;
+  do {
+    u64 size = *ip->as_file()->read_size();
+    if (cur >= size || n == 0)
+      return 0;
+    want = MIN(n, size - cur);
+  } while (!off.compare_exchange_weak(cur, cur + want));
+
+  ssize_t r = readiv(ip, iov, iovcnt, cur, want);
+  if ((size_t)r != want) {
+    // A bad user buffer.  Give back what we didn't read if we can.
+    u64 expected = cur + want;
+    off.compare_exchange_strong(expected, r > 0 ? cur + r : cur);
+  }
+  return r;
+}
+
+ssize_t
+file_inode::writev(const struct iovec *iov, int iovcnt)
+{
+  if (ip->type() != mnode::types::file)
+    return file::writev(iov, iovcnt);
+  if (!writable)
+    return -1;
+
+  size_t n = iov_total(iov, iovcnt);
+  if (n == 0)
+    return 0;
+
+  // Appends take the size lock for each gathered chunk.  The lock
+  // disables interrupts, so it can't be held while copying from user
+  // memory, which makes appends larger than a chunk atomic only a
+  // chunk at a time.
+  if (append) {
+    return iov_write_chunks(
+      iov, iovcnt, n, [&](const iov_pages &data, size_t) {
+        mfile::resizer resize = ip->as_file()->write_size();
+        u64 start = resize.read_size();
+        ssize_t r = data.for_each([&](const char *b, size_t len, size_t pos) {
+            return writei(ip, b, start + pos, len, &resize);
+          });
+        off.store(r > 0 ? start + r : start, std::memory_order_relaxed);
+        return r;
+      });
+  }
+
+  // Hold the offset reservation across all of the chunks so the whole
+  // write is atomic with respect to other I/O on this file descriptor.
+  u64 start = off.fetch_add(n);
+  ssize_t r = iov_write(iov, iovcnt, n,
+                        [&](const char *b, size_t len, size_t pos) {
+                          return writei(ip, b, start + pos, len);
+                        });
+  if ((size_t)r != n) {
+    u64 expected = start + n;
+    off.compare_exchange_strong(expected, r > 0 ? start + r : start);
+  }
+  return r;
+}
+
+ssize_t
+file_inode::preadv(const struct iovec *iov, int iovcnt, off_t off)
+{
+  if (ip->type() != mnode::types::file)
+    return file::preadv(iov, iovcnt, off);
+  if (!readable)
+    return -1;
+  size_t n = iov_total(iov, iovcnt);
+  if (n == 0)
+    return 0;
+  return readiv(ip, iov, iovcnt, off, n);
+}
+
+ssize_t
+file_inode::pwritev(const struct iovec *iov, int iovcnt, off_t off)
+{
+  if (ip->type() != mnode::types::file)
+    return file::pwritev(iov, iovcnt, off);
+  if (!writable)
+    return -1;
+
+  return iov_write(iov, iovcnt, iov_total(iov, iovcnt),
+                   [&](const char *b, size_t len, size_t pos) {
+                     return writei(ip, b, off + pos, len);
+                   });
+}
+
 
 int
 file_pipe_reader::stat(struct stat *st, enum stat_flags flags)
@@ -190,3 +548,35 @@ file_pipe_writer::onzero(void)
   pipeclose(pipe, true);
   delete this;
 }
+
+ssize_t
+file_exitfd::read(char *addr, size_t n)
+{
+  if (n < sizeof(int))
+    return -1;
+  int pid = wait_ready(nonblock);
+  if (pid <= 0)
+    return pid;
+  memcpy(addr, &pid, sizeof pid);
+  return sizeof pid;
+}
+
+ssize_t
+file_signalfd::read(char *addr, size_t n)
+{
+  if (n < sizeof(int))
+    return -1;
+  u64 sigs = signal_wait(mask, nonblock);
+  if (!sigs)
+    return -1;
+  size_t count = 0;
+  for (; sigs && count + sizeof(int) <= n; sigs &= sigs - 1) {
+    int signo = __builtin_ctzll(sigs);
+    memcpy(addr + count, &signo, sizeof signo);
+    count += sizeof signo;
+  }
+  // Leave the ones that didn't fit for the next read
+  if (sigs)
+    myproc()->sig_pending.fetch_or(sigs);
+  return count;
+}
@@ -0,0 +1,267 @@
+#include "types.h"
+#include "kernel.hh"
+#include "filetable.hh"
+
+filetable::chunk::chunk() : used(0)
+{
+  fdinfo none(nullptr, false);
+  for (int i = 0; i < CHUNK_FDS; i++) {
+    info[i].store(none, std::memory_order_relaxed);
+    cloexec[i].store(true, std::memory_order_relaxed);
+  }
+}
+
+filetable::filetable()
+{
+  for (int cpu = 0; cpu < NCPU; cpu++) {
+    first_[cpu].store(nullptr, std::memory_order_relaxed);
+    rest_[cpu].store(nullptr, std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+filetable::~filetable()
+{
+  // Close all FDs
+  for (int cpu = 0; cpu < NCPU; cpu++) {
+    std::atomic<chunk*> *rest = rest_[cpu].load();
+    for (int ci = 0; ci < (rest ? NCHUNKS : 1); ci++) {
+      chunk *c = get_chunk(cpu, ci);
+      if (!c)
+        continue;
+      for (int i = 0; i < CHUNK_FDS; i++) {
+        fdinfo info = c->info[i].load();
+        if (info.get_file()) {
+          info.get_file()->pre_close();
+          info.get_file()->dec();
+        }
+      }
+      delete c;
+    }
+    if (rest)
+      kmfree(rest, NCHUNKS * sizeof *rest);
+  }
+}
+
+filetable::chunk *
+filetable::create_chunk(int cpu, int ci)
+{
+  chunk *c = get_chunk(cpu, ci);
+  if (c)
+    return c;
+
+  std::atomic<chunk*> *slot;
+  if (ci == 0) {
+    slot = &first_[cpu];
+  } else {
+    std::atomic<chunk*> *rest = rest_[cpu].load(std::memory_order_acquire);
+    if (!rest) {
+      rest = (std::atomic<chunk*>*)kmalloc(NCHUNKS * sizeof *rest,
+                                           "filetable::rest");
+      if (!rest)
+        return nullptr;
+      for (int i = 0; i < NCHUNKS; i++)
+        rest[i].store(nullptr, std::memory_order_relaxed);
+      std::atomic<chunk*> *expected = nullptr;
+      if (!rest_[cpu].compare_exchange_strong(expected, rest)) {
+        kmfree(rest, NCHUNKS * sizeof *rest);
+        rest = expected;
+      }
+    }
+    slot = &rest[ci];
+  }
+
+  c = new (std::nothrow) chunk();
+  if (!c)
+    return nullptr;
+  chunk *expected = nullptr;
+  if (!slot->compare_exchange_strong(expected, c)) {
+    // Somebody beat us to it
+    delete c;
+    c = expected;
+  }
+  return c;
+}
+
+sref<filetable>
+filetable::copy(bool close_cloexec)
+{
+  sref<filetable> t = sref<filetable>::transfer(new filetable());
+
+  for (int cpu = 0; cpu < NCPU; cpu++) {
+    int nchunks = rest_[cpu].load() ? NCHUNKS : 1;
+    for (int ci = 0; ci < nchunks; ci++) {
+      chunk *c = get_chunk(cpu, ci);
+      if (!c || c->used.load(std::memory_order_relaxed) == 0)
+        continue;
+      chunk *nc = nullptr;
+      for (int i = 0; i < CHUNK_FDS; i++) {
+        // Avoid reading info altogether if we're closing cloexec FDs
+        // and this is a cloexec FD.
+        if (close_cloexec && c->cloexec[i])
+          continue;
+        // XXX Relaxed load?
+        fdinfo info = c->info[i].load();
+        file *f = info.get_file();
+        if (!f || (close_cloexec && info.get_cloexec()))
+          continue;
+
+        if (!nc && !(nc = t->create_chunk(cpu, ci)))
+          throw_bad_alloc();
+        // XXX f's refcount could have dropped to zero between the
+        // load and here
+        file* newf = f->dup();
+        fdinfo newinfo(newf, info.get_cloexec());
+        nc->info[i].store(newinfo, std::memory_order_relaxed);
+        nc->cloexec[i].store(info.get_cloexec(), std::memory_order_relaxed);
+        nc->used.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  return t;
+}
+
+int
+filetable::allocfd(sref<file>&& f, bool percpu, bool cloexec)
+{
+  int cpu = percpu ? myid() : 0;
+  fdinfo none(nullptr, false);
+  // Transfer f to manual reference counting since we can't store
+  // sref's in the info table.
+  file *fptr = f->dup();
+  fdinfo newinfo(fptr, cloexec, true);
+  // Chunks are allocated in order, so this finds the lowest free FD
+  // and only grows the table when all of its chunks are full.
+  for (int ci = 0; ci < NCHUNKS; ci++) {
+    chunk *c = create_chunk(cpu, ci);
+    if (!c)
+      break;
+    if (c->used.load(std::memory_order_relaxed) == CHUNK_FDS)
+      continue;
+    for (int i = 0; i < CHUNK_FDS; i++) {
+      // Note that we skip over locked FDs because that means they're
+      // either non-null or about to be.
+      if (c->info[i].load(std::memory_order_relaxed) == none &&
+          cmpxch(&c->info[i], none, newinfo)) {
+        c->used.fetch_add(1, std::memory_order_relaxed);
+        // The default state of cloexec is 'true', so we only need to
+        // write to it if this is a keep-exec FD.
+        if (!cloexec)
+          c->cloexec[i] = cloexec;
+        // Unlock FD
+        c->info[i].store(newinfo.with_locked(false),
+                         std::memory_order_release);
+        return (cpu << cpushift) | (ci * CHUNK_FDS + i);
+      }
+    }
+  }
+  cprintf("filetable::allocfd: failed\n");
+  // The "dup" call told f that we're binding it to a FD.  That
+  // ultimately failed, but we have to tell it that we're "closing"
+  // the FD now.
+  fptr->pre_close();
+  fptr->dec();
+  return -1;
+}
+
+void
+filetable::close(int fd)
+{
+  // XXX(sbw) if f->ref_ > 1 the kernel will not actually close
+  // the file when this function returns (i.e. sys_close can return
+  // while the file/pipe/socket is still open).
+  int cpu = fd >> cpushift;
+  fd = fd & fdmask;
+
+  if (cpu < 0 || cpu >= NCPU) {
+    cprintf("filetable::close: bad fd cpu %u\n", cpu);
+    return;
+  }
+
+  chunk *c = get_chunk(cpu, fd / CHUNK_FDS);
+  if (!c) {
+    cprintf("filetable::close: bad fd %u\n", fd);
+    return;
+  }
+  int i = fd % CHUNK_FDS;
+
+  // Lock the FD to prevent concurrent modifications
+  std::atomic<fdinfo> *infop = &c->info[i];
+  fdinfo info = lock_fdinfo(infop);
+
+  // Clear cloexec back to default state of 'true'
+  if (!c->cloexec[i])
+    c->cloexec[i] = true;
+
+  // Update and unlock the FD
+  fdinfo newinfo(nullptr, false);
+  infop->store(newinfo, std::memory_order_release);
+
+  // Close old file
+  if (info.get_file()) {
+    c->used.fetch_sub(1, std::memory_order_relaxed);
+    info.get_file()->pre_close();
+    info.get_file()->dec();
+  } else {
+    cprintf("filetable::close: bad fd %u\n", fd);
+  }
+}
+
+bool
+filetable::replace(int fd, sref<file>&& newf, bool cloexec)
+{
+  assert(newf);
+
+  int cpu = fd >> cpushift;
+  fd = fd & fdmask;
+
+  if (cpu < 0 || cpu >= NCPU) {
+    cprintf("filetable::replace: bad fd cpu %u\n", cpu);
+    return false;
+  }
+
+  chunk *c = create_chunk(cpu, fd / CHUNK_FDS);
+  if (!c)
+    return false;
+  int i = fd % CHUNK_FDS;
+
+  // Lock the FD to prevent concurrent modifications
+  std::atomic<fdinfo> *infop = &c->info[i];
+  fdinfo oldinfo = lock_fdinfo(infop);
+
+  // Update to new info and unlock.  It's safe to update cloexec
+  // non-atomically with info even with concurrent lock-free readers
+  // because any that care will double-check the fdinfo bit.
+  file *newfptr = newf->dup();
+  fdinfo newinfo(newfptr, cloexec);
+  if (cloexec != c->cloexec[i])
+    c->cloexec[i] = cloexec;
+  if (!oldinfo.get_file())
+    c->used.fetch_add(1, std::memory_order_relaxed);
+  infop->store(newinfo, std::memory_order_release);
+
+  // Close the old FD
+  if (oldinfo.get_file() && oldinfo.get_file() != newfptr) {
+    oldinfo.get_file()->pre_close();
+    oldinfo.get_file()->dec();
+  }
+  return true;
+}
+
+filetable::fdinfo
+filetable::lock_fdinfo(std::atomic<fdinfo> *infop)
+{
+  fdinfo info;
+  while (true) {
+    info = infop->load(std::memory_order_relaxed);
+  retry:
+    if (info.get_locked())
+      nop_pause();
+    else
+      break;
+  }
+  if (!infop->compare_exchange_weak(info, info.with_locked(true)))
+    goto retry;
+  return info;
+}
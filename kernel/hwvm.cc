@@ -33,6 +33,33 @@ static const char *levelnames[] = {
   "PT", "PD", "PDP", "PML4"
 };
 
+// Page table pages being freed, which we return to the buddy
+// allocators in sorted batches.  Tearing down an address space frees
+// many of these at once, so this saves a lot of allocator locking.
+class pgmap_free_batch
+{
+  enum { MAX = 64 };
+  void *pages_[MAX];
+  size_t n_;
+
+public:
+  pgmap_free_batch() : n_(0) { }
+  ~pgmap_free_batch() { flush(); }
+
+  void add(void *page)
+  {
+    if (n_ == MAX)
+      flush();
+    pages_[n_++] = page;
+  }
+
+  void flush()
+  {
+    kfree_batch(pages_, n_);
+    n_ = 0;
+  }
+};
+
 // One level in an x86-64 page table, typically the top level.  Many
 // of the methods of pgmap assume they are being invoked on a
 // top-level PML4.
@@ -57,18 +84,19 @@ struct pgmap {
 private:
   std::atomic<pme_t> e[PGSIZE / sizeof(pme_t)];
 
-  void free(int level, int end = 512, bool release = true)
+  void free(int level, pgmap_free_batch *batch, int end = 512,
+            bool release = true)
   {
     if (level != 0) {
       for (int i = 0; i < end; i++) {
         pme_t entry = e[i].load(memory_order_relaxed);
-        if (entry & PTE_P)
-          ((pgmap*) p2v(PTE_ADDR(entry)))->free(level - 1);
+        if (entry & (PTE_P | PTE_HIDDEN))
+          ((pgmap*) p2v(PTE_ADDR(entry)))->free(level - 1, batch);
       }
     }
 
     if (release)
-      kfree(this);
+      batch->add(this);
   }
 
   u64 internal_pages(int level, int end = 512) const
@@ -78,7 +106,7 @@ private:
     if (level != 0) {
       for (int i = 0; i < end; i++) {
         pme_t entry = e[i].load(memory_order_relaxed);
-        if (entry & PTE_P)
+        if (entry & (PTE_P | PTE_HIDDEN))
           count += ((pgmap*) p2v(PTE_ADDR(entry)))->internal_pages(level - 1);
       }
     }
@@ -102,7 +130,8 @@ public:
   {
     // Don't free kernel portion of the pml4 and don't kfree this
     // page, since operator delete will do that.
-    free(L_PML4, PX(L_PML4, KGLOBAL), false);
+    pgmap_free_batch batch;
+    free(L_PML4, &batch, PX(L_PML4, KGLOBAL), false);
   }
 
   // Delete'ing a ::pgmap also frees all sub-pgmaps (except those
@@ -118,7 +147,7 @@ public:
   // this pgmap.
   pgmap *kclone() const
   {
-    pgmap *pml4 = (pgmap*)kalloc("PML4");
+    pgmap *pml4 = (pgmap*)kalloc("PML4", PGSIZE, KALLOC_PGTABLE);
     if (!pml4)
       throw_bad_alloc();
     size_t k = PX(L_PML4, KGLOBAL);
@@ -131,7 +160,8 @@ public:
   // and populates the quasi user-visible part.
   pgmap_pair kclone_pair() const
   {
-    pgmap *pml4 = (pgmap*)kalloc("PML4-pair", PGSIZE * 2);
+    pgmap *pml4 = (pgmap*)kalloc("PML4-pair", PGSIZE * 2,
+                                 KALLOC_PGTABLE);
     if (!pml4)
       throw_bad_alloc();
 
@@ -173,6 +203,45 @@ public:
     return internal_pages(L_PML4, PX(L_PML4, KGLOBAL));
   }
 
+  // Hide every present PML4 entry that maps user space by clearing
+  // its present bit and setting PTE_HIDDEN, which unmaps all of user
+  // space in one step (fork uses this to start copy-on-write).  A
+  // hidden entry keeps its page table, so lookups and frees still
+  // find it, and the next insert under it reveals it again (see
+  // iterator::resolve).  Since every access to a hidden page faults,
+  // kernel writes through uaccess reach the copy-on-write path just
+  // like user writes.
+  void hide_user()
+  {
+    for (size_t i = 0; i < PX(L_PML4, USERTOP); i++) {
+      pme_t entry = e[i].load(memory_order_relaxed);
+      while ((entry & PTE_P) &&
+             !e[i].compare_exchange_weak(
+               entry, (entry & ~(pme_t)PTE_P) | PTE_HIDDEN,
+               memory_order_relaxed))
+        ;
+    }
+  }
+
+  // Hide every present entry of this level-level page structure, or
+  // drop them if this is a page table, so they fault back in one at a
+  // time.  resolve uses this to push hiding down a level before it
+  // reveals the entry pointing here.  Nothing below a hidden entry is
+  // in any TLB, so this needs no TLB flush.
+  void hide_entries(int level)
+  {
+    for (auto &c : e) {
+      pme_t entry = c.load(memory_order_relaxed);
+      if (!(entry & PTE_P))
+        continue;
+      if (level == L_PT)
+        c.compare_exchange_strong(entry, 0, memory_order_relaxed);
+      else
+        c.compare_exchange_strong(entry, (entry & ~(pme_t)PTE_P) | PTE_HIDDEN,
+                                  memory_order_relaxed);
+    }
+  }
+
   // An iterator that references the page structure entry on a fixed
   // level of the page structure tree for some virtual address.
   // Moving the iterator changes the virtual address, but not the
@@ -216,13 +285,27 @@ public:
       retry:
         if (entry & PTE_P) {
           cur = (pgmap*) p2v(PTE_ADDR(entry));
+        } else if (entry & PTE_HIDDEN) {
+          // The table under a hidden entry is intact, so a lookup
+          // can use it as is.  Before mapping anything under it,
+          // hide what it maps one level down and reveal it, so that
+          // only what is mapped from now on becomes visible.
+          pgmap *next = (pgmap*) p2v(PTE_ADDR(entry));
+          if (create) {
+            next->hide_entries(reached - 1);
+            if (!atomic_compare_exchange_weak(
+                  entryp, &entry, (entry & ~(pme_t)PTE_HIDDEN) | PTE_P))
+              goto retry;
+          }
+          cur = next;
         } else if (!create) {
           cur = nullptr;
           break;
         } else {
           // XXX(Austin) Could use zalloc except during really early
           // boot (really, zalloc shouldn't crash during early boot).
-          pgmap *next = (pgmap*) kalloc(levelnames[reached - 1]);
+          pgmap *next = (pgmap*) kalloc(levelnames[reached - 1], PGSIZE,
+                                        KALLOC_PGTABLE);
           if (!next)
             throw_bad_alloc();
           memset(next, 0, sizeof *next);
@@ -448,6 +531,9 @@ switchvm(struct proc *p)
   mycpu()->ts.iomba = (u16)__offsetof(struct taskstate, iopb);
   ltr(TSSSEG);
 
+  // The address space we're leaving may go away once we're off it.
+  vmap::flush_rss();
+
   if (*cur_page_map_cache)
     (*cur_page_map_cache)->switch_from();
 
@@ -491,6 +577,15 @@ inittls(struct cpu *c)
 // vmalloc_free.
 void *
 vmalloc_raw(size_t bytes, size_t guard, const char *name)
+{
+  void *res = vmalloc_raw_nothrow(bytes, guard, name);
+  if (!res)
+    throw_bad_alloc();
+  return res;
+}
+
+void *
+vmalloc_raw_nothrow(size_t bytes, size_t guard, const char *name)
 {
   if (kvmallocpos == 0)
     panic("vmalloc called before initpg");
@@ -510,8 +605,13 @@ vmalloc_raw(size_t bytes, size_t guard, const char *name)
 
   for (auto it = kpml4.find(base); it.index() < base + bytes; it += it.span()) {
     void *page = kalloc(name);
-    if (!page)
-      throw_bad_alloc();
+    if (!page) {
+      // Release what we've mapped so far.  vmalloc_free stops at
+      // the first unmapped page.
+      if (it.index() != base)
+        vmalloc_free((void*)base);
+      return nullptr;
+    }
     *it.create(0) = v2p(page) | PTE_P | PTE_W;
   }
   mtlabel(mtrace_label_heap, (void*)base, bytes, name, strlen(name));
@@ -657,6 +757,16 @@ namespace mmu_shared_page_table {
     pml4->find(va).create(PTE_U)->store(pte, memory_order_relaxed);
   }
 
+  void
+  page_map_cache::hide_user()
+  {
+    pml4->hide_user();
+    shootdown sd;
+    sd.set_cache_tracker(this);
+    sd.add_range(0, USERTOP);
+    sd.perform();
+  }
+
   void
   page_map_cache::__invalidate(
     uintptr_t start, uintptr_t len, shootdown *sd)
@@ -689,8 +799,8 @@ namespace mmu_per_core_page_table {
   page_map_cache::~page_map_cache()
   {
     for (size_t i = 0; i < ncpu; ++i) {
-      delete pml4s[i].user;
-      delete pml4s[i].kernel;
+      delete cores[i].pml4s.user;
+      delete cores[i].pml4s.kernel;
     }
   }
 
@@ -698,7 +808,7 @@ namespace mmu_per_core_page_table {
   page_map_cache::insert(uintptr_t va, page_tracker *t, pme_t pte)
   {
     scoped_cli cli;
-    pgmap_pair& mypml4s = *pml4s;
+    pgmap_pair& mypml4s = cores->pml4s;
     assert(mypml4s.user);
     assert(mypml4s.kernel);
     mypml4s.user->find(va).create(PTE_U & pte)->store(pte, memory_order_relaxed);
@@ -708,15 +818,85 @@ namespace mmu_per_core_page_table {
     t->tracker_cores.set(myid());
   }
 
+  void
+  page_map_cache::hide_user()
+  {
+    // Every core with page tables for this page_map_cache must hide
+    // user space in them.  Cores that aren't running it do so the
+    // next time they switch to it (see finish_lazy).
+    bitset<NCPU> targets;
+    for (int i = 0; i < ncpu; ++i) {
+      if (cores[i].pml4s.user) {
+        cores[i].hide_pending.store(true, memory_order_relaxed);
+        targets.set(i);
+      }
+    }
+
+    // As in shootdown::perform, order this before reading
+    // active_cores; see also switch_to.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bitset<NCPU> ipi_targets = active_cores;
+    ipi_targets &= targets;
+
+    {
+      scoped_cli cli;
+      if (ipi_targets[myid()]) {
+        finish_hide();
+        ipi_targets.reset(myid());
+      }
+    }
+
+    if (ipi_targets.none())
+      return;
+    kstats::inc(&kstats::tlb_shootdown_count);
+    kstats::inc(&kstats::tlb_shootdown_targets, ipi_targets.count());
+    kstats::timer timer(&kstats::tlb_shootdown_cycles);
+    run_on_cpus(ipi_targets, [this]() {
+        finish_hide();
+      });
+  }
+
+  void
+  page_map_cache::hide_local() const
+  {
+    pgmap_pair& mypml4s = cores->pml4s;
+    mypml4s.user->hide_user();
+    mypml4s.kernel->hide_user();
+  }
+
+  void
+  page_map_cache::finish_hide() const
+  {
+    // If this core has switched away, it will hide user space in its
+    // tables when it switches back.
+    if (reinterpret_cast<const page_map_cache*>(*cur_page_map_cache) != this)
+      return;
+    if (!cores->hide_pending.exchange(false, memory_order_acquire))
+      return;
+    hide_local();
+    lcr3(rcr3());
+    // That flushed the current PCID only.  The kernel entry and exit
+    // paths flush when they load the other table, but switch_to may
+    // not, so make it.
+    cores->lazy_pending.store(true, memory_order_release);
+  }
+
   void
   page_map_cache::switch_to(bool kernel, proc* p) const
   {
     cpuid_t id = myid();
-    auto &mypml4s = pml4s[id];
+    auto &mypml4s = cores[id].pml4s;
     if (!mypml4s.kernel) {
       mypml4s = kpml4.kclone_pair();
     }
 
+    // Once we're marked active, remote invalidations will IPI us, so
+    // anything they recorded before that must be cleared now.  This
+    // must happen before willneed inserts anything.
+    active_cores.atomic_set(id);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool lazy_flush = finish_lazy();
+
     p->vmap->willneed((uptr)p, PGSIZE);
     p->vmap->willneed((uptr)p->kstack, KSTACKSIZE);
 
@@ -728,7 +908,9 @@ namespace mmu_per_core_page_table {
     auto& pcid_history = mycpu()->pcid_history;
     for(int i = 0; i < PCID_HISTORY_SIZE; i++) {
       if(pcid_history[i] == mypml4s.user) {
-        flush_tlb = false;
+        // Our TLB may still hold lazily cleared entries under this
+        // PCID.
+        flush_tlb = lazy_flush;
         pcid = i;
         break;
       }
@@ -750,13 +932,57 @@ namespace mmu_per_core_page_table {
     mycpu()->has_secrets = kernel;
   }
 
+  void
+  page_map_cache::switch_from() const
+  {
+    active_cores.atomic_reset(myid());
+    // No need for a fence; worst case, we just get an extra IPI.
+  }
+
+  void
+  page_map_cache::clear_lazy(cpuid_t core, uintptr_t start, uintptr_t end)
+  {
+    core_state &c = cores[core];
+    uintptr_t cur = c.lazy_start.load(memory_order_relaxed);
+    while (start < cur &&
+           !c.lazy_start.compare_exchange_weak(cur, start,
+                                               memory_order_relaxed));
+    cur = c.lazy_end.load(memory_order_relaxed);
+    while (cur < end &&
+           !c.lazy_end.compare_exchange_weak(cur, end, memory_order_relaxed));
+    c.lazy_pending.store(true, memory_order_release);
+  }
+
+  bool
+  page_map_cache::finish_lazy() const
+  {
+    core_state &c = *cores;
+    bool flush = false;
+    if (c.hide_pending.load(memory_order_relaxed) &&
+        c.hide_pending.exchange(false, memory_order_acquire)) {
+      hide_local();
+      flush = true;
+    }
+    if (!c.lazy_pending.exchange(false, memory_order_acquire))
+      return flush;
+    // If a remote core extends the region concurrently with this, it
+    // will also see us in active_cores and IPI us, so it doesn't
+    // matter if we miss part of its update.
+    uintptr_t start = c.lazy_start.exchange(~(uintptr_t)0,
+                                            memory_order_relaxed);
+    uintptr_t end = c.lazy_end.exchange(0, memory_order_relaxed);
+    if (start < end)
+      clear(start, end);
+    return true;
+  }
+
   u64
   page_map_cache::internal_pages() const
   {
     u64 count = 0;
 
     for (int i = 0; i < ncpu; i++) {
-      pgmap_pair& pm = pml4s[i];
+      pgmap_pair& pm = cores[i].pml4s;
       if (!pm.kernel)
         continue;
       count += pm.kernel->internal_pages();
@@ -766,7 +992,7 @@ namespace mmu_per_core_page_table {
   }
 
   void
-  page_map_cache::clear(uintptr_t start, uintptr_t end)
+  page_map_cache::clear(uintptr_t start, uintptr_t end) const
   {
     // Are we the current page_map_cache on this core?  (Depending on
     // MMU_SCHEME, *cur_page_map_cache may not be this type of
@@ -774,12 +1000,12 @@ namespace mmu_per_core_page_table {
     // path.)
     bool current =
       (reinterpret_cast<const page_map_cache*>(*cur_page_map_cache) == this);
-    pgmap_pair& mypml4s = *pml4s;
-    // If we're clearing this CPU's page map cache, then we must have
-    // inserted something into it previously.  (Note that this may
-    // not hold if we start tracking shootdowns conservatively.)
-    assert(mypml4s.user);
-    assert(mypml4s.kernel);
+    pgmap_pair& mypml4s = cores->pml4s;
+    // A vmap that was copied by fork starts out with its parent's
+    // page trackers, so we may be asked to clear a CPU that never
+    // used this page_map_cache.  There's nothing to clear.
+    if (!mypml4s.user)
+      return;
     for (auto it = mypml4s.user->find(start); it.index() < end; it += it.span()) {
       if (it.is_set()) {
         it->store(0, memory_order_relaxed);
@@ -811,10 +1037,30 @@ namespace mmu_per_core_page_table {
     if (targets.none())
       return;
     assert(start < end && end <= USERTOP);
+
+    // Every target clears lazily the next time it switches to this
+    // page_map_cache, whether or not we IPI it.  This also covers a
+    // target that is switching away as we IPI it, since the IPI won't
+    // flush its TLB if the page_map_cache is no longer current.
+    for (auto cpu : targets)
+      cache->clear_lazy(cpu, start, end);
+
+    // Only cores that are running this page_map_cache right now may
+    // use the stale mappings before their next switch_to.  Order the
+    // clear_lazy updates before reading active_cores; see also
+    // switch_to.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bitset<NCPU> ipi_targets = cache->active_cores;
+    ipi_targets &= targets;
+
+    kstats::inc(&kstats::tlb_shootdown_lazy,
+                targets.count() - ipi_targets.count());
+    if (ipi_targets.none())
+      return;
     kstats::inc(&kstats::tlb_shootdown_count);
-    kstats::inc(&kstats::tlb_shootdown_targets, targets.count());
+    kstats::inc(&kstats::tlb_shootdown_targets, ipi_targets.count());
     kstats::timer timer(&kstats::tlb_shootdown_cycles);
-    run_on_cpus(targets, [this]() {
+    run_on_cpus(ipi_targets, [this]() {
         cache->clear(start, end);
       });
   }
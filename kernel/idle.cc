@@ -78,9 +78,8 @@ idleloop(void)
     sched();
     finishzombies();
     if (steal() == 0) {
-        // XXX(Austin) This will prevent us from immediately picking
-        // up work that's trying to push itself to this core (pinned
-        // thread).  Use an IPI to poke idle cores.
+        // addrun sends a T_RESCHED IPI to wake us if it queues a
+        // thread here.
         asm volatile("hlt");
     }
   }
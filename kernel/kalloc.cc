@@ -22,6 +22,12 @@
 #include "file.hh"
 #include "major.h"
 #include "heapprof.hh"
+#include "kmemcache.hh"
+#include "shrinker.hh"
+#include "ipi.hh"
+#include "bits.hh"
+#include "condvar.hh"
+#include "vm.hh"
 
 #include <algorithm>
 #include <iterator>
@@ -56,6 +62,12 @@ struct locked_buddy
 
 static static_vector<locked_buddy, MAX_BUDDIES> buddies;
 
+static_assert((int)KALLOC_KERNEL == buddy_allocator::MIGRATE_UNMOVABLE &&
+              (int)KALLOC_PGTABLE == buddy_allocator::MIGRATE_PGTABLE &&
+              (int)KALLOC_MOVABLE == buddy_allocator::MIGRATE_MOVABLE &&
+              (int)KALLOC_NTYPES == buddy_allocator::MIGRATE_ALLOC_TYPES,
+              "kalloc_type doesn't match buddy_allocator::migratetype");
+
 struct mempool : public balance_pool<mempool> {
   int buddy_;      // the buddy allocator this pool; it can contain any phys mem
   uintptr_t base_; // base this pool's local memory
@@ -101,11 +113,12 @@ struct mempool : public balance_pool<mempool> {
     return (void*)lim_;
   }
 
-  char *kalloc(size_t size)
+  char *kalloc(size_t size, kalloc_type type)
   {
     auto lb = &buddies[buddy_];
     auto l = lb->lock.guard();
-    void *res = lb->alloc.alloc_nothrow(size);
+    void *res = lb->alloc.alloc_nothrow(
+      size, (buddy_allocator::migratetype)type);
     return (char *) res;
   }
 
@@ -279,9 +292,10 @@ struct cpu_mem
   steal_order steal;
   int mempool;   // XXX cache align?
 
-  // Hot page cache of recently freed pages
-  void *hot_pages[KALLOC_HOT_PAGES];
-  size_t nhot;
+  // Hot page caches of recently freed pages, one for each
+  // kalloc_type
+  void *hot_pages[KALLOC_NTYPES][KALLOC_HOT_PAGES];
+  size_t nhot[KALLOC_NTYPES];
 };
 
 // Prefer mycpu()->mem for local access to this.  This is NOINIT since
@@ -290,6 +304,16 @@ DEFINE_PERCPU_NOINIT(struct cpu_mem, cpu_mem);
 
 static_vector<numa_node, MAX_NUMA_NODES> numa_nodes;
 
+// The buddy allocators of each NUMA node and the node's total free
+// memory at boot
+struct node_range
+{
+  size_t low, high;
+  size_t total;
+};
+
+static node_range node_ranges[MAX_NUMA_NODES];
+
 void *percpu_offsets[NCPU];
 
 static int kinited __mpalign__;
@@ -314,7 +338,7 @@ struct memory {
     mempools.emplace_back(m);
   }
 
-  char* kalloc(const char *name, size_t size)
+  char* kalloc(const char *name, size_t size, kalloc_type type)
   {
     if (!kinited)
       return (char*)early_kalloc(size, size);
@@ -322,15 +346,15 @@ struct memory {
     auto mem = mycpu()->mem;
     if (size == PGSIZE) {
       // allocate from page cache, if possible
-      if (mem->nhot > 0) {
-        res = mem->hot_pages[--mem->nhot];
+      if (mem->nhot[type] > 0) {
+        res = mem->hot_pages[type][--mem->nhot[type]];
       }
     }
     if (!res) {
-      res = mempools[mem->mempool].kalloc(size);
+      res = mempools[mem->mempool].kalloc(size, type);
       if (!res) {
         b_.balance();
-        res = mempools[mem->mempool].kalloc(size);
+        res = mempools[mem->mempool].kalloc(size, type);
       }
     }
     if (res) {
@@ -394,26 +418,28 @@ struct memory {
 
     if (size == PGSIZE) {
       // Free to the hot list
+      kalloc_type type = kalloc_type_of(v);
       scoped_cli cli;
       auto mem = mycpu()->mem;
-      if (mem->nhot == KALLOC_HOT_PAGES) {
+      void **hot = mem->hot_pages[type];
+      if (mem->nhot[type] == KALLOC_HOT_PAGES) {
         // There's no more room in the hot pages list, so free half of
         // it.  We sort the list so we can merge it with the buddy
         // allocator list.
         kstats::inc(&kstats::kalloc_hot_list_flush_count);
-        std::sort(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2));
+        std::sort(hot, hot + (KALLOC_HOT_PAGES / 2));
         // XXX make kfree_batch_pool to batch moving hot pages
         for (size_t i = 0; i < KALLOC_HOT_PAGES / 2; ++i) {
-          void *ptr = mem->hot_pages[i];
+          void *ptr = hot[i];
           kfree_pool(ptr, size);
         }
         // Shift hot page list down
         // XXX(Austin) Could use two lists and switch off
-        mem->nhot = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
-        memmove(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2),
-                mem->nhot * sizeof *mem->hot_pages);
+        mem->nhot[type] = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
+        memmove(hot, hot + (KALLOC_HOT_PAGES / 2),
+                mem->nhot[type] * sizeof *hot);
       }
-      mem->hot_pages[mem->nhot++] = v;
+      hot[mem->nhot[type]++] = v;
       kstats::inc(&kstats::kalloc_page_free_count);
       return;
     }
@@ -636,6 +662,51 @@ early_kalloc(size_t size, size_t align)
   return (char*)p2v(pa);
 }
 
+// Print free blocks by order and migratetype across all buddies.
+// The unusable index of an order is the fraction of free memory in
+// blocks too small to satisfy an allocation of that order.
+static void
+kmemprint_fragmentation(print_stream *s)
+{
+  typedef buddy_allocator ba;
+  static const char *type_names[ba::MIGRATE_TYPES] = {
+    "unmovable", "pgtable", "movable", "isolate"
+  };
+
+  ba::stats all{};
+  for (auto &lb : buddies) {
+    ba::stats stats;
+    {
+      auto l = lb.lock.guard();
+      stats = lb.alloc.get_stats();
+    }
+    all.free += stats.free;
+    all.fallbacks += stats.fallbacks;
+    all.conversions += stats.conversions;
+    for (size_t order = 0; order <= ba::MAX_ORDER; ++order)
+      all.nfree[order] += stats.nfree[order];
+    for (size_t t = 0; t < ba::MIGRATE_TYPES; ++t)
+      for (size_t order = 0; order < ba::PAGEBLOCK_ORDER; ++order)
+        all.nfree_type[t][order] += stats.nfree_type[t][order];
+  }
+
+  size_t free_pages = all.free / ba::MIN_SIZE;
+  // Free pages in blocks of at least the current order
+  size_t usable = free_pages;
+  for (size_t order = 0; order <= ba::MAX_ORDER; ++order) {
+    s->print("order ", order, ": free blocks ", all.nfree[order],
+             " unusable ", free_pages ? (free_pages - usable) * 100 / free_pages
+                                      : 0, "%");
+    if (order < ba::PAGEBLOCK_ORDER)
+      for (size_t t = 0; t < ba::MIGRATE_TYPES; ++t)
+        s->print(" ", type_names[t], " ", all.nfree_type[t][order]);
+    s->println();
+    usable -= all.nfree[order] << order;
+  }
+  s->println("pageblock fallbacks ", all.fallbacks,
+             " conversions ", all.conversions);
+}
+
 void
 kmemprint(print_stream *s)
 {
@@ -671,6 +742,32 @@ kmemprint(print_stream *s)
             "Page size: ", buddy_allocator::MIN_SIZE);
 
   s->println();
+  kmemprint_fragmentation(s);
+  kmem_cache::print_all(s);
+  shrinker::print_all(s);
+}
+
+size_t
+kalloc_node_free(int node)
+{
+  size_t free = 0;
+  // Like kfree, read the free counts without locking
+  for (size_t b = node_ranges[node].low; b < node_ranges[node].high; ++b)
+    free += buddies[b].alloc.get_free_bytes();
+  return free;
+}
+
+size_t
+kalloc_node_total(int node)
+{
+  return node_ranges[node].total;
+}
+
+static int
+mynode(void)
+{
+  auto node = mycpu()->node;
+  return node ? node->id : 0;
 }
 
 static int
@@ -683,17 +780,20 @@ kmemstatsread(mdev*, char *dst, u32 off, u32 n)
 
 #if KALLOC_LOAD_BALANCE
 char*
-kalloc(const char *name, size_t size)
+kalloc(const char *name, size_t size, kalloc_type type)
 {
-  return allmem.kalloc(name, size);
+  return allmem.kalloc(name, size, type);
 }
 #else
 char*
-kalloc(const char *name, size_t size)
+kalloc(const char *name, size_t size, kalloc_type type)
 {
   if (!kinited)
     return (char*)early_kalloc(size, size);
 
+  auto mtype = (buddy_allocator::migratetype)type;
+  bool reclaimed = false;
+retry:
   void *res = nullptr;
   const char *source = nullptr;
 
@@ -701,17 +801,19 @@ kalloc(const char *name, size_t size)
     // Go to the hot list
     scoped_cli cli;
     auto mem = mycpu()->mem;
-    if (mem->nhot == 0) {
+    void **hot = mem->hot_pages[type];
+    size_t &nhot = mem->nhot[type];
+    if (nhot == 0) {
       // No hot pages; fill half of the cache
       kstats::inc(&kstats::kalloc_hot_list_refill_count);
       auto buddyit = mem->steal.begin(), buddyend = mem->steal.end();
       auto lb = &buddies[*buddyit];
       auto l = lb->lock.guard();
-      while (mem->nhot < KALLOC_HOT_PAGES / 2 && buddyit != buddyend) {
-        void *page = lb->alloc.alloc_nothrow(PGSIZE);
+      while (nhot < KALLOC_HOT_PAGES / 2 && buddyit != buddyend) {
+        void *page = lb->alloc.alloc_nothrow(PGSIZE, mtype);
         if (!page) {
           // Move to the next allocator
-          if (++buddyit == buddyend && mem->nhot == 0) {
+          if (++buddyit == buddyend && nhot == 0) {
             // We couldn't allocate any pages; we're probably out of
             // memory, but drop through to the more aggressive
             // general-purpose allocator.
@@ -728,12 +830,12 @@ kalloc(const char *name, size_t size)
 #endif
           }
         } else {
-          mem->hot_pages[mem->nhot++] = page;
+          hot[nhot++] = page;
         }
       }
       source = "refilled hot list";
     }
-    res = mem->hot_pages[--mem->nhot];
+    res = hot[--nhot];
     kstats::inc(&kstats::kalloc_page_alloc_count);
     if (!source)
       source = "hot list";
@@ -746,7 +848,7 @@ kalloc(const char *name, size_t size)
     for (auto idx : mycpu()->mem->steal) {
       auto &lb = buddies[idx];
       auto l = lb.lock.guard();
-      res = lb.alloc.alloc_nothrow(size);
+      res = lb.alloc.alloc_nothrow(size, mtype);
 #if PRINT_STEAL
       if (res && mycpu()->mem->steal.is_local(idx))
         cprintf("CPU %d stole from buddy %lu\n", myid(), idx);
@@ -785,8 +887,19 @@ kalloc(const char *name, size_t size)
     }
 
     mtlabel(mtrace_label_block, res, size, name, strlen(name));
+    // We had to go to the buddy allocators, so free memory may be
+    // getting low.
+    if (strcmp(source, "hot list") != 0)
+      reclaim_check(mynode());
     return (char*)res;
+  } else if (!reclaimed && reclaim_direct(mynode(), size)) {
+    reclaimed = true;
+    goto retry;
   } else {
+    // Reclaim can't help with fragmentation, but compaction might
+    // for the next high-order allocation.
+    if (size > PGSIZE)
+      compact_request(mynode());
     cprintf("kalloc: out of memory\n");
     if (KERNEL_HEAP_PROFILE)
       heap_profile_print(&console);
@@ -795,6 +908,52 @@ kalloc(const char *name, size_t size)
 }
 #endif
 
+// Allocate up to n pages of the given type into pages, returning how
+// many were allocated.  This takes what it can from this CPU's hot
+// list and then from its local buddy allocator under a single lock
+// acquisition, and falls back to kalloc for the rest, so it is much
+// cheaper than n calls to kalloc when the hot list is empty.
+size_t
+kalloc_batch(const char *name, kalloc_type type, void **pages, size_t n)
+{
+  size_t got = 0;
+#if !KALLOC_LOAD_BALANCE
+  if (kinited && !ALLOC_MEMSET && !KERNEL_HEAP_PROFILE) {
+    auto mtype = (buddy_allocator::migratetype)type;
+    scoped_cli cli;
+    auto mem = mycpu()->mem;
+    void **hot = mem->hot_pages[type];
+    size_t &nhot = mem->nhot[type];
+    while (got < n && nhot)
+      pages[got++] = hot[--nhot];
+    if (got < n) {
+      auto &lb = buddies[*mem->steal.begin()];
+      auto l = lb.lock.guard();
+      while (got < n) {
+        void *page = lb.alloc.alloc_nothrow(PGSIZE, mtype);
+        if (!page)
+          break;
+        pages[got++] = page;
+      }
+    }
+    kstats::inc(&kstats::kalloc_page_alloc_count, got);
+  }
+  if (!name)
+    name = "kmem";
+  for (size_t i = 0; i < got; i++)
+    mtlabel(mtrace_label_block, pages[i], PGSIZE, name, strlen(name));
+  if (got)
+    reclaim_check(mynode());
+#endif
+
+  for (; got < n; got++) {
+    pages[got] = kalloc(name, PGSIZE, type);
+    if (!pages[got])
+      break;
+  }
+  return got;
+}
+
 void *
 ksalloc(int slab)
 {
@@ -1053,6 +1212,8 @@ initkalloc(void)
       }
     }
     size_t node_buddies = buddies.size() - node_low;
+    node_ranges[node.id] = {node_low, node_low + node_buddies,
+                            node_stats.free};
 
     console.println("kalloc: ", ssize(node_stats.free), " available in node ",
                     node.id,
@@ -1077,7 +1238,8 @@ initkalloc(void)
       // Then steal from the whole node (this will be a no-op if
       // there's only one subnode).
       cpu->mem->steal.add(node_low, node_low + node_buddies);
-      cpu->mem->nhot = 0;
+      for (size_t type = 0; type < KALLOC_NTYPES; ++type)
+        cpu->mem->nhot[type] = 0;
       cpu->mem->mempool = node_low;
       ++cpu_index;
     }
@@ -1108,13 +1270,115 @@ initkalloc(void)
   devsw[MAJ_KMEMSTATS].pread = kmemstatsread;
 }
 
+// Return the first buddy in mem's steal order that tracks v.  This is
+// the buddy kfree will usually return v to.
+static locked_buddy *
+home_buddy(struct cpu_mem *mem, void *v)
+{
+  for (auto buddyidx : mem->steal)
+    if (buddies[buddyidx].alloc.contains(v))
+      return &buddies[buddyidx];
+  panic("kfree: pointer %p is not in an allocated region", v);
+}
+
+kalloc_type
+kalloc_type_of(void *v)
+{
+  scoped_cli cli;
+  auto type = home_buddy(mycpu()->mem, v)->alloc.get_type(v);
+  // Only movable pageblocks are isolated
+  if (type == buddy_allocator::MIGRATE_ISOLATE)
+    return KALLOC_MOVABLE;
+  return (kalloc_type)type;
+}
+
 #if KALLOC_LOAD_BALANCE
 void
 kfree(void *v, size_t size)
 {
   allmem.kfree(v, size);
 }
+
+void
+kfree_batch(void **pages, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    kfree(pages[i]);
+}
 #else
+// Return n single pages to the buddy allocators.  mem must be this
+// CPU's and interrupts must be disabled.  This reorders pages.
+static void
+buddy_free_pages(struct cpu_mem *mem, void **pages, size_t n)
+{
+  // We sort the pages so we can merge them with the buddy allocator
+  // list, minimizing and batching our locks.
+  std::sort(pages, pages + n);
+  locked_buddy *lb = nullptr;
+  lock_guard<spinlock> lock;
+  for (size_t i = 0; i < n; ++i) {
+    void *ptr = pages[i];
+    // Do we have the right buddy?
+    if (!lb || !(lb->alloc.contains(ptr) &&
+                 lb->alloc.get_free_bytes() < lb->free_limit)) {
+      // Find the first buddy in steal order that contains ptr and
+      // hasn't reached its free limit.  We do it this way in case
+      // there are overlapping buddies.
+      lock.release();
+      lb = nullptr;
+      for (auto buddyidx : mem->steal) {
+        auto lbtry = &buddies[buddyidx];
+        // We can access free_bytes and free_limit without locking
+        // here since it's okay if we actually go a little over
+        // free_limit.
+        if (lbtry->alloc.contains(ptr) &&
+            lbtry->alloc.get_free_bytes() < lbtry->free_limit) {
+          lb = lbtry;
+          break;
+        }
+      }
+      assert(lb);
+      if (!mem->steal.is_local(lb - &buddies[0])) {
+        kstats::inc(&kstats::kalloc_hot_list_remote_free_count);
+#if PRINT_STEAL
+        cprintf("CPU %d returning hot list to buddy %lu\n", myid(),
+                lb - &buddies[0]);
+#endif
+      }
+      lock = lb->lock.guard();
+    }
+    lb->alloc.free(ptr, PGSIZE);
+  }
+}
+
+// Return the first n pages of mem's type hot list to the buddy
+// allocators.  mem must be this CPU's and interrupts must be
+// disabled.
+static void
+hot_list_free(struct cpu_mem *mem, kalloc_type type, size_t n)
+{
+  void **hot = mem->hot_pages[type];
+  buddy_free_pages(mem, hot, n);
+  // Shift hot page list down
+  // XXX(Austin) Could use two lists and switch off
+  mem->nhot[type] -= n;
+  memmove(hot, hot + n, mem->nhot[type] * sizeof *hot);
+}
+
+// Return all of this CPU's hot pages to the buddy allocators.
+// Interrupts must be disabled.  Returns the number of pages freed.
+static size_t
+hot_list_drain(void)
+{
+  auto mem = mycpu()->mem;
+  size_t n = 0;
+  for (size_t type = 0; type < KALLOC_NTYPES; ++type) {
+    n += mem->nhot[type];
+    hot_list_free(mem, (kalloc_type)type, mem->nhot[type]);
+  }
+  return n;
+}
+
 void
 kfree(void *v, size_t size)
 {
@@ -1133,67 +1397,30 @@ kfree(void *v, size_t size)
       heap_profile_update(HEAP_PROFILE_KALLOC, alloc_rip, -size);
   }
 
-  auto mem = mycpu()->mem;
   if (size == PGSIZE) {
-    // Free to the hot list
+    // Free to the hot list of v's pageblock type, unless v is being
+    // compacted, in which case we return it right away so its
+    // pageblock can coalesce.
     scoped_cli cli;
-    if (mem->nhot == KALLOC_HOT_PAGES) {
-      // There's no more room in the hot pages list, so free half of
-      // it.  We sort the list so we can merge it with the buddy
-      // allocator list, minimizing and batching our locks.
-      kstats::inc(&kstats::kalloc_hot_list_flush_count);
-      std::sort(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2));
-      locked_buddy *lb = nullptr;
-      lock_guard<spinlock> lock;
-      for (size_t i = 0; i < KALLOC_HOT_PAGES / 2; ++i) {
-        void *ptr = mem->hot_pages[i];
-        // Do we have the right buddy?
-        if (!lb || !(lb->alloc.contains(ptr) &&
-                     lb->alloc.get_free_bytes() < lb->free_limit)) {
-          // Find the first buddy in steal order that contains ptr and
-          // hasn't reached its free limit.  We do it this way in case
-          // there are overlapping buddies.
-          lock.release();
-          lb = nullptr;
-          for (auto buddyidx : mem->steal) {
-            auto lbtry = &buddies[buddyidx];
-            // We can access free_bytes and free_limit without locking
-            // here since it's okay if we actually go a little over
-            // free_limit.
-            if (lbtry->alloc.contains(ptr) &&
-                lbtry->alloc.get_free_bytes() < lbtry->free_limit) {
-              lb = lbtry;
-              break;
-            }
-          }
-          assert(lb);
-          if (!mem->steal.is_local(lb - &buddies[0])) {
-            kstats::inc(&kstats::kalloc_hot_list_remote_free_count);
-#if PRINT_STEAL
-            cprintf("CPU %d returning hot list to buddy %lu\n", myid(),
-                    lb - &buddies[0]);
-#endif
-          }
-          lock = lb->lock.guard();
-        }
-        lb->alloc.free(ptr, PGSIZE);
+    auto mem = mycpu()->mem;
+    auto type = home_buddy(mem, v)->alloc.get_type(v);
+    if (type != buddy_allocator::MIGRATE_ISOLATE) {
+      if (mem->nhot[type] == KALLOC_HOT_PAGES) {
+        // There's no more room in the hot pages list, so free half of
+        // it.
+        kstats::inc(&kstats::kalloc_hot_list_flush_count);
+        hot_list_free(mem, (kalloc_type)type, KALLOC_HOT_PAGES / 2);
       }
-      lock.release();
-      // Shift hot page list down
-      // XXX(Austin) Could use two lists and switch off
-      mem->nhot = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
-      memmove(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2),
-              mem->nhot * sizeof *mem->hot_pages);
+      mem->hot_pages[type][mem->nhot[type]++] = v;
+      kstats::inc(&kstats::kalloc_page_free_count);
+      return;
     }
-    mem->hot_pages[mem->nhot++] = v;
-    kstats::inc(&kstats::kalloc_page_free_count);
-    return;
   }
 
   // Find the first allocator in steal order to return v to.  This
   // will check our local allocators first and handle overlapping
   // buddies.
-  for (auto buddyidx : mem->steal) {
+  for (auto buddyidx : mycpu()->mem->steal) {
     if (buddies[buddyidx].alloc.contains(v)) {
       auto l = buddies[buddyidx].lock.guard();
       buddies[buddyidx].alloc.free(v, size);
@@ -1202,8 +1429,189 @@ kfree(void *v, size_t size)
   }
   panic("kfree: pointer %p is not in an allocated region", v);
 }
+
+// Free n single pages, returning them straight to their buddy
+// allocators in sorted runs rather than through the hot list.  This
+// reorders pages.
+void
+kfree_batch(void **pages, size_t n)
+{
+  if (!kinited || KERNEL_HEAP_PROFILE) {
+    for (size_t i = 0; i < n; i++)
+      kfree(pages[i]);
+    return;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (ALLOC_MEMSET)
+      memset(pages[i], 1, PGSIZE);
+    mtunlabel(mtrace_label_block, pages[i]);
+  }
+  // These pages are usually from an address space being torn down, so
+  // they're cold; don't push hot pages out of the hot lists for them.
+  scoped_cli cli;
+  buddy_free_pages(mycpu()->mem, pages, n);
+  kstats::inc(&kstats::kalloc_page_free_count, (u64)n);
+}
+
+// Return pages cached in the hot lists of a node's CPUs to the buddy
+// allocators.
+class hot_list_shrinker : public shrinker
+{
+  static size_t hot_pages(int cpu)
+  {
+    size_t n = 0;
+    for (size_t type = 0; type < KALLOC_NTYPES; ++type)
+      n += cpu_mem[cpu].nhot[type];
+    return n;
+  }
+
+public:
+  hot_list_shrinker() : shrinker("kalloc hot lists") { }
+
+  size_t count(int node) override
+  {
+    size_t n = 0;
+    for (auto cpu : numa_nodes[node].cpuids)
+      n += hot_pages(cpu);
+    return n;
+  }
+
+  size_t scan(int node, size_t target, bool direct) override
+  {
+    std::atomic<size_t> freed(0);
+    auto drain = [&freed]() {
+      freed += hot_list_drain();
+    };
+
+    bitset<NCPU> remote;
+    bool interruptable = readrflags() & FL_IF;
+    {
+      scoped_cli cli;
+      for (auto cpu : numa_nodes[node].cpuids) {
+        if (cpu == myid())
+          drain();
+        else if (hot_pages(cpu))
+          remote.set(cpu);
+      }
+    }
+    // Other CPUs' hot lists can only be touched by their owners.  If
+    // we can't take IPIs ourselves, asking them could deadlock.
+    if (remote.any() && interruptable)
+      run_on_cpus(remote, drain);
+    return freed;
+  }
+};
+
+static hot_list_shrinker hot_list_shrinker;
+#endif
+
+// Compaction.  We isolate the movable pageblocks in this CPU's local
+// buddy allocators that are already mostly free and migrate the user
+// pages still allocated in them.  The old pages come back through
+// refcache, and kfree returns pages in isolated pageblocks straight to
+// the buddy allocator, so once they're all back the pageblock
+// coalesces.
+
+enum {
+  // Maximum pageblocks to isolate in one pass
+  COMPACT_PAGEBLOCKS = 16,
+  // How long to keep pageblocks isolated after migrating their pages,
+  // to give refcache time to free the old pages (in msec)
+  COMPACT_SETTLE = 50,
+};
+
+class compact_migrator : public page_migrator
+{
+public:
+  struct target
+  {
+    locked_buddy *lb;
+    uintptr_t pageblock;
+  };
+  static_vector<target, COMPACT_PAGEBLOCKS> targets;
+
+  bool want(void *va) override
+  {
+    uintptr_t pb = (uintptr_t)va &
+      ~((uintptr_t)buddy_allocator::PAGEBLOCK_SIZE - 1);
+    for (auto &t : targets)
+      if (t.pageblock == pb)
+        return true;
+    return false;
+  }
+
+  char *alloc() override
+  {
+    // The hot list may still have pages from the pageblocks we're
+    // emptying.  kfree sends those straight back to the buddy
+    // allocator.
+    for (int i = 0; i <= KALLOC_HOT_PAGES; ++i) {
+      char *p = kalloc("(compact)", PGSIZE, KALLOC_MOVABLE);
+      if (!p || !want(p))
+        return p;
+      kfree(p);
+    }
+    return nullptr;
+  }
+};
+
+size_t
+kalloc_compact(void)
+{
+  typedef buddy_allocator ba;
+  compact_migrator m;
+
+  kstats::inc(&kstats::compact_count);
+  steal_order::segment local;
+  {
+    scoped_cli cli;
+    local = mycpu()->mem->steal.get_local();
+  }
+  size_t per_buddy = std::max<size_t>(
+    1, COMPACT_PAGEBLOCKS / (local.high - local.low));
+  for (size_t b = local.low; b < local.high; ++b) {
+    uintptr_t pbs[COMPACT_PAGEBLOCKS];
+    size_t n = std::min(per_buddy, m.targets.capacity() - m.targets.size());
+    auto &lb = buddies[b];
+    {
+      auto l = lb.lock.guard();
+      n = lb.alloc.compaction_candidates(pbs, n, ba::PAGEBLOCK_SIZE / 2);
+      lb.alloc.move_pageblocks(pbs, n, ba::MIGRATE_ISOLATE);
+    }
+    for (size_t i = 0; i < n; ++i)
+      m.targets.push_back(compact_migrator::target{&lb, pbs[i]});
+  }
+  if (m.targets.empty())
+    return 0;
+  kstats::inc(&kstats::compact_pageblocks, m.targets.size());
+
+  size_t moved = vmap::migrate_all(&m);
+  kstats::inc(&kstats::compact_migrated, moved);
+
+  // Wait for the old pages to come back
+  {
+    spinlock lock("compact_settle");
+    condvar cv("compact_settle");
+    u64 deadline = nsectime() + (u64)COMPACT_SETTLE * 1000000;
+    scoped_acquire l(&lock);
+    while (nsectime() < deadline)
+      cv.sleep_to(&lock, deadline);
+  }
+#if !KALLOC_LOAD_BALANCE
+  {
+    scoped_cli cli;
+    hot_list_drain();
+  }
 #endif
 
+  for (auto &t : m.targets) {
+    auto l = t.lb->lock.guard();
+    t.lb->alloc.move_pageblocks(&t.pageblock, 1, ba::MIGRATE_MOVABLE);
+  }
+  return moved;
+}
+
 void
 ksfree(int slab, void *v)
 {
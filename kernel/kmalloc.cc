@@ -1,5 +1,6 @@
 //
-// Allocate objects smaller than a page.
+// Allocate objects smaller than a page.  Larger objects get their own
+// run of pages.
 //
 
 #include "types.h"
@@ -15,12 +16,17 @@
 #include "amd64.h"
 #include "page_info.hh"
 #include "heapprof.hh"
+#include "vmalloc.hh"
 
 #include <type_traits>
 
 // allocate in power-of-two sizes up to 2^KMMAX (PGSIZE)
 #define KMMAX 12
 
+// Large objects at least this big fall back to vmalloc if there's no
+// contiguous run of pages for them.
+#define KMVMALLOC_MIN (16 * PGSIZE)
+
 struct header {
   struct header *next;
 };
@@ -125,6 +131,28 @@ kmalloc_small(size_t b, const char *name)
   return h;
 }
 
+static bool
+is_vmalloced(void *p)
+{
+  return KVMALLOC <= (uintptr_t)p && (uintptr_t)p < KVMALLOCEND;
+}
+
+static void *
+kmalloc_large(u64 nbytes, const char *name)
+{
+  // Take exactly as many pages as we need, rather than rounding up to
+  // a power of two.  kmfree recomputes the run length from the size.
+  u64 bytes = PGROUNDUP(nbytes);
+  void *h = kalloc(name, bytes);
+  // Big objects don't need to be physically contiguous.  Since
+  // KVMALLOC space is never reused, only do this when we can't find
+  // a contiguous run.  Heap profiling keeps its alloc_debug_info in
+  // the first page's page_info, which needs a direct-mapped address.
+  if (!h && bytes >= KMVMALLOC_MIN && !KERNEL_HEAP_PROFILE)
+    h = vmalloc_raw_nothrow(bytes, PGSIZE, name);
+  return h;
+}
+
 void *
 kmalloc(u64 nbytes, const char *name)
 {
@@ -133,7 +161,7 @@ kmalloc(u64 nbytes, const char *name)
 
   if (mbytes > PGSIZE / 2) {
     // Full page allocation
-    h = kalloc(name, round_up_to_pow2(mbytes));
+    h = kmalloc_large(mbytes, name);
   } else {
     // Sub-page allocation
     int b = bucket(mbytes);
@@ -173,7 +201,10 @@ kmfree(void *ap, u64 nbytes)
 
   if (nbytes > PGSIZE / 2) {
     // Free full page allocation
-    kfree(ap, round_up_to_pow2(nbytes));
+    if (is_vmalloced(ap))
+      vmalloc_free(ap);
+    else
+      kfree(ap, PGROUNDUP(nbytes));
   } else {
     // Free sub-page allocation
     int b = bucket(nbytes);
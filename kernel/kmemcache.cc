@@ -0,0 +1,407 @@
+//
+// Typed object caches with per-CPU magazines.
+//
+
+#include "types.h"
+#include "mmu.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "kmemcache.hh"
+#include "cpu.hh"
+#include "mtrace.h"
+#include "kstream.hh"
+#include "shrinker.hh"
+#include "numa.hh"
+#include "ipi.hh"
+#include "bits.hh"
+
+#include <algorithm>
+
+// Objects that fit fewer than this many to a slab page are allocated
+// with kmalloc instead.
+#define MIN_PER_SLAB 8
+
+static spinlock caches_lock("kmem_caches");
+static kmem_cache *caches;
+
+kmem_cache::stats &
+kmem_cache::stats::operator+=(const stats &o)
+{
+  allocs += o.allocs;
+  frees += o.frees;
+  remote_frees += o.remote_frees;
+  refills += o.refills;
+  flushes += o.flushes;
+  slab_allocs += o.slab_allocs;
+  slab_frees += o.slab_frees;
+  return *this;
+}
+
+static size_t
+object_size(size_t size, size_t align)
+{
+  size = std::max(size, sizeof(void*));
+  return (size + align - 1) & ~(align - 1);
+}
+
+kmem_cache::kmem_cache(const char *name, size_t size, size_t align)
+  : next_(nullptr)
+{
+  safestrcpy(name_, name, sizeof name_);
+  align = std::max(align, alignof(free_obj));
+  assert((align & (align - 1)) == 0 && align <= PGSIZE);
+  size_ = object_size(size, align);
+  offset_ = (sizeof(slab) + align - 1) & ~(align - 1);
+  per_slab_ = (PGSIZE - offset_) / size_;
+  if (per_slab_ < MIN_PER_SLAB) {
+    // kmalloc only guarantees cache line alignment below a page
+    assert(size_ > PGSIZE / 2 || align <= CACHELINE);
+    per_slab_ = 0;
+  }
+
+  for (int cpu = 0; cpu < NCPU; cpu++) {
+    cpu_state *c = &cpu_[cpu];
+    c->nmag = 0;
+    c->remote.store(nullptr, std::memory_order_relaxed);
+    c->nempty = 0;
+    c->st = stats{};
+  }
+}
+
+kmem_cache *
+kmem_cache::get(const char *name, size_t size, size_t align)
+{
+  scoped_acquire l(&caches_lock);
+  size_t osize = object_size(size, std::max(align, alignof(free_obj)));
+  for (kmem_cache *kc = caches; kc; kc = kc->next_)
+    if (kc->size_ == osize && strcmp(kc->name_, name) == 0)
+      return kc;
+
+  kmem_cache *kc = new kmem_cache(name, size, align);
+  kc->next_ = caches;
+  caches = kc;
+  return kc;
+}
+
+kmem_cache::slab *
+kmem_cache::slab_of(void *p) const
+{
+  return (slab*)PGROUNDDOWN((uptr)p);
+}
+
+kmem_cache::slab *
+kmem_cache::new_slab(cpu_state *c, int cpu)
+{
+  char *page = kalloc(name_);
+  if (!page)
+    return nullptr;
+  slab *s = (slab*)page;
+  s->cpu = cpu;
+  s->inuse = 0;
+  s->listed = false;
+
+  // Thread the free list in address order
+  free_obj **tail = &s->free;
+  for (size_t i = 0; i < per_slab_; i++) {
+    free_obj *o = (free_obj*)(page + offset_ + i * size_);
+    *tail = o;
+    tail = &o->next;
+  }
+  *tail = nullptr;
+
+  c->st.slab_allocs++;
+  return s;
+}
+
+// Return o to slab s, which must be owned by this CPU.
+void
+kmem_cache::put_local(cpu_state *c, slab *s, free_obj *o)
+{
+  o->next = s->free;
+  s->free = o;
+  if (!s->listed) {
+    c->partial.push_front(s);
+    s->listed = true;
+  }
+  if (--s->inuse)
+    return;
+
+  // The slab is completely free.  Keep a few around at the back of
+  // the list, so we prefer to allocate from partially used slabs.
+  c->partial.erase(c->partial.iterator_to(s));
+  if (c->nempty < KEEP_EMPTY) {
+    c->partial.push_back(s);
+    c->nempty++;
+  } else {
+    s->listed = false;
+    kfree(s);
+    c->st.slab_frees++;
+  }
+}
+
+// Return objects other CPUs have freed to our slabs.
+void
+kmem_cache::drain_remote(cpu_state *c)
+{
+  free_obj *o = c->remote.exchange(nullptr, std::memory_order_acquire);
+  while (o) {
+    free_obj *next = o->next;
+    put_local(c, slab_of(o), o);
+    o = next;
+  }
+}
+
+// Fill half of c's magazine.  Returns false if we couldn't allocate
+// anything.
+bool
+kmem_cache::refill(cpu_state *c, int cpu)
+{
+  c->st.refills++;
+  if (large()) {
+    // Large objects are expensive to hold on to, so just get one.
+    void *p = kmalloc(size_, name_);
+    if (!p)
+      return false;
+    c->mag[c->nmag++] = p;
+    c->st.slab_allocs++;
+    return true;
+  }
+
+  drain_remote(c);
+  while (c->nmag < MAG_SIZE / 2) {
+    if (c->partial.empty()) {
+      slab *s = new_slab(c, cpu);
+      if (!s)
+        break;
+      c->partial.push_front(s);
+      s->listed = true;
+      c->nempty++;
+    }
+
+    slab *s = &c->partial.front();
+    if (s->inuse == 0)
+      c->nempty--;
+    while (s->free && c->nmag < MAG_SIZE / 2) {
+      free_obj *o = s->free;
+      s->free = o->next;
+      s->inuse++;
+      c->mag[c->nmag++] = o;
+    }
+    if (!s->free) {
+      c->partial.pop_front();
+      s->listed = false;
+    }
+  }
+  return c->nmag > 0;
+}
+
+// Release the oldest n objects in c's magazine.
+void
+kmem_cache::flush(cpu_state *c, int cpu, int n)
+{
+  c->st.flushes++;
+
+  if (large()) {
+    for (int i = 0; i < n; i++)
+      kmfree(c->mag[i], size_);
+    c->st.slab_frees += n;
+  } else {
+    drain_remote(c);
+    // Sort the objects so that objects from the same slab, and mostly
+    // the same owner, are adjacent.  We return each run of objects
+    // owned by another CPU with a single push onto its remote-free
+    // queue.
+    std::sort(c->mag, c->mag + n);
+    for (int i = 0; i < n; ) {
+      free_obj *head = (free_obj*)c->mag[i++];
+      int owner = slab_of(head)->cpu;
+      if (owner == cpu) {
+        put_local(c, slab_of(head), head);
+        continue;
+      }
+
+      free_obj *tail = head;
+      u64 count = 1;
+      for (; i < n && slab_of(c->mag[i])->cpu == owner; i++, count++) {
+        tail->next = (free_obj*)c->mag[i];
+        tail = tail->next;
+      }
+      std::atomic<free_obj*> &q = cpu_[owner].remote;
+      free_obj *old = q.load(std::memory_order_relaxed);
+      do {
+        tail->next = old;
+      } while (!q.compare_exchange_weak(old, head, std::memory_order_release));
+      c->st.remote_frees += count;
+    }
+  }
+
+  c->nmag -= n;
+  memmove(c->mag, c->mag + n, c->nmag * sizeof c->mag[0]);
+}
+
+void *
+kmem_cache::alloc()
+{
+  void *p;
+  {
+    scoped_cli cli;
+    int cpu = myid();
+    cpu_state *c = &cpu_[cpu];
+    if (c->nmag == 0 && !refill(c, cpu)) {
+      cprintf("kmem_cache %s: out of memory\n", name_);
+      return nullptr;
+    }
+    p = c->mag[--c->nmag];
+    c->st.allocs++;
+  }
+
+  if (ALLOC_MEMSET)
+    memset(p, 4, size_);
+  mtlabel(mtrace_label_heap, p, size_, name_, strlen(name_));
+  return p;
+}
+
+void
+kmem_cache::free(void *p)
+{
+  mtunlabel(mtrace_label_heap, p);
+  if (ALLOC_MEMSET)
+    memset(p, 3, size_);
+
+  scoped_cli cli;
+  int cpu = myid();
+  cpu_state *c = &cpu_[cpu];
+  if (c->nmag == MAG_SIZE)
+    flush(c, cpu, MAG_SIZE / 2);
+  c->mag[c->nmag++] = p;
+  c->st.frees++;
+}
+
+// Release c's whole magazine and all of its empty slabs.  Returns the
+// number of pages released.
+size_t
+kmem_cache::shrink(cpu_state *c, int cpu)
+{
+  u64 before = c->st.slab_frees;
+  if (c->nmag)
+    flush(c, cpu, c->nmag);
+  if (large()) {
+    u64 objs = c->st.slab_frees - before;
+    return (objs * size_ + PGSIZE - 1) / PGSIZE;
+  }
+
+  drain_remote(c);
+  // put_local keeps empty slabs at the back of the list
+  while (!c->partial.empty() && c->partial.back().inuse == 0) {
+    slab *s = &c->partial.back();
+    c->partial.pop_back();
+    s->listed = false;
+    kfree(s);
+    c->nempty--;
+    c->st.slab_frees++;
+  }
+  return c->st.slab_frees - before;
+}
+
+static kmem_cache *
+all_caches()
+{
+  scoped_acquire l(&caches_lock);
+  return caches;
+}
+
+size_t
+kmem_cache::reclaimable(int cpu)
+{
+  size_t pages = 0;
+  // Caches are never removed, so we can walk the list unlocked.  The
+  // per-CPU state may be changing under us, but this is only an
+  // estimate.
+  for (kmem_cache *kc = all_caches(); kc; kc = kc->next_) {
+    cpu_state *c = &kc->cpu_[cpu];
+    pages += c->nmag * kc->size_ / PGSIZE;
+    if (!kc->large())
+      pages += c->nempty;
+  }
+  return pages;
+}
+
+size_t
+kmem_cache::shrink_local()
+{
+  assert(!(readrflags() & FL_IF));
+  int cpu = myid();
+  size_t pages = 0;
+  for (kmem_cache *kc = all_caches(); kc; kc = kc->next_)
+    pages += kc->shrink(&kc->cpu_[cpu], cpu);
+  return pages;
+}
+
+kmem_cache::stats
+kmem_cache::get_stats() const
+{
+  stats res{};
+  for (int cpu = 0; cpu < ncpu; cpu++)
+    res += cpu_[cpu].st;
+  return res;
+}
+
+void
+kmem_cache::print_all(print_stream *s)
+{
+  // Caches are never removed, so we can walk the list unlocked.
+  for (kmem_cache *kc = all_caches(); kc; kc = kc->next_) {
+    stats st = kc->get_stats();
+    s->println("cache ", kc->name_, " size ", kc->size_,
+               " per-slab ", kc->per_slab_,
+               " in-use ", st.allocs - st.frees,
+               " slabs ", st.slab_allocs - st.slab_frees,
+               " allocs ", st.allocs,
+               " remote-frees ", st.remote_frees,
+               " refills ", st.refills, " flushes ", st.flushes);
+  }
+}
+
+// Release the free objects and empty slabs held by a node's CPUs.
+class kmem_cache_shrinker : public shrinker
+{
+public:
+  kmem_cache_shrinker() : shrinker("kmem caches") { }
+
+  size_t count(int node) override
+  {
+    size_t n = 0;
+    for (auto cpu : numa_nodes[node].cpuids)
+      n += kmem_cache::reclaimable(cpu);
+    return n;
+  }
+
+  size_t scan(int node, size_t target, bool direct) override
+  {
+    std::atomic<size_t> freed(0);
+    auto shrink = [&freed]() { freed += kmem_cache::shrink_local(); };
+
+    bitset<NCPU> remote;
+    bool interruptable = readrflags() & FL_IF;
+    {
+      scoped_cli cli;
+      for (auto cpu : numa_nodes[node].cpuids) {
+        // A direct reclaim may come from inside one of this CPU's
+        // caches, so leave our own state alone.
+        if (cpu == myid()) {
+          if (!direct)
+            shrink();
+        } else {
+          remote.set(cpu);
+        }
+      }
+    }
+    // Per-CPU state can only be touched by its owner.  If we can't
+    // take IPIs ourselves, asking other CPUs could deadlock.
+    if (remote.any() && interruptable)
+      run_on_cpus(remote, shrink);
+    return freed;
+  }
+};
+
+static kmem_cache_shrinker kmem_cache_shrinker;
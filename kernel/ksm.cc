@@ -0,0 +1,241 @@
+//
+// Same-page merging for anonymous memory.
+//
+// A background thread walks every address space, hashing private
+// anonymous pages that were marked with MADV_MERGEABLE.  When it
+// finds two identical pages, it makes one of them a shared
+// copy-on-write page and points the other mapping at it, using the
+// same COW machinery as fork.  The first write to a merged page gets
+// a private copy again.
+//
+// Shared pages live in the stable table, keyed by the hash of their
+// contents, which can't change.  Pages we've seen once during a pass
+// go in the unstable table.  Their contents may change at any time,
+// so we only trust it as a hint, and throw it away after each pass.
+// Both are only touched by the scanner thread.
+//
+
+#include "types.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "cpu.hh"
+#include "vm.hh"
+#include "page_info.hh"
+#include "kstats.hh"
+
+enum {
+  // Hash buckets in each table
+  NBUCKETS = 4096,
+  // Pages to scan between checks of our CPU budget
+  BATCH = 64,
+  // Minimum time between the starts of two passes (in msec)
+  PASS_INTERVAL = 1000,
+};
+
+// A page whose contents are fixed and which mappings can share
+struct stable_node
+{
+  stable_node *next;
+  u64 hash;
+  sref<page_info> page;
+
+  NEW_DELETE_OPS(stable_node);
+};
+
+// A page we've seen once this pass, and where it was mapped
+struct unstable_node
+{
+  unstable_node *next;
+  u64 hash;
+  vmap *vm;
+  uptr va;
+  page_info *page;
+
+  NEW_DELETE_OPS(unstable_node);
+};
+
+static u64
+hash_page(const void *va)
+{
+  // FNV-1a, a word at a time
+  const u64 *p = (const u64*)va;
+  u64 h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < PGSIZE / sizeof(u64); i++)
+    h = (h ^ p[i]) * 0x100000001b3ull;
+  return h;
+}
+
+class ksm_scanner : public page_merger
+{
+  stable_node *stable_[NBUCKETS];
+  unstable_node *unstable_[NBUCKETS];
+  spinlock lock_;
+  condvar cv_;
+  u64 batch_start_;
+  int batch_pages_;
+
+  static int bucket(u64 hash) { return hash % NBUCKETS; }
+
+  void sleep(u64 nsec)
+  {
+    scoped_acquire l(&lock_);
+    u64 deadline = nsectime() + nsec;
+    while (deadline > nsectime())
+      cv_.sleep_to(&lock_, deadline);
+  }
+
+  // Sleep long enough to keep us within our share of the CPU.
+  void throttle()
+  {
+    if (++batch_pages_ < BATCH)
+      return;
+    u64 busy = nsectime() - batch_start_;
+    sleep(busy * (100 - KSM_CPU_PERCENT) / KSM_CPU_PERCENT);
+    batch_pages_ = 0;
+    batch_start_ = nsectime();
+  }
+
+  stable_node *find_stable(u64 hash)
+  {
+    for (stable_node *n = stable_[bucket(hash)]; n; n = n->next)
+      if (n->hash == hash)
+        return n;
+    return nullptr;
+  }
+
+  void add_stable(u64 hash, const sref<page_info> &page)
+  {
+    stable_node *n = new stable_node{stable_[bucket(hash)], hash, page};
+    stable_[bucket(hash)] = n;
+    kstats::inc(&kstats::ksm_shared);
+  }
+
+  // Forget shared pages that nothing maps any more.
+  void prune_stable()
+  {
+    for (auto &head : stable_) {
+      for (stable_node **np = &head; *np; ) {
+        stable_node *n = *np;
+        if (n->page->get_consistent() <= 1) {
+          *np = n->next;
+          delete n;
+        } else {
+          np = &n->next;
+        }
+      }
+    }
+  }
+
+  void clear_unstable()
+  {
+    for (auto &head : unstable_) {
+      while (head) {
+        unstable_node *n = head;
+        head = n->next;
+        delete n;
+      }
+    }
+  }
+
+  // Remove and return an unstable page with the given hash that
+  // isn't page itself.
+  unstable_node *take_unstable(u64 hash, page_info *page)
+  {
+    for (unstable_node **np = &unstable_[bucket(hash)]; *np; np = &(*np)->next) {
+      unstable_node *n = *np;
+      if (n->hash == hash && n->page != page) {
+        *np = n->next;
+        return n;
+      }
+    }
+    return nullptr;
+  }
+
+  bool seen_unstable(u64 hash, page_info *page)
+  {
+    for (unstable_node *n = unstable_[bucket(hash)]; n; n = n->next)
+      if (n->hash == hash && n->page == page)
+        return true;
+    return false;
+  }
+
+public:
+  ksm_scanner()
+    : stable_{}, unstable_{}, lock_("ksm"), cv_("ksm"),
+      batch_start_(0), batch_pages_(0) { }
+
+  void scan(vmap *vm, uptr va, const sref<page_info> &page) override
+  {
+    throttle();
+    kstats::timer timer(&kstats::ksm_cycles);
+    kstats::inc(&kstats::ksm_scanned);
+    u64 hash = hash_page(page->va());
+
+    if (stable_node *s = find_stable(hash)) {
+      // Already shared, or identical to something that is.
+      // merge_page checks the contents, so a hash collision just
+      // means we don't merge.
+      if (vm->merge_page(va, page.get(), s->page))
+        kstats::inc(&kstats::ksm_merged);
+      return;
+    }
+
+    // Pages shared by fork show up once for each mapping
+    if (seen_unstable(hash, page.get()))
+      return;
+
+    unstable_node *u = take_unstable(hash, page.get());
+    if (!u) {
+      unstable_node *n = new unstable_node{
+        unstable_[bucket(hash)], hash, vm, va, page.get()};
+      unstable_[bucket(hash)] = n;
+      return;
+    }
+
+    // Found a match.  Freeze this page's contents and make sure they
+    // didn't change while we were hashing, then share it with the
+    // other mapping.
+    if (vm->protect_page(va, page.get()) && hash_page(page->va()) == hash) {
+      add_stable(hash, page);
+      sref<vmap> other = vmap::lookup(u->vm);
+      if (other && other->merge_page(u->va, u->page, page))
+        kstats::inc(&kstats::ksm_merged);
+    }
+    delete u;
+  }
+
+  void run()
+  {
+    for (;;) {
+      u64 start = nsectime();
+      batch_start_ = start;
+      batch_pages_ = 0;
+      prune_stable();
+      vmap::merge_scan_all(this);
+      clear_unstable();
+
+      u64 elapsed = nsectime() - start;
+      u64 interval = ((u64)PASS_INTERVAL) * 1000000ull;
+      if (elapsed < interval)
+        sleep(interval - elapsed);
+    }
+  }
+};
+
+static ksm_scanner scanner;
+
+static void
+ksm_worker(void *arg)
+{
+  scanner.run();
+}
+
+void
+initksm(void)
+{
+  if (KSM_CPU_PERCENT == 0)
+    return;
+  static_assert(KSM_CPU_PERCENT <= 100, "KSM_CPU_PERCENT is a percentage");
+  threadpin(ksm_worker, nullptr, "ksm", ncpu - 1);
+}
@@ -50,6 +50,8 @@ void initcpprt(void);
 void initfutex(void);
 void initcmdline(void);
 void initrefcache(void);
+void initreclaim(void);
+void initksm(void);
 void initacpitables(void);
 void initnuma(void);
 void initcpus(void);
@@ -236,6 +238,8 @@ cmain(u64 mbmagic, u64 mbaddr)
   initidle();
   initgc();        // gc epochs and threads
   initrefcache();  // Requires initsched
+  initreclaim();   // Requires initsched
+  initksm();       // Requires initsched
   initconsole();
   initfutex();
   initsamp();
@@ -100,8 +100,13 @@ nameiparent(sref<mnode> cwd, const char* path, strbuf<DIRSIZ>* buf)
   return namex(cwd, path, true, buf);
 }
 
-s64
-readi(sref<mnode> m, char* buf, u64 start, u64 nbytes)
+// Read [start, start + nbytes) of m, passing each contiguous piece to
+// copy(off, src, len), where off is the offset of the piece relative
+// to start.  copy returns false to stop early.  Returns the number of
+// bytes copied, or -1 if nothing was copied.
+template<class Copy>
+static s64
+readi_common(sref<mnode> m, u64 start, u64 nbytes, Copy &&copy)
 {
   if (m->type() != mnode::types::file)
     return -1;
@@ -131,13 +136,52 @@ readi(sref<mnode> m, char* buf, u64 start, u64 nbytes)
     if (pgend > PGSIZE)
       pgend = PGSIZE;
 
-    memmove(buf + off, (const char*) pi->va() + pgoff, pgend - pgoff);
+    if (!copy(off, (const char*) pi->va() + pgoff, pgend - pgoff))
+      return off ?: -1;
     off += (pgend - pgoff);
   }
 
   return off;
 }
 
+s64
+readi(sref<mnode> m, char* buf, u64 start, u64 nbytes)
+{
+  return readi_common(m, start, nbytes,
+                      [buf](u64 off, const char *src, u64 len) {
+                        memmove(buf + off, src, len);
+                        return true;
+                      });
+}
+
+s64
+readiv(sref<mnode> m, const struct iovec *iov, int iovcnt,
+       u64 start, u64 nbytes)
+{
+  // Copy directly from file pages to the user's buffers.
+  int seg = 0;
+  u64 segoff = 0;
+  return readi_common(m, start, nbytes,
+                      [&](u64 off, const char *src, u64 len) {
+                        while (len) {
+                          if (seg == iovcnt)
+                            return false;
+                          u64 n = MIN(len, iov[seg].iov_len - segoff);
+                          if (putmem((char*)iov[seg].iov_base + segoff,
+                                     src, n))
+                            return false;
+                          src += n;
+                          len -= n;
+                          segoff += n;
+                          if (segoff == iov[seg].iov_len) {
+                            ++seg;
+                            segoff = 0;
+                          }
+                        }
+                        return true;
+                      });
+}
+
 s64
 writei(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
        mfile::resizer* parentresize)
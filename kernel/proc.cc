@@ -13,9 +13,11 @@
 #include "ns.hh"
 #include "work.hh"
 #include "filetable.hh"
+#include "kstats.hh"
 #include <uk/fcntl.h>
 #include <uk/unistd.h>
 #include <uk/wait.h>
+#include <uk/resource.h>
 
 u64
 proc::hash(const u32 &p)
@@ -34,16 +36,22 @@ enum { sched_debug = 0 };
 
 proc::proc(int npid) :
   kstack(0), qstack(0), killed(0), tf(0), uaccess_(0), user_fs_(0), pid(npid),
-  parent(0), context(0),   tsc(0), curcycles(0), cpuid(0), fpu_state(nullptr),
-  cpu_pin(0), oncv(0), cv_wakeup(0),
+  parent(0), context(0),   tsc(0), curcycles(0), acct(), child_acct(),
+  cpuid(0), fpu_state(nullptr), cpu_pin(0),
+  sched_policy(SCHED_OTHER), sched_prio(0), sched_weight(SCHED_WEIGHT_NICE_0),
+  vruntime(0), vruntime_cpu(-1), runq_level(-1), preempted_(false), reapable(false), oncv(0), cv_wakeup(0),
   futex_lock("proc::futex_lock", LOCKSTAT_PROC), unmap_tlbreq_(0),
   data_cpuid(-1), in_exec_(0), yield_(false), upath(nullptr), uargv(nullptr),
-  exception_inuse(0), magic(PROC_MAGIC), unmapped_hint(0), state_(EMBRYO)
+  tid_word(nullptr), vfork_parent(nullptr),
+  exception_inuse(0), magic(PROC_MAGIC), unmapped_hint(0), sig_pending(0),
+  sig_blocked(0), pgid(0), freer_(this), state_(EMBRYO)
 {
   snprintf(lockname, sizeof(lockname), "cv:proc:%d", pid);
   lock = spinlock(lockname+3, LOCKSTAT_PROC);
-  cv = new condvar(lockname);
-  gc = new gc_handle();
+  // proc::alloc fills in kstack, qstack, cv and gc
+  cv = nullptr;
+  gc = nullptr;
+  acct.last_cpu = -1;
   memset(__cxa_eh_global, 0, sizeof(__cxa_eh_global));
   memset(sig, 0, sizeof(sig));
 }
@@ -106,6 +114,23 @@ proc::set_cpu_pin(int cpu)
   return 0;
 }
 
+// Move the current process to cpu, unless it is pinned.
+void
+proc::migrate(int cpu)
+{
+  acquire(&lock);
+  if (myproc() != this)
+    panic("migrate not implemented for non-current proc");
+  if (cpu_pin || cpu == mycpu()->id) {
+    release(&lock);
+    return;
+  }
+  // post_swtch will put us on the new runq.
+  cpuid = cpu;
+  set_state(RUNNABLE);
+  sched();
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
@@ -116,6 +141,19 @@ yield(void)
   sched();
 }
 
+// Let the scheduler take the CPU away because our time slice is up
+// or a higher priority thread woke up.  Unlike yield, we keep running
+// if nothing queued outranks us.
+void
+preempt(void)
+{
+  acquire(&myproc()->lock);
+  myproc()->set_state(RUNNABLE);
+  myproc()->yield_ = false;
+  myproc()->preempted_ = true;
+  sched();
+}
+
 
 // A fork child's very first scheduling by scheduler()
 // will swtch here.  "Return" to user space.
@@ -136,6 +174,8 @@ forkret(void)
   if (myproc()->cwd_m == nullptr)
     myproc()->cwd_m = namei(myproc()->cwd_m, "/");
 
+  myproc()->acct.user_start = rdtsc();
+
   // Return to "caller", actually trapret (see allocproc).
   return myproc()->user_fs_;
 }
@@ -157,18 +197,44 @@ exit(int status)
 
   myproc()->status = (status & __WAIT_STATUS_VAL_MASK) | __WAIT_STATUS_EXITED;
 
-  // Pass abandoned children to init.
+  // Let threads joining us through our tid word know we're gone.
+  // This has to happen while we still have our address space.
+  if (myproc()->tid_word) {
+    u64 zero = 0;
+    futexkey_t key;
+    if (myproc()->tid_word.store(&zero) &&
+        futexkey(myproc()->tid_word.unsafe_get(), myproc()->vmap.get(),
+                 &key) == 0)
+      futexwake(key, ~0ull);
+  }
+
+  // Pass abandoned children to init.  Exiting children move
+  // themselves to their parent's zombieq with the parent locked, so
+  // hold our lock to keep them from moving under us.  Locks go from
+  // init to parent to child, as when a child exits, so take init's
+  // lock before ours.  Nothing can give us new children now, so if we
+  // have none, we can skip init's lock.
   wakeupinit = 0;
-  while (!myproc()->childq.empty()) {
-    auto &p = myproc()->childq.front();
-    myproc()->childq.pop_front();
-    scoped_acquire pl(&p.lock);
+  acquire(&myproc()->lock);
+  bool orphans = !myproc()->childq.empty() || !myproc()->zombieq.empty();
+  release(&myproc()->lock);
+  if (orphans) {
     scoped_acquire bl(&bootproc->lock);
-    p.parent = bootproc;
-    if(p.get_state() == ZOMBIE)  {
+    scoped_acquire ml(&myproc()->lock);
+    while (!myproc()->childq.empty()) {
+      auto &p = myproc()->childq.front();
+      myproc()->childq.pop_front();
+      scoped_acquire pl(&p.lock);
+      p.parent = bootproc;
+      bootproc->childq.push_back(&p);
+    }
+    while (!myproc()->zombieq.empty()) {
+      auto &p = myproc()->zombieq.front();
+      myproc()->zombieq.pop_front();
+      p.parent = bootproc;
+      bootproc->zombieq.push_back(&p);
       wakeupinit = 1;
     }
-    bootproc->childq.push_back(&p);
   }
 
   // Release vmap
@@ -181,18 +247,37 @@ exit(int status)
     // Remove user visible state associated with this proc from vmap.
     vmap->remove((uptr)myproc(), PGSIZE);
     vmap->remove((uptr)myproc()->kstack, KSTACKSIZE);
-  }
 
-  // Lock the parent first, since otherwise we might deadlock.
-  if (myproc()->parent != nullptr)
-    acquire(&myproc()->parent->lock);
+    // If this was the last user of the address space, tearing it
+    // down can take a while.  Do it in the background so our parent
+    // can reap us right away.
+    vmap::release_async(std::move(vmap), myproc()->data_cpuid);
+  }
+  myproc()->vfork_done();
+
+  // Lock the parent first, since otherwise we might deadlock.  Our
+  // parent may be passing us to init while we wait for its lock.
+  struct proc *parent;
+  for (;;) {
+    parent = myproc()->parent;
+    if (parent == nullptr)
+      break;
+    acquire(&parent->lock);
+    if (parent == myproc()->parent)
+      break;
+    release(&parent->lock);
+  }
 
   acquire(&(myproc()->lock));
 
   // Kernel threads might not have a parent
-  if (myproc()->parent != nullptr) {
-    release(&myproc()->parent->lock);
-    myproc()->parent->cv->wake_all();
+  if (parent != nullptr) {
+    // Let our parent find us without scanning its children
+    parent->childq.erase(parent->childq.iterator_to(myproc()));
+    parent->zombieq.push_back(myproc());
+    myproc()->reapable = true;
+    release(&parent->lock);
+    parent->cv->wake_all();
   } else {
     idlezombie(myproc());
   }
@@ -215,10 +300,18 @@ exit(int status)
   panic("zombie exit");
 }
 
+void
+proc::freer::do_gc()
+{
+  if (p->qstack)
+    proccache_put(p);
+  delete p;
+}
+
 static void
 freeproc(struct proc *p)
 {
-  delete p;
+  gc_delayed(&p->freer_);
 }
 
 proc*
@@ -236,30 +329,25 @@ proc::alloc(void)
   p->mtrace_stacks.curr = -1;
 #endif
 
-  if (!xnspid->insert(p->pid, p))
-    panic("allocproc: ns_insert");
-
-  // Allocate kernel stacks.
+  // Allocate kernel stacks.  Do this before p is visible in xnspid,
+  // since others may use p->cv once it is.
   try {
-    if(!(p->qstack = (char*) kalloc("qstack", KSTACKSIZE)))
-      throw_bad_alloc();
-
+    proccache_get(p);
 #if KSTACK_DEBUG && false // TODO: fix kstack debugging
     // vmalloc the stack to surround it with guard pages so we can
     // detect stack over/underflows.
+    kfree(p->kstack, KSTACKSIZE);
     p->kstack_vm = vmalloc<char[]>(KSTACKSIZE);
     p->kstack = p->kstack_vm.get();
-#else
-    if(!(p->kstack = (char*) kalloc("kstack", KSTACKSIZE)))
-      throw_bad_alloc();
 #endif
   } catch (...) {
-    if (!xnspid->remove(p->pid, &p))
-      panic("allocproc: ns_remove");
     freeproc(p);
     throw;
   }
 
+  if (!xnspid->insert(p->pid, p))
+    panic("allocproc: ns_insert");
+
   sp = p->kstack + KSTACKSIZE;
 
   // Leave room for trap frame.
@@ -323,20 +411,98 @@ proc::kill(void)
   return 0;
 }
 
+// Send signal signo to this thread.  Signals this thread hasn't
+// blocked take effect right away if they kill it or are ignored.
+// Otherwise they stay pending until the thread returns to user space
+// or reads them from a signalfd.
+int
+proc::signal(int signo)
+{
+  if (signo <= 0 || signo >= NSIG)
+    return -1;
+  if (signo == SIGKILL)
+    return kill();
+
+  u64 bit = sigmask(signo);
+  if (!(sig_blocked & bit)) {
+    if (sig[signo].sa_handler == SIG_IGN)
+      return 0;
+    if (sig[signo].sa_handler == SIG_DFL)
+      return kill();
+  }
+  sig_pending.fetch_or(bit);
+
+  // Wake the thread if it is waiting in signal_wait.  It checks
+  // sig_pending with its lock held, so once we've gone through its
+  // lock it is either on cv or will see the signal.
+  acquire(&lock);
+  release(&lock);
+  cv->wake_all();
+  return 0;
+}
+
+// Take a pending signal that this thread hasn't blocked.  Returns its
+// number, or 0 if there's none to run a handler for.  A signal whose
+// handler was reset to the default after it was sent kills us.
+int
+proc::take_signal(void)
+{
+  for (;;) {
+    u64 ready = sig_pending.load(std::memory_order_relaxed) & ~sig_blocked;
+    if (!ready)
+      return 0;
+    int signo = __builtin_ctzll(ready);
+    // A concurrent signalfd read may have taken it
+    if (!(sig_pending.fetch_and(~sigmask(signo)) & sigmask(signo)))
+      continue;
+    if (sig[signo].sa_handler == SIG_IGN)
+      continue;
+    if (sig[signo].sa_handler == SIG_DFL) {
+      kill();
+      return 0;
+    }
+    return signo;
+  }
+}
+
+// Send signal signo to process pid.  If pid is 0, send it to every
+// process in our process group, and if pid is less than -1, to every
+// process in group -pid.  We don't support signaling every process,
+// so pid -1 fails.
 int
-proc::kill(int pid)
+proc::kill(int pid, int signo)
 {
   struct proc *p;
 
-  // XXX The one use of lookup and it is wrong: it should return a locked
-  // proc structure, or be in an RCU epoch.  Now another process can delete
-  // p between lookup and kill.
-  p = xnspid->lookup(pid);
-  if (p == 0) {
-    panic("kill");
+  if (signo <= 0 || signo >= NSIG)
     return -1;
+
+  // Procs are freed through gc, so those we find in xnspid stay
+  // around until we're done with them, even if they exit meanwhile.
+  scoped_gc_epoch rcu;
+
+  if (pid <= 0) {
+    int pgid = pid == 0 ? myproc()->pgid : -pid;
+    if (pid == -1 || pgid <= 0)
+      return -1;
+    // xnspid's enumerate doesn't take any locks, so signaling a large
+    // group doesn't serialize with forks and exits elsewhere.  Group
+    // signals never reach init.
+    int n = 0;
+    xnspid->enumerate([pgid, signo, &n](u32, proc *p) {
+      if (p->pgid == pgid && p != bootproc && p->get_state() != ZOMBIE) {
+        p->signal(signo);
+        n++;
+      }
+      return false;
+    });
+    return n ? 0 : -1;
   }
-  return p->kill();
+
+  p = xnspid->lookup(pid);
+  if (p == 0)
+    return -1;
+  return p->signal(signo);
 }
 
 // Print a process listing to console.  For debugging.
@@ -397,7 +563,7 @@ doclone(clone_flags flags)
     freeproc(np);
   });
 
-  if (flags & CLONE_SHARE_VMAP) {
+  if (flags & (CLONE_SHARE_VMAP | CLONE_VFORK)) {
     np->vmap = myproc()->vmap;
   } else if (!(flags & CLONE_NO_VMAP)) {
     // Copy process state from p.
@@ -405,13 +571,17 @@ doclone(clone_flags flags)
   }
   np->init_vmap();
 
-  np->parent = myproc();
   *np->tf = *myproc()->tf;
   np->cpu_pin = myproc()->cpu_pin;
+  np->sched_policy = myproc()->sched_policy;
+  np->sched_prio = myproc()->sched_prio;
+  np->sched_weight = myproc()->sched_weight;
   np->data_cpuid = myproc()->data_cpuid;
   np->run_cpuid_ = myproc()->run_cpuid_;
   np->user_fs_ = myproc()->user_fs_;
   memcpy(np->sig, myproc()->sig, sizeof(np->sig));
+  np->sig_blocked = myproc()->sig_blocked;
+  np->pgid = myproc()->pgid;
 
   // Clear %eax so that fork returns 0 in the child.
   np->tf->rax = 0;
@@ -425,11 +595,24 @@ doclone(clone_flags flags)
   np->cwd = myproc()->cwd;
   np->cwd_m = myproc()->cwd_m;
   safestrcpy(np->name, myproc()->name, sizeof(myproc()->name));
-  acquire(&myproc()->lock);
-  myproc()->childq.push_back(np);
-  release(&myproc()->lock);
+  if (np->vmap && np->vmap != myproc()->vmap)
+    np->vmap->set_owner(np->pid, np->name);
+  if (!(flags & CLONE_NO_PARENT)) {
+    np->parent = myproc();
+    acquire(&myproc()->lock);
+    myproc()->childq.push_back(np);
+    release(&myproc()->lock);
+  }
 
-  np->cpuid = mycpu()->id;
+  // sys_spawn places its process once it has loaded the image.  A
+  // vfork child takes over our CPU, where our memory is warm, and
+  // exec will move it if there's a better one.
+  if (flags & (CLONE_NO_RUN | CLONE_VFORK))
+    np->cpuid = mycpu()->id;
+  else
+    np->cpuid = pickcpu(false);
+  if (flags & CLONE_VFORK)
+    np->vfork_parent = myproc();
   if (!(flags & CLONE_NO_RUN)) {
     acquire(&np->lock);
     addrun(np);
@@ -437,18 +620,39 @@ doclone(clone_flags flags)
   }
 
   proc_cleanup.dismiss();
+
+  if (flags & CLONE_VFORK) {
+    // np is running on our stack, so we can't return to user space
+    // until it's done with it.  np can't be reaped while we wait,
+    // since we're its parent.  This sleep isn't interruptible: if we
+    // exited, np would be left with a dangling vfork_parent.
+    acquire(&myproc()->lock);
+    while (np->vfork_parent)
+      myproc()->cv->sleep(&myproc()->lock);
+    release(&myproc()->lock);
+  }
   return np;
 }
 
+// If our parent is suspended in vfork, let it run again.  Called once
+// we no longer use the parent's address space.
+void
+proc::vfork_done()
+{
+  proc *p = vfork_parent;
+  if (!p)
+    return;
+  acquire(&p->lock);
+  vfork_parent = nullptr;
+  release(&p->lock);
+  p->cv->wake_all();
+}
+
 void
 finishproc(struct proc *p, bool removepid)
 {
   if (removepid && !xnspid->remove(p->pid, &p))
     panic("finishproc: ns_remove");
-#if !KSTACK_DEBUG
-  if (p->kstack)
-    kfree(p->kstack, KSTACKSIZE);
-#endif
 
   p->pid = 0;
   p->parent = 0;
@@ -473,42 +677,147 @@ struct finishproc_work : public dwork
 };
 
 
+// Find an exited child of the current process matching wpid (-1
+// for any child).  Sets *havekids if there is any matching child.
+// The caller must hold myproc()->lock.
+static proc *
+find_zombie(int wpid, bool *havekids)
+{
+  proc *me = myproc();
+  if (wpid == -1) {
+    *havekids = !me->childq.empty() || !me->zombieq.empty();
+    return me->zombieq.empty() ? nullptr : &me->zombieq.front();
+  }
+
+  // Only we can reap our children, so if p is one of them, it can't
+  // go away while we hold our lock.  If it isn't, all we do is look
+  // at its parent and pid, which may be stale (see proc::kill).
+  proc *p = xnspid->lookup(wpid);
+  *havekids = p && p->parent == me && p->pid == wpid;
+  if (*havekids && p->reapable)
+    return p;
+  return nullptr;
+}
+
+static u64
+cycles_to_ns(u64 cycles)
+{
+  extern u64 cpuhz;
+  return cycles / cpuhz * 1000000000 + cycles % cpuhz * 1000000000 / cpuhz;
+}
+
+static void
+acct_to_rusage(const proc_acct &a, struct rusage *ru)
+{
+  ru->ru_utime = cycles_to_ns(a.user);
+  // a.user can get ahead of a.run, which only catches up when the
+  // thread is switched out.
+  ru->ru_stime = cycles_to_ns(a.run > a.user ? a.run - a.user : 0);
+  ru->ru_wtime = cycles_to_ns(a.wait);
+  ru->ru_nvcsw = a.nvcsw;
+  ru->ru_nivcsw = a.nivcsw;
+  ru->ru_nmigrate = a.nmigrate;
+}
+
+// Return the current thread's resource usage, or the totals of its
+// reaped children.
+int
+getrusage(int who, struct rusage *ru)
+{
+  proc_acct a;
+  if (who == RUSAGE_SELF) {
+    a = myproc()->acct;
+    // Include the time since we were last switched in
+    a.run += rdtsc() - myproc()->tsc;
+  } else if (who == RUSAGE_CHILDREN) {
+    a = myproc()->child_acct;
+  } else {
+    return -1;
+  }
+  acct_to_rusage(a, ru);
+  return 0;
+}
+
+int
+proc::acct_read(char *dst, u32 off, u32 n)
+{
+  // Return one record for each thread.  Like procdumpall, this reads
+  // threads without locking them, so a reader that reads in pieces
+  // may see some twice or not at all.
+  u32 pos = 0, used = 0;
+  xnspid->enumerate([&](u32, proc *p) {
+      if (used == n)
+        return true;
+      if (pos + sizeof(procacct_rec) <= off) {
+        pos += sizeof(procacct_rec);
+        return false;
+      }
+
+      procacct_rec rec{};
+      struct rusage ru;
+      acct_to_rusage(p->acct, &ru);
+      rec.pid = p->pid;
+      memmove(rec.name, p->name, sizeof rec.name);
+      rec.name[sizeof rec.name - 1] = 0;
+      rec.cpu = p->acct.last_cpu;
+      rec.utime = ru.ru_utime;
+      rec.stime = ru.ru_stime;
+      rec.wtime = ru.ru_wtime;
+      rec.nvcsw = ru.ru_nvcsw;
+      rec.nivcsw = ru.ru_nivcsw;
+      rec.nmigrate = ru.ru_nmigrate;
+
+      u32 roff = off > pos ? off - pos : 0;
+      u32 len = MIN(sizeof rec - roff, n - used);
+      memmove(dst + used, (char*)&rec + roff, len);
+      used += len;
+      pos += sizeof rec;
+      return false;
+    });
+  return used;
+}
+
 // Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
+// Return -1 if this process has no children, or 0 if options
+// includes WNOHANG and no child has exited yet.  If ru is non-null,
+// fill it with the child's resource usage, including its own reaped
+// children.
 int
-wait(int wpid,  userptr<int> status)
+wait(int wpid, userptr<int> status, int options, struct rusage *ru)
 {
-  int havekids, pid;
+  bool havekids;
 
   for(;;){
-    // Scan children for ZOMBIEs
-    havekids = 0;
     acquire(&myproc()->lock);
-    for (auto it = myproc()->childq.begin(); it != myproc()->childq.end(); it++) {
-      proc &p = *it;
-      acquire(&p.lock);
-      if (wpid == -1 || wpid == p.pid) {
-	havekids = 1;
-	if(p.get_state() == ZOMBIE){
-	  release(&p.lock);	// noone else better be trying to lock p
-	  pid = p.pid;
-          myproc()->childq.erase(it);
-	  release(&myproc()->lock);
-
-          if (status) {
-            status.store(&p.status);
-          }
-
-          proc *np = &p;
-          if (!xnspid->remove(pid, &np))
-            panic("wait: ns_remove");
-
-          finishproc_work *w = new finishproc_work(&p);
-          assert(dwork_push(w, p.run_cpuid_) >= 0);
-	  return pid;
-	}
+    proc *p = find_zombie(wpid, &havekids);
+    if (p) {
+      int pid = p->pid;
+      myproc()->zombieq.erase(myproc()->zombieq.iterator_to(p));
+      release(&myproc()->lock);
+
+      // p went on our zombieq with its lock held, and holds it until
+      // it has switched away for the last time.
+      acquire(&p->lock);
+      assert(p->get_state() == ZOMBIE);
+      release(&p->lock);
+
+      if (status) {
+        status.store(&p->status);
       }
-      release(&p.lock);
+
+      proc_acct a = p->acct;
+      a.add(p->child_acct);
+      myproc()->child_acct.add(a);
+      if (ru)
+        acct_to_rusage(a, ru);
+
+      proc *np = p;
+      if (!xnspid->remove(pid, &np))
+        panic("wait: ns_remove");
+
+      finishproc_work *w = new finishproc_work(p);
+      assert(dwork_push(w, p->run_cpuid_) >= 0);
+      return pid;
     }
 
     // No point waiting if we don't have any children.
@@ -516,13 +825,55 @@ wait(int wpid,  userptr<int> status)
       release(&myproc()->lock);
       return -1;
     }
+    if (options & WNOHANG) {
+      release(&myproc()->lock);
+      return 0;
+    }
 
-    // Wait for children to exit.  (See wakeup1 call in proc_exit.)
+    // Wait for children to exit.  (See wake_all call in exit.)
     myproc()->cv->sleep(&myproc()->lock);
     release(&myproc()->lock);
   }
 }
 
+// Wait until the current process has an exited child and return its
+// pid without reaping it.  Return 0 if it has no children, or -1 if
+// nonblock is set and no child has exited yet, or if it was killed.
+int
+wait_ready(bool nonblock)
+{
+  scoped_acquire l(&myproc()->lock);
+  for (;;) {
+    bool havekids;
+    proc *p = find_zombie(-1, &havekids);
+    if (p)
+      return p->pid;
+    if (!havekids)
+      return 0;
+    if (nonblock || myproc()->killed)
+      return -1;
+    myproc()->cv->sleep(&myproc()->lock);
+  }
+}
+
+// Wait until a signal in mask is pending for the current thread and
+// take all pending signals in mask.  Returns the signals taken, or 0
+// if nonblock is set and none is pending, or if we were killed.
+u64
+signal_wait(u64 mask, bool nonblock)
+{
+  proc *p = myproc();
+  scoped_acquire l(&p->lock);
+  for (;;) {
+    u64 sigs = p->sig_pending.fetch_and(~mask) & mask;
+    if (sigs)
+      return sigs;
+    if (nonblock || p->killed)
+      return 0;
+    p->cv->sleep(&p->lock);
+  }
+}
+
 void
 threadhelper(void (*fn)(void *), void *arg)
 {
@@ -574,6 +925,7 @@ threadpin(void (*fn)(void*), void *arg, const char *name, int cpu)
     panic("threadpin: alloc");
 
   snprintf(p->name, sizeof(p->name), "%s", name);
+  p->vmap->set_owner(p->pid, p->name);
   p->cpuid = cpu;
   p->cpu_pin = 1;
   acquire(&p->lock);
@@ -592,6 +944,12 @@ proc::deliver_signal(int signo)
     return false;
 
   trapframe tf_save = *tf;
+  // sig_restore returns through tf_save with iretq and reloads %ds
+  // from the last word of padding3.  Traps don't save %ds and
+  // sysentry doesn't save the segments at all.
+  tf_save.padding3[7] = UDSEG | 0x3;
+  tf_save.cs = UCSEG | 0x3;
+  tf_save.ss = UDSEG | 0x3;
   tf->rsp -= 128;   // skip redzone
   tf->rsp -= sizeof(tf_save);
   if (putmem((void*) tf->rsp, &tf_save, sizeof(tf_save)) < 0)
@@ -0,0 +1,286 @@
+//
+// Per-CPU caches of process kernel stacks.
+//
+// Every process needs a kernel stack, a quasi user-visible stack, a
+// condvar and a GC handle, none of which depend on which process it
+// is.  When a process is freed, these go back to a per-CPU cache as a
+// bundle, so creating a process usually doesn't touch the page or
+// object allocators.
+//
+// A bundle belongs to the CPU that allocated it, where its memory is
+// local.  Processes are usually freed on the CPU they last ran on,
+// so a CPU collects other CPUs' bundles and returns them in batches.
+// Each CPU refills its cache in the background when it runs low, and
+// a shrinker empties the caches when memory runs low.
+//
+
+#include "types.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "proc.hh"
+#include "cpu.hh"
+#include "gc.hh"
+#include "numa.hh"
+#include "work.hh"
+#include "percpu.hh"
+#include "shrinker.hh"
+
+#include <algorithm>
+
+enum {
+  // Refill a CPU's cache in the background when taking a bundle
+  // leaves fewer than LOW_BUNDLES, up to HIGH_BUNDLES.
+  LOW_BUNDLES = 4,
+  HIGH_BUNDLES = 16,
+  // Most bundles a CPU caches.  Beyond this, freed bundles are
+  // released.
+  MAX_BUNDLES = 64,
+  // Bundles a CPU collects for other CPUs before returning them
+  RETURN_BATCH = 16,
+  // Pages held by a bundle
+  BUNDLE_PAGES = 2 * KSTACKSIZE / PGSIZE,
+};
+
+// A cached bundle.  This header lives at the bottom of the bundle's
+// qstack.
+struct bundle
+{
+  bundle *next;
+  char *kstack;                 // nullptr if the kernel stack was vmalloc'd
+  condvar *cv;
+  gc_handle *gc;
+  int home;                     // CPU that allocated this bundle
+};
+
+struct proc_cache : public dwork
+{
+  spinlock lock;
+  bundle *free;                 // Bundles homed on this CPU
+  int nfree;
+  std::atomic<bool> refilling;
+
+  // Other CPUs' bundles freed here, waiting to be returned.  Only
+  // this CPU touches these, with interrupts disabled.
+  bundle *out[RETURN_BATCH];
+  int nout;
+
+  proc_cache()
+    : lock("proc_cache", LOCKSTAT_PROC), free(nullptr), nfree(0),
+      refilling(false), nout(0) { }
+
+  void run() override;
+};
+
+DEFINE_PERCPU(proc_cache, proc_caches);
+
+static bundle *
+bundle_alloc(int home)
+{
+  char *qstack = (char*) kalloc("qstack", KSTACKSIZE);
+  char *kstack = (char*) kalloc("kstack", KSTACKSIZE);
+  condvar *cv = new (std::nothrow) condvar();
+  gc_handle *gc = new (std::nothrow) gc_handle();
+  if (!qstack || !kstack || !cv || !gc) {
+    if (qstack)
+      kfree(qstack, KSTACKSIZE);
+    if (kstack)
+      kfree(kstack, KSTACKSIZE);
+    delete cv;
+    delete gc;
+    return nullptr;
+  }
+
+  bundle *b = (bundle*)qstack;
+  b->kstack = kstack;
+  b->cv = cv;
+  b->gc = gc;
+  b->home = home;
+  return b;
+}
+
+static void
+bundle_free(bundle *b)
+{
+  if (b->kstack)
+    kfree(b->kstack, KSTACKSIZE);
+  delete b->cv;
+  delete b->gc;
+  kfree(b, KSTACKSIZE);
+}
+
+// Add n bundles to c's cache, releasing any that don't fit.
+static void
+cache_give(proc_cache *c, bundle **bs, int n)
+{
+  bundle *excess = nullptr;
+  {
+    scoped_acquire l(&c->lock);
+    for (int i = 0; i < n; i++) {
+      bundle *b = bs[i];
+      if (c->nfree < MAX_BUNDLES) {
+        b->next = c->free;
+        c->free = b;
+        c->nfree++;
+      } else {
+        b->next = excess;
+        excess = b;
+      }
+    }
+  }
+  while (excess) {
+    bundle *next = excess->next;
+    bundle_free(excess);
+    excess = next;
+  }
+}
+
+// Return the bundles c has collected to their home CPUs, taking each
+// home CPU's lock once.
+static void
+cache_return(proc_cache *c)
+{
+  std::sort(c->out, c->out + c->nout,
+            [](bundle *a, bundle *b) { return a->home < b->home; });
+  for (int i = 0; i < c->nout; ) {
+    int home = c->out[i]->home;
+    int j = i + 1;
+    while (j < c->nout && c->out[j]->home == home)
+      j++;
+    cache_give(&proc_caches[home], &c->out[i], j - i);
+    i = j;
+  }
+  c->nout = 0;
+}
+
+void
+proc_cache::run()
+{
+  int cpu = myid();
+  for (;;) {
+    {
+      scoped_acquire l(&lock);
+      if (nfree >= HIGH_BUNDLES)
+        break;
+    }
+    bundle *b = bundle_alloc(cpu);
+    if (!b)
+      break;
+    cache_give(this, &b, 1);
+  }
+  refilling = false;
+}
+
+// Give p its kernel stacks, condvar and GC handle.  Throws bad_alloc
+// if we're out of memory.
+void
+proccache_get(proc *p)
+{
+  bundle *b;
+  proc_cache *c;
+  int cpu;
+  bool refill = false;
+  {
+    scoped_cli cli;
+    cpu = myid();
+    c = &proc_caches[cpu];
+    scoped_acquire l(&c->lock);
+    if ((b = c->free) != nullptr) {
+      c->free = b->next;
+      if (--c->nfree < LOW_BUNDLES && !c->refilling) {
+        c->refilling = true;
+        refill = true;
+      }
+    }
+  }
+  if (refill)
+    dwork_push(c, cpu);
+
+  if (!b && !(b = bundle_alloc(cpu)))
+    throw_bad_alloc();
+  if (!b->kstack && !(b->kstack = (char*) kalloc("kstack", KSTACKSIZE))) {
+    bundle_free(b);
+    throw_bad_alloc();
+  }
+
+  p->kstack = b->kstack;
+  p->qstack = (char*)b;
+  p->kstack_home = b->home;
+  *b->cv = condvar(p->lockname);
+  b->gc->core = -1;
+  b->gc->epoch = 0;
+  p->cv = b->cv;
+  p->gc = b->gc;
+}
+
+// Return p's kernel stacks, condvar and GC handle to the cache.  p
+// must never run again.
+void
+proccache_put(proc *p)
+{
+  bundle *b = (bundle*)p->qstack;
+  // If kstack_vm holds the kernel stack, it frees it, and whoever
+  // gets this bundle next allocates a new one.
+  b->kstack = p->kstack_vm ? nullptr : p->kstack;
+  b->cv = p->cv;
+  b->gc = p->gc;
+  b->home = p->kstack_home;
+  p->kstack = p->qstack = nullptr;
+  p->cv = nullptr;
+  p->gc = nullptr;
+
+  scoped_cli cli;
+  proc_cache *c = &proc_caches[myid()];
+  if (b->home == myid()) {
+    cache_give(c, &b, 1);
+    return;
+  }
+  c->out[c->nout++] = b;
+  if (c->nout == RETURN_BATCH)
+    cache_return(c);
+}
+
+// Release cached bundles under memory pressure.
+class proc_cache_shrinker : public shrinker
+{
+public:
+  proc_cache_shrinker() : shrinker("proc caches") { }
+
+  size_t count(int node) override
+  {
+    size_t n = 0;
+    for (auto cpu : numa_nodes[node].cpuids)
+      n += proc_caches[cpu].nfree;
+    return n * BUNDLE_PAGES;
+  }
+
+  size_t scan(int node, size_t target, bool direct) override
+  {
+    size_t pages = 0;
+    for (auto cpu : numa_nodes[node].cpuids) {
+      proc_cache *c = &proc_caches[cpu];
+      bundle *list = nullptr;
+      {
+        scoped_acquire l(&c->lock);
+        while (c->free && pages < target) {
+          bundle *b = c->free;
+          c->free = b->next;
+          c->nfree--;
+          b->next = list;
+          list = b;
+          pages += BUNDLE_PAGES;
+        }
+      }
+      while (list) {
+        bundle *next = list->next;
+        bundle_free(list);
+        list = next;
+      }
+      if (pages >= target)
+        break;
+    }
+    return pages;
+  }
+};
+
+static proc_cache_shrinker proc_cache_shrinker;
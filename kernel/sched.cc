@@ -16,9 +16,59 @@
 #include "ilist.hh"
 #include "kstream.hh"
 #include "file.hh"
+#include "apic.hh"
+#include "traps.h"
+
+#include <algorithm>
+
+//
+// Each CPU has a run queue per real-time priority, which it serves
+// highest priority first, FIFO within a priority, and a queue of
+// SCHED_OTHER threads sorted by vruntime, which it serves only when
+// no real-time thread is runnable.  vruntime is CPU time scaled by
+// the thread's weight, so running the lowest vruntime first gives
+// each thread a share of the CPU proportional to its weight.
+//
+// Making a thread runnable on a CPU that's running something of lower
+// priority (or nothing) preempts it right away, with a T_RESCHED IPI
+// if it's another CPU.  Otherwise, the running thread is preempted on
+// the timer tick: SCHED_FIFO only for a higher priority, SCHED_RR
+// also for an equal priority, and SCHED_OTHER once it has a higher
+// vruntime than the next queued thread.
+//
 
 enum { sched_debug = 0 };
 
+// Weight of each nice value from SCHED_NICE_MIN to SCHED_NICE_MAX.
+// Each step is worth about 10% of the CPU relative to the next.
+static const u32 nice_weight[SCHED_NICE_MAX - SCHED_NICE_MIN + 1] = {
+  88761, 71755, 56483, 46273, 36291,
+  29154, 23254, 18705, 14949, 11916,
+  9548, 7620, 6100, 4904, 3906,
+  3121, 2501, 1991, 1586, 1277,
+  1024, 820, 655, 526, 423,
+  335, 272, 215, 172, 137,
+  110, 87, 70, 56, 45,
+  36, 29, 23, 18, 15,
+};
+
+// Scheduling rank of p: its real-time priority, or 0 for SCHED_OTHER.
+// An idle CPU has rank -1.
+static int
+sched_rank(const proc *p)
+{
+  return p->sched_policy == SCHED_OTHER ? 0 : p->sched_prio;
+}
+
+// How far behind its run queue's min_vruntime a thread that slept may
+// be placed when it wakes up, in cycles.
+static u64
+sleep_credit(void)
+{
+  extern u64 cpuhz;
+  return cpuhz / 1000 * QUANTUM / 2;
+}
+
 struct schedule : public balance_pool<schedule> {
 public:
   schedule(int id);
@@ -28,7 +78,8 @@ public:
   int id_;    // XXX false sharing on this var???
 
   void enq(proc* entry);
-  proc* deq();
+  proc* deq(proc *prev, u64 ran, bool preempted);
+  void set_sched(proc *p, int policy, int prio, u32 weight);
   void dump(print_stream *);
 
   void enq_dwork(dwork *w);
@@ -37,28 +88,70 @@ public:
   void balance_move_to(schedule *other);
   u64 balance_count() const;
 
+  // A cheap summary of how busy this CPU is: the number of processes
+  // waiting in its run queue plus one if it's running something other
+  // than its idle process.  Other CPUs read this without locking.
+  u32 load() const {
+    return nqueued_.load(std::memory_order_relaxed) +
+      (cur_rank_.load(std::memory_order_relaxed) >= 0 ? 1 : 0);
+  }
+
+  // The rank of what this CPU is running.  Other CPUs read this
+  // without locking to decide whether to preempt it.
+  int cur_rank() const {
+    return cur_rank_.load();
+  }
+
   sched_stat stats_;
   u64 ncansteal_;
+  // A T_RESCHED IPI is on its way to this CPU.  Other CPUs write
+  // this, so keep it off the lines this CPU uses.
+  std::atomic<bool> resched_pending_ __mpalign__;
 private:
   void sanity(void);
+  void insert(proc *p);
+  void remove(proc *p);
+  void set_cur_rank(int rank) {
+    if (cur_rank_.load(std::memory_order_relaxed) != rank)
+      cur_rank_.store(rank);
+  }
+  // Highest real-time priority with a queued thread, or 0 if none
+  int rt_top() const {
+    for (int i = NELEM(rtmask_) - 1; i >= 0; i--)
+      if (rtmask_[i])
+        return i * 64 + 63 - __builtin_clzll(rtmask_[i]);
+    return 0;
+  }
 
   struct spinlock lock_ __mpalign__;
-  ilist<proc, &proc::sched_link> proc_;
+  ilist<proc, &proc::sched_link> proc_;  // SCHED_OTHER, by vruntime
+  ilist<proc, &proc::sched_link> rt_[SCHED_RT_MAX + 1];
+  u64 rtmask_[(SCHED_RT_MAX + 64) / 64]; // Non-empty rt_ queues
+  u64 min_vruntime_;
+  // vruntime of the SCHED_OTHER thread this CPU last ran with nothing
+  // queued.  insert folds it into min_vruntime_, so deq doesn't have to
+  // take lock_ on every tick to keep min_vruntime_ up to date.
+  std::atomic<u64> idle_vruntime_;
   isqueue<dwork, &dwork::link_> work_;
   volatile bool cansteal_ __mpalign__;
+  std::atomic<u32> nqueued_;
+  std::atomic<int> cur_rank_;
   __padout__;
 };
 
 schedule::schedule(int id)
-  : balance_pool(1), id_(id), lock_("schedule::lock_", LOCKSTAT_SCHED)
+  : balance_pool(1), id_(id), ncansteal_(0), resched_pending_(false),
+    lock_("schedule::lock_", LOCKSTAT_SCHED), rtmask_{}, min_vruntime_(0),
+    idle_vruntime_(0),
+    nqueued_(0), cur_rank_(-1)
 {
-  ncansteal_ = 0;
   stats_.enqs = 0;
   stats_.deqs = 0;
   stats_.steals = 0;
   stats_.misses = 0;
   stats_.idle = 0;
   stats_.busy = 0;
+  stats_.preempts = 0;
   stats_.schedstart = 0;
 }
 
@@ -81,13 +174,14 @@ schedule::balance_move_to(schedule* target)
   if (!cansteal_ || !tryacquire(&lock_))
     return;
 
+  // Only SCHED_OTHER threads migrate.  A real-time thread stays on
+  // its CPU, where it preempts anything of lower priority.
   for (auto it = proc_.begin(); it != proc_.end(); ++it) {
     if ((*it).cansteal(true)) {
-      proc_.erase(it);
-      if (--ncansteal_ == 0)
-        cansteal_ = false;
-      sanity();
       victim = &(*it);
+      remove(victim);
+      sanity();
+      break;
     }
   }
   release(&lock_);
@@ -111,52 +205,166 @@ schedule::balance_move_to(schedule* target)
   ++stats_.misses;
   cprintf("%d: don't steal %s---hasn't run long enough\n", 
           mycpu()->id, victim->name);
-#if 0
-  // XXX why is this code here?  you should only steal a runnable process
-  // it has run for a while on the cpu, or not all.
-  if (victim->get_state() == RUNNABLE) {
-    target->enq(victim);
-  }
-#endif
+  // Put it back where it was so it doesn't get lost
+  if (victim->get_state() == RUNNABLE)
+    enq(victim);
   release(&victim->lock);
 }
 
+// Put p on the queue for its policy.  Caller must hold lock_.
+void
+schedule::insert(proc *p)
+{
+  if (p->sched_policy == SCHED_OTHER) {
+    min_vruntime_ = std::max(min_vruntime_,
+                             idle_vruntime_.load(std::memory_order_relaxed));
+    // A thread that last queued on another CPU starts at this CPU's
+    // min_vruntime_.  One that slept keeps at most sleep_credit() of
+    // the lead it built up, so it runs soon after waking up without
+    // starving everybody else.
+    if (p->vruntime_cpu != id_) {
+      p->vruntime = min_vruntime_;
+      p->vruntime_cpu = id_;
+    } else if (p->vruntime + sleep_credit() < min_vruntime_) {
+      p->vruntime = min_vruntime_ - sleep_credit();
+    }
+    // Threads usually queue with the highest vruntime, so search from
+    // the back.
+    auto it = proc_.end();
+    while (it != proc_.begin()) {
+      auto prev = it;
+      if ((--prev)->vruntime <= p->vruntime)
+        break;
+      it = prev;
+    }
+    proc_.insert(it, p);
+    if (p->cansteal(true))
+      if (ncansteal_++ == 0) {
+        cansteal_ = true;
+      }
+  } else {
+    rt_[p->sched_prio].push_back(p);
+    rtmask_[p->sched_prio / 64] |= 1ull << (p->sched_prio % 64);
+  }
+  p->runq_level = sched_rank(p);
+  nqueued_.fetch_add(1);
+}
+
+// Take p off its queue.  Caller must hold lock_.
+void
+schedule::remove(proc *p)
+{
+  int level = p->runq_level;
+  if (level == 0) {
+    proc_.erase(proc_.iterator_to(p));
+    if (p->cansteal(true))
+      if (--ncansteal_ == 0)
+        cansteal_ = false;
+  } else {
+    rt_[level].erase(rt_[level].iterator_to(p));
+    if (rt_[level].empty())
+      rtmask_[level / 64] &= ~(1ull << (level % 64));
+  }
+  p->runq_level = -1;
+  nqueued_.fetch_sub(1, std::memory_order_relaxed);
+}
+
 void
 schedule::enq(proc* p)
 {
   scoped_acquire x(&lock_);
-  proc_.push_back(p);
-  if (p->cansteal(true))
-    if (ncansteal_++ == 0) {
-      cansteal_ = true;
-    }
+  insert(p);
   sanity();
   stats_.enqs++;
 }
 
+// Charge prev, the thread this CPU was running (or nullptr for the
+// idle thread), for ran cycles and return the thread to run next.
+// Returns nullptr if prev should keep running, or if there's nothing
+// to run.  preempted is true if prev isn't giving up the CPU
+// voluntarily, in which case it keeps it against equals when its
+// policy says so.
 proc*
-schedule::deq(void)
-{   
-  if (proc_.empty())
+schedule::deq(proc *prev, u64 ran, bool preempted)
+{
+  bool fair = prev && prev->sched_policy == SCHED_OTHER;
+  if (fair)
+    prev->vruntime += ran * SCHED_WEIGHT_NICE_0 / prev->sched_weight;
+
+  proc *cur = nullptr;
+  if (prev && prev->get_state() == RUNNABLE && prev->cpuid == id_)
+    cur = prev;
+  // Publish the rank we'll have if nothing is queued before checking
+  // the queues.  Together with enq, which queues before reading our
+  // rank, this ensures a thread queued here either gets picked up now
+  // or preempts us.
+  set_cur_rank(cur ? sched_rank(cur) : -1);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (nqueued_.load(std::memory_order_relaxed) == 0) {
+    if (cur && fair && cur->vruntime_cpu == id_)
+      idle_vruntime_.store(cur->vruntime, std::memory_order_relaxed);
     return nullptr;
-  // Remove from head
+  }
+
   scoped_acquire x(&lock_);
-  if (proc_.empty()) 
+  // Advance min_vruntime_ to the lowest vruntime of cur and the queue.
+  // It never moves backward.
+  if (cur && fair && cur->vruntime_cpu == id_) {
+    u64 v = cur->vruntime;
+    if (!proc_.empty())
+      v = std::min(v, proc_.front().vruntime);
+    min_vruntime_ = std::max(min_vruntime_, v);
+  } else if (!proc_.empty()) {
+    min_vruntime_ = std::max(min_vruntime_, proc_.front().vruntime);
+  }
+
+  int top = rt_top();
+  int qrank = top ? top : (proc_.empty() ? -1 : 0);
+  if (qrank < 0)
     return nullptr;
-  proc &p = proc_.front();
-  proc_.pop_front();
-  if (p.cansteal(true))
-    if (--ncansteal_ == 0)
-      cansteal_ = false;
+  if (cur) {
+    int rank = sched_rank(cur);
+    if (rank > qrank)
+      return nullptr;
+    // Against an equal, a preempted SCHED_FIFO thread keeps running,
+    // and so does a preempted SCHED_OTHER thread that hasn't had more
+    // than its share.
+    if (rank == qrank && preempted &&
+        (cur->sched_policy == SCHED_FIFO ||
+         (rank == 0 && cur->vruntime <= proc_.front().vruntime)))
+      return nullptr;
+  }
+
+  proc *p = top ? &rt_[top].front() : &proc_.front();
+  remove(p);
+  set_cur_rank(sched_rank(p));
   sanity();
   stats_.deqs++;
-  return &p;
+  return p;
+}
+
+// Change p's scheduling policy, moving it to its new queue if it's
+// queued here.  Caller must hold p->lock.
+void
+schedule::set_sched(proc *p, int policy, int prio, u32 weight)
+{
+  scoped_acquire x(&lock_);
+  bool queued = p->runq_level >= 0;
+  if (queued)
+    remove(p);
+  p->sched_policy = policy;
+  p->sched_prio = prio;
+  p->sched_weight = weight;
+  if (queued)
+    insert(p);
+  sanity();
 }
 
 void
 schedule::dump(print_stream *s)
 {
-  s->print(" enq ", stats_.enqs, " deqs ", stats_.deqs, " steals ", stats_.steals, " misses ", stats_.misses);
+  s->print(" enq ", stats_.enqs, " deqs ", stats_.deqs, " steals ", stats_.steals, " misses ", stats_.misses,
+           " preempts ", stats_.preempts);
 }
 
 void
@@ -165,12 +373,26 @@ schedule::sanity(void)
 #if DEBUG
   u64 n = 0;
 
-  for (auto &p : proc_) 
+  u64 queued = 0;
+
+  for (auto &p : proc_) {
     if (p.cansteal(true))
       n++;
+    queued++;
+  }
   
   if (n != ncansteal_)
     panic("schedule::sanity: %lu != %lu", n, ncansteal_);
+
+  for (int i = 1; i <= SCHED_RT_MAX; i++) {
+    for (auto it = rt_[i].begin(); it != rt_[i].end(); ++it)
+      queued++;
+    if (rt_[i].empty() != !(rtmask_[i / 64] & (1ull << (i % 64))))
+      panic("schedule::sanity: rtmask %d", i);
+  }
+
+  if (queued != nqueued_)
+    panic("schedule::sanity: %lu queued != %u", queued, nqueued_.load());
 #endif
 }
 
@@ -218,7 +440,58 @@ public:
 
   void addrun(struct proc* p) {
     p->set_state(RUNNABLE);
+    p->acct.wait_start = rdtsc();
     schedule_[p->cpuid]->enq(p);
+    // Preempt the CPU if p outranks what it's running.  This also
+    // wakes it up if it's idle.
+    if (sched_rank(p) > schedule_[p->cpuid]->cur_rank())
+      resched(p->cpuid);
+  }
+
+  // Make cpu pick a thread to run again.  Caller must have interrupts
+  // disabled.
+  void resched(int cpu) {
+    schedule *s = schedule_[cpu];
+    // Count on this CPU so we don't write to cpu's stats
+    schedule_[mycpu()->id]->stats_.preempts++;
+    if (cpu == mycpu()->id) {
+      if (myproc())
+        myproc()->yield_ = true;
+    } else if (!s->resched_pending_.load(std::memory_order_relaxed) &&
+               !s->resched_pending_.exchange(true)) {
+      lapic->send_resched(&cpus[cpu]);
+    }
+  }
+
+  // Handle a T_RESCHED IPI
+  void on_resched() {
+    schedule_[mycpu()->id]->resched_pending_.store(false);
+    myproc()->yield_ = true;
+  }
+
+  int set_sched(proc *p, int policy, int prio) {
+    u32 weight = SCHED_WEIGHT_NICE_0;
+    if (policy == SCHED_OTHER) {
+      if (prio < SCHED_NICE_MIN || prio > SCHED_NICE_MAX)
+        return -1;
+      weight = nice_weight[prio - SCHED_NICE_MIN];
+    } else if (policy == SCHED_FIFO || policy == SCHED_RR) {
+      if (prio < 1 || prio > SCHED_RT_MAX)
+        return -1;
+    } else {
+      return -1;
+    }
+
+    scoped_acquire l(&p->lock);
+    schedule_[p->cpuid]->set_sched(p, policy, prio, weight);
+    if (p == myproc()) {
+      // Let sched decide whether we still rank first
+      p->yield_ = true;
+    } else if (p->runq_level >= 0 &&
+               sched_rank(p) > schedule_[p->cpuid]->cur_rank()) {
+      resched(p->cpuid);
+    }
+    return 0;
   }
 
   void pushwork(struct dwork *w, int cpu) {
@@ -229,8 +502,52 @@ public:
     schedule_[mycpu()->id]->try_dwork();
   }
 
-  proc* next() {
-    return schedule_[mycpu()->id]->deq();
+  proc* next(u64 ran, bool preempted) {
+    proc *prev = myproc() == idleproc() ? nullptr : myproc();
+    return schedule_[mycpu()->id]->deq(prev, ran, preempted);
+  }
+
+  // Return the least loaded CPU in [lo, hi), or -1 if none has a load
+  // below best.  Updates best.
+  int least_loaded(int lo, int hi, u32 *best) const {
+    int res = -1;
+    for (int cpu = lo; cpu < hi && *best > 0; cpu++) {
+      u32 load = schedule_[cpu]->load();
+      if (load < *best) {
+        *best = load;
+        res = cpu;
+      }
+    }
+    return res;
+  }
+
+  int pick_cpu(bool self) const {
+    int me = mycpu()->id;
+    if (!SCHED_PLACEMENT)
+      return me;
+
+    // Stay here unless another CPU is strictly less loaded.  If self
+    // is set, the process being placed is the one running here, so
+    // don't count it against this CPU.
+    u32 best = schedule_[me]->load();
+    if (self && best > 0)
+      best--;
+    int res = me;
+
+    int sock_lo = (me / NCPU_PER_SOCKET) * NCPU_PER_SOCKET;
+    int sock_hi = std::min(sock_lo + NCPU_PER_SOCKET, ncpu);
+    int cpu = least_loaded(sock_lo, sock_hi, &best);
+    if (cpu >= 0)
+      res = cpu;
+    if (SCHED_PLACEMENT >= 2) {
+      // Try the other sockets, starting with the next one so that not
+      // every socket prefers the same one
+      if ((cpu = least_loaded(sock_hi, ncpu, &best)) >= 0)
+        res = cpu;
+      if ((cpu = least_loaded(0, sock_lo, &best)) >= 0)
+        res = cpu;
+    }
+    return res;
   }
 
   void
@@ -256,10 +573,14 @@ public:
     if(readrflags()&FL_IF)
       panic("sched interruptible");
     intena = mycpu()->intena;
-    myproc()->curcycles += rdtsc() - myproc()->tsc;
+    u64 ran = rdtsc() - myproc()->tsc;
+    myproc()->curcycles += ran;
+    myproc()->acct.run += ran;
+    bool preempted = myproc()->preempted_;
+    myproc()->preempted_ = false;
 
     // Interrupts are disabled
-    next = this->next();
+    next = this->next(ran, preempted);
 
     u64 t = rdtsc();
     if (myproc() == idleproc())
@@ -275,6 +596,7 @@ public:
         next = idleproc();
       } else {
         myproc()->set_state(RUNNING);
+        myproc()->tsc = t;
         mycpu()->intena = intena;
         release(&myproc()->lock);
         return;
@@ -285,6 +607,12 @@ public:
       panic("non-RUNNABLE next %s %u", next->name, next->get_state());
 
     prev = myproc();
+    // prev is still runnable if it was preempted or yielded rather
+    // than blocking.
+    if (prev->get_state() == RUNNABLE)
+      prev->acct.nivcsw++;
+    else if (prev->get_state() == SLEEPING)
+      prev->acct.nvcsw++;
     mycpu()->proc = next;
     mycpu()->prev = prev;
 
@@ -297,6 +625,14 @@ public:
     switchvm(next);
     next->set_state(RUNNING);
     next->tsc = rdtsc();
+    if (next != idleproc()) {
+      next->acct.wait += next->tsc - next->acct.wait_start;
+      if (next->acct.last_cpu != mycpu()->id) {
+        if (next->acct.last_cpu >= 0)
+          next->acct.nmigrate++;
+        next->acct.last_cpu = mycpu()->id;
+      }
+    }
 
     if (next->context->rip != (uptr)threadstub && next->context->rip != (uptr)forkret) {
       mtresume(next);
@@ -367,6 +703,31 @@ statread(mdev* m, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
+// Return the CPU a new process image should run on: the least
+// loaded CPU according to SCHED_PLACEMENT.  If self is true, the
+// image is the current process's.
+int
+pickcpu(bool self)
+{
+  return thesched_dir.pick_cpu(self);
+}
+
+// Set p's scheduling policy.  prio is the real-time priority for
+// SCHED_FIFO and SCHED_RR, and the nice value for SCHED_OTHER.  If p
+// is running on another CPU, the change takes effect when that CPU
+// next schedules.
+int
+proc::set_sched(int policy, int prio)
+{
+  return thesched_dir.set_sched(this, policy, prio);
+}
+
+void
+sched_resched_ipi(void)
+{
+  thesched_dir.on_resched();
+}
+
 int
 steal(void)
 {
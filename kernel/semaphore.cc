@@ -4,10 +4,17 @@ void
 semaphore::acquire(uint64_t permits)
 {
   scoped_acquire l(&lock);
-  while (count < permits) {
-    cv.sleep(&lock);
+  if (count < permits) {
+    int caller = 0;
+    u64 ts = stat.block(__builtin_return_address(0), &caller);
+    // cv.sleep throws if we're killed
+    auto cleanup = scoped_cleanup([&]() { stat.unblock(ts, caller); });
+    while (count < permits) {
+      cv.sleep(&lock);
+    }
   }
   count -= permits;
+  stat.acquired();
 }
 
 bool
@@ -17,14 +24,20 @@ semaphore::try_acquire(uint64_t permits, uint64_t nsec)
   if (nsec == 0 && count < permits)
     return false;
 
-  uint64_t now = nsectime();
-  uint64_t target = now + nsec;
-  while (count < permits && ((now = nsectime()) < target)) {
-    cv.sleep_to(&lock, target);
+  if (count < permits) {
+    int caller = 0;
+    u64 ts = stat.block(__builtin_return_address(0), &caller);
+    auto cleanup = scoped_cleanup([&]() { stat.unblock(ts, caller); });
+    uint64_t now = nsectime();
+    uint64_t target = now + nsec;
+    while (count < permits && ((now = nsectime()) < target)) {
+      cv.sleep_to(&lock, target);
+    }
   }
   if (count < permits)
     return false;
   count -= permits;
+  stat.acquired();
   return true;
 }
 
@@ -0,0 +1,185 @@
+//
+// Memory pressure reclaim for kernel caches.
+//
+
+#include "types.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "cpu.hh"
+#include "numa.hh"
+#include "gc.hh"
+#include "kstats.hh"
+#include "kstream.hh"
+#include "shrinker.hh"
+
+#include <algorithm>
+
+enum {
+  // A node's watermarks, as fractions of its memory.  Reclaim starts
+  // when free memory drops below the low watermark and stops when it
+  // reaches the high watermark.
+  LOW_WMARK_DIV = 64,
+  HIGH_WMARK_DIV = 32,
+  // How often reclaim threads check their watermarks even if nobody
+  // woke them (in msec)
+  RECLAIM_INTERVAL = 1000,
+  // Extra pages to release on direct reclaim, beyond what the failed
+  // allocation needs
+  DIRECT_SLACK = 32,
+  // Minimum time between compaction passes on a node (in msec)
+  COMPACT_INTERVAL = 1000,
+};
+
+static std::atomic<shrinker*> shrinkers;
+
+struct node_reclaim
+{
+  spinlock lock;
+  condvar cv;
+  bool wanted;
+  bool compact;
+
+  node_reclaim()
+    : lock("node_reclaim"), cv("node_reclaim"), wanted(false),
+      compact(false) { }
+};
+
+static node_reclaim reclaimers[MAX_NUMA_NODES];
+
+shrinker::shrinker(const char *name)
+  : name_(name), reclaimed_(0)
+{
+  // This may run before the scheduler and kalloc are up, so just push
+  // ourselves on the list.
+  next_ = shrinkers.load(std::memory_order_relaxed);
+  while (!shrinkers.compare_exchange_weak(next_, this));
+}
+
+void
+shrinker::print_all(print_stream *s)
+{
+  for (shrinker *sh = shrinkers.load(); sh; sh = sh->next_) {
+    size_t count = 0;
+    for (auto &node : numa_nodes)
+      count += sh->count(node.id);
+    s->println("shrinker ", sh->name_, " reclaimable (pages) ", count,
+               " reclaimed (pages) ", sh->reclaimed_.load());
+  }
+}
+
+size_t
+shrink_node(int node, size_t target, bool direct)
+{
+  size_t done = 0;
+  for (shrinker *sh = shrinkers.load(); sh && done < target; sh = sh->next_) {
+    size_t n = sh->scan(node, target - done, direct);
+    sh->reclaimed_ += n;
+    done += n;
+  }
+  return done;
+}
+
+static size_t
+low_wmark(int node)
+{
+  return kalloc_node_total(node) / LOW_WMARK_DIV;
+}
+
+static size_t
+high_wmark(int node)
+{
+  return kalloc_node_total(node) / HIGH_WMARK_DIV;
+}
+
+void
+reclaim_check(int node)
+{
+  auto &r = reclaimers[node];
+  if (r.wanted || kalloc_node_free(node) >= low_wmark(node))
+    return;
+  scoped_acquire l(&r.lock);
+  if (!r.wanted) {
+    r.wanted = true;
+    r.cv.wake_all();
+  }
+}
+
+bool
+reclaim_direct(int node, size_t size)
+{
+  size_t target = (size + PGSIZE - 1) / PGSIZE + DIRECT_SLACK;
+  kstats::inc(&kstats::reclaim_direct_count);
+  size_t n = shrink_node(node, target, true);
+  // Try other nodes before giving up.  kalloc will steal from them.
+  for (auto &other : numa_nodes)
+    if (n < target && other.id != node)
+      n += shrink_node(other.id, target - n, true);
+  kstats::inc(&kstats::reclaim_direct_pages, n);
+  reclaim_check(node);
+  return n > 0;
+}
+
+void
+compact_request(int node)
+{
+  auto &r = reclaimers[node];
+  if (r.compact)
+    return;
+  scoped_acquire l(&r.lock);
+  if (!r.compact) {
+    r.compact = true;
+    r.cv.wake_all();
+  }
+}
+
+static void
+reclaim_worker(void *arg)
+{
+  int node = (uintptr_t)arg;
+  auto &r = reclaimers[node];
+  u64 last_compact = 0;
+
+  acquire(&r.lock);
+  for (;;) {
+    if (!r.wanted && !r.compact)
+      r.cv.sleep_to(&r.lock,
+                    nsectime() + ((u64)RECLAIM_INTERVAL)*1000000ull);
+    r.wanted = false;
+    bool compact = r.compact;
+    r.compact = false;
+    release(&r.lock);
+
+    if (compact &&
+        nsectime() - last_compact >= ((u64)COMPACT_INTERVAL)*1000000ull) {
+      kalloc_compact();
+      last_compact = nsectime();
+    }
+
+    size_t free = kalloc_node_free(node);
+    if (free < low_wmark(node)) {
+      kstats::inc(&kstats::reclaim_wakeup_count);
+      size_t target = (high_wmark(node) - free) / PGSIZE;
+      size_t n = shrink_node(node, target, false);
+      kstats::inc(&kstats::reclaim_pages, n);
+      // Objects waiting for an RCU epoch to pass don't count, but
+      // they'll free up soon if we nudge the collector.
+      if (n < target)
+        gc_wakeup();
+    }
+
+    acquire(&r.lock);
+  }
+}
+
+void
+initreclaim(void)
+{
+  for (auto &node : numa_nodes) {
+    if (node.cpuids.empty())
+      continue;
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "reclaim_%lu", node.id);
+    threadpin(reclaim_worker, (void*)node.id, namebuf, node.cpuids[0]);
+  }
+}
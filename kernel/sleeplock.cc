@@ -0,0 +1,28 @@
+#include "types.h"
+#include "kernel.hh"
+#include "sleeplock.hh"
+
+void
+sleeplock::acquire()
+{
+  scoped_acquire x(&spinlock_);
+  if (held_) {
+    int caller = 0;
+    u64 ts = stat_.block(__builtin_return_address(0), &caller);
+    // cv_.sleep throws if we're killed
+    auto cleanup = scoped_cleanup([&]() { stat_.unblock(ts, caller); });
+    while (held_)
+      cv_.sleep(&spinlock_);
+  }
+  held_ = true;
+  stat_.acquired();
+}
+
+void
+sleeplock::release()
+{
+  scoped_acquire x(&spinlock_);
+  stat_.releasing();
+  held_ = false;
+  cv_.wake_all();
+}
@@ -5,6 +5,7 @@
 #include "amd64.h"
 #include "cpu.hh"
 #include "bits.hh"
+#include "log2.hh"
 #include "spinlock.hh"
 #include "mtrace.h"
 #include "condvar.hh"
@@ -17,9 +18,11 @@
 // but have never been acquired.
 struct klockstat klockstat_lazy("<lazy>");
 
-static int lockstat_enable;
+int lockstat_enable;
 
 void lockstat_init(struct spinlock *lk, bool lazy);
+static void lockstat_init(struct klockstat **slot, const char *name, u32 kind,
+                          bool lazy);
 
 static inline struct cpulockstat *
 mylockstat(struct spinlock *lk)
@@ -130,36 +133,136 @@ ilist<klockstat,&klockstat::link> lockstat_list;
 //static struct lockstat_list lockstat_list = { (struct klockstat*) nullptr };
 static struct spinlock lockstat_lock("lockstat");
 
-klockstat::klockstat(const char *name) :
+klockstat::klockstat(const char *name, u32 kind) :
   rcu_freed("klockstat", this, sizeof(*this))
 {
   magic = LOCKSTAT_MAGIC;
   memset(&s, 0, sizeof(s));
   safestrcpy(s.name, name, sizeof(s.name));
+  s.kind = kind;
+  key = nullptr;
 };
 
-void
-lockstat_init(struct spinlock *lk, bool lazy)
+static void
+lockstat_init(struct klockstat **slot, const char *name, u32 kind, bool lazy)
 {
-  klockstat *ls = new klockstat(lk->name);
+  klockstat *ls = new klockstat(name, kind);
   if (!ls)
     return;
 
   if (lazy) {
-    if (!__sync_bool_compare_and_swap(&lk->stat, &klockstat_lazy, ls)) {
+    if (!__sync_bool_compare_and_swap(slot, &klockstat_lazy, ls)) {
       delete ls;
       return;
     }
   } else {
-    lk->stat = ls;
+    *slot = ls;
   }
 
   acquire(&lockstat_lock);
-  lockstat_list.push_front(lk->stat);
+  lockstat_list.push_front(ls);
   //LIST_INSERT_HEAD(&lockstat_list, lk->stat, link);
   release(&lockstat_lock);
 }
 
+void
+lockstat_init(struct spinlock *lk, bool lazy)
+{
+  lockstat_init(&lk->stat, lockname(lk), LOCKSTAT_KIND_SPIN, lazy);
+}
+
+// Point *slot, which must be &klockstat_lazy, at the shared klockstat
+// for blocking primitive name.
+static void
+blockstat_init(struct klockstat **slot, const char *name, u32 kind)
+{
+  {
+    scoped_acquire l(&lockstat_lock);
+    for (auto &stat : lockstat_list) {
+      if (stat.key && stat.s.kind == kind && strcmp(stat.key, name) == 0) {
+        __sync_bool_compare_and_swap(slot, &klockstat_lazy, &stat);
+        return;
+      }
+    }
+  }
+
+  // XXX Two instances could race to create the klockstat, in which
+  // case their statistics are reported separately.
+  klockstat *ls = new klockstat(name, kind);
+  ls->key = name;
+  if (!__sync_bool_compare_and_swap(slot, &klockstat_lazy, ls)) {
+    delete ls;
+    return;
+  }
+  scoped_acquire l(&lockstat_lock);
+  lockstat_list.push_front(ls);
+}
+
+u64
+blockstat::block_slow(void *pc, int *caller)
+{
+  if (stat_ == &klockstat_lazy)
+    blockstat_init(&stat_, name_, kind_);
+  struct lockstat *s = &stat_->s;
+
+  // s is shared with other instances, which may be protected by
+  // other locks, so update it atomically.
+  u32 nwaiters = nwaiters_++;
+  int bucket = 0;
+  if (nwaiters)
+    bucket = MIN(LOCKSTAT_WAITER_BUCKETS - 1, floor_log2(nwaiters) + 1);
+  __atomic_add_fetch(&s->waiters[bucket], 1, __ATOMIC_RELAXED);
+
+  // Find or allocate this caller's entry.  The last entry collects
+  // callers that don't fit.
+  int i;
+  for (i = 0; i < LOCKSTAT_NCALLERS - 1; i++) {
+    u64 cur = s->callers[i].pc;
+    if (cur == 0 &&
+        __atomic_compare_exchange_n(&s->callers[i].pc, &cur, (uptr)pc, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+    if (cur == (uptr)pc)
+      break;
+  }
+  __atomic_add_fetch(&s->callers[i].contends, 1, __ATOMIC_RELAXED);
+  *caller = i;
+
+  s->cpu[mycpu()->id].contends++;
+  return rdtsc();
+}
+
+void
+blockstat::unblock_slow(u64 ts, int caller)
+{
+  u64 delta = rdtsc() - ts;
+  --nwaiters_;
+  // The stat may have been disabled while we were blocked
+  if (stat_ == nullptr || stat_ == &klockstat_lazy)
+    return;
+  stat_->s.cpu[mycpu()->id].locking += delta;
+  __atomic_add_fetch(&stat_->s.callers[caller].waiting, delta,
+                     __ATOMIC_RELAXED);
+}
+
+void
+blockstat::acquired_slow()
+{
+  if (stat_ == &klockstat_lazy)
+    blockstat_init(&stat_, name_, kind_);
+  stat_->s.cpu[mycpu()->id].acquires++;
+  if (kind_ == LOCKSTAT_KIND_SLEEPLOCK)
+    locked_ts_ = rdtsc();
+}
+
+void
+blockstat::releasing_slow()
+{
+  if (stat_ && stat_ != &klockstat_lazy)
+    stat_->s.cpu[mycpu()->id].locked += rdtsc() - locked_ts_;
+  locked_ts_ = 0;
+}
+
 static void
 lockstat_stop(struct spinlock *lk)
 {
@@ -186,6 +289,8 @@ lockstat_clear(void)
       // stat->link.le_next = 0;
       gc_delayed(stat);
     } else {
+      memset(&stat->s.waiters, 0, sizeof(stat->s.waiters));
+      memset(&stat->s.callers, 0, sizeof(stat->s.callers));
       memset(&stat->s.cpu, 0, sizeof(stat->s.cpu));
     }
   }
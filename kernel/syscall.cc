@@ -7,6 +7,7 @@
 #include "amd64.h"
 #include "cpu.hh"
 #include "kmtrace.hh"
+#include "kstats.hh"
 #include "errno.h"
 
 extern "C" int __uaccess_mem(void* dst, const void* src, u64 size);
@@ -115,6 +116,7 @@ syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
         // }
 
         u64 r;
+        u64 start = rdtsc();
         mtstart(syscalls[num], myproc());
         mtrec();
         {
@@ -123,6 +125,9 @@ syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
         }
         mtstop(myproc());
         mtign();
+        // We may have migrated, so this is charged to the CPU the
+        // call finished on.
+        mysyscall_kstats()[num].record(rdtsc() - start, (s64)r < 0);
         return r;
       } else {
         cprintf("%d %s: unknown sys call %ld\n",
@@ -64,17 +64,14 @@ sys_dup2(int ofd, int nfd)
 }
 
 static off_t
-compute_offset(file_inode *fi, off_t *fioffp, off_t offset, int whence)
+compute_offset(file_inode *fi, off_t fioff, off_t offset, int whence)
 {
   switch (whence) {
   case SEEK_SET:
     return offset;
 
-  case SEEK_CUR: {
-    off_t fioff = fi->off;
-    if (fioffp) *fioffp = fioff;
+  case SEEK_CUR:
     return fioff + offset;
-  }
 
   case SEEK_END:
     if (offset < 0) {
@@ -105,23 +102,18 @@ sys_lseek(int fd, off_t offset, int whence)
   if (fi->ip->type() != mnode::types::file)
     return -1;                  // ESPIPE
 
-  // Pre-validate offset and whence.  Be careful to only read fi->off
-  // once, regardless of what code path we take.
-  off_t fioff = -1;
-  off_t orig_new_off = compute_offset(fi, &fioff, offset, whence);
-  if (orig_new_off < 0)
-    return -1;
-  if (fioff == -1)
-    fioff = fi->off;
-  if (orig_new_off == fioff)
-    // No change; don't acquire the lock
-    return orig_new_off;
-
-  auto l = fi->off_lock.guard();
-  off_t new_offset = compute_offset(fi, nullptr, offset, whence);
-  if (new_offset < 0)
-    return -1;
-  fi->off = new_offset;
+  // Regular file offsets are updated without a lock (see
+  // file_inode::read), so retry if the offset changes under us.
+  u64 fioff = fi->off.load(std::memory_order_relaxed);
+  off_t new_offset;
+  do {
+    new_offset = compute_offset(fi, fioff, offset, whence);
+    if (new_offset < 0)
+      return -1;
+    if ((u64)new_offset == fioff)
+      // No change; don't write the shared offset
+      return new_offset;
+  } while (!fi->off.compare_exchange_weak(fioff, new_offset));
 
   return new_offset;
 }
@@ -234,6 +226,77 @@ sys_pwrite(int fd, const void *ubuf, size_t count, off_t offset)
   return f->pwrite(b, count, offset);
 }
 
+// Copy in and validate a user iovec array.  Returns nullptr if the
+// array is invalid or its total length overflows ssize_t.
+static std::unique_ptr<struct iovec[]>
+load_iov(userptr<struct iovec> uiov, int iovcnt)
+{
+  if (iovcnt < 0 || iovcnt > IOV_MAX)
+    return nullptr;
+  auto iov = uiov.load_alloc(iovcnt);
+  if (!iov)
+    return nullptr;
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > (~(size_t)0 >> 1) - total)
+      return nullptr;
+    total += iov[i].iov_len;
+  }
+  return iov;
+}
+
+//SYSCALL {"uargs":["int fd", "const struct iovec *iov", "int iovcnt"]}
+ssize_t
+sys_readv(int fd, userptr<struct iovec> uiov, int iovcnt)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  auto iov = load_iov(uiov, iovcnt);
+  if (!iov)
+    return -1;
+  return f->readv(iov.get(), iovcnt);
+}
+
+//SYSCALL {"uargs":["int fd", "const struct iovec *iov", "int iovcnt"]}
+ssize_t
+sys_writev(int fd, userptr<struct iovec> uiov, int iovcnt)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  auto iov = load_iov(uiov, iovcnt);
+  if (!iov)
+    return -1;
+  return f->writev(iov.get(), iovcnt);
+}
+
+//SYSCALL {"uargs":["int fd", "const struct iovec *iov", "int iovcnt", "off_t offset"]}
+ssize_t
+sys_preadv(int fd, userptr<struct iovec> uiov, int iovcnt, off_t offset)
+{
+  sref<file> f = getfile(fd);
+  if (!f || offset < 0)
+    return -1;
+  auto iov = load_iov(uiov, iovcnt);
+  if (!iov)
+    return -1;
+  return f->preadv(iov.get(), iovcnt, offset);
+}
+
+//SYSCALL {"uargs":["int fd", "const struct iovec *iov", "int iovcnt", "off_t offset"]}
+ssize_t
+sys_pwritev(int fd, userptr<struct iovec> uiov, int iovcnt, off_t offset)
+{
+  sref<file> f = getfile(fd);
+  if (!f || offset < 0)
+    return -1;
+  auto iov = load_iov(uiov, iovcnt);
+  if (!iov)
+    return -1;
+  return f->pwritev(iov.get(), iovcnt, offset);
+}
+
 //SYSCALL
 int
 sys_fstatx(int fd, userptr<struct stat> st, enum stat_flags flags)
@@ -771,6 +834,9 @@ sys_sys_spawn(userptr_str upath, userptr<userptr_str> uargv,
   // Install ftable
   p->ftable = std::move(newftable);
 
+  // Run p on the least loaded CPU and clean up after it there
+  p->cpuid = p->run_cpuid_ = p->data_cpuid = pickcpu(false);
+
   // Make p runnable (normally doclone would do this)
   {
     scoped_acquire l(&p->lock);
@@ -12,6 +12,10 @@
 #include "version.hh"
 #include "filetable.hh"
 
+#include <uk/fcntl.h>
+#include <uk/signal.h>
+#include <uk/resource.h>
+#include <uk/sched.h>
 #include <uk/mman.h>
 #include <uk/utsname.h>
 #include <uk/unistd.h>
@@ -31,6 +35,81 @@ sys_fork_flags(int flags)
   return p->pid;
 }
 
+// Create a child that runs on our address space and stack until it
+// calls exec or exits, and suspend the caller until then.  This
+// avoids copying the address space when the child is only going to
+// replace it.  The child may only call exec or exit.
+//SYSCALL
+int
+sys_vfork(void)
+{
+  // The child returns from the syscall stub on our stack and will
+  // overwrite the stub's return address when it calls exec.  Save it
+  // and put it back before we return.
+  userptr<u64> retp((u64*)myproc()->tf->rsp);
+  u64 ret;
+  if (!retp.load(&ret))
+    return -1;
+
+  proc *p = doclone(CLONE_VFORK);
+  if (!p)
+    return -1;
+  int pid = p->pid;
+  if (!retp.store(&ret))
+    return -1;
+  return pid;
+}
+
+// Start a thread sharing our address space.  It begins at pc with
+// arg as its first argument and its stack pointer just below ustack,
+// which must be 16-byte aligned.  pc must not return.  If tls is
+// non-zero it becomes the thread's %fs base.  If tidp is non-null,
+// the thread's pid is stored there before it starts, and zero is
+// stored and the futex woken when it exits.
+//SYSCALL
+int
+sys_clone_thread(uptr ustack, uptr pc, uptr arg, uptr tls,
+                 userptr<u64> tidp, int flags)
+{
+  if (flags & ~(FORK_SHARE_FD | FORK_DETACHED))
+    return -1;
+  if (ustack % 16 || ((flags & FORK_DETACHED) && !tidp))
+    return -1;
+  // Make sure we can write the tid word before committing to the
+  // thread.
+  u64 tid;
+  if (tidp && !tidp.load(&tid))
+    return -1;
+
+  clone_flags cflags = CLONE_SHARE_VMAP | CLONE_NO_RUN;
+  if (flags & FORK_SHARE_FD)
+    cflags |= CLONE_SHARE_FTABLE;
+  if (flags & FORK_DETACHED)
+    cflags |= CLONE_NO_PARENT;
+  proc *p = doclone(cflags);
+  if (!p)
+    return -1;
+
+  p->tf->rip = pc;
+  // Leave room for a return address, as if pc had been called
+  p->tf->rsp = ustack - 8;
+  p->tf->rdi = arg;
+  if (tls)
+    p->user_fs_ = tls;
+  if (tidp) {
+    tid = p->pid;
+    tidp.store(&tid);
+    p->tid_word = tidp;
+  }
+
+  int pid = p->pid;
+  p->cpuid = pickcpu(false);
+  acquire(&p->lock);
+  addrun(p);
+  release(&p->lock);
+  return pid;
+}
+
 //SYSCALL {"noret":true}
 void
 sys_exit(int status)
@@ -43,7 +122,7 @@ sys_exit(int status)
 int
 sys_waitpid(int pid,  userptr<int> status, int options)
 {
-  return wait(pid, status);
+  return wait(pid, status, options);
 }
 
 //SYSCALL
@@ -53,11 +132,127 @@ sys_wait(userptr<int> status)
   return wait(-1, status);
 }
 
+// Like waitpid, but also return the child's resource usage.
+//SYSCALL
+int
+sys_wait4(int pid, userptr<int> status, int options, userptr<struct rusage> ru)
+{
+  struct rusage r;
+  int res = wait(pid, status, options, ru ? &r : nullptr);
+  if (res > 0 && ru && !ru.store(&r))
+    return -1;
+  return res;
+}
+
+//SYSCALL
+int
+sys_getrusage(int who, userptr<struct rusage> ru)
+{
+  struct rusage r;
+  if (getrusage(who, &r) < 0 || !ru.store(&r))
+    return -1;
+  return 0;
+}
+
+//SYSCALL
+int
+sys_exitfd(int flags)
+{
+  if (flags & ~(O_NONBLOCK | O_CLOEXEC))
+    return -1;
+  return fdalloc(make_sref<file_exitfd>(flags & O_NONBLOCK), flags);
+}
+
 //SYSCALL
 int
-sys_kill(int pid)
+sys_kill(int pid, int signo)
 {
-  return proc::kill(pid);
+  return proc::kill(pid, signo);
+}
+
+//SYSCALL
+int
+sys_sigprocmask(int how, userptr<u64> set, userptr<u64> oset)
+{
+  proc *p = myproc();
+  u64 old = p->sig_blocked;
+  if (set) {
+    u64 s;
+    if (!set.load(&s))
+      return -1;
+    s &= ~sigmask(SIGKILL);
+    switch (how) {
+    case SIG_BLOCK:
+      p->sig_blocked |= s;
+      break;
+    case SIG_UNBLOCK:
+      p->sig_blocked &= ~s;
+      break;
+    case SIG_SETMASK:
+      p->sig_blocked = s;
+      break;
+    default:
+      return -1;
+    }
+  }
+  if (oset && !oset.store(&old))
+    return -1;
+  return 0;
+}
+
+//SYSCALL
+int
+sys_signalfd(u64 mask, int flags)
+{
+  if (flags & ~(O_NONBLOCK | O_CLOEXEC))
+    return -1;
+  if (!(mask & ~sigmask(SIGKILL)) || (mask & sigmask(0)))
+    return -1;
+  return fdalloc(make_sref<file_signalfd>(mask, flags & O_NONBLOCK), flags);
+}
+
+// Move process pid, which must be the caller or one of its children,
+// to process group pgid.  pid 0 means the caller, and pgid 0 means
+// the group whose ID is pid.
+//SYSCALL
+int
+sys_setpgid(int pid, int pgid)
+{
+  proc *me = myproc();
+  if (pid == 0)
+    pid = me->pid;
+  if (pgid == 0)
+    pgid = pid;
+  if (pgid < 0)
+    return -1;
+  if (pid == me->pid) {
+    me->pgid = pgid;
+    return 0;
+  }
+  scoped_acquire l(&me->lock);
+  for (auto &child : me->childq) {
+    if (child.pid == pid) {
+      child.pgid = pgid;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Return the process group of pid, which must be the caller or one
+// of its children.  pid 0 means the caller.
+//SYSCALL
+int
+sys_getpgid(int pid)
+{
+  proc *me = myproc();
+  if (pid == 0 || pid == me->pid)
+    return me->pgid;
+  scoped_acquire l(&me->lock);
+  for (auto &child : me->childq)
+    if (child.pid == pid)
+      return child.pgid;
+  return -1;
 }
 
 //SYSCALL {"nosec": true}
@@ -161,6 +356,8 @@ sys_mmap(userptr<void> addr, size_t len, int prot, int flags, int fd,
   if (m && (flags & MAP_PRIVATE))
     desc.flags |= vmdesc::FLAG_COW;
   uptr r = myproc()->vmap->insert(desc, start, end - start);
+  if ((flags & MAP_POPULATE) && r != (uptr)MAP_FAILED)
+    myproc()->vmap->willneed(r, end - start);
   return (void*)r;
 }
 
@@ -189,6 +386,18 @@ sys_madvise(userptr<void> addr, size_t len, int advice)
       return -1;
     return 0;
 
+  case MADV_DONTNEED:
+    if (myproc()->vmap->dontneed(align_addr, align_len) < 0)
+      return -1;
+    return 0;
+
+  case MADV_MERGEABLE:
+  case MADV_UNMERGEABLE:
+    if (myproc()->vmap->set_mergeable(align_addr, align_len,
+                                      advice == MADV_MERGEABLE) < 0)
+      return -1;
+    return 0;
+
   case MADV_INVALIDATE_CACHE:
     if (myproc()->vmap->invalidate_cache(align_addr, align_len) < 0)
       return -1;
@@ -261,6 +470,79 @@ sys_setaffinity(int cpu)
   return myproc()->set_cpu_pin(cpu);
 }
 
+// Return pid, which must be the caller or one of its children, with
+// its lock held.  pid 0 means the caller.  Returns nullptr if there's
+// no such process.
+static proc *
+lock_self_or_child(int pid)
+{
+  proc *me = myproc();
+  if (pid == 0 || pid == me->pid) {
+    acquire(&me->lock);
+    return me;
+  }
+  scoped_acquire l(&me->lock);
+  for (auto &child : me->childq) {
+    if (child.pid == pid) {
+      acquire(&child.lock);
+      return &child;
+    }
+  }
+  return nullptr;
+}
+
+//SYSCALL
+int
+sys_sched_setscheduler(int pid, int policy, userptr<struct sched_param> param)
+{
+  struct sched_param sp;
+  if (!param.load(&sp))
+    return -1;
+  proc *me = myproc();
+  if (pid == 0 || pid == me->pid)
+    return me->set_sched(policy, sp.sched_priority);
+  // A child can't exit and be freed while we hold our lock.
+  scoped_acquire l(&me->lock);
+  for (auto &child : me->childq)
+    if (child.pid == pid)
+      return child.set_sched(policy, sp.sched_priority);
+  return -1;
+}
+
+//SYSCALL
+int
+sys_sched_getscheduler(int pid)
+{
+  proc *p = lock_self_or_child(pid);
+  if (!p)
+    return -1;
+  int policy = p->sched_policy;
+  release(&p->lock);
+  return policy;
+}
+
+//SYSCALL
+int
+sys_sched_getparam(int pid, userptr<struct sched_param> param)
+{
+  proc *p = lock_self_or_child(pid);
+  if (!p)
+    return -1;
+  struct sched_param sp;
+  sp.sched_priority = p->sched_prio;
+  release(&p->lock);
+  if (!param.store(&sp))
+    return -1;
+  return 0;
+}
+
+//SYSCALL
+int
+sys_getcpu(void)
+{
+  return myid();
+}
+
 //SYSCALL
 long
 sys_futex(const u64* addr, int op, u64 val, u64 timer)
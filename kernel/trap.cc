@@ -43,6 +43,22 @@ linearhash<u64, u64> wm_addrs(1024);
 
 static void trap(struct trapframe *tf);
 
+// Charge the time since p last returned to user space as user time.
+static inline void
+acct_enter_kernel(proc *p)
+{
+  if (p->acct.user_start) {
+    p->acct.user += rdtsc() - p->acct.user_start;
+    p->acct.user_start = 0;
+  }
+}
+
+static inline void
+acct_return_to_user(proc *p)
+{
+  p->acct.user_start = rdtsc();
+}
+
 u64
 sysentry_c(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
 {
@@ -51,15 +67,36 @@ sysentry_c(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
     exit(-1);
   }
 
+  acct_enter_kernel(myproc());
+
   trapframe *tf = (trapframe*) (myproc()->kstack + KSTACKSIZE - sizeof(*tf));
   myproc()->tf = tf;
   u64 r = syscall(a0, a1, a2, a3, a4, a5, num);
 
+  // Run a pending signal's handler on the way out.  The handler's
+  // sig_restore returns the syscall's result through tf, and sysentry
+  // passes our return value to the handler in %rdi.
+  if (myproc()->sig_pending.load(std::memory_order_relaxed)) {
+    int signo = myproc()->take_signal();
+    if (signo) {
+      tf->rax = r;
+      if (myproc()->deliver_signal(signo))
+        r = signo;
+      else
+        myproc()->killed = 1;
+    }
+  }
+
   if(myproc()->killed) {
     mtstart(trap, myproc());
     exit(-1);
   }
 
+  // Give up the CPU if we woke up a higher priority thread
+  if (myproc()->yield_)
+    preempt();
+
+  acct_return_to_user(myproc());
   return r;
 }
 
@@ -189,8 +226,15 @@ trap_c(struct trapframe *tf)
   // XXX mt_ascope ascope("trap:%d", tf->trapno);
 #endif
 
+  bool from_user = (tf->cs&3) == 0x3;
+  if (from_user)
+    acct_enter_kernel(myproc());
+
   trap(tf);
 
+  if (from_user)
+    acct_return_to_user(myproc());
+
 #if MTRACE
   mtstop(myproc());
   if (myproc()->mtrace_stacks.curr >= 0)
@@ -280,6 +324,15 @@ trap(struct trapframe *tf)
     on_ipicall();
     break;
   }
+  case T_RESCHED:
+    lapiceoi();
+    sched_resched_ipi();
+    // Like a timer tick, wait until we can schedule
+    if (mycpu()->no_sched_count) {
+      mycpu()->no_sched_count |= NO_SCHED_COUNT_YIELD_REQUESTED;
+      return;
+    }
+    break;
   case T_DEVICE: {
     // Clear "task switched" flag to enable floating-point
     // instructions.  sched will set this again when it switches
@@ -345,11 +398,20 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == 0x3)
     exit(-1);
 
-  // Force process to give up CPU on clock tick.
+  // Let the scheduler take the CPU on clock tick or if a higher
+  // priority thread woke up.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->get_state() == RUNNING &&
      (tf->trapno == T_IRQ0+IRQ_TIMER || myproc()->yield_)) {
-    yield();
+    preempt();
+  }
+
+  // Run a pending signal's handler if we're returning to user space
+  if(myproc() && (tf->cs&3) == 0x3 &&
+     myproc()->sig_pending.load(std::memory_order_relaxed)) {
+    int signo = myproc()->take_signal();
+    if (signo && !myproc()->deliver_signal(signo))
+      myproc()->killed = 1;
   }
 
   // Check if the process has been killed since we yielded
@@ -614,7 +676,7 @@ scoped_critical::release_yield()
   // Clear the yield request and yield
   modify_no_sched_count(-NO_SCHED_COUNT_YIELD_REQUESTED);
   // Below here is racy, strictly speaking, but that's okay.
-  yield();
+  preempt();
 }
 
 bool
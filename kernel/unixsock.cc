@@ -7,6 +7,7 @@
 #include "atomic_util.hh"
 #include "proc.hh"
 #include "file.hh"
+#include "kmemcache.hh"
 #include <uk/socket.h>
 #include <uk/un.h>
 
@@ -23,7 +24,7 @@ struct msghdr {
   msghdr() {}
   ~msghdr() {}
 
-  NEW_DELETE_OPS(msghdr);
+  NEW_DELETE_OPS_CACHE(msghdr, "msghdr");
 };
 
 struct coresocket : public balance_pool<coresocket> {
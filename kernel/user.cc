@@ -42,8 +42,10 @@ inituser(void)
   p->tf->rsp = PGSIZE;
   p->tf->rip = INIT_START;  // beginning of initcode.S
   p->data_cpuid = myid();
+  p->pgid = p->pid;
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
+  p->vmap->set_owner(p->pid, p->name);
   p->cwd.reset(); // forkret will fix in the process's context
   acquire(&p->lock);
   addrun(p);
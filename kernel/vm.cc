@@ -16,6 +16,7 @@
 #include "page_info.hh"
 #include <algorithm>
 #include "kstats.hh"
+#include "work.hh"
 
 enum { SDEBUG = false };
 static console_stream sdebug(SDEBUG);
@@ -37,6 +38,8 @@ void to_stream(class print_stream *s, const vmdesc &vmd)
         {"ANON", vmdesc::FLAG_ANON},
         {"WRITE", vmdesc::FLAG_WRITE},
         {"SHARED", vmdesc::FLAG_SHARED},
+        {"PINNED", vmdesc::FLAG_PINNED},
+        {"MERGEABLE", vmdesc::FLAG_MERGEABLE},
       }), " ");
   if (vmd.page)
     s->print((void*)vmd.page->pa(), "}");
@@ -78,11 +81,15 @@ class page_holder
 
   batch *cur;
   size_t curmax;
+  size_t count;
   batch first;
   char first_buf[NLOCAL * sizeof(sref<class page_info>)];
 
 public:
-  page_holder() : cur(&first), curmax(NLOCAL) {
+  // Next in a vmap's list of deferred page_holders
+  page_holder *next;
+
+  page_holder() : cur(&first), curmax(NLOCAL), count(0), next(nullptr) {
     // TODO: fix this hack?
     // static_assert((void*)&(((page_holder*)nullptr)->first.pages[NLOCAL]) <=
     //               (void*)&((page_holder*)nullptr)->first_buf[sizeof(first_buf)],
@@ -110,9 +117,166 @@ public:
       curmax = NHEAP;
     }
     new (&cur->pages[cur->used++]) sref<class page_info>(std::move(page));
+    count++;
+  }
+
+  // The number of pages held
+  size_t size() const
+  {
+    return count;
+  }
+
+  NEW_DELETE_OPS(page_holder);
+};
+
+static void
+free_page_holders(page_holder *pages)
+{
+  while (pages) {
+    page_holder *next = pages->next;
+    delete pages;
+    pages = next;
+  }
+}
+
+/*
+ * Resident page accounting
+ */
+
+enum {
+  // Cached counter updates a CPU can accumulate before it folds them
+  // into the vmap
+  RSS_BATCH = 64,
+  // Pages willneed allocates and maps at once
+  PREFAULT_BATCH = 64,
+};
+
+// Page faults update the counters of the running address space far
+// more often than anything reads them, so each CPU caches its updates
+// for the vmap it's running, like refcache caches reference count
+// deltas.  The running process keeps that vmap alive until switchvm
+// calls flush_rss.
+struct rss_cache
+{
+  vmap *vm;
+  s64 delta[vmap::RSS_NTYPES];
+};
+
+static percpu<rss_cache, NO_INT> rss_caches;
+
+// Counter updates collected while a range is locked, to apply once
+// at the end
+struct vmap::rss_tally
+{
+  s64 n[RSS_NTYPES] = {};
+
+  // Count the page desc maps, if any, n times.
+  void count(const vmdesc &desc, s64 times)
+  {
+    if (!desc.page || (desc.flags & vmdesc::FLAG_QVISIBLE))
+      return;
+    n[(desc.flags & vmdesc::FLAG_ANON) ? RSS_ANON : RSS_FILE] += times;
+  }
+
+  void apply(vmap *vm)
+  {
+    for (int type = 0; type < RSS_NTYPES; ++type)
+      vm->add_rss((rss_type)type, n[type]);
   }
 };
 
+void
+vmap::add_rss(rss_type type, s64 n)
+{
+  if (n == 0)
+    return;
+
+  scoped_cli cli;
+  rss_cache *c = &*rss_caches;
+  if (c->vm != this) {
+    // Only cache updates to the running address space.  Anything
+    // else might go away before we flush.
+    proc *p = myproc();
+    if (!p || p->vmap.get() != this) {
+      rss_[type] += n;
+      return;
+    }
+    flush_rss();
+    c->vm = this;
+  }
+  c->delta[type] += n;
+  if (c->delta[type] >= RSS_BATCH || c->delta[type] <= -RSS_BATCH) {
+    rss_[type] += c->delta[type];
+    c->delta[type] = 0;
+  }
+}
+
+void
+vmap::flush_rss()
+{
+  assert(!(readrflags() & FL_IF));
+  rss_cache *c = &*rss_caches;
+  if (!c->vm)
+    return;
+  for (int type = 0; type < RSS_NTYPES; ++type) {
+    if (c->delta[type])
+      c->vm->rss_[type] += c->delta[type];
+    c->delta[type] = 0;
+  }
+  c->vm = nullptr;
+}
+
+u64
+vmap::rss(rss_type type) const
+{
+  s64 n = rss_[type];
+  // Other CPUs may be changing their caches under us, but this is
+  // only an estimate.
+  for (int cpu = 0; cpu < ncpu; ++cpu)
+    if (rss_caches[cpu].vm == this)
+      n += rss_caches[cpu].delta[type];
+  return n < 0 ? 0 : n;
+}
+
+void
+vmap::set_owner(int pid, const char *name)
+{
+  owner_pid_ = pid;
+  safestrcpy(owner_name_, name, sizeof owner_name_);
+}
+
+int
+vmap::procmem_read(char *dst, u32 off, u32 n)
+{
+  // Return one record for each address space.  Address spaces may
+  // come and go between reads, so a reader that reads in pieces may
+  // see some twice or not at all.
+  u32 pos = 0, used = 0;
+  for_each([&](vmap *vm) {
+      if (used == n)
+        return;
+      if (pos + sizeof(procmem_rec) <= off) {
+        pos += sizeof(procmem_rec);
+        return;
+      }
+
+      procmem_rec rec{};
+      rec.pid = vm->owner_pid_;
+      memmove(rec.name, vm->owner_name_, sizeof rec.name);
+      rec.name[sizeof rec.name - 1] = 0;
+      rec.anon_pages = vm->rss(RSS_ANON);
+      rec.file_pages = vm->rss(RSS_FILE);
+      rec.pt_pages = vm->internal_pages();
+
+      u32 roff = off > pos ? off - pos : 0;
+      u32 len = MIN(sizeof rec - roff, n - used);
+      memmove(dst + used, (char*)&rec + roff, len);
+      used += len;
+      pos += sizeof rec;
+    });
+  return used;
+}
+
 /*
  * vmap
  */
@@ -127,67 +291,210 @@ vmap::alloc(void)
   return v;
 }
 
+struct vmap::all_list
+{
+  spinlock lock;
+  ilist<vmap, &vmap::all_link_> list;
+  __padout__;
+
+  all_list() : lock("vmap::all", LOCKSTAT_VM) { }
+} __mpalign__;
+
+vmap::all_list vmap::all_[NCPU];
+
 vmap::vmap() : 
-  brk_(0), brklock_("brk_lock", LOCKSTAT_VM)
+  rcu_freed("vmap", this, sizeof(*this)), brk_(0), brklock_("brk_lock", LOCKSTAT_VM),
+  deferred_lock_("vmap::deferred", LOCKSTAT_VM), deferred_pages_(nullptr),
+  deferred_npages_(0), deferred_start_(~0), deferred_end_(0),
+  deferred_flushing_(0)
+{
+  for (auto &n : rss_)
+    n.store(0, std::memory_order_relaxed);
+  owner_pid_.store(0, std::memory_order_relaxed);
+  owner_name_[0] = 0;
+  any_mergeable_.store(false, std::memory_order_relaxed);
+  gate_.store(GATE_OPEN, std::memory_order_relaxed);
+  gate_overflow_.store(0, std::memory_order_relaxed);
+  all_cpu_ = myid();
+  scoped_acquire l(&all_[all_cpu_].lock);
+  all_[all_cpu_].list.push_back(this);
+}
+
+namespace {
+  struct release_work : public dwork
+  {
+    release_work(sref<vmap> &&vm) : vm_(std::move(vm)) { }
+
+    virtual void run() override {
+      // The destructor will decref vm_.
+      delete this;
+    }
+
+    sref<vmap> vm_;
+
+    NEW_DELETE_OPS(release_work);
+  };
+}
+
+void
+vmap::release_async(sref<vmap> &&vm, int cpu)
 {
+  if (!vm)
+    return;
+  release_work *w = new release_work(std::move(vm));
+  assert(dwork_push(w, cpu) >= 0);
 }
 
 vmap::~vmap()
 {
+  {
+    auto &all = all_[all_cpu_];
+    scoped_acquire l(&all.lock);
+    all.list.erase(all.list.iterator_to(this));
+  }
+  // Nothing can be running this address space any more, so there's
+  // nothing left to shoot down.
+  free_page_holders(deferred_pages_);
+}
+
+// Each CPU's fork gate slot: the vmap it has range locks on, and
+// how many.
+struct fork_gate_slot
+{
+  std::atomic<vmap*> vm;
+  int depth;
+};
+
+static percpu<fork_gate_slot> gate_slots;
+
+bool
+vmap::enter_gate()
+{
+  fork_gate_slot *slot = &*gate_slots;
+  if (slot->vm.load(std::memory_order_relaxed) == this) {
+    // Nested range lock; the gate is already held open.
+    ++slot->depth;
+    return false;
+  }
+  // If this CPU holds a range lock on another vmap, it has to use
+  // gate_overflow_, and it may only wait for a fork that has closed
+  // the gate (see vmap::gate_).
+  bool overflow = slot->vm.load(std::memory_order_relaxed) != nullptr;
+  int passable = overflow ? GATE_DRAINING : GATE_OPEN;
+  for (;;) {
+    if (overflow)
+      ++gate_overflow_;
+    else
+      slot->vm.store(this, std::memory_order_relaxed);
+    // Pairs with the fence in close_gate: either we see the gate
+    // closed or it sees our slot (or gate_overflow_).
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (gate_.load(std::memory_order_relaxed) <= passable) {
+      if (!overflow)
+        slot->depth = 1;
+      return overflow;
+    }
+    if (overflow)
+      --gate_overflow_;
+    else
+      slot->vm.store(nullptr, std::memory_order_relaxed);
+    while (gate_.load(std::memory_order_relaxed) > passable)
+      nop_pause();
+  }
+}
+
+void
+vmap::leave_gate(bool overflow)
+{
+  if (overflow) {
+    gate_overflow_.fetch_sub(1, std::memory_order_release);
+    return;
+  }
+  fork_gate_slot *slot = &*gate_slots;
+  if (--slot->depth == 0)
+    slot->vm.store(nullptr, std::memory_order_release);
+}
+
+bool
+vmap::gate_drained() const
+{
+  for (int cpu = 0; cpu < ncpu; ++cpu)
+    if (gate_slots[cpu].vm.load(std::memory_order_acquire) == this)
+      return false;
+  return gate_overflow_.load(std::memory_order_acquire) == 0;
+}
+
+void
+vmap::close_gate()
+{
+  int open = GATE_OPEN;
+  while (!gate_.compare_exchange_weak(open, GATE_DRAINING)) {
+    open = GATE_OPEN;
+    nop_pause();
+  }
+  for (;;) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!gate_drained())
+      nop_pause();
+    // Nested range locks may have slipped in while we looked, but
+    // once the gate is closed, any that we don't see will see it.
+    gate_.store(GATE_CLOSED, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (gate_drained())
+      return;
+    gate_.store(GATE_DRAINING, std::memory_order_relaxed);
+  }
+}
+
+void
+vmap::open_gate()
+{
+  gate_.store(GATE_OPEN, std::memory_order_release);
 }
 
 sref<vmap>
 vmap::copy()
 {
+  scoped_gc_epoch rcu;
+
   if (SDEBUG)
     sdebug.println("vm: copy pid ", myproc()->pid);
 
   sref<vmap> nm = alloc();
-  mmu::shootdown shootdown;
 
   {
-    auto out = nm->vpfs_.begin();
-    auto lock = vpfs_.acquire(vpfs_.begin(), vpfs_.end());
-    for (auto it = vpfs_.begin(), end = vpfs_.end(); it != end; ) {
-      // Skip unset spans and qvisible spans
-      if (!it.is_set() || (it->flags & vmdesc::FLAG_QVISIBLE)) {
-        // We can use the base span because we know we just reached this
-        // span.
-        out += it.base_span();
-        it += it.base_span();
-        continue;
-      }
-      if (SDEBUG)
-        sdebug.println("vm: dup ", *it, " at ", shex(it.index() * PGSIZE));
-
-      // If the original vmdesc isn't COW, mark it so and fix the page
-      // table.
-      if (it->page && !(it->flags & vmdesc::FLAG_SHARED) && !(it->flags & vmdesc::FLAG_COW)) {
-        if (SDEBUG)
-          sdebug.println("vm: mark COW");
-        it->flags |= vmdesc::FLAG_COW;
-        // XXX(Austin) Should we try to invalidate in larger chunks?
-        cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
-      }
-
-      // Copy the descriptor
-      nm->vpfs_.fill(out, it->dup());
-
-      // Next page
-      ++out;
-      ++it;
+    scoped_no_sched nosched;
+    close_gate();
+    // Hide our user page tables first, so a thread of ours that
+    // touches a page from here on faults and waits at the gate, and
+    // finds the page copy-on-write once it gets through.
+    cache.hide_user();
+    try {
+      // Only the user half is shared.  The qvisible mappings above
+      // USERTOP belong to this process.
+      vpfs_.share(&nm->vpfs_, vpfs_.begin(), vpfs_.find(USERTOP / PGSIZE));
+    } catch (...) {
+      open_gate();
+      throw;
     }
-
-    shootdown.perform();
+    open_gate();
   }
 
+  // nm maps the same pages, none of which are qvisible.
+  for (int type = 0; type < RSS_NTYPES; ++type)
+    nm->rss_[type].store(rss((rss_type)type), std::memory_order_relaxed);
   nm->brk_ = brk_;
+  // The descriptors we share keep FLAG_MERGEABLE
+  nm->any_mergeable_.store(any_mergeable_.load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
   return nm;
 }
 
 uptr
 vmap::insert(const vmdesc &desc, uptr start, uptr len)
 {
+  scoped_gc_epoch rcu;
+
   kstats::inc(&kstats::mmap_count);
   kstats::timer timer(&kstats::mmap_cycles);
 
@@ -212,9 +519,10 @@ again:
   auto end = vpfs_.find((start + len) / PGSIZE);
   mmu::shootdown shootdown;
   page_holder pages;
+  rss_tally rss;
 
   {
-    auto lock = vpfs_.acquire(begin, end);
+    auto lock = lock_range(begin, end);
 
     for (auto it = begin; it < end; it += it.span()) {
       if (!it.is_set())
@@ -222,9 +530,11 @@ again:
       // Verify unmapped region now that we hold the lock
       if (!fixed)
         goto again;
+      rss.count(*it, -1);
       pages.add(std::move(it->page));
     }
 
+    flush_deferred(start, start + len);
     cache.invalidate(start, len, begin, &shootdown);
 
     // XXX If this is a large fill, we could actively re-fold already
@@ -240,12 +550,15 @@ again:
     shootdown.perform();
   }
 
+  rss.apply(this);
   return start;
 }
 
 int
 vmap::remove(uptr start, uptr len)
 {
+  scoped_gc_epoch rcu;
+
   kstats::inc(&kstats::munmap_count);
   kstats::timer timer(&kstats::munmap_cycles);
 
@@ -253,57 +566,238 @@ vmap::remove(uptr start, uptr len)
     sdebug.println("vm: remove(", start, ",", len, ")");
 
   mmu::shootdown shootdown;
-  page_holder pages;
+  page_holder local_pages;
+  page_holder *pages = &local_pages;
+  // If we can, collect the pages where we can hold on to them past
+  // the end of this call, so we can defer the shootdown.
+  if (TLB_DEFER_PAGES) {
+    if (page_holder *p = new (std::nothrow) page_holder())
+      pages = p;
+  }
 
   auto begin = vpfs_.find(start / PGSIZE);
   auto end = vpfs_.find((start + len) / PGSIZE);
-  auto lock = vpfs_.acquire(begin, end);
-  for (auto it = begin; it < end; it += it.span())
-    if (it.is_set())
-      pages.add(std::move(it->page));
+  auto lock = lock_range(begin, end);
+  rss_tally rss;
+  for (auto it = begin; it < end; it += it.span()) {
+    if (it.is_set()) {
+      rss.count(*it, -1);
+      pages->add(std::move(it->page));
+    }
+  }
+  rss.apply(this);
   cache.invalidate(start, len, begin, &shootdown);
   // XXX If this is a large unset, we could actively re-fold already
   // expanded regions.
   vpfs_.unset(begin, end);
-  shootdown.perform();
+  if (pages != &local_pages)
+    defer_shootdown(shootdown, pages, start, start + len);
+  else
+    shootdown.perform();
 
   return 0;
 }
 
+void
+vmap::defer_shootdown(const mmu::shootdown &sd, page_holder *pages,
+                      uptr start, uptr end)
+{
+  if (sd.empty()) {
+    // Nobody else can reach these pages
+    delete pages;
+    return;
+  }
+
+  mmu::shootdown batch;
+  page_holder *batch_pages;
+  {
+    scoped_acquire l(&deferred_lock_);
+    kstats::inc(&kstats::tlb_shootdown_deferred);
+    deferred_sd_.merge(sd);
+    pages->next = deferred_pages_;
+    deferred_pages_ = pages;
+    // Count every unmap, so we don't put off shootdowns forever even
+    // if they don't free any pages.
+    deferred_npages_ += std::max(pages->size(), (size_t)1);
+    deferred_start_ = std::min(deferred_start_, start);
+    deferred_end_ = std::max(deferred_end_, end);
+    if (deferred_npages_ < TLB_DEFER_PAGES)
+      return;
+    take_deferred(&batch, &batch_pages);
+  }
+  finish_deferred(batch, batch_pages);
+}
+
+bool
+vmap::deferred_overlaps(uptr start, uptr end)
+{
+  scoped_acquire l(&deferred_lock_);
+  return deferred_flushing_ || (deferred_start_ < end && start < deferred_end_);
+}
+
+void
+vmap::flush_deferred(uptr start, uptr end)
+{
+  while (true) {
+    mmu::shootdown batch;
+    page_holder *batch_pages;
+    bool taken = false;
+    {
+      scoped_acquire l(&deferred_lock_);
+      if (deferred_start_ < end && start < deferred_end_) {
+        take_deferred(&batch, &batch_pages);
+        taken = true;
+      } else if (!deferred_flushing_) {
+        return;
+      }
+    }
+    if (taken)
+      finish_deferred(batch, batch_pages);
+    else
+      // Another thread is performing a batch that may overlap ours
+      nop_pause();
+  }
+}
+
+// Take the current batch of deferred shootdowns.  The caller must
+// hold deferred_lock_ and must pass the batch to finish_deferred.
+void
+vmap::take_deferred(mmu::shootdown *sd, page_holder **pages)
+{
+  assert(deferred_lock_.holding());
+  kstats::inc(&kstats::tlb_shootdown_batches);
+  *sd = deferred_sd_;
+  *pages = deferred_pages_;
+  deferred_sd_ = mmu::shootdown();
+  deferred_pages_ = nullptr;
+  deferred_npages_ = 0;
+  deferred_start_ = ~0;
+  deferred_end_ = 0;
+  deferred_flushing_++;
+}
+
+void
+vmap::finish_deferred(const mmu::shootdown &sd, page_holder *pages)
+{
+  sd.perform();
+  free_page_holders(pages);
+  scoped_acquire l(&deferred_lock_);
+  deferred_flushing_--;
+}
+
+// Returns true if ensure_page would have to allocate a fresh
+// anonymous page for the slot at it.
+static bool
+needs_anon_page(const vmdesc &desc)
+{
+  return ((desc.flags & vmdesc::FLAG_ANON) &&
+          !(desc.flags & vmdesc::FLAG_QVISIBLE) && !desc.page);
+}
+
 int
 vmap::willneed(uptr start, uptr len)
 {
-  auto begin = vpfs_.find(start / PGSIZE);
-  auto end = vpfs_.find((start + len) / PGSIZE);
-  auto lock = vpfs_.acquire(begin, end);
+  // switch_to calls this in the middle of a context switch for the
+  // proc and its kernel stack, which are never shared or unmapped
+  // while in use, so only user ranges need an epoch.
+  scoped_gc_epoch rcu(start < USERTOP);
 
   page_holder pages;
   mmu::shootdown shootdown;
 
-  for (auto it = begin; it < end; it += it.span()) {
-    if (!it.is_set())
-      continue;
+  // Work through the range in batches, so we take each batch's
+  // backing pages from the allocator at once and don't hold the
+  // whole range locked while we zero them.
+  for (uptr idx = start / PGSIZE, endidx = (start + len) / PGSIZE;
+       idx < endidx; idx += PREFAULT_BATCH) {
+    auto begin = vpfs_.find(idx);
+    auto end = vpfs_.find(std::min(idx + PREFAULT_BATCH, endidx));
+    auto lock = lock_range(begin, end);
+
+    void *fresh[PREFAULT_BATCH];
+    size_t nfresh = 0, used = 0;
+    for (auto it = begin; it < end; it += it.span())
+      if (it.is_set() && needs_anon_page(*it))
+        nfresh += std::min(it.span(), (size_t)(end.index() - it.index()));
+    if (nfresh) {
+      nfresh = kalloc_batch("(vmap::willneed)", KALLOC_MOVABLE, fresh, nfresh);
+      kstats::inc(&kstats::prefault_pages, (u64)nfresh);
+    }
 
-    bool writable = (it->flags & vmdesc::FLAG_WRITE);
-    if (writable && (it->flags & vmdesc::FLAG_COW)) {
-      sref<page_info> old_page = it->page;
-      pages.add(std::move(old_page));
-      cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+    for (auto it = begin; it < end; it += it.span()) {
+      if (!it.is_set())
+        continue;
+
+      bool writable = (it->flags & vmdesc::FLAG_WRITE);
+      if (writable && (it->flags & vmdesc::FLAG_COW)) {
+        sref<page_info> old_page = it->page;
+        pages.add(std::move(old_page));
+        cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+      }
+
+      char *page_mem = nullptr;
+      if (used < nfresh && needs_anon_page(*it))
+        page_mem = (char*)fresh[used++];
+      page_info *page = ensure_page(it, writable ? access_type::WRITE
+                                                 : access_type::READ,
+                                    nullptr, page_mem);
+      if (!page)
+        continue;
+
+      // Only this CPU's page tables get the mappings now.  Other CPUs
+      // fill theirs on their first fault, which finds the page.
+      u64 flags = (it->flags & vmdesc::FLAG_QVISIBLE) ? PTE_NX : PTE_U;
+
+      if (it->flags & vmdesc::FLAG_COW || !writable)
+        cache.insert(it.index() * PGSIZE, &*it, page->pa() | PTE_P | flags);
+      else
+        cache.insert(it.index() * PGSIZE, &*it,
+                     page->pa() | PTE_P | flags | PTE_W);
     }
 
-    page_info *page = ensure_page(it, writable ? access_type::WRITE
-                                               : access_type::READ);
-    if (!page)
-      continue;
+    // We hold the batch locked, so every page we counted was used
+    assert(used == nfresh);
+  }
 
-    u64 flags = (it->flags & vmdesc::FLAG_QVISIBLE) ? PTE_NX : PTE_U;
+  shootdown.perform();
+  return 0;
+}
 
-    if (it->flags & vmdesc::FLAG_COW || !writable)
-      cache.insert(it.index() * PGSIZE, &*it, page->pa() | PTE_P | flags);
-    else
-      cache.insert(it.index() * PGSIZE, &*it, page->pa() | PTE_P | flags | PTE_W);
+int
+vmap::dontneed(uptr start, uptr len)
+{
+  scoped_gc_epoch rcu;
+
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto end = vpfs_.find((start + len) / PGSIZE);
+  auto lock = lock_range(begin, end);
+
+  mmu::shootdown shootdown;
+  page_holder pages;
+  rss_tally rss;
+
+  const u64 mask = vmdesc::FLAG_ANON | vmdesc::FLAG_SHARED |
+    vmdesc::FLAG_QVISIBLE;
+  for (auto it = begin; it < end; it += it.span()) {
+    if (!it.is_set() || !it->page ||
+        (it->flags & mask) != vmdesc::FLAG_ANON)
+      continue;
+
+    rss.count(*it, -1);
+    cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+    if (it.base_span() == 1) {
+      // Safe to update in place
+      pages.add(std::move(it->page));
+      it->flags &= ~vmdesc::FLAG_COW;
+    } else {
+      vmdesc n(*it);
+      pages.add(std::move(n.page));
+      n.flags &= ~vmdesc::FLAG_COW;
+      vpfs_.fill(it, std::move(n));
+    }
   }
 
+  rss.apply(this);
   shootdown.perform();
   return 0;
 }
@@ -311,9 +805,11 @@ vmap::willneed(uptr start, uptr len)
 int
 vmap::invalidate_cache(uptr start, uptr len)
 {
+  scoped_gc_epoch rcu;
+
   auto begin = vpfs_.find(start / PGSIZE);
   auto end = vpfs_.find((start + len) / PGSIZE);
-  auto lock = vpfs_.acquire(begin, end);
+  auto lock = lock_range(begin, end);
 
   mmu::shootdown shootdown;
 
@@ -331,9 +827,11 @@ vmap::invalidate_cache(uptr start, uptr len)
 int
 vmap::mprotect(uptr start, uptr len, uint64_t flags)
 {
+  scoped_gc_epoch rcu;
+
   auto begin = vpfs_.find(start / PGSIZE);
   auto end = vpfs_.find((start + len) / PGSIZE);
-  auto lock = vpfs_.acquire(begin, end);
+  auto lock = lock_range(begin, end);
 
   mmu::shootdown shootdown;
 
@@ -365,9 +863,54 @@ vmap::mprotect(uptr start, uptr len, uint64_t flags)
   return 0;
 }
 
+int
+vmap::set_mergeable(uptr start, uptr len, bool mergeable)
+{
+  scoped_gc_epoch rcu;
+
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto end = vpfs_.find((start + len) / PGSIZE);
+  auto lock = lock_range(begin, end);
+
+  if (mergeable)
+    any_mergeable_.store(true, std::memory_order_relaxed);
+
+  for (auto it = begin; it < end; it += it.span()) {
+    if (!it.is_set())
+      return -1;                // ENOMEM
+    if (!(it->flags & vmdesc::FLAG_ANON))
+      continue;
+
+    // Pages that are already merged stay shared until they're
+    // written, as after fork.
+    u64 nflags = mergeable ? it->flags | vmdesc::FLAG_MERGEABLE
+                           : it->flags & ~vmdesc::FLAG_MERGEABLE;
+    if (nflags == it->flags)
+      continue;
+
+    if (it.base() >= begin.index() &&
+        it.base() + it.base_span() <= end.index()) {
+      // The whole slot is in range, so it's safe to update in place
+      it->flags = nflags;
+    } else {
+      // A folded slot straddles a range boundary.  Split off the part
+      // inside the range rather than changing pages outside it.
+      vmdesc n(*it);
+      n.flags = nflags;
+      auto split_end = std::min(it.base() + it.base_span(), end.index());
+      vpfs_.fill(it, vpfs_.find(split_end), n);
+      // Continue after the part we just filled
+      it = vpfs_.find(split_end - 1);
+    }
+  }
+  return 0;
+}
+
 int
 vmap::dup_page(uptr dest, uptr src)
 {
+  scoped_gc_epoch rcu;
+
   auto srcit = vpfs_.find(src / PGSIZE);
   vmdesc desc;
 
@@ -375,22 +918,242 @@ vmap::dup_page(uptr dest, uptr src)
   // atomically, but we can't take a lock here on srcit or it would
   // defeat the benchmark.  Fixing this is pointless because we're
   // trying to simulate a unified buffer cache, which would hand us a
-  // physical page directly.
+  // physical page directly.  (Likewise, if fork left srcit's node
+  // shared, setting FLAG_PINNED below pins the child's copy, too.)
   if (!srcit.is_set())
     return -1;
   desc = srcit->dup();
+  // Both frames now share the page without COW, so neither copy can
+  // be migrated on its own.
+  desc.flags |= vmdesc::FLAG_PINNED;
+  if (srcit.base_span() == 1)
+    __atomic_fetch_or(&srcit->flags, (u64)vmdesc::FLAG_PINNED,
+                      __ATOMIC_RELAXED);
 
   auto destit = vpfs_.find(dest / PGSIZE);
 
   {
-    auto lock = vpfs_.acquire(destit);
+    auto lock = lock_range(destit);
     assert(!destit.is_set());
     vpfs_.fill(destit, desc);
   }
+  rss_tally rss;
+  rss.count(desc, 1);
+  rss.apply(this);
 
   return 0;
 }
 
+// Call f on every live vmap, one CPU's list at a time, without
+// holding the lists' locks.
+template<class F>
+void
+vmap::for_each(F f)
+{
+  sref<vmap> cur;
+
+  for (auto &all : all_) {
+    acquire(&all.lock);
+    for (auto it = all.list.begin(); it != all.list.end(); ++it) {
+      // Skip address spaces that are being destroyed
+      sref<vmap> next;
+      if (!next.init(&*it))
+        continue;
+      release(&all.lock);
+      // This may drop the last reference to the previous vmap, which
+      // takes its list's lock.  Holding next keeps it, and hence our
+      // place in the list, alive.
+      cur = std::move(next);
+      f(cur.get());
+      acquire(&all.lock);
+    }
+    release(&all.lock);
+  }
+}
+
+size_t
+vmap::migrate_all(page_migrator *m)
+{
+  size_t moved = 0;
+  for_each([&](vmap *vm) { moved += vm->migrate_pages(m); });
+  return moved;
+}
+
+size_t
+vmap::migrate_pages(page_migrator *m)
+{
+  scoped_gc_epoch rcu;
+
+  enum {
+    // Pages to lock at a time, so we don't hold up page faults
+    // elsewhere in the address space for too long
+    CHUNK = 512,
+  };
+
+  // Only private anonymous pages belong to just this page frame, so
+  // they're the only ones we can move by rewriting one vmdesc.
+  const u64 mask = vmdesc::FLAG_ANON | vmdesc::FLAG_COW |
+    vmdesc::FLAG_SHARED | vmdesc::FLAG_QVISIBLE | vmdesc::FLAG_PINNED;
+  auto movable = [&](const vpf_array::iterator &it) {
+    return it.is_set() && it.base_span() == 1 && it->page &&
+      (it->flags & mask) == vmdesc::FLAG_ANON && m->want(it->page->va());
+  };
+
+  size_t moved = 0;
+  auto end = vpfs_.find(USERTOP / PGSIZE);
+  for (auto it = vpfs_.begin(); it < end; ) {
+    // Skip unmapped space without locking it
+    if (!it.is_set()) {
+      it += it.span();
+      continue;
+    }
+
+    auto chunk_end = vpfs_.find(std::min(it.index() + CHUNK, end.index()));
+    auto lock = lock_range(it, chunk_end);
+
+    // Unmap the pages first so nothing can write to them while we
+    // copy them.
+    mmu::shootdown shootdown;
+    bool any = false;
+    for (auto pit = it; pit < chunk_end; pit += pit.span()) {
+      if (movable(pit)) {
+        cache.invalidate(pit.index() * PGSIZE, PGSIZE, pit, &shootdown);
+        any = true;
+      }
+    }
+
+    if (any) {
+      shootdown.perform();
+      page_holder old_pages;
+      for (auto pit = it; pit < chunk_end; pit += pit.span()) {
+        if (!movable(pit))
+          continue;
+        char *p = m->alloc();
+        if (!p)
+          // The rest will just fault back in
+          return moved;
+        memmove(p, pit->page->va(), PGSIZE);
+        old_pages.add(std::move(pit->page));
+        pit->page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
+        ++moved;
+      }
+    }
+    it = chunk_end;
+  }
+  return moved;
+}
+
+/*
+ * Same-page merging
+ */
+
+bool
+vmap::mergeable(const vpf_array::iterator &it)
+{
+  // Pages that are already COW are fine: they're read-only, and
+  // whoever else maps them will get their own copy when they write.
+  const u64 mask = vmdesc::FLAG_ANON | vmdesc::FLAG_MERGEABLE |
+    vmdesc::FLAG_SHARED | vmdesc::FLAG_QVISIBLE | vmdesc::FLAG_PINNED;
+  return it.is_set() && it.base_span() == 1 && it->page &&
+    (it->flags & mask) == (vmdesc::FLAG_ANON | vmdesc::FLAG_MERGEABLE);
+}
+
+void
+vmap::merge_scan_all(page_merger *m)
+{
+  for_each([&](vmap *vm) { vm->merge_scan(m); });
+}
+
+void
+vmap::merge_scan(page_merger *m)
+{
+  scoped_gc_epoch rcu;
+
+  if (!any_mergeable_.load(std::memory_order_relaxed))
+    return;
+
+  auto end = vpfs_.find(USERTOP / PGSIZE);
+  for (auto it = vpfs_.begin(); it < end; ) {
+    // Skip unmapped space without locking it
+    if (!it.is_set()) {
+      it += it.span();
+      continue;
+    }
+
+    u64 index = it.index();
+    u64 span;
+    sref<page_info> page;
+    {
+      auto lock = lock_range(it);
+      span = it.span();
+      if (mergeable(it))
+        page = it->page;
+    }
+    // m may take a while and may sleep, so it runs unlocked.  Our
+    // reference keeps the page alive, even if it gets unmapped.
+    if (page)
+      m->scan(this, index * PGSIZE, page);
+    it = vpfs_.find(index + span);
+  }
+}
+
+bool
+vmap::merge_page(uptr va, page_info *page, const sref<page_info> &shared)
+{
+  scoped_gc_epoch rcu;
+
+  auto it = vpfs_.find(va / PGSIZE);
+  auto lock = lock_range(it);
+  if (!mergeable(it) || it->page != page || page == shared.get())
+    return false;
+
+  // Unmap the page before comparing so nothing can write to it in the
+  // meantime.  If they differ, it will just fault back in.
+  mmu::shootdown shootdown;
+  cache.invalidate(va, PGSIZE, it, &shootdown);
+  shootdown.perform();
+  if (memcmp(page->va(), shared->va(), PGSIZE) != 0)
+    return false;
+
+  sref<page_info> old_page = std::move(it->page);
+  it->page = shared;
+  it->flags |= vmdesc::FLAG_COW;
+  return true;
+}
+
+bool
+vmap::protect_page(uptr va, page_info *page)
+{
+  scoped_gc_epoch rcu;
+
+  auto it = vpfs_.find(va / PGSIZE);
+  auto lock = lock_range(it);
+  if (!mergeable(it) || it->page != page)
+    return false;
+  if (!(it->flags & vmdesc::FLAG_COW)) {
+    it->flags |= vmdesc::FLAG_COW;
+    mmu::shootdown shootdown;
+    cache.invalidate(va, PGSIZE, it, &shootdown);
+    shootdown.perform();
+  }
+  return true;
+}
+
+sref<vmap>
+vmap::lookup(vmap *vm)
+{
+  // vm may already be freed, so we can't ask it which list it's on
+  for (auto &all : all_) {
+    scoped_acquire l(&all.lock);
+    for (auto &it : all.list) {
+      sref<vmap> res;
+      if (&it == vm && res.init(&it))
+        return res;
+    }
+  }
+  return sref<vmap>();
+}
+
 /*
  * pagefault handling code on vmap
  */
@@ -398,6 +1161,10 @@ vmap::dup_page(uptr dest, uptr src)
 int
 vmap::pagefault(uptr va, u32 err)
 {
+  // Faults on kernel addresses may come with interrupts disabled and
+  // locks held, and touch nothing that's freed through gc.
+  scoped_gc_epoch rcu(va < USERTOP);
+
   access_type type = (err & FEC_WR) ? access_type::WRITE : access_type::READ;
   mmu::shootdown shootdown;
 
@@ -415,7 +1182,7 @@ vmap::pagefault(uptr va, u32 err)
 
   {
     auto it = vpfs_.find(va / PGSIZE);
-    auto lock = vpfs_.acquire(it);
+    auto lock = lock_range(it);
     if (!it.is_set())
       return -1;
     if (SDEBUG)
@@ -493,6 +1260,8 @@ pagefault(vmap *vmap, uptr va, u32 err)
 void*
 vmap::pagelookup(uptr va)
 {
+  scoped_gc_epoch rcu;
+
   if (va >= USERTOP)
     return nullptr;
 
@@ -503,7 +1272,7 @@ vmap::pagelookup(uptr va)
   auto it = vpfs_.find(va / PGSIZE);
   if (!it.is_set())
     return nullptr;
-  auto lock = vpfs_.acquire(it);
+  auto lock = lock_range(it);
   if (!it.is_set())
     return nullptr;
 
@@ -511,6 +1280,18 @@ vmap::pagelookup(uptr va)
   if (!pi)
     return nullptr;
 
+  // Our caller may hold on to the kernel address, so this page must
+  // stay put.
+  if (!(it->flags & vmdesc::FLAG_PINNED)) {
+    if (it.base_span() == 1) {
+      it->flags |= vmdesc::FLAG_PINNED;
+    } else {
+      vmdesc n(*it);
+      n.flags |= vmdesc::FLAG_PINNED;
+      vpfs_.fill(it, std::move(n));
+    }
+  }
+
   char* kptr = (char*)pi->va();
   return &kptr[va & (PGSIZE-1)];
 }
@@ -541,10 +1322,12 @@ pagelookup(vmap* vmap, uptr va)
 int
 vmap::copyout(uptr va, const void *p, u64 len)
 {
+  scoped_gc_epoch rcu;
+
   char *buf = (char*)p;
   auto it = vpfs_.find(va / PGSIZE);
   auto end = vpfs_.find(PGROUNDUP(va + len) / PGSIZE);
-  auto lock = vpfs_.acquire(it, end);
+  auto lock = lock_range(it, end);
   for (; it != end; ++it) {
     if (!it.is_set())
       return -1;
@@ -567,11 +1350,13 @@ vmap::copyout(uptr va, const void *p, u64 len)
 int
 vmap::set_write_permission(uptr start, uptr len, bool is_readonly, bool is_cow)
 {
+  scoped_gc_epoch rcu;
+
   assert(start % PGSIZE == 0);
   assert(len % PGSIZE == 0);
   auto it = vpfs_.find(start / PGSIZE);
   auto end = vpfs_.find((start + len) / PGSIZE);
-  auto lock = vpfs_.acquire(it, end);
+  auto lock = lock_range(it, end);
   for (; it != end; ++it) {
     if (!it.is_set())
       return -1;
@@ -591,6 +1376,8 @@ vmap::set_write_permission(uptr start, uptr len, bool is_readonly, bool is_cow)
 int
 vmap::sbrk(ssize_t n, uptr *addr)
 {
+  scoped_gc_epoch rcu;
+
   if (SDEBUG)
     sdebug.println("vm: sbrk(", n, ") pid ", myproc()->pid);
 
@@ -623,13 +1410,27 @@ vmap::sbrk(ssize_t n, uptr *addr)
     // Adjust break down by freeing pages
     auto begin = vpfs_.find(newend / PGSIZE),
       end = vpfs_.find(newstart / PGSIZE);
-    auto rlock = vpfs_.acquire(begin, end);
+    auto rlock = lock_range(begin, end);
+    rss_tally rss;
+    for (auto it = begin; it < end; it += it.span())
+      if (it.is_set())
+        rss.count(*it, -1);
+    rss.apply(this);
     vpfs_.unset(begin, end);
   } else if (newstart < newend) {
+    // Pages unmapped from this range may still be in other cores'
+    // TLBs.  We can't shoot them down while holding brklock_, since
+    // it disables interrupts.
+    if (deferred_overlaps(newstart, newend)) {
+      xlock.release();
+      flush_deferred(newstart, newend);
+      return sbrk(n, addr);
+    }
+
     // Adjust break up by mapping pages
     auto begin = vpfs_.find(newstart / PGSIZE),
       end = vpfs_.find(newend / PGSIZE);
-    auto rlock = vpfs_.acquire(begin, end);
+    auto rlock = lock_range(begin, end);
 
     // Make sure we're not about to overwrite an existing mapping
     for (auto it = begin; it < end; it += it.span()) {
@@ -650,6 +1451,8 @@ vmap::sbrk(ssize_t n, uptr *addr)
 uptr
 vmap::unmapped_area(size_t npages)
 {
+  scoped_gc_epoch rcu;
+
   uptr start = std::max(myproc()->unmapped_hint, 16UL * 1024 * 1024 / PGSIZE);
   auto it = vpfs_.find(start), end = vpfs_.find(USERTOP / PGSIZE);
 
@@ -667,7 +1470,7 @@ vmap::unmapped_area(size_t npages)
 
 page_info *
 vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
-                  bool *allocated)
+                  bool *allocated, char *fresh)
 {
   if (allocated)
     *allocated = false;
@@ -679,6 +1482,7 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     return desc.page.get();
 
   sref<page_info> page = desc.page;
+  bool page_was_set = !!page;
   if (!page) {
     if (desc.flags & vmdesc::FLAG_ANON) {
       assert(!(desc.flags & vmdesc::FLAG_COW));
@@ -689,7 +1493,11 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
         auto p = new(page_info::of(pa)) page_info_nokfree();
         page = sref<page_info>::transfer(p);
       } else {
-        char *p = zalloc("(vmap::pagelookup)");
+        char *p = fresh;
+        if (p)
+          memset(p, 0, PGSIZE);
+        else
+          p = zalloc("(vmap::pagelookup)", KALLOC_MOVABLE);
         if (!p)
           throw_bad_alloc();
         page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
@@ -706,7 +1514,10 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     // This is a COW fault; copy in to a new page
     if (allocated)
       *allocated = true;
-    char *p = zalloc("(vmap::pagelookup)");
+    // Private copies of file pages aren't anonymous, so compaction
+    // won't move them.
+    char *p = zalloc("(vmap::pagelookup)", (desc.flags & vmdesc::FLAG_ANON) ?
+                     KALLOC_MOVABLE : KALLOC_KERNEL);
     if (!p)
       throw_bad_alloc();
 
@@ -717,6 +1528,9 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
   }
 
+  if (!page_was_set && !(desc.flags & vmdesc::FLAG_QVISIBLE))
+    add_rss((desc.flags & vmdesc::FLAG_ANON) ? RSS_ANON : RSS_FILE, 1);
+
   // Install the page in the canonical page table
   if (it.base_span() == 1) {
     // Safe to update in place
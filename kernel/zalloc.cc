@@ -18,47 +18,54 @@ struct free_page
   typedef ilist<free_page, &free_page::link> list_t;
 };
 
-struct zallocator {
+// A pool of zeroed pages of one kalloc_type
+struct zpool {
   // pages and nPages must only be accessed by the local CPU and must
   // be accessed with interrupts disabled.
   free_page::list_t pages;
   unsigned nPages;
   dwframe frame;
 };
+
+struct zallocator {
+  zpool pools[KALLOC_NTYPES];
+};
 DEFINE_PERCPU(zallocator, z_);
 
 struct zwork : public dwork {
-  zwork(dwframe* frame)
-    : frame_(frame)
+  zwork(dwframe* frame, kalloc_type type)
+    : frame_(frame), type_(type)
   {
     frame_->inc();
   }
 
   virtual void run() override {
     for (int i = 0; i < 32; i++) {
-      auto *r = (struct free_page*)kalloc("zpage");
+      auto *r = (struct free_page*)kalloc("zpage", PGSIZE, type_);
       if (r == nullptr)
         break;
       zpage_nc(r);
       scoped_cli cli;
-      z_->pages.push_front(r);
-      ++z_->nPages;
+      z_->pools[type_].pages.push_front(r);
+      ++z_->pools[type_].nPages;
     }
     frame_->dec();
     delete this;
   }
 
   dwframe* frame_;
+  kalloc_type type_;
 
   NEW_DELETE_OPS(zwork);
 };
 
 static void
-tryrefill(void)
+tryrefill(kalloc_type type)
 {
   int cpu = myid();
-  if (prezero && z_[cpu].nPages < 16 && z_[cpu].frame.zero()) {
-    zwork* w = new zwork(&z_[cpu].frame);
+  zpool *pool = &z_[cpu].pools[type];
+  if (prezero && pool->nPages < 16 && pool->frame.zero()) {
+    zwork* w = new zwork(&pool->frame, type);
     // XXX This is higher priority than doing actual work.  We should
     // only do background zeroing if we would otherwise be idle.
     if (dwork_push(w, cpu) < 0)
@@ -66,24 +73,25 @@ tryrefill(void)
   }
 }
 
-// Allocate a zeroed page.  This page can be freed with kfree or, if
-// it is known to be zeroed when it is freed, zfree.
+// Allocate a zeroed page of the given type.  This page can be freed
+// with kfree or, if it is known to be zeroed when it is freed, zfree.
 char*
-zalloc(const char* name)
+zalloc(const char* name, kalloc_type type)
 {
   char* p = nullptr;
 
   {
     scoped_cli cli;
-    if (!z_->pages.empty()) {
-      p = (char*)&z_->pages.front();
-      z_->pages.pop_front();
-      --z_->nPages;
+    zpool *pool = &z_->pools[type];
+    if (!pool->pages.empty()) {
+      p = (char*)&pool->pages.front();
+      pool->pages.pop_front();
+      --pool->nPages;
     }
   }
 
   if (p == nullptr) {
-    p = kalloc(name);
+    p = kalloc(name, PGSIZE, type);
     if (p != nullptr)
       zpage(p);
   } else {
@@ -95,7 +103,7 @@ zalloc(const char* name)
       for (int i = 0; i < PGSIZE; i++)
         assert(p[i] == 0);
   }
-  tryrefill();
+  tryrefill(type);
   return p;
 }
 
@@ -107,10 +115,11 @@ zfree(void* p)
     for (int i = 0; i < 4096; i++)
       assert(((char*)p)[i] == 0);
 
+  kalloc_type type = kalloc_type_of(p);
   scoped_cli cli;
   mtunlabel(mtrace_label_block, p);
-  z_->pages.push_front((struct free_page*)p);
-  ++z_->nPages;
+  z_->pools[type].pages.push_front((struct free_page*)p);
+  ++z_->pools[type].nPages;
 }
 
 void
@@ -13,3 +13,36 @@ signal(int sig, sighandler_t func)
   else
     return oact.sa_handler;
 }
+
+int
+sigemptyset(sigset_t *set)
+{
+  *set = 0;
+  return 0;
+}
+
+int
+sigaddset(sigset_t *set, int sig)
+{
+  if (sig <= 0 || sig >= NSIG)
+    return -1;
+  *set |= sigmask(sig);
+  return 0;
+}
+
+int
+sigdelset(sigset_t *set, int sig)
+{
+  if (sig <= 0 || sig >= NSIG)
+    return -1;
+  *set &= ~sigmask(sig);
+  return 0;
+}
+
+int
+sigismember(const sigset_t *set, int sig)
+{
+  if (sig <= 0 || sig >= NSIG)
+    return -1;
+  return (*set & sigmask(sig)) != 0;
+}
@@ -18,8 +18,10 @@ struct tlsdata {
   void* buf[max_keys];
 };
 
-void
-forkt_setup(u64 pid)
+// Allocate and initialize a TLS block for a new thread and return
+// the value for its %fs base.
+static u64
+tls_alloc(void)
 {
   static size_t memsz;
   static size_t filesz;
@@ -46,16 +48,41 @@ forkt_setup(u64 pid)
   memcpy((void*)tptr, initimage, filesz);
   tlsdata* t = (tlsdata*) (tptr + memsz_align);
   t->tlsptr[0] = t;
-  setfs((u64) t);
+  return (u64) t;
 }
 
-int
-pthread_create(pthread_t* tid, const pthread_attr_t* attr,
-               void* (*start)(void*), void* arg)
+void
+forkt_setup(u64 pid)
+{
+  setfs(tls_alloc());
+}
+
+struct thread_start {
+  void* (*start)(void*);
+  void* arg;
+};
+
+static void
+thread_entry(thread_start* ts)
+{
+  ts->start(ts->arg);
+  malloc_thread_exit();
+  exit(0);
+}
+
+// Start a thread with the clone_thread system call, which sets up its
+// stack and TLS in one step.  flags are FORK_* bits.
+static int
+thread_create(pthread_t* tid, void* (*start)(void*), void* arg, int flags)
 {
   char* base = (char*) sbrk(stack_size);
   assert(base != (char*)-1);
-  int t = forkt(base + stack_size, (void*) start, arg, FORK_SHARE_VMAP | FORK_SHARE_FD);
+  // Pass start and arg on the new thread's stack
+  thread_start* ts = (thread_start*) ((u64)(base + stack_size) & ~0xf) - 1;
+  ts->start = start;
+  ts->arg = arg;
+  int t = clone_thread((u64) ts, (u64) thread_entry, (u64) ts, tls_alloc(),
+                       nullptr, flags & ~FORK_SHARE_VMAP);
   if (t < 0)
     return t;
 
@@ -63,38 +90,31 @@ pthread_create(pthread_t* tid, const pthread_attr_t* attr,
   return 0;
 }
 
+int
+pthread_create(pthread_t* tid, const pthread_attr_t* attr,
+               void* (*start)(void*), void* arg)
+{
+  return thread_create(tid, start, arg, FORK_SHARE_FD);
+}
+
 int
 pthread_createflags(pthread_t* tid, const pthread_attr_t* attr,
                     void* (*start)(void*), void* arg, int flag)
 {
-  char* base = (char*) sbrk(stack_size);
-  assert(base != (char*)-1);
-  int t = forkt(base + stack_size, (void*) start, arg, FORK_SHARE_VMAP);
-  if (t < 0)
-    return t;
-
-  *tid = t;
-  return 0;
+  return thread_create(tid, start, arg, 0);
 }
 
 int
 xthread_create(pthread_t* tid, int flags,
                void* (*start)(void*), void* arg)
 {
-  char* base = (char*) sbrk(stack_size);
-  assert(base != (char*)-1);
-  int t = forkt(base + stack_size, (void*) start, arg,
-                FORK_SHARE_VMAP | FORK_SHARE_FD | flags);
-  if (t < 0)
-    return t;
-
-  *tid = t;
-  return 0;
+  return thread_create(tid, start, arg, FORK_SHARE_FD | flags);
 }
 
 void
 pthread_exit(void* retval)
 {
+  malloc_thread_exit();
   exit(0);
 }
 
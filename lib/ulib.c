@@ -207,5 +207,6 @@ __crt_main(uint64_t argc, char **argv, uint64_t elf_phdr, uint64_t elf_phnum)
   for (size_t i = __fini_array_end - __fini_array_start; i-- > 0; )
       (*__fini_array_start[i])();
 
+  malloc_thread_exit();
   exit(res);
 }
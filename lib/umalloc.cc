@@ -8,6 +8,8 @@
 #include <linux/unistd.h>       // __NR_gettid
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <utility>
 #include <memory>
 #include <new>
@@ -17,12 +19,13 @@
 #include "log2.hh"
 
 // This allocator strongly weighs its own scalability over other forms
-// of efficiency.  In particular, when memory is freed via a given
-// thread, only that thread can then reuse that memory.  Also, after a
-// page is carved up in to sub-page regions, it can never be used for
-// any other size class (allocations that involve a page or more of
-// memory can be re-partitioned, however).  It also never returns
-// memory to the system.
+// of efficiency.  Each thread allocates from its own heap without
+// synchronization.  Small objects freed by another thread are sent
+// back to the owning thread's heap in batches, and pages and large
+// runs freed by a thread are reused by that thread.  Sub-page regions
+// of a page can only be used for one size class until the whole page
+// is free again.  Large free regions are returned to the system with
+// MADV_DONTNEED, though their address space is never unmapped.
 
 // == Overall architecture ==
 //
@@ -60,17 +63,31 @@
 // This could result in an arbitrary size region, so it is split in to
 // the largest size classes possible.
 //
+// When freeing and merging produces a free run of at least
+// release_bytes, the pages of the run that haven't been returned to
+// the kernel yet are returned with MADV_DONTNEED before the run is
+// added to the free lists.  They will be zero-filled if reused.  The
+// radix array records which free pages have been returned, so a run
+// that keeps growing doesn't return the same pages again.
+//
 // Finally, a *small allocator* handles allocations for size classes
 // half-a-page and smaller (where multiple objects will fit on one
 // page).  Like the large allocation, this allocator maintains
 // per-core per-size-class free lists; however, the small allocator
 // does no splitting or merging.  If the free list for an allocation
 // is empty, it obtains a page from the large allocator, carves it up
-// in to equal size regions, and stores the size class at the
-// beginning of the page.  As a result, there is no per-object space
-// overhead; only per-page overhead.  Freeing an object simply checks
-// the page header to find the object's size class and adds it to the
-// appropriate free list.
+// in to equal size regions, and stores the size class, the owning
+// heap, and a count of allocated objects at the beginning of the
+// page.  As a result, there is no per-object space overhead; only
+// per-page overhead.  Freeing an object checks the page header to
+// find the object's size class and owner.  If the current thread owns
+// the page, it adds the object to the appropriate free list, and once
+// every object on a page is free (and the thread already has a free
+// page of that size class), it returns the page to the large
+// allocator.  Otherwise, it chains the object on to a per-thread
+// batch of remote frees for that owner, which it pushes on to the
+// owner's lock-free remote-free queue all at once.  Owners drain
+// their queue when a small size class runs out of free objects.
 //
 // malloc determines whether to use the large allocator or the small
 // allocator based on the requested object size.  free determines
@@ -89,12 +106,28 @@
 // If there seems to be a bug, disabling this is the place to start.
 enum { DO_MERGE = 1 };
 
+// If non-zero, maintain per-thread heap statistics, which can be
+// printed with malloc_show_stats.
+enum { DO_STATS = 1 };
+
 namespace {
   enum { PGSIZE = 4096 };
 
   // Must be >= 4096 and a valid size class
   size_t min_map_bytes = 256 * 1024;
 
+  // A free run of at least this many bytes returns its pages to the
+  // kernel.
+  size_t release_bytes = 256 * 1024;
+
+  // The maximum number of objects to batch up for a remote free
+  enum { REMOTE_BATCH = 32 };
+
+  // A thread always keeps this many completely free pages of each
+  // small size class, and returns more to the large allocator only if
+  // over half of its pages of that class are free.
+  enum { KEEP_EMPTY_PAGES = 8 };
+
   pid_t gettid()
   {
 #if defined(XV6_USER)
@@ -316,6 +349,101 @@ namespace {
     }
   };
 
+  //
+  // Per-thread heaps
+  //
+
+  struct remote_obj
+  {
+    remote_obj *next;
+  };
+
+  struct heap_stats
+  {
+    size_t mallocs, frees;
+    // Small objects freed to other heaps and received from them
+    size_t remote_sent, remote_received;
+    // Pages carved up by the small allocator and returned to the
+    // large allocator
+    size_t small_pages, small_pages_freed;
+    // Bytes mapped from and released to the kernel
+    size_t mapped_bytes, released_bytes;
+  };
+
+  // A thread's heap.  Other threads may hold objects from a heap's
+  // pages after its thread exits, so heaps are never freed.
+  struct heap
+  {
+    pid_t tid;
+    // Small objects freed by other threads
+    std::atomic<remote_obj*> remote;
+    heap *next;
+    heap_stats stats;
+  };
+
+  // All heaps, for statistics
+  std::atomic<heap*> heaps;
+
+  __thread heap *my_heap;
+
+  heap *get_heap()
+  {
+    if (my_heap)
+      return my_heap;
+    heap *h = linear_allocator<heap>().allocate(1);
+    memset(h, 0, sizeof *h);
+    h->tid = gettid();
+    h->next = heaps.load(std::memory_order_relaxed);
+    while (!heaps.compare_exchange_weak(h->next, h))
+      ;
+    return my_heap = h;
+  }
+
+  // A batch of objects being freed to another heap
+  struct remote_batch
+  {
+    heap *owner;
+    remote_obj *head, *tail;
+    int count;
+  };
+
+  __thread remote_batch pending;
+
+  // Push the pending batch of remote frees to its owner.
+  void flush_remote()
+  {
+    if (!pending.count)
+      return;
+    std::atomic<remote_obj*> &q = pending.owner->remote;
+    remote_obj *old = q.load(std::memory_order_relaxed);
+    do {
+      pending.tail->next = old;
+    } while (!q.compare_exchange_weak(old, pending.head,
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed));
+    if (DO_STATS)
+      get_heap()->stats.remote_sent += pending.count;
+    pending.owner = nullptr;
+    pending.head = pending.tail = nullptr;
+    pending.count = 0;
+  }
+
+  // Free ptr, which belongs to another thread's heap.
+  void free_remote(heap *owner, void *ptr)
+  {
+    if (pending.owner != owner)
+      flush_remote();
+    remote_obj *o = static_cast<remote_obj*>(ptr);
+    o->next = pending.head;
+    pending.head = o;
+    if (!pending.count++) {
+      pending.owner = owner;
+      pending.tail = o;
+    }
+    if (pending.count == REMOTE_BATCH)
+      flush_remote();
+  }
+
   //
   // Large allocator (size classes one page large and up)
   //
@@ -340,6 +468,10 @@ namespace {
     //   ALLOCATED_HEAD and the rest are ALLOCATED_REST.
     pid_t owner;
 
+    // For free pages, whether the page has been returned to the
+    // kernel.  Every page of a free run agrees.
+    bool released;
+
     // XXX The information about free pages could be written on the
     // pages themselves, rather than requiring lots of space in a
     // radix tree.  There could be races with checking the data, so
@@ -348,7 +480,8 @@ namespace {
     // more efficiently (we could even use a straight 16GB mapping).
 
     page_info() = default;
-    explicit page_info(pid_t owner) : owner(owner) { }
+    explicit page_info(pid_t owner, bool released = false)
+      : owner(owner), released(released) { }
 
     dummy_bit_spinlock get_lock()
     {
@@ -386,7 +519,8 @@ namespace {
 
   // Add a free run of size bytes starting at run.  The run must not
   // be on any free list or contained within any run on any free list.
-  void add_free_run(void *run, size_t bytes)
+  // released is whether its pages have been returned to the kernel.
+  void add_free_run(void *run, size_t bytes, bool released)
   {
     assert(bytes >= PGSIZE);
     assert(bytes % PGSIZE == 0);
@@ -403,9 +537,9 @@ namespace {
       auto nextit = it + fbytes / PGSIZE;
 
       // Mark pages as free to this thread
-      pages.fill(it++, page_info(tid));
+      pages.fill(it++, page_info(tid, released));
       if (it != nextit) {
-        pages.fill(it, nextit, page_info(-tid));
+        pages.fill(it, nextit, page_info(-tid, released));
         it = nextit;
       }
       run = (char*)run + fbytes;
@@ -415,8 +549,9 @@ namespace {
   }
 
   // Allocate bytes from run, which is of size class sc.  run must not
-  // be on any free list.
-  void *alloc_from_run(void *run, size_t sc, size_t bytes)
+  // be on any free list.  released is whether run's pages have been
+  // returned to the kernel.
+  void *alloc_from_run(void *run, size_t sc, size_t bytes, bool released)
   {
     pdebug("alloc_large %zu bytes from run %zu => %p\n", bytes, sc, run);
 
@@ -429,7 +564,7 @@ namespace {
       // It's possible we could merge this in to following runs to
       // create larger runs, but we don't bother
       add_free_run((char*)run + used_pages * PGSIZE,
-                   (have_pages - used_pages) * PGSIZE);
+                   (have_pages - used_pages) * PGSIZE, released);
     }
 
     // Mark pages allocated
@@ -448,9 +583,12 @@ namespace {
     size_t sc = size_to_class(bytes);
 
     // Find a free run of at least this size class
-    for (size_t i = sc; i < MAX_LARGE_CLASS; ++i)
-      if (free_runs[i])
-        return alloc_from_run(free_runs[i].pop(i), i, bytes);
+    for (size_t i = sc; i < MAX_LARGE_CLASS; ++i) {
+      if (free_runs[i]) {
+        void *run = free_runs[i].pop(i);
+        return alloc_from_run(run, i, bytes, pages.find(idx(run))->released);
+      }
+    }
 
     // Can't satisfy request.  Get more pages from the system.
     size_t map_bytes = class_max_size(sc);
@@ -465,9 +603,12 @@ namespace {
     if (run == MAP_FAILED)
       return nullptr;
     pdebug("alloc_large mapped %p for class %zu\n", run, map_sc);
+    if (DO_STATS)
+      get_heap()->stats.mapped_bytes += map_bytes;
 
-    // Allocate from the new run
-    return alloc_from_run(run, map_sc, bytes);
+    // Allocate from the new run.  Its pages haven't been touched, so
+    // they're as good as released.
+    return alloc_from_run(run, map_sc, bytes, true);
   }
 
   // Free the memory at ptr to the large allocator.
@@ -516,13 +657,38 @@ namespace {
       }
     }
 
+    // Once the merged run is big enough, return the parts of it we
+    // haven't already returned to the kernel.  This must come after
+    // removing the runs from the free lists, since it clears their
+    // links.  If we don't release it, the whole run counts as
+    // unreleased, even if some of it was; we'll just release that
+    // part again later.
+    bool released = false;
+    if ((size_t)(post - pre) * PGSIZE >= release_bytes) {
+      released = true;
+      for (auto it = pre; it < post; ) {
+        if (it->released) {
+          it += it.base_span();
+          continue;
+        }
+        size_t from = it.index();
+        while (it < post && !it->released)
+          it += it.base_span();
+        size_t bytes = (std::min(it.index(), post.index()) - from) * PGSIZE;
+        if (madvise(idx_to_ptr(from), bytes, MADV_DONTNEED) < 0)
+          released = false;
+        else if (DO_STATS)
+          get_heap()->stats.released_bytes += bytes;
+      }
+    }
+
     // Add (possibly expanded) run to free list
     // XXX Because we add the largest size class first when adding a
     // run, this may re-create lots of runs we just absorbed.  There
     // should be a way to avoid this.
     pdebug("free_large %p of %lu pages (expanded %p %lu pages)\n",
            ptr, end - start, idx_to_ptr(pre.index()), post - pre);
-    add_free_run(idx_to_ptr(pre.index()), (post - pre) * PGSIZE);
+    add_free_run(idx_to_ptr(pre.index()), (post - pre) * PGSIZE, released);
   }
 
   // Get the allocated size of the large allocation at ptr.
@@ -540,23 +706,96 @@ namespace {
   // Small allocator (size classes less than a page)
   //
 
-  // XXX This never frees pages back to the large allocator, so once a
-  // page has been reserved for a size class, it will stay that size
-  // class forever.
-
   // Fragment free lists by size class (ceil(log2(bytes))).  Fragments
   // must be at least sizeof(block_list::block), so the smaller
   // classes are unused.
   thread_local block_list free_fragments[13];
 
+  // The number of pages of each size class, and the number of those
+  // with no allocated fragments.
+  thread_local size_t class_pages[13], empty_pages[13];
+
   // Header for pages owned by the small allocator.  Following this
   // header, a page is divided into equal-size fragments.
   struct page_hdr
   {
-    uintptr_t magic;
-    size_t size_class;
+    uint32_t magic;
+    uint16_t size_class;
+    // Allocated fragments, including those on their way back through
+    // a remote-free queue
+    uint16_t inuse;
+    // The heap whose free lists this page's fragments go on
+    heap *owner;
   };
-  enum { PAGE_HDR_MAGIC = 0x2065c977e3516564 };
+  enum { PAGE_HDR_MAGIC = 0xe3516564 };
+
+  page_hdr *get_page_hdr(void *ptr)
+  {
+    // Round ptr to the page start to get the page metadata
+    page_hdr *hdr = (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
+    if (hdr->magic != PAGE_HDR_MAGIC)
+      throw std::runtime_error("Bad free or corrupted page magic");
+    return hdr;
+  }
+
+  // Return the first and last fragments of a small allocator page.
+  // Fragments are always 16-byte aligned.  (This could be less aligned
+  // for smaller size classes, but there are no smaller size classes.)
+  char *first_fragment(page_hdr *hdr)
+  {
+    static_assert(sizeof(page_hdr) <= 16, "page_hdr too large");
+    return (char*)hdr + 16;
+  }
+
+  char *last_fragment(page_hdr *hdr)
+  {
+    return (char*)hdr + PGSIZE - class_max_size(hdr->size_class);
+  }
+
+  // Free ptr, which belongs to this thread's heap, to its page.
+  void free_local(page_hdr *hdr, void *ptr)
+  {
+    size_t sc = hdr->size_class;
+    free_fragments[sc].push(ptr, sc);
+    if (--hdr->inuse)
+      return;
+
+    // The page is empty.  Keep empty pages unless a lot of this size
+    // class is idle, so varying allocation rates don't repeatedly
+    // carve and release pages.
+    if (empty_pages[sc] < KEEP_EMPTY_PAGES ||
+        empty_pages[sc] * 2 < class_pages[sc]) {
+      ++empty_pages[sc];
+      return;
+    }
+
+    // Return the page to the large allocator
+    size_t sbytes = class_max_size(sc);
+    for (char *fragment = first_fragment(hdr), *last = last_fragment(hdr);
+         fragment <= last; fragment += sbytes)
+      block_list::remove(fragment);
+    pdebug("free_small returning page %p of class %zu\n", hdr, sc);
+    hdr->magic = 0;
+    --class_pages[sc];
+    free_large(hdr);
+    if (DO_STATS)
+      get_heap()->stats.small_pages_freed++;
+  }
+
+  // Move objects other threads have freed to our heap on to our free
+  // lists.
+  void drain_remote(heap *h)
+  {
+    remote_obj *o = h->remote.exchange(nullptr, std::memory_order_acquire);
+    size_t n = 0;
+    for (; o; ++n) {
+      remote_obj *next = o->next;
+      free_local(get_page_hdr(o), o);
+      o = next;
+    }
+    if (DO_STATS)
+      h->stats.remote_received += n;
+  }
 
   // Allocate bytes bytes from the small allocator
   void *alloc_small(size_t bytes)
@@ -569,6 +808,14 @@ namespace {
 
     // Check for a free fragment
     size_t sc = size_to_class(bytes);
+    if (!free_fragments[sc]) {
+      // Take back objects other threads have freed and send back the
+      // objects we've freed to other threads
+      heap *h = get_heap();
+      flush_remote();
+      if (h->remote.load(std::memory_order_relaxed))
+        drain_remote(h);
+    }
     if (!free_fragments[sc]) {
       // There are no free fragments of this size.  Get a page from
       // the large allocator and chop it up.
@@ -578,21 +825,25 @@ namespace {
       page_hdr *hdr = static_cast<page_hdr*>(page);
       hdr->magic = PAGE_HDR_MAGIC;
       hdr->size_class = sc;
+      hdr->inuse = 0;
+      hdr->owner = get_heap();
 
       size_t sbytes = class_max_size(sc);
-      // Make sure fragments are always 16-byte aligned.  (This could
-      // be less aligned for smaller size classes, but there are no
-      // smaller size classes.)
-      char *fragment = (char*)page + 16;
-      assert(sizeof(page_hdr) <= 16);
-      char *last = (char*)page + PGSIZE - sbytes;
+      char *fragment = first_fragment(hdr), *last = last_fragment(hdr);
       int i = 0;
       for (; fragment <= last; fragment += sbytes, ++i)
         free_fragments[sc].push(fragment, sc);
+      ++class_pages[sc];
+      ++empty_pages[sc];
       pdebug("alloc_small growing class %zu by %d objects\n", sc, i);
+      if (DO_STATS)
+        hdr->owner->stats.small_pages++;
     }
 
     void *ptr = free_fragments[sc].pop(sc);
+    page_hdr *hdr = get_page_hdr(ptr);
+    if (hdr->inuse++ == 0)
+      --empty_pages[sc];
     pdebug("alloc_small %zu bytes from class %zu => %p\n", bytes, sc, ptr);
     return ptr;
   }
@@ -600,27 +851,26 @@ namespace {
   // Free the memory at ptr to the small allocator.
   void free_small(void *ptr)
   {
-    // Round ptr to the page start to get the page metadata
-    page_hdr *hdr = (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
-    if (hdr->magic != PAGE_HDR_MAGIC)
-      throw std::runtime_error("Bad free or corrupted page magic");
-    pdebug("free_small %p to class %zu\n", ptr, hdr->size_class);
-    free_fragments[hdr->size_class].push(ptr, hdr->size_class);
+    page_hdr *hdr = get_page_hdr(ptr);
+    pdebug("free_small %p to class %u\n", ptr, hdr->size_class);
+    if (hdr->owner == get_heap())
+      free_local(hdr, ptr);
+    else
+      free_remote(hdr->owner, ptr);
   }
 
   // Get the allocated size of the small allocation at ptr.
   size_t get_size_small(void *ptr)
   {
-    page_hdr *hdr = (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
-    if (hdr->magic != PAGE_HDR_MAGIC)
-      throw std::runtime_error("Bad free or corrupted page magic");
-    return class_max_size(hdr->size_class);
+    return class_max_size(get_page_hdr(ptr)->size_class);
   }
 }
 
 extern "C" void *
 malloc(size_t size)
 {
+  if (DO_STATS)
+    get_heap()->stats.mallocs++;
   if (size < LARGE_THRESHOLD)
     return alloc_small(size);
   return alloc_large(size);
@@ -631,6 +881,8 @@ free(void *ptr)
 {
   if (!ptr)
     return;
+  if (DO_STATS)
+    get_heap()->stats.frees++;
   uintptr_t x = reinterpret_cast<uintptr_t>(ptr);
   if (x % PGSIZE == 0) {
     // This memory came from the large allocator
@@ -687,6 +939,45 @@ malloc_set_alloc_unit(size_t bytes)
   min_map_bytes = class_max_size(size_to_class(bytes));
 }
 
+// Set the size of a free run at which its memory is returned to the
+// kernel.  0 disables returning memory.
+extern "C" void
+malloc_set_release_size(size_t bytes)
+{
+  release_bytes = bytes ? bytes : ~(size_t)0;
+}
+
+// Send the objects this thread has freed to other threads' heaps
+// back to them.  Threads call this when they exit, since nothing else
+// would.
+extern "C" void
+malloc_thread_exit()
+{
+  flush_remote();
+}
+
+// Print the statistics of every thread's heap.
+extern "C" void
+malloc_show_stats()
+{
+  if (!DO_STATS) {
+    printf("malloc statistics disabled\n");
+    return;
+  }
+  printf("%6s %10s %10s %10s %10s %8s %8s %10s %10s\n",
+         "tid", "mallocs", "frees", "rsent", "rrecv",
+         "spages", "sfreed", "mappedKB", "releasedKB");
+  for (heap *h = heaps.load(); h; h = h->next) {
+    const heap_stats &st = h->stats;
+    printf("%6d %10lu %10lu %10lu %10lu %8lu %8lu %10lu %10lu\n",
+           h->tid, (unsigned long)st.mallocs, (unsigned long)st.frees,
+           (unsigned long)st.remote_sent, (unsigned long)st.remote_received,
+           (unsigned long)st.small_pages, (unsigned long)st.small_pages_freed,
+           (unsigned long)st.mapped_bytes / 1024,
+           (unsigned long)st.released_bytes / 1024);
+  }
+}
+
 extern "C" void
 malloc_show_state()
 {
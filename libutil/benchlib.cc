@@ -0,0 +1,803 @@
+// Common benchmark driver.  See benchlib.hh.
+
+#include "benchlib.hh"
+#include "libutil.h"
+#include "spinbarrier.hh"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#if defined(XV6_USER)
+#include "types.h"
+#include "user.h"
+#include "pthread.h"
+#include "kstats.hh"
+#include "pmcdb.hh"
+#include "uk/lockstat.h"
+#include <xv6/perf.h>
+#else
+#include <pthread.h>
+#endif
+
+// The number of most-contended locks to report.
+enum { LOCKSTAT_TOP = 8 };
+
+//
+// JSON output
+//
+
+namespace {
+  // Builds a single JSON object for a JSON lines stream.
+  class json_line
+  {
+    char buf_[16384];
+    size_t len_;
+    // Whether the current object or array is still empty, by depth.
+    bool empty_[8];
+    int depth_;
+
+    void raw(const char *s, size_t n)
+    {
+      n = std::min(n, sizeof buf_ - 2 - len_);
+      memmove(buf_ + len_, s, n);
+      len_ += n;
+    }
+
+    void raw(const char *s)
+    {
+      raw(s, strlen(s));
+    }
+
+    void str(const char *s)
+    {
+      raw("\"");
+      for (; *s; ++s) {
+        char esc[8];
+        if (*s == '"' || *s == '\\') {
+          esc[0] = '\\';
+          esc[1] = *s;
+          raw(esc, 2);
+        } else if ((unsigned char)*s < 0x20) {
+          snprintf(esc, sizeof esc, "\\u%04x", (unsigned char)*s);
+          raw(esc);
+        } else {
+          raw(s, 1);
+        }
+      }
+      raw("\"");
+    }
+
+    void key(const char *k)
+    {
+      if (!empty_[depth_])
+        raw(",");
+      empty_[depth_] = false;
+      if (k) {
+        str(k);
+        raw(":");
+      }
+    }
+
+  public:
+    json_line() : len_(0), depth_(0)
+    {
+      empty_[0] = true;
+      raw("{");
+    }
+
+    void begin(const char *k, bool array = false)
+    {
+      key(k);
+      raw(array ? "[" : "{");
+      empty_[++depth_] = true;
+    }
+
+    void end(bool array = false)
+    {
+      raw(array ? "]" : "}");
+      --depth_;
+    }
+
+    void kv(const char *k, const char *v)
+    {
+      key(k);
+      str(v);
+    }
+
+    void kv(const char *k, uint64_t v)
+    {
+      char b[32];
+      key(k);
+      snprintf(b, sizeof b, "%llu", (unsigned long long)v);
+      raw(b);
+    }
+
+    void kv(const char *k, unsigned v)
+    {
+      kv(k, (uint64_t)v);
+    }
+
+    void kv(const char *k, long long v)
+    {
+      char b[32];
+      key(k);
+      snprintf(b, sizeof b, "%lld", v);
+      raw(b);
+    }
+
+    void kv(const char *k, double v)
+    {
+      char b[64];
+      key(k);
+      snprintf(b, sizeof b, "%.3f", v);
+      raw(b);
+    }
+
+    void kv_raw(const char *k, const char *v)
+    {
+      key(k);
+      raw(v);
+    }
+
+    void write(int fd)
+    {
+      buf_[len_++] = '}';
+      buf_[len_++] = '\n';
+      xwrite(fd, buf_, len_);
+    }
+  };
+}
+
+static void
+format_iso8601(char *buf, size_t n)
+{
+  time_t now = time(nullptr);
+  struct tm tm;
+  localtime_r(&now, &tm);
+
+  snprintf(buf, n, "%04d-%02d-%02dT%02d:%02d:%02d%c%02d%02d",
+           tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+           tm.tm_hour, tm.tm_min, tm.tm_sec,
+           TZ_SECS < 0 ? '+' : '-',
+           std::max(TZ_SECS, -TZ_SECS) / 3600,
+           (std::max(TZ_SECS, -TZ_SECS) % 3600) / 60);
+}
+
+void
+bench_kconfig(void (*cb)(const char *line, void *arg), void *arg)
+{
+  char buf[512];
+  int pos = 0;
+  int fd = open("/dev/kconfig", O_RDONLY);
+  if (fd < 0)
+    return;
+  while (pos < sizeof buf) {
+    int n = read(fd, buf + pos, sizeof buf - pos);
+    if (n < 0)
+      break;
+    pos += n;
+    while (true) {
+      char *nl = std::find(buf, buf + pos, '\n');
+      if (nl == buf + pos)
+        break;
+      *nl = '\0';
+      cb(buf, arg);
+      pos -= (nl - buf) + 1;
+      memmove(buf, nl + 1, pos);
+    }
+    if (n == 0)
+      break;
+  }
+  close(fd);
+}
+
+//
+// Configuration
+//
+
+void
+bench_config::param(const char *key, const char *val)
+{
+  if (nparams_ == MAX_PARAMS)
+    die("bench_config: too many parameters");
+  params_[nparams_++] = kv{key, val, 0, false};
+}
+
+void
+bench_config::param(const char *key, long long val)
+{
+  if (nparams_ == MAX_PARAMS)
+    die("bench_config: too many parameters");
+  params_[nparams_++] = kv{key, nullptr, val, true};
+}
+
+unsigned
+bench_config::counter(const char *name)
+{
+  if (ncounters_ == MAX_COUNTERS)
+    die("bench_config: too many counters");
+  counters_[ncounters_] = name;
+  return ncounters_++;
+}
+
+bool
+bench_parse_cores(const char *str, std::vector<unsigned> *out)
+{
+  std::vector<unsigned> res;
+  const char *p = str;
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10), last = first, step = 1;
+    if (end == p)
+      return false;
+    p = end;
+    if (*p == '-') {
+      last = strtol(++p, &end, 10);
+      if (end == p || last < first)
+        return false;
+      p = end;
+      if (*p == ':') {
+        step = strtol(++p, &end, 10);
+        if (end == p || step <= 0)
+          return false;
+        p = end;
+      }
+    }
+    if (*p == ',')
+      ++p;
+    else if (*p)
+      return false;
+    for (long n = first; n <= last; n += step) {
+      if (n <= 0 || n > NCPU)
+        return false;
+      res.push_back(n);
+    }
+  }
+  if (res.empty())
+    return false;
+  *out = std::move(res);
+  return true;
+}
+
+void
+bench_usage_common(void)
+{
+  fprintf(stderr, "  -c cores      Core counts (e.g., 1,10-80:10)\n");
+  fprintf(stderr, "  -n trials     Trials per core count\n");
+  fprintf(stderr, "  -w secs       Warmup duration\n");
+  fprintf(stderr, "  -d secs       Measurement duration\n");
+  fprintf(stderr, "  -H            Record latency histograms\n");
+  fprintf(stderr, "  -L            Report lock contention\n");
+  fprintf(stderr, "  -e perfevent  Measure perfevent\n");
+  fprintf(stderr, "  -o path       Append JSON results to path\n");
+}
+
+int
+bench_getopt(bench_config *conf, int argc, char **argv, const char *optstring)
+{
+  static const char common[] = "c:n:w:d:HLe:o:";
+  char opts[128];
+  snprintf(opts, sizeof opts, "%s%s", common, optstring);
+
+  int opt;
+  while ((opt = getopt(argc, argv, opts)) != -1) {
+    switch (opt) {
+    case 'c':
+      if (!bench_parse_cores(optarg, &conf->cores))
+        die("bad core list: %s", optarg);
+      break;
+    case 'n':
+      conf->trials = atoi(optarg);
+      if (conf->trials == 0)
+        die("bad trial count: %s", optarg);
+      break;
+    case 'w':
+      conf->warmup_secs = atoi(optarg);
+      break;
+    case 'd':
+      conf->duration_secs = atoi(optarg);
+      if (conf->duration_secs == 0)
+        die("bad duration: %s", optarg);
+      break;
+    case 'H':
+      conf->latency = true;
+      break;
+    case 'L':
+      conf->lockstat = true;
+      break;
+    case 'e':
+      conf->pmc = optarg;
+      break;
+    case 'o':
+      conf->json_path = optarg;
+      break;
+    default:
+      return opt;
+    }
+  }
+  return -1;
+}
+
+//
+// Kernel statistics
+//
+
+namespace {
+  struct lock_sample
+  {
+    char name[16];
+    const char *kind;
+    uint64_t acquires, contends, locking, locked;
+  };
+
+  struct kernel_snapshot
+  {
+#if defined(XV6_USER)
+    struct kstats kstats;
+#endif
+    bool have_kstats;
+
+    void read()
+    {
+      have_kstats = false;
+#if defined(XV6_USER)
+      int fd = open("/dev/kstats", O_RDONLY);
+      if (fd < 0)
+        return;
+      have_kstats = (xread(fd, &kstats, sizeof kstats) == sizeof kstats);
+      close(fd);
+#endif
+    }
+  };
+
+#if defined(XV6_USER)
+  // Send commands to /dev/lockstat.  Returns false if lockstat isn't
+  // available in this kernel.
+  bool
+  lockstat_cmd(const char *cmds)
+  {
+    int fd = open("/dev/lockstat", O_RDWR);
+    if (fd < 0)
+      return false;
+    bool ok = true;
+    for (; *cmds && ok; ++cmds)
+      ok = write(fd, cmds, 1) == 1;
+    close(fd);
+    return ok;
+  }
+#endif
+
+  bool
+  lockstat_start()
+  {
+#if defined(XV6_USER)
+    const char cmds[] = {'0' + LOCKSTAT_CLEAR, '0' + LOCKSTAT_START, 0};
+    return lockstat_cmd(cmds);
+#else
+    return false;
+#endif
+  }
+
+  void
+  lockstat_stop()
+  {
+#if defined(XV6_USER)
+    const char cmds[] = {'0' + LOCKSTAT_STOP, 0};
+    lockstat_cmd(cmds);
+#endif
+  }
+
+  // Read the LOCKSTAT_TOP most contended locks.
+  unsigned
+  lockstat_top(lock_sample *out)
+  {
+    unsigned n = 0;
+#if defined(XV6_USER)
+    int fd = open("/dev/lockstat", O_RDONLY);
+    if (fd < 0)
+      return 0;
+    // struct lockstat is large, so don't put it on the stack
+    static struct lockstat ls;
+    while (read(fd, &ls, sizeof ls) == sizeof ls) {
+      lock_sample s{};
+      memmove(s.name, ls.name, sizeof s.name);
+      s.name[sizeof s.name - 1] = 0;
+      static const char *kinds[] = {"spin", "sleeplock", "condvar", "semaphore"};
+      s.kind = ls.kind < 4 ? kinds[ls.kind] : "unknown";
+      for (int i = 0; i < NCPU; i++) {
+        s.acquires += ls.cpu[i].acquires;
+        s.contends += ls.cpu[i].contends;
+        s.locking += ls.cpu[i].locking;
+        s.locked += ls.cpu[i].locked;
+      }
+      if (s.contends == 0)
+        continue;
+      // Insertion sort into out by descending contends
+      unsigned pos = n < LOCKSTAT_TOP ? n++ : LOCKSTAT_TOP;
+      while (pos > 0 && out[pos - 1].contends < s.contends) {
+        if (pos < LOCKSTAT_TOP)
+          out[pos] = out[pos - 1];
+        --pos;
+      }
+      if (pos < LOCKSTAT_TOP)
+        out[pos] = s;
+    }
+    close(fd);
+#endif
+    return n;
+  }
+}
+
+//
+// Trials
+//
+
+static bench_thread threads[NCPU];
+
+bool
+bench_thread::next_phase(int phase)
+{
+  uint64_t tsc = rdtsc(), usec = now_usec();
+  uint64_t pmc = 0;
+#if defined(XV6_USER)
+  if (pmc_)
+    pmc = rdpmc(0);
+#endif
+
+  if (phase == PHASE_MEASURE) {
+    // Warmup is over.  Discard everything we've counted.
+    ops_ = 0;
+    memset(counts_, 0, sizeof counts_);
+    hist_ = bench_histogram();
+    start_tsc_ = tsc;
+    start_usec_ = usec;
+    start_pmc_ = pmc;
+  } else if (phase == PHASE_STOP && myphase_ != PHASE_STOP) {
+    if (myphase_ == PHASE_WARMUP) {
+      // We never observed the measurement phase (one operation took
+      // longer than the whole measurement), so we have nothing to
+      // contribute.
+      ops_ = 0;
+      memset(counts_, 0, sizeof counts_);
+      start_tsc_ = tsc;
+      start_usec_ = usec;
+      start_pmc_ = pmc;
+    }
+    stop_tsc_ = tsc;
+    stop_usec_ = usec;
+    stop_pmc_ = pmc;
+  }
+  myphase_ = phase;
+  return phase != PHASE_STOP;
+}
+
+struct bench_trial
+{
+  const bench_config &conf;
+  const bench_ops &ops;
+  const char *run_id;
+  unsigned ncores, trial;
+
+  std::atomic<int> phase __mpalign__;
+  std::atomic<unsigned> ready;
+  std::atomic<bool> go;
+  __padout__;
+
+  bench_trial(const bench_config &conf, const bench_ops &ops,
+              const char *run_id, unsigned ncores, unsigned trial)
+    : conf(conf), ops(ops), run_id(run_id), ncores(ncores), trial(trial),
+      phase(bench_thread::PHASE_WARMUP), ready(0), go(false) { }
+
+  static void*
+  thread_main(void *opaque)
+  {
+    bench_thread *t = (bench_thread*)opaque;
+    bench_trial *trial = (bench_trial*)t->arg_;
+    t->arg_ = trial->ops.arg;
+
+    if (setaffinity(t->id_) < 0)
+      die("setaffinity failed");
+
+    ++trial->ready;
+    while (!trial->go.load(std::memory_order_acquire))
+      nop_pause();
+
+    trial->ops.body(t);
+    // In case body returned early, wait for the trial to end
+    if (t->myphase_ != bench_thread::PHASE_STOP)
+      while (t->running())
+        ;
+    return nullptr;
+  }
+
+  void
+  run(int json_fd)
+  {
+    if (ops.setup)
+      ops.setup(ncores, ops.arg);
+
+    pthread_t tids[NCPU];
+    for (unsigned i = 0; i < ncores; ++i) {
+      bench_thread *t = &threads[i];
+      t->id_ = i;
+      t->ncores_ = ncores;
+      t->arg_ = this;
+      t->latency_ = conf.latency;
+      t->pmc_ = conf.pmc != nullptr;
+      t->myphase_ = bench_thread::PHASE_WARMUP;
+      t->phase_ = &phase;
+      t->ops_ = 0;
+      memset(t->counts_, 0, sizeof t->counts_);
+      t->hist_ = bench_histogram();
+      // On xv6, a new thread starts on its creator's core, so move
+      // there first.
+      setaffinity(i);
+      if (pthread_create(&tids[i], nullptr, thread_main, t) != 0)
+        die("pthread_create failed");
+    }
+    setaffinity(0);
+
+    while (ready.load() < ncores)
+      nop_pause();
+
+    kernel_snapshot before, after;
+    go.store(true, std::memory_order_release);
+    sleep(conf.warmup_secs);
+
+    bool have_lockstat = false;
+    if (conf.lockstat)
+      have_lockstat = lockstat_start();
+    before.read();
+    phase = bench_thread::PHASE_MEASURE;
+
+    sleep(conf.duration_secs);
+
+    phase = bench_thread::PHASE_STOP;
+    for (unsigned i = 0; i < ncores; ++i)
+      pthread_join(tids[i], nullptr);
+    after.read();
+    if (have_lockstat)
+      lockstat_stop();
+
+    if (ops.teardown)
+      ops.teardown(ncores, ops.arg);
+
+    report(json_fd, before, after, have_lockstat);
+  }
+
+  void
+  report(int json_fd, const kernel_snapshot &before,
+         const kernel_snapshot &after, bool have_lockstat)
+  {
+    uint64_t nops = 0, cycles = 0, pmc = 0;
+    uint64_t start_usec = 0, stop_usec = 0;
+    uint64_t min_start = ~0ull, max_start = 0;
+    uint64_t counts[bench_config::MAX_COUNTERS] = {};
+    bench_histogram hist;
+    for (unsigned i = 0; i < ncores; ++i) {
+      const bench_thread &t = threads[i];
+      nops += t.ops_;
+      for (unsigned c = 0; c < conf.ncounters_; ++c)
+        counts[c] += t.counts_[c];
+      cycles += t.stop_tsc_ - t.start_tsc_;
+      pmc += t.stop_pmc_ - t.start_pmc_;
+      start_usec += t.start_usec_;
+      stop_usec += t.stop_usec_;
+      min_start = std::min(min_start, t.start_usec_);
+      max_start = std::max(max_start, t.start_usec_);
+      hist += t.hist_;
+    }
+    double secs = (double)(stop_usec - start_usec) / ncores / 1e6;
+    double ops_per_sec = secs > 0 ? nops / secs : 0;
+    uint64_t cycles_per_op = nops ? cycles / nops : 0;
+
+    fflush(stdout);
+    printf("# %s cores=%u trial=%u: %llu ops in %.3f secs, "
+           "%.1f ops/sec, %llu cycles/op\n",
+           conf.name, ncores, trial, (unsigned long long)nops, secs,
+           ops_per_sec, (unsigned long long)cycles_per_op);
+    if (conf.latency && hist.count())
+      printf("#   latency cycles: min %llu p50 %llu p99 %llu max %llu\n",
+             (unsigned long long)hist.min(),
+             (unsigned long long)hist.quantile(0.5),
+             (unsigned long long)hist.quantile(0.99),
+             (unsigned long long)hist.max());
+    for (unsigned c = 0; c < conf.ncounters_; ++c)
+      printf("#   %s: %llu, %.1f/sec\n", conf.counters_[c],
+             (unsigned long long)counts[c], secs > 0 ? counts[c] / secs : 0);
+    fflush(stdout);
+
+    json_line j;
+    j.kv("type", "trial");
+    j.kv("run", run_id);
+    j.kv("bench", conf.name);
+    write_params(&j, conf);
+    j.kv("cores", ncores);
+    j.kv("trial", trial);
+    j.kv("secs", secs);
+    j.kv("ops", nops);
+    j.kv("ops_per_sec", ops_per_sec);
+    j.kv("cycles_per_op", cycles_per_op);
+    j.kv("start_skew_usec", max_start - min_start);
+
+    if (conf.ncounters_) {
+      j.begin("counters");
+      for (unsigned c = 0; c < conf.ncounters_; ++c) {
+        j.begin(conf.counters_[c]);
+        j.kv("count", counts[c]);
+        j.kv("per_sec", secs > 0 ? counts[c] / secs : 0.0);
+        j.end();
+      }
+      j.end();
+    }
+
+    if (conf.latency && hist.count()) {
+      j.begin("latency_cycles");
+      j.kv("count", hist.count());
+      j.kv("min", hist.min());
+      j.kv("mean", hist.mean());
+      j.kv("p50", hist.quantile(0.5));
+      j.kv("p90", hist.quantile(0.9));
+      j.kv("p99", hist.quantile(0.99));
+      j.kv("p999", hist.quantile(0.999));
+      j.kv("max", hist.max());
+      j.end();
+    }
+
+    if (conf.pmc) {
+      j.begin("pmc");
+      j.kv("event", conf.pmc);
+      j.kv("count", pmc);
+      j.kv("per_op", nops ? (double)pmc / nops : 0.0);
+      j.end();
+    }
+
+#if defined(XV6_USER)
+    if (before.have_kstats && after.have_kstats) {
+      struct kstats delta = after.kstats - before.kstats;
+      j.begin("kstats");
+#define X(type, name) if (delta.name) j.kv(#name, (uint64_t)delta.name);
+      KSTATS_ALL(X);
+#undef X
+      j.end();
+    }
+#endif
+
+    if (have_lockstat) {
+      lock_sample top[LOCKSTAT_TOP];
+      unsigned ntop = lockstat_top(top);
+      j.begin("lockstat", true);
+      for (unsigned i = 0; i < ntop; ++i) {
+        j.begin(nullptr);
+        j.kv("name", top[i].name);
+        j.kv("kind", top[i].kind);
+        j.kv("acquires", top[i].acquires);
+        j.kv("contends", top[i].contends);
+        j.kv("locking", top[i].locking);
+        j.kv("locked", top[i].locked);
+        j.end();
+      }
+      j.end(true);
+    }
+
+    j.write(json_fd);
+  }
+
+  static void
+  write_params(json_line *j, const bench_config &conf)
+  {
+    j->begin("params");
+    for (unsigned i = 0; i < conf.nparams_; ++i) {
+      const bench_config::kv &p = conf.params_[i];
+      if (p.is_int)
+        j->kv(p.key, p.ival);
+      else
+        j->kv(p.key, p.sval);
+    }
+    j->end();
+  }
+};
+
+static void
+write_header(int fd, const bench_config &conf, const char *run_id)
+{
+  struct utsname uts;
+  uname(&uts);
+
+  json_line j;
+  j.kv("type", "header");
+  j.kv("run", run_id);
+  j.kv("bench", conf.name);
+  bench_trial::write_params(&j, conf);
+  j.kv("warmup_secs", conf.warmup_secs);
+  j.kv("duration_secs", conf.duration_secs);
+  j.kv("trials", conf.trials);
+  j.kv("kernel", uts.sysname);
+  j.kv("host", uts.nodename);
+  j.kv("krel", uts.release);
+  j.kv("kver", uts.version);
+
+  j.begin("kconfig");
+  bench_kconfig([](const char *line, void *arg) {
+      json_line *j = (json_line*)arg;
+      const char *eq = strchr(line, '=');
+      if (!eq)
+        return;
+      char key[64];
+      size_t len = std::min(sizeof key - 1, (size_t)(eq - line));
+      memmove(key, line, len);
+      key[len] = 0;
+      j->kv(key, eq + 1);
+    }, &j);
+  j.end();
+
+  j.write(fd);
+}
+
+void
+bench_run(const bench_config &conf, const bench_ops &ops)
+{
+  std::vector<unsigned> cores(conf.cores);
+  if (cores.empty())
+    cores.push_back(1);
+
+  int json_fd = 1;
+  if (conf.json_path) {
+    json_fd = open(conf.json_path, O_WRONLY|O_CREAT|O_APPEND, 0666);
+    if (json_fd < 0)
+      die("%s: cannot open %s", conf.name, conf.json_path);
+  }
+
+#if defined(XV6_USER)
+  if (conf.pmc) {
+    try {
+      perf_start(pmcdb_parse_selector(conf.pmc), 0);
+    } catch (std::invalid_argument &e) {
+      die("%s", e.what());
+    }
+  }
+#else
+  if (conf.pmc)
+    die("%s: -e not supported on Linux", conf.name);
+#endif
+
+  char run_id[64];
+  format_iso8601(run_id, sizeof run_id);
+
+  fflush(stdout);
+  printf("# %s --warmup=%us --duration=%us --trials=%u",
+         conf.name, conf.warmup_secs, conf.duration_secs, conf.trials);
+  for (unsigned i = 0; i < conf.nparams_; ++i) {
+    const bench_config::kv &p = conf.params_[i];
+    if (p.is_int)
+      printf(" --%s=%lld", p.key, p.ival);
+    else
+      printf(" --%s=%s", p.key, p.sval);
+  }
+  printf("\n");
+  fflush(stdout);
+  write_header(json_fd, conf, run_id);
+
+  for (unsigned ncores : cores) {
+    for (unsigned trial = 1; trial <= conf.trials; ++trial) {
+      bench_trial t(conf, ops, run_id, ncores, trial);
+      t.run(json_fd);
+    }
+  }
+
+#if defined(XV6_USER)
+  if (conf.pmc)
+    perf_stop();
+#endif
+
+  if (json_fd != 1)
+    close(json_fd);
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+// A common driver for multicore scalability benchmarks.
+//
+// Most benchmarks in bin/ share the same structure: pin one worker
+// thread per core, let them run for a warmup period, measure for a
+// fixed duration, then report throughput and a few kernel counters.
+// benchlib implements that structure once.  On top of it, it adds
+// core-count sweeps, repeated trials, per-operation latency
+// histograms, /dev/kstats and /dev/lockstat deltas, and an optional
+// hardware performance counter.
+//
+// Each trial is reported as one JSON object per line, preceded by a
+// header object that describes the kernel and its configuration.
+// Human-readable output is prefixed with '#'.  This makes it possible
+// to scrape results from a console log and compare them with
+// tools/benchcmp.
+//
+// A benchmark looks like
+//
+//   static void
+//   body(bench_thread *t)
+//   {
+//     while (t->running()) {
+//       uint64_t start = t->op_begin();
+//       do_something(t->id());
+//       t->op_end(start);
+//     }
+//   }
+//
+//   int main(int argc, char **argv)
+//   {
+//     bench_config conf("mybench");
+//     int opt;
+//     while ((opt = bench_getopt(&conf, argc, argv, "x:")) != -1) ...
+//     bench_run(conf, bench_ops{nullptr, body, nullptr});
+//   }
+
+#include "histogram.hh"
+#include "compiler.h"
+#include "amd64.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Latency histograms are in cycles.
+typedef histogram_log2<uint64_t, (1ull << 40)> bench_histogram;
+
+struct bench_config
+{
+  // Benchmark name, reported in every result.
+  const char *name;
+  // Seconds to run before measuring.
+  unsigned warmup_secs;
+  // Seconds to measure for.
+  unsigned duration_secs;
+  // Number of trials for each core count.
+  unsigned trials;
+  // Core counts to run at.  If empty, run on one core.
+  std::vector<unsigned> cores;
+  // Record per-operation latency histograms.  Only operations timed
+  // with op_begin/op_end contribute.
+  bool latency;
+  // Report /dev/lockstat deltas for contended locks.
+  bool lockstat;
+  // Hardware performance counter event to record (see pmcdb), or
+  // null.
+  const char *pmc;
+  // Where to append JSON results, or null for standard output.
+  const char *json_path;
+
+  explicit bench_config(const char *name)
+    : name(name), warmup_secs(1), duration_secs(5), trials(1),
+      latency(false), lockstat(false), pmc(nullptr), json_path(nullptr),
+      nparams_(0), ncounters_(0) { }
+
+  // Record a benchmark-specific parameter.  Parameters are reported
+  // with every result and distinguish otherwise identical runs when
+  // results are compared.  key and val must outlive the run.
+  void param(const char *key, const char *val);
+  void param(const char *key, long long val);
+
+  // Declare a benchmark-specific event counter and return its index
+  // for bench_thread::count.  Counters are reported alongside the
+  // operation count, for benchmarks whose threads do more than one
+  // kind of operation.  name must outlive the run.
+  unsigned counter(const char *name);
+
+  enum { MAX_PARAMS = 16, MAX_COUNTERS = 4 };
+  struct kv {
+    const char *key;
+    const char *sval;
+    long long ival;
+    bool is_int;
+  };
+  kv params_[MAX_PARAMS];
+  unsigned nparams_;
+  const char *counters_[MAX_COUNTERS];
+  unsigned ncounters_;
+};
+
+class bench_thread
+{
+public:
+  // Index of this thread, from 0 to ncores() - 1.
+  unsigned id() const { return id_; }
+  // Number of threads in this trial.
+  unsigned ncores() const { return ncores_; }
+  // Benchmark-specific argument, from bench_ops::arg.
+  void *arg() const { return arg_; }
+
+  // Return true while the benchmark should keep running.  Counters
+  // are reset when the warmup period ends, so bodies must call this
+  // between operations.
+  bool running()
+  {
+    int phase = phase_->load(std::memory_order_relaxed);
+    if (__builtin_expect(phase != myphase_, 0))
+      return next_phase(phase);
+    return true;
+  }
+
+  // Count n completed operations.
+  void op(uint64_t n = 1)
+  {
+    ops_ += n;
+  }
+
+  // Add n to the counter with index idx (see bench_config::counter).
+  void count(unsigned idx, uint64_t n = 1)
+  {
+    counts_[idx] += n;
+  }
+
+  // Start timing an operation.
+  uint64_t op_begin()
+  {
+    return rdtsc();
+  }
+
+  // Finish timing an operation started at start and count n
+  // completed operations.
+  void op_end(uint64_t start, uint64_t n = 1)
+  {
+    ops_ += n;
+    if (latency_)
+      hist_ += rdtsc() - start;
+  }
+
+  // Phases of a trial.
+  enum { PHASE_WARMUP, PHASE_MEASURE, PHASE_STOP };
+
+private:
+  friend struct bench_trial;
+  bool next_phase(int phase);
+
+  unsigned id_, ncores_;
+  void *arg_;
+  bool latency_;
+  bool pmc_;
+  int myphase_;
+  const std::atomic<int> *phase_;
+
+  uint64_t ops_;
+  uint64_t counts_[bench_config::MAX_COUNTERS];
+  uint64_t start_tsc_, stop_tsc_;
+  uint64_t start_usec_, stop_usec_;
+  uint64_t start_pmc_, stop_pmc_;
+  bench_histogram hist_;
+} __mpalign__;
+
+struct bench_ops
+{
+  // Called on the main thread before each trial with the number of
+  // cores in the trial.  May be null.
+  void (*setup)(unsigned ncores, void *arg);
+  // The per-thread benchmark body.
+  void (*body)(bench_thread *t);
+  // Called on the main thread after each trial.  May be null.
+  void (*teardown)(unsigned ncores, void *arg);
+  // Passed to setup, teardown, and bench_thread::arg.
+  void *arg;
+};
+
+// Like getopt(3), but handles the driver's common options:
+//   -c cores    Core counts, as a comma-separated list of N or
+//               FIRST-LAST[:STEP] (e.g., "1,10-80:10")
+//   -n trials   Number of trials per core count
+//   -w secs     Warmup duration
+//   -d secs     Measurement duration
+//   -H          Record latency histograms
+//   -L          Report lock contention from /dev/lockstat
+//   -e event    Record a performance counter event
+//   -o path     Append JSON results to path
+// Returns the next option not handled by the driver, or -1 at the
+// end of the options.  optstring lists the benchmark's own options.
+int bench_getopt(bench_config *conf, int argc, char **argv,
+                 const char *optstring);
+
+// Print the usage of the common options to stderr.
+void bench_usage_common(void);
+
+// Parse a core list as accepted by -c.  Returns false on a syntax
+// error.
+bool bench_parse_cores(const char *str, std::vector<unsigned> *out);
+
+// Run the benchmark described by ops for every core count and trial
+// in conf, reporting results as they complete.
+void bench_run(const bench_config &conf, const bench_ops &ops);
+
+// Call cb for each "key=value" line in /dev/kconfig.  Does nothing if
+// /dev/kconfig doesn't exist.
+void bench_kconfig(void (*cb)(const char *line, void *arg), void *arg);
@@ -148,6 +148,31 @@ public:
     return sum_ / (double)count();
   }
 
+  // Return an upper bound on the p'th quantile (0 <= p <= 1).  Since
+  // buckets are powers of two, this may overestimate by up to 2x,
+  // but never returns more than max().
+  T
+  quantile(double p) const
+  {
+    T total = count();
+    if (total == 0)
+      return 0;
+    T rank = p * total;
+    if (rank >= total)
+      rank = total - 1;
+    T seen = zero_;
+    if (rank < seen)
+      return 0;
+    for (std::size_t i = 0; i < NBUCKETS; ++i) {
+      seen += buckets_[i];
+      if (rank < seen) {
+        T hi = ((T)2 << i) - 1;
+        return hi < max_ ? hi : max_;
+      }
+    }
+    return max_;
+  }
+
   void
   print_stats() const
   {
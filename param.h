@@ -1,7 +1,5 @@
 #pragma once
-#define NPROC        64  // maximum number of processes
 #define KSTACKSIZE 32768 // size of per-process kernel stack
-#define NOFILE      100  // open files per process
 #define NFILE       100  // open files per system
 #define NBUF      10000  // size of disk block cache
 #define NINODE     5000  // maximum number of active i-nodes
@@ -13,7 +11,6 @@
 #define UNIX_PATH_MAX 128
 #define NEPOCH        4
 #define CACHELINE    64  // cache line size
-#define CPUKSTACKS   (NPROC + NCPU*2)
 #define VICTIMAGE 1000000 // cycles a proc executes before an eligible victim
 #define PCID_HISTORY_SIZE 8 // number of past pgmap's to remember on each CPU
 #define VERBOSE       0  // print kernel diagnostics
@@ -38,11 +35,20 @@
 //  batched_shootdown
 //  core_tracking_shootdown
 #define TLB_SCHEME    core_tracking_shootdown
+// The number of pages unmapped by munmap whose TLB shootdowns an
+// address space may defer and then perform as one batch.  Until the
+// batch is performed, other threads may still reach these pages, but
+// they are not freed.  If 0, shoot down every munmap immediately.
+#define TLB_DEFER_PAGES 256
 // Physical page reference counting scheme.  One of:
 //  :: for shared reference counters
 //  refcache:: for refcache counters
 //  locked_snzi:: for SNZI counters
 #define PAGE_REFCOUNT refcache::
+// The percentage of one CPU the same-page merging scanner may use to
+// find identical anonymous pages.  It only looks at pages marked with
+// MADV_MERGEABLE.  If 0, don't merge pages.
+#define KSM_CPU_PERCENT 5
 // The maximum number of recently freed pages to cache per core.
 #define KALLOC_HOT_PAGES 128
 // How to balance memory load.  If 1, dynamically load balance pages
@@ -54,6 +60,10 @@
 #define KALLOC_BUDDY_PER_CPU 1
 // Whether or not to load balance in the scheduler.
 #define SCHED_LOAD_BALANCE 0
+// Where to run new processes and images (fork, spawn, and exec).  0
+// keeps them on the parent's CPU, 1 picks the least loaded CPU in the
+// parent's socket, and 2 picks the least loaded CPU anywhere.
+#define SCHED_PLACEMENT 2
 // Reference counting scheme for inode's nlink.  One of:
 //  :: for shared reference counters
 //  refcache:: for refcache counters
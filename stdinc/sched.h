@@ -1,5 +1,6 @@
 #pragma once
 #include "types.h"
+#include <uk/sched.h>
 
 BEGIN_DECLS
 
@@ -19,4 +20,10 @@ typedef struct cpu_set cpu_set_t;
 
 int sched_setaffinity(int, size_t, cpu_set_t*);
 
+// For SCHED_OTHER, param->sched_priority is the nice value.  pid must
+// be the caller or one of its children, and 0 means the caller.
+int sched_setscheduler(int pid, int policy, struct sched_param *param);
+int sched_getscheduler(int pid);
+int sched_getparam(int pid, struct sched_param *param);
+
 END_DECLS
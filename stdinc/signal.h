@@ -8,5 +8,9 @@ typedef void (*sighandler_t)(int);
 
 sighandler_t signal(int sig, sighandler_t func);
 int sigaction(int sig, struct sigaction* act, struct sigaction* oact);
+int sigemptyset(sigset_t *set);
+int sigaddset(sigset_t *set, int sig);
+int sigdelset(sigset_t *set, int sig);
+int sigismember(const sigset_t *set, int sig);
 
 END_DECLS
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "compiler.h"
+#include <sys/types.h>
+#include <uk/resource.h>
+
+BEGIN_DECLS
+
+int getrusage(int who, struct rusage *usage);
+
+END_DECLS
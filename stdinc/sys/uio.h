@@ -0,0 +1,14 @@
+#pragma once
+
+#include "compiler.h"
+#include <sys/types.h>
+#include <uk/uio.h>
+
+BEGIN_DECLS
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+END_DECLS
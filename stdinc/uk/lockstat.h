@@ -2,8 +2,21 @@
 
 #define LOCKSTAT_MAGIC 0xb4cd79c1b2e46f40ull
 
+#define LOCKSTAT_KIND_SPIN       0
+#define LOCKSTAT_KIND_SLEEPLOCK  1
+#define LOCKSTAT_KIND_CONDVAR    2
+#define LOCKSTAT_KIND_SEMAPHORE  3
+
+#define LOCKSTAT_WAITER_BUCKETS  8
+#define LOCKSTAT_NCALLERS        8
+
 #if __cplusplus
 
+// For spinlocks, locking is cycles spent acquiring and locked is
+// cycles held.  For blocking primitives, acquires counts
+// acquisitions (or condvar sleeps), contends counts the times the
+// caller blocked, locking is cycles spent blocked, and locked is
+// cycles held (sleeplocks only).
 struct cpulockstat {
   u64 acquires;
   u64 contends;
@@ -15,8 +28,27 @@ struct cpulockstat {
   __padout__;
 } __mpalign__;
 
+// A code location that blocked on a sleeplock, condvar, or semaphore.
+struct lockstat_caller {
+  u64 pc;
+  u64 contends;
+  // Cycles spent blocked
+  u64 waiting;
+};
+
 struct lockstat {
   char name[16];
+  // LOCKSTAT_KIND_*
+  u32 kind;
+
+  // Blocking primitives only.  waiters[i] counts the times a thread
+  // blocked and found [2^(i-1), 2^i) threads already waiting
+  // (waiters[0] counts no other waiters).  callers holds the first
+  // LOCKSTAT_NCALLERS distinct callers that blocked; any others are
+  // counted in the last entry with a pc of 0.
+  u64 waiters[LOCKSTAT_WAITER_BUCKETS];
+  struct lockstat_caller callers[LOCKSTAT_NCALLERS];
+
   struct cpulockstat cpu[NCPU] __mpalign__;
 };
 
@@ -45,6 +77,8 @@ struct klockstat;
 #define LOCKSTAT_NS        1
 #define LOCKSTAT_PIPE      1
 #define LOCKSTAT_PROC      1
+#define LOCKSTAT_SEMAPHORE 1
+#define LOCKSTAT_SLEEPLOCK 1
 #define LOCKSTAT_SCHED     1
 #define LOCKSTAT_VM        1
 #define LOCKSTAT_WQ        1
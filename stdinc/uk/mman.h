@@ -10,10 +10,17 @@
 #define MAP_PRIVATE   0x2
 #define MAP_FIXED     0x4
 #define MAP_ANONYMOUS 0x8
+// Populate the mapping now, as if by MADV_WILLNEED
+#define MAP_POPULATE  0x10
 
 #define MAP_FAILED ((void*)-1)
 
 #define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
+// Let same-page merging share these anonymous pages with identical
+// pages, or stop it from doing so
+#define MADV_MERGEABLE   12
+#define MADV_UNMERGEABLE 13
 
 // xv6 extension: invalidate all page tables
 #define MADV_INVALIDATE_CACHE 1000
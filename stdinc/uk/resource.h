@@ -0,0 +1,18 @@
+// User/kernel shared resource usage definitions
+#pragma once
+
+// getrusage who
+#define RUSAGE_SELF      0
+#define RUSAGE_CHILDREN  (-1)
+
+// Resource usage of a thread, or the totals of a thread's reaped
+// children.  Times are in nanoseconds.
+struct rusage
+{
+  u64 ru_utime;                 // Running in user space
+  u64 ru_stime;                 // Running in the kernel
+  u64 ru_wtime;                 // Runnable, but waiting for a CPU
+  u64 ru_nvcsw;                 // Context switches because we blocked
+  u64 ru_nivcsw;                // Context switches while runnable
+  u64 ru_nmigrate;              // Times run on a different CPU
+};
@@ -0,0 +1,21 @@
+// User/kernel shared scheduling definitions
+#pragma once
+
+// Scheduling policies
+#define SCHED_OTHER      0      // Weighted fair share, by nice value
+#define SCHED_FIFO       1      // Real-time, runs until it blocks or yields
+#define SCHED_RR         2      // Real-time, round-robin within a priority
+
+// Real-time priorities range from 1 to SCHED_RT_MAX, higher first.
+// Any runnable real-time thread runs before every SCHED_OTHER thread.
+#define SCHED_RT_MAX     99
+
+// Nice values for SCHED_OTHER, from the largest share of the CPU to
+// the smallest
+#define SCHED_NICE_MIN   (-20)
+#define SCHED_NICE_MAX   19
+
+struct sched_param
+{
+  int sched_priority;           // Real-time priority, or nice value
+};
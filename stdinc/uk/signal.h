@@ -1,10 +1,27 @@
 #pragma once
 
+#define SIGHUP    1
+#define SIGINT    2
+#define SIGQUIT   3
 #define SIGBUS    7
+#define SIGKILL   9
+#define SIGUSR1   10
 #define SIGSEGV   11
+#define SIGUSR2   12
 #define SIGPIPE   13
+#define SIGALRM   14
+#define SIGTERM   15
 #define NSIG      16
 
+// A set of signals, with bit n set for signal n
+typedef unsigned long sigset_t;
+#define sigmask(sig) (1UL << (sig))
+
+// sigprocmask how
+#define SIG_BLOCK   0
+#define SIG_UNBLOCK 1
+#define SIG_SETMASK 2
+
 #define SIG_DFL   ((void (*)(int)) 0)
 #define SIG_IGN   ((void (*)(int)) 1)
 #define SIG_ERR   ((void (*)(int)) -1)
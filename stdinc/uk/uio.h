@@ -0,0 +1,11 @@
+// User/kernel shared vectored I/O definitions
+#pragma once
+
+struct iovec
+{
+  void *iov_base;
+  __SIZE_TYPE__ iov_len;
+};
+
+// Maximum number of iovecs in one call
+#define IOV_MAX 1024
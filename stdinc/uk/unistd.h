@@ -4,6 +4,10 @@
 // xv6 fork flags
 #define FORK_SHARE_VMAP     (1<<0)
 #define FORK_SHARE_FD       (1<<1)
+// clone_thread only: the thread is not a child of its creator and is
+// reaped when it exits.  Join it through its tid word instead of
+// waitpid.
+#define FORK_DETACHED       (1<<2)
 
 // xv6 fstatx flags
 enum stat_flags {
@@ -1,5 +1,8 @@
 #pragma once
 
+// waitpid options
+#define WNOHANG 1
+
 #define __WAIT_STATUS_VAL_MASK  0xFF
 #define __WAIT_STATUS_TYPE_MASK 0xFF00
 #define __WAIT_STATUS_EXITED    (0 << 8)
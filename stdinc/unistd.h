@@ -28,6 +28,9 @@ int fsync(int fd);
 unsigned sleep(unsigned);
 pid_t getpid(void);
 pid_t fork(void);
+pid_t vfork(void);
+int setpgid(pid_t pid, pid_t pgid);
+pid_t getpgid(pid_t pid);
 
 extern char* optarg;
 extern int optind;
@@ -30,6 +30,7 @@ def main():
         print "#include \"kernel.hh\""
         print "#include <uk/unistd.h>"
         print "#include <uk/signal.h>"
+        print "#include \"kstats.hh\""
         print
         for syscall in syscalls:
             print "extern %s %s(%s);" % (syscall.rettype, syscall.kname,
@@ -67,6 +68,25 @@ def main():
         print
 
         print "extern const int nsyscalls = %d;" % (max(bynum.keys()) + 1)
+        print
+
+        print "struct syscall_kstats_table"
+        print "{"
+        print "  struct syscall_kstats sys[%d];" % (max(bynum.keys()) + 1)
+        print "};"
+        print "DEFINE_PERCPU(struct syscall_kstats_table, syscall_kstats_table, NO_CRITICAL);"
+        print
+        print "struct syscall_kstats *"
+        print "mysyscall_kstats(void)"
+        print "{"
+        print "  return syscall_kstats_table->sys;"
+        print "}"
+        print
+        print "struct syscall_kstats *"
+        print "syscall_kstats_on(int cpu)"
+        print "{"
+        print "  return syscall_kstats_table[cpu].sys;"
+        print "}"
 
     if options.ustubs:
         print "#include \"traps.h\""